@@ -22,8 +22,11 @@
 #include <linux/vmalloc.h>	
 #include <linux/slab.h>
 #include <linux/fs.h>
-#include <asm/uaccess.h>
+#include <linux/mm.h>
+#include <linux/sched.h>
+#include <linux/uaccess.h>
 #include "buddy_alloc.h"
+#include "buddy_list.h"
 
 #define KERNEL_AUTH     "Samir Silbak"
 #define KERNEL_DESC     "kernel 'driver' implementing buddy allocator  <silbak04@gmail.com>"
@@ -36,158 +39,151 @@ static int dev_open = 0;
 char *buddy_alloc;
 int ref;
 
-struct buddy
-{
-    int free;
-    int split;
-    int page_ref_blk;
-    int page_sized_blk;
-
-    struct buddy *left;
-    struct buddy *right;
-};
+/* the allocator's free lists, see buddy_list.h; one vmalloc
+   for the lot, made at module load */
+static struct buddy_lists *lists = NULL;
 
-struct buddy *root = NULL;
+/* which open of the device allocated each block, by block number
+   (like lists->state); only that open may mmap() it.  Zeroed at
+   load, and sessions count from 1, so no block starts out owned */
+static unsigned int *owners = NULL;
+static unsigned int session = 0;
 
-static int buddy_mem_alloc(struct buddy *node, int mem_size)
+static int buddy_mem_alloc(int mem_size)
 {
-    int ret_val = 0;
-    if (node->split)
-    {
-        ret_val = buddy_mem_alloc(node->left, mem_size);
-        if (ret_val < 0)
-            return buddy_mem_alloc(node->right, mem_size);
-        else
-            return ret_val;
-    }
-    if (!node->free || node->page_sized_blk < mem_size)
-        return -1;
- 
-    /* traverse through the linked list 
-       allocating blocks of memory
-       until we hit the smallest block
-       needed - all are free */
-    if (node->page_sized_blk > 2*mem_size)
-    {                                                                               /* ----------------- */
-        node->split = 1;                                                            /*    BINARY TREE    */
-        node->right = (struct buddy *)vmalloc(sizeof(struct buddy));                /* ----------------- */
-        node->right->free  = 1;                                                     /*        _|_        */
-        node->right->split = 0;                                                     /*       /   \       */
-        node->right->page_sized_blk = node->page_sized_blk / 2;                     /*      /\   /\      */
-        node->right->page_ref_blk = node->page_ref_blk + node->page_sized_blk / 2;  /*     /\/\ /\/\     */
-
-        node->left = (struct buddy *)vmalloc(sizeof(struct buddy));                 
-        node->left->free  = 1;                                                      
-        node->left->split = 0;                                                      
-        node->left->page_sized_blk = node->page_sized_blk / 2;
-        node->left->page_ref_blk = node->page_ref_blk;
-
-        return buddy_mem_alloc(node->left, mem_size);
-    }
+    int block_ref = buddy_list_alloc(lists, mem_size);
 
-    /* we can now assign our data
-       to the smallest block found 
-       and this node will no longer
-       be free */
-    node->free = 0;
+    if (block_ref >= 0)
+        owners[block_ref >> BUDDY_MIN_SHIFT] = session;
 
-    return node->page_ref_blk; 
+    return block_ref;
 }
 
-static int buddy_mem_free(struct buddy *node, int block_ref)
+static int buddy_mem_free(int block_ref)
 {
-    /* are we trying to free
-       space that is already free? */
-    if (!node->split && node->free ||
-        block_ref > ref             )
-        return -1;
-
-    /* checks to see if we have allocated
-       maximum size given from the operating
-       system */
-    if (!node->split && !node->free && 
-        node->page_ref_blk == block_ref) 
-    {
-        vfree(node);
-        node = NULL;
-        node->split = 0;
-        node->free  = 1;
-    }
-
-    /* if nodes are split, let's go ahead
-       and traverse through the link list
-       to find which node to free */
-    if (node->split)
-    {
-        if (node->left->split) 
-        {
-            buddy_mem_free(node->left, block_ref);
-        }
+    return buddy_list_free(lists, block_ref);
+}
 
-        if (!node->left->free && 
-            node->left->page_ref_blk == block_ref)
-        {
-            node->left->free = 1;
-        }
+static int open(struct inode *ip, struct file *fp)
+{
+    printk(KERN_INFO "opening file\n");
 
-        if (node->right->split) 
-        {
-            buddy_mem_free(node->right, block_ref);
-        }
+    if (dev_open) return -EBUSY;
+    else dev_open++;
 
-        if (!node->right->free &&
-            node->right->page_ref_blk == block_ref)
-        {
-            node->right->free = 1;
-        }
+    /* a new owner for whatever gets allocated from now on */
+    session++;
 
-        /* have we found two free buddies next
-           to each other? let's go ahead and
-           coalesce the two together working
-           our way back up the tree */
-        if (node->right->free == 1  &&
-            node->left->free  == 1   )
-        {
-            vfree(node->right);
-            vfree(node->left);
+    return 0;
+}
 
-            node->left  = NULL;
-            node->right = NULL;
-            node->split = 0;
-            node->free  = 1;
-        }
-    }
+static int release(struct inode *ip, struct file *fp)
+{
+    printk(KERN_INFO "releasing file\n");
+    dev_open--;
 
     return 0;
 }
 
-static void destroy_buddies(struct buddy *node)
+/* how much of its block there is from pos on, if pos is in a block
+   this open allocated; -EINVAL if it isn't */
+static long block_left(loff_t pos)
 {
-    if (node->split)
-    {
-        destroy_buddies(node->left);
-        destroy_buddies(node->right);
-    }
-    vfree(node);
-    node = NULL;
+    int block_ref;
+    int size;
+
+    if (pos < 0 || pos >= ALLOC_SIZE)
+        return -EINVAL;
+
+    size = buddy_list_find(lists, (int)pos, &block_ref);
+    if (size < 0 || owners[block_ref >> BUDDY_MIN_SHIFT] != session)
+        return -EINVAL;
+
+    return block_ref + size - pos;
 }
 
-static int open(struct inode *ip, struct file *fp)
+/* read() and write() (and pread() and pwrite()) copy any bytes at
+   all, as many as asked for in one go, at a file position that's a
+   block reference plus an offset into the block.  They stop short at
+   the end of the block rather than run into the next one. */
+static ssize_t read(struct file *fp, char __user *buf, size_t len, loff_t *ppos)
 {
-    printk(KERN_INFO "opening file\n");
+    long left = block_left(*ppos);
 
-    if (dev_open) return -EBUSY;
-    else dev_open++;
+    if (left < 0)
+        return left;
+    if (len > (size_t)left)
+        len = left;
 
-    return 0;
+    if (copy_to_user(buf, buddy_alloc + *ppos, len))
+        return -EFAULT;
+
+    *ppos += len;
+    return len;
 }
 
-static int release(struct inode *ip, struct file *fp)
+static ssize_t write(struct file *fp, const char __user *buf, size_t len, loff_t *ppos)
 {
-    printk(KERN_INFO "releasing file\n");
-    dev_open--;
+    long left = block_left(*ppos);
 
-    return 0;
+    if (left < 0)
+        return left;
+    if (len > (size_t)left)
+        len = left;
+
+    if (copy_from_user(buddy_alloc + *ppos, buf, len))
+        return -EFAULT;
+
+    *ppos += len;
+    return len;
+}
+
+/* how many batch ops get copied in and out at a time; they
+   live on the stack while they're worked on */
+#define BATCH_CHUNK 32
+
+/* IOCTL_BATCH_MEM: everything the single ioctls do per op less
+   the syscall and the printk, see buddy_alloc.h */
+static long batch_mem(struct mem_batch __user *arg)
+{
+    struct mem_batch batch;
+    struct mem_batch_op __user *ops;
+    struct mem_batch_op op[BATCH_CHUNK];
+    unsigned int done, n, i;
+
+    if (copy_from_user(&batch, arg, sizeof(batch)))
+        return -EFAULT;
+    if (batch.count > INT_MAX)
+        return -EINVAL;
+    ops = u64_to_user_ptr(batch.ops);
+
+    for (done = 0; done < batch.count; done += n)
+    {
+        n = min_t(unsigned int, batch.count - done, BATCH_CHUNK);
+        /* writing the ops straight back makes sure the results will
+           have somewhere to go before any of them are done */
+        if (copy_from_user(op, ops + done, n * sizeof(*op)) ||
+            copy_to_user(ops + done, op, n * sizeof(*op)))
+            return done ? done : -EFAULT;
+
+        for (i = 0; i < n; i++)
+        {
+            if (op[i].op == MEM_OP_ALLOC)
+                op[i].result = buddy_mem_alloc(op[i].arg);
+            else if (op[i].op == MEM_OP_FREE)
+                op[i].result = buddy_mem_free(op[i].arg);
+            else
+                op[i].result = -1;
+        }
+
+        /* only if the caller unmapped them meanwhile; these are done
+           all the same */
+        if (copy_to_user(ops + done, op, n * sizeof(*op)))
+            return done + n;
+        cond_resched();
+    }
+
+    return done;
 }
 
 long ioctl(struct file *fp, unsigned int ioctl_num,
@@ -203,7 +199,7 @@ long ioctl(struct file *fp, unsigned int ioctl_num,
         case IOCTL_ALLOC_MEM:
 
             printk(KERN_INFO "Allocating [%d] bytes\n", (int)ioctl_param);
-            return buddy_mem_alloc(root, (int)ioctl_param);
+            return buddy_mem_alloc((int)ioctl_param);
 
         case IOCTL_WRITE_REF: 
 
@@ -244,7 +240,11 @@ long ioctl(struct file *fp, unsigned int ioctl_num,
         case IOCTL_FREE_MEM:
 
             printk(KERN_INFO "Freeing bytes at block reference: [%d]\n", (int)ioctl_param);
-            return buddy_mem_free(root, (int)ioctl_param);
+            return buddy_mem_free((int)ioctl_param);
+
+        case IOCTL_BATCH_MEM:
+
+            return batch_mem((struct mem_batch __user *)ioctl_param);
 
         default:
             return -1;
@@ -253,11 +253,42 @@ long ioctl(struct file *fp, unsigned int ioctl_num,
     return 0;
 }
 
+/* map part of the pool straight into the caller: the file offset is
+   a block reference, and every block the pages cover has to have been
+   allocated by this open.  Pages are bigger than small blocks, so a
+   small block can only be mapped along with the rest of its page.
+   The mapping holds the file open, and with it everyone else out, so
+   a block freed while mapped can't end up anyone else's. */
+static int mmap(struct file *fp, struct vm_area_struct *vma)
+{
+    unsigned long off = vma->vm_pgoff << PAGE_SHIFT;
+    unsigned long len = vma->vm_end - vma->vm_start;
+    unsigned long pos;
+    int size;
+
+    if (off >= ALLOC_SIZE || len > ALLOC_SIZE - off)
+        return -EINVAL;
+
+    for (pos = off; pos < off + len; pos += size)
+    {
+        size = buddy_list_size(lists, pos);
+        if (size < 0 || owners[pos >> BUDDY_MIN_SHIFT] != session)
+            return -EACCES;
+    }
+
+    return remap_vmalloc_range(vma, buddy_alloc, vma->vm_pgoff);
+}
+
 static struct file_operations file_ops =
 {
     .open           = open,
     .release        = release,
-    .unlocked_ioctl = ioctl
+    .llseek         = default_llseek,
+    .read           = read,
+    .write          = write,
+    .unlocked_ioctl = ioctl,
+    .compat_ioctl   = compat_ptr_ioctl,
+    .mmap           = mmap
 };
 
 int init_budd_alloc(void)
@@ -273,18 +304,22 @@ int init_budd_alloc(void)
     else
         printk(KERN_INFO "%s has been registered\n", DEVICE_NAME);
 
-    /* allocate the desired memory pool size */
-    buddy_alloc = (char *)vmalloc(ALLOC_SIZE * sizeof(*buddy_alloc));
-
-    /* set the root of our block */
-    root = (struct buddy *)vmalloc(sizeof(struct buddy));
-    root->page_sized_blk = ALLOC_SIZE;
-    root->free = 1;
-    root->split = 0;
-    root->page_ref_blk = 0;
+    /* allocate the desired memory pool size, in a form
+       remap_vmalloc_range() will hand to user space */
+    buddy_alloc = (char *)vmalloc_user(ALLOC_SIZE * sizeof(*buddy_alloc));
 
-    root->left  = NULL;
-    root->right = NULL;
+    /* ... and the free lists that keep track of it */
+    lists  = (struct buddy_lists *)vmalloc(sizeof(*lists));
+    owners = (unsigned int *)vzalloc(BUDDY_LEAVES * sizeof(*owners));
+    if (!buddy_alloc || !lists || !owners)
+    {
+        vfree(buddy_alloc);
+        vfree(lists);
+        vfree(owners);
+        unregister_chrdev(MAJOR_NUM, DEVICE_NAME);
+        return -ENOMEM;
+    }
+    buddy_list_init(lists);
 
     return 0;
 }
@@ -292,7 +327,8 @@ int init_budd_alloc(void)
 void exit_budd_alloc(void)
 {
     vfree(buddy_alloc);
-    destroy_buddies(root);
+    vfree(lists);
+    vfree(owners);
 
     unregister_chrdev(MAJOR_NUM, DEVICE_NAME);
     printk(KERN_INFO "%s has been unregistered\n", DEVICE_NAME);
@@ -1,10 +1,22 @@
+#ifndef BUDDY_ALLOC_H
+#define BUDDY_ALLOC_H
+
 #include <linux/ioctl.h>
+#include <linux/types.h>
 
 #define MAJOR_NUM  100
 
-#define ALLOC_SIZE 16777216
+#define ALLOC_SHIFT 24
+#define ALLOC_SIZE  (1 << ALLOC_SHIFT)
 #define BUFF_SIZE  4096
 
+/* the smallest block handed out; orders 0 (BUDDY_MIN_BLOCK bytes)
+   up to ALLOC_SIZE */
+#define BUDDY_MIN_SHIFT 6
+#define BUDDY_MIN_BLOCK (1 << BUDDY_MIN_SHIFT)
+#define BUDDY_ORDERS    (ALLOC_SHIFT - BUDDY_MIN_SHIFT + 1)
+#define BUDDY_LEAVES    (1 << (BUDDY_ORDERS - 1))
+
 #define DEVICE_FILE_NAME "/dev/mem_dev"
 #define DEVICE_NAME      "mem_dev"
 
@@ -14,3 +26,32 @@
 #define IOCTL_FILL_WBUF _IOW(MAJOR_NUM, 3, int)
 #define IOCTL_FILL_RBUF _IOW(MAJOR_NUM, 4, int)
 #define IOCTL_FREE_MEM  _IOR(MAJOR_NUM, 5, char *)
+#define IOCTL_BATCH_MEM _IOWR(MAJOR_NUM, 6, struct mem_batch)
+
+/* IOCTL_BATCH_MEM: count allocations and frees in one call, done in
+   order.  Each op's result is what IOCTL_ALLOC_MEM or IOCTL_FREE_MEM
+   would have returned for it (-1 for an op that's neither); the ioctl
+   itself returns how many ops it did.  If part of ops can't be read or
+   written, it stops there, and returns how many were done before it,
+   or -EFAULT if none were.
+
+   ops holds a pointer to the ops, cast through uintptr_t: a __u64
+   keeps struct mem_batch the same for 32- and 64-bit callers. */
+#define MEM_OP_ALLOC 0      /* arg is a size */
+#define MEM_OP_FREE  1      /* arg is a block reference */
+
+struct mem_batch_op
+{
+    int op;
+    int arg;
+    int result;
+};
+
+struct mem_batch
+{
+    __u32 count;
+    __u32 pad;
+    __u64 ops;          /* struct mem_batch_op * */
+};
+
+#endif
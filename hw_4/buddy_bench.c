@@ -0,0 +1,450 @@
+/*  buddy_bench.c
+* ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+*
+*  Microbenchmark for the mem_dev buddy allocator, run in user space:
+*  the free lists from buddy_list.h against the flat-array tree from
+*  buddy_tree.h and the pointer tree the module started out with
+*  (copied below, with malloc for vmalloc), all managing the same
+*  ALLOC_SIZE pool.
+*
+*  usage: buddy_bench [-f] [-n ops] [-l live blocks] [-s max size] [-r seed]
+*
+*  Each allocator first allocates -l blocks (default 256) of random
+*  sizes from 1 to -s bytes (default 16384), then does -n (default
+*  1000000) random operations: an allocation or, half the time or
+*  when the pool is full, the freeing of a random live block.  Prints
+*  operations per second for each, and each over the first.
+*
+*  -f stresses fragmentation instead: -l defaults to 4096, sizes are
+*  mostly small with a tail of big ones (up to ALLOC_SIZE / 4), and
+*  every allocation and free is timed on its own.  Prints percentiles
+*  of both, in nanoseconds; the clock itself adds a few tens of them.
+*
+* ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include "buddy_alloc.h"
+#include "buddy_list.h"
+#include "buddy_tree.h"
+
+/* ------------------------------------------------------------------ */
+/* the old allocator: one malloc'd node per split, searched from root */
+
+struct buddy
+{
+    int free;
+    int split;
+    int page_ref_blk;
+    int page_sized_blk;
+
+    struct buddy *left;
+    struct buddy *right;
+};
+
+static struct buddy *root = NULL;
+
+static struct buddy *old_node(int ref_blk, int sized_blk)
+{
+    struct buddy *node = malloc(sizeof(struct buddy));
+
+    node->free  = 1;
+    node->split = 0;
+    node->page_ref_blk = ref_blk;
+    node->page_sized_blk = sized_blk;
+    node->left  = NULL;
+    node->right = NULL;
+
+    return node;
+}
+
+static int old_alloc(struct buddy *node, int mem_size)
+{
+    int ret_val = 0;
+    if (node->split)
+    {
+        ret_val = old_alloc(node->left, mem_size);
+        if (ret_val < 0)
+            return old_alloc(node->right, mem_size);
+        else
+            return ret_val;
+    }
+    if (!node->free || node->page_sized_blk < mem_size)
+        return -1;
+
+    if (node->page_sized_blk > 2*mem_size)
+    {
+        node->split = 1;
+        node->right = old_node(node->page_ref_blk + node->page_sized_blk / 2,
+                               node->page_sized_blk / 2);
+        node->left  = old_node(node->page_ref_blk, node->page_sized_blk / 2);
+
+        return old_alloc(node->left, mem_size);
+    }
+
+    node->free = 0;
+
+    return node->page_ref_blk;
+}
+
+/* as it was, less the check against the last IOCTL_WRITE_REF and the
+   whole-pool case, which crashed; the benchmark never frees the root */
+static int old_free(struct buddy *node, int block_ref)
+{
+    if (!node->split && node->free)
+        return -1;
+
+    if (node->split)
+    {
+        if (node->left->split)
+            old_free(node->left, block_ref);
+
+        if (!node->left->free &&
+            node->left->page_ref_blk == block_ref)
+            node->left->free = 1;
+
+        if (node->right->split)
+            old_free(node->right, block_ref);
+
+        if (!node->right->free &&
+            node->right->page_ref_blk == block_ref)
+            node->right->free = 1;
+
+        if (node->right->free == 1  &&
+            node->left->free  == 1   )
+        {
+            free(node->right);
+            free(node->left);
+
+            node->left  = NULL;
+            node->right = NULL;
+            node->split = 0;
+            node->free  = 1;
+        }
+    }
+
+    return 0;
+}
+
+static void old_destroy(struct buddy *node)
+{
+    if (node->split)
+    {
+        old_destroy(node->left);
+        old_destroy(node->right);
+    }
+    free(node);
+}
+
+static void old_start(void)
+{
+    root = old_node(0, ALLOC_SIZE);
+}
+
+static int old_get(int size)
+{
+    return old_alloc(root, size);
+}
+
+static void old_put(int ref)
+{
+    old_free(root, ref);
+}
+
+static void old_stop(void)
+{
+    old_destroy(root);
+}
+
+/* ------------------------------------------------------------------ */
+/* the flat tree */
+
+static unsigned char tree[BUDDY_NODES];
+
+static void tree_start(void)
+{
+    buddy_tree_init(tree);
+}
+
+static int tree_get(int size)
+{
+    return buddy_tree_alloc(tree, size);
+}
+
+static void tree_put(int ref)
+{
+    buddy_tree_free(tree, ref);
+}
+
+static void tree_stop(void)
+{
+}
+
+/* ------------------------------------------------------------------ */
+/* the free lists, which mem_dev uses now */
+
+static struct buddy_lists lists;
+
+static void list_start(void)
+{
+    buddy_list_init(&lists);
+}
+
+static int list_get(int size)
+{
+    return buddy_list_alloc(&lists, size);
+}
+
+static void list_put(int ref)
+{
+    buddy_list_free(&lists, ref);
+}
+
+static void list_stop(void)
+{
+}
+
+/* ------------------------------------------------------------------ */
+
+struct allocator
+{
+    const char *name;
+    void (*start)(void);
+    int  (*get)(int size);
+    void (*put)(int ref);
+    void (*stop)(void);
+};
+
+static struct allocator allocators[] =
+{
+    { "pointer tree", old_start,  old_get,  old_put,  old_stop },
+    { "flat tree",    tree_start, tree_get, tree_put, tree_stop },
+    { "free lists",   list_start, list_get, list_put, list_stop },
+};
+
+#define NALLOCATORS (int)(sizeof(allocators) / sizeof(allocators[0]))
+
+static uint64_t rng;
+
+static uint64_t next_rand(void)
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* -f: 60% up to 1 KiB, 30% up to 32 KiB, 9% up to 512 KiB, and
+   the rest up to a quarter of the pool */
+static int frag_size(void)
+{
+    int pick = next_rand() % 100;
+    int max;
+
+    if (pick < 60)
+        max = 1024;
+    else if (pick < 90)
+        max = 32768;
+    else if (pick < 99)
+        max = 524288;
+    else
+        max = ALLOC_SIZE / 4;
+
+    return 1 + next_rand() % max;
+}
+
+struct result
+{
+    double rate;
+    long fails;
+    /* with -f, nanoseconds per call, and how many of each */
+    uint32_t *alloc_ns, *free_ns;
+    long nalloc, nfree;
+};
+
+/* one run of one allocator; with -f (frag), sizes come from
+   frag_size() and every call is timed */
+static void run(struct allocator *a, int *live, int nlive, long ops, int max_size,
+                uint64_t seed, int frag, struct result *r)
+{
+    double start;
+    uint64_t t = 0;
+    long i;
+    int n = 0;
+    int ref;
+    int k;
+
+    rng = seed;
+    r->fails = 0;
+    r->nalloc = r->nfree = 0;
+    a->start();
+
+    while (n < nlive)
+    {
+        ref = a->get(frag ? frag_size() : 1 + (int)(next_rand() % max_size));
+        if (ref < 0)
+            break;
+        live[n++] = ref;
+    }
+
+    start = now();
+    for (i = 0; i < ops; i++)
+    {
+        if (n < nlive && (n == 0 || next_rand() & 1))
+        {
+            int size = frag ? frag_size() : 1 + (int)(next_rand() % max_size);
+
+            if (frag)
+                t = now_ns();
+            ref = a->get(size);
+            if (frag)
+                r->alloc_ns[r->nalloc++] = now_ns() - t;
+            if (ref >= 0)
+            {
+                live[n++] = ref;
+                continue;
+            }
+            r->fails++;
+            if (n == 0)
+                continue;
+        }
+        k = next_rand() % n;
+        if (frag)
+            t = now_ns();
+        a->put(live[k]);
+        if (frag)
+            r->free_ns[r->nfree++] = now_ns() - t;
+        live[k] = live[--n];
+    }
+    r->rate = ops / (now() - start);
+
+    while (n > 0)
+        a->put(live[--n]);
+    a->stop();
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void print_latency(const char *name, const char *what, uint32_t *ns, long n)
+{
+    if (n == 0)
+        return;
+
+    qsort(ns, n, sizeof(*ns), cmp_u32);
+    printf("%-14s %-6s %9ld %8u %8u %8u %8u %10u\n", name, what, n,
+           ns[n / 2], ns[n * 9 / 10], ns[n * 99 / 100], ns[n * 999 / 1000], ns[n - 1]);
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: buddy_bench [-f] [-n ops] [-l live blocks] [-s max size] [-r seed]\n");
+}
+
+int main(int argc, char *argv[])
+{
+    struct result r;
+    long ops = 1000000;
+    int nlive = 0;
+    int max_size = 16384;
+    int frag = 0;
+    uint64_t seed = 1;
+    double first = 0;
+    int *live;
+    int opt;
+    int i;
+
+    while ((opt = getopt(argc, argv, "fn:l:s:r:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'f': frag = 1; break;
+            case 'n': ops = atol(optarg); break;
+            case 'l': nlive = atoi(optarg); break;
+            case 's': max_size = atoi(optarg); break;
+            case 'r': seed = strtoull(optarg, NULL, 0); break;
+            default:
+                usage();
+                return 2;
+        }
+    }
+    if (nlive == 0)
+        nlive = frag ? 4096 : 256;
+    if (ops < 1 || nlive < 1 || max_size < 1 || max_size >= ALLOC_SIZE || seed == 0)
+    {
+        usage();
+        return 2;
+    }
+
+    memset(&r, 0, sizeof(r));
+    live = malloc(nlive * sizeof(*live));
+    if (frag)
+    {
+        r.alloc_ns = malloc(ops * sizeof(*r.alloc_ns));
+        r.free_ns  = malloc(ops * sizeof(*r.free_ns));
+    }
+    if (live == NULL || (frag && (r.alloc_ns == NULL || r.free_ns == NULL)))
+    {
+        perror("malloc");
+        return 1;
+    }
+
+    if (frag)
+    {
+        printf("%d byte pool, %d live blocks of mixed sizes, %ld operations\n\n",
+               ALLOC_SIZE, nlive, ops);
+        printf("%-14s %-6s %9s %8s %8s %8s %8s %10s\n", "allocator", "call", "calls",
+               "p50 ns", "p90 ns", "p99 ns", "p99.9 ns", "max ns");
+    }
+    else
+    {
+        printf("%d byte pool, %d live blocks of 1 to %d bytes, %ld operations\n\n",
+               ALLOC_SIZE, nlive, max_size, ops);
+        printf("%-14s %12s %10s %8s\n", "allocator", "ops/s", "no room", "vs first");
+    }
+
+    for (i = 0; i < NALLOCATORS; i++)
+    {
+        run(&allocators[i], live, nlive, ops, max_size, seed, frag, &r);
+        if (frag)
+        {
+            print_latency(allocators[i].name, "alloc", r.alloc_ns, r.nalloc);
+            print_latency(allocators[i].name, "free", r.free_ns, r.nfree);
+            printf("%-14s no room %ld times\n", allocators[i].name, r.fails);
+            continue;
+        }
+        if (i == 0)
+            first = r.rate;
+        printf("%-14s %12.0f %10ld %7.2fx\n", allocators[i].name, r.rate, r.fails,
+               r.rate / first);
+    }
+
+    free(r.alloc_ns);
+    free(r.free_ns);
+    free(live);
+    return 0;
+}
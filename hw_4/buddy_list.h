@@ -0,0 +1,197 @@
+/*  buddy_list.h
+* ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+*
+*  The buddy allocator behind mem_dev, kept free of kernel headers so
+*  buddy_bench can build the very same code in user space.
+*
+*  The classic layout: one free list per order, from BUDDY_MIN_BLOCK
+*  bytes (order 0) up to the whole pool, plus a bitmask of which lists
+*  have anything on them.  Blocks are named by their offset in
+*  BUDDY_MIN_BLOCK units, and the list links and each block's state
+*  live in arrays indexed by that number, so the pool itself holds
+*  nothing but user data.
+*
+*  Allocating takes the head of the smallest non-empty list that's big
+*  enough - one look at the bitmask - and if that's bigger than asked
+*  for, splits it, putting the upper halves back on the lists below.
+*  When the right list has a block, that's O(1).  Freeing finds the
+*  block's buddy by flipping one bit of its number (n ^ (1 << order));
+*  while the buddy is free and of the same order, the two are merged
+*  and the next order up is tried.  Both are at worst O(orders).
+*
+* ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
+
+#ifndef BUDDY_LIST_H
+#define BUDDY_LIST_H
+
+#include "buddy_alloc.h"
+
+/* what's known about each block number; 0 for the ones that
+   are inside a block rather than at its start */
+#define BUDDY_FREE  0x40
+#define BUDDY_USED  0x80
+#define BUDDY_ORDER 0x3f
+
+struct buddy_lists
+{
+    unsigned int nonempty;              /* bit k: head[k] has a block */
+    int head[BUDDY_ORDERS];             /* -1 for an empty list */
+    int next[BUDDY_LEAVES];
+    int prev[BUDDY_LEAVES];
+    unsigned char state[BUDDY_LEAVES];  /* BUDDY_FREE or BUDDY_USED | order */
+};
+
+static inline int buddy_list_order(int size)
+{
+    int order = 0;
+
+    while ((BUDDY_MIN_BLOCK << order) < size)
+        order++;
+
+    return order;
+}
+
+static inline void buddy_list_push(struct buddy_lists *bl, int blk, int order)
+{
+    bl->state[blk] = BUDDY_FREE | order;
+    bl->prev[blk]  = -1;
+    bl->next[blk]  = bl->head[order];
+    if (bl->head[order] >= 0)
+        bl->prev[bl->head[order]] = blk;
+    bl->head[order] = blk;
+    bl->nonempty |= 1u << order;
+}
+
+static inline void buddy_list_unlink(struct buddy_lists *bl, int blk, int order)
+{
+    if (bl->prev[blk] >= 0)
+        bl->next[bl->prev[blk]] = bl->next[blk];
+    else
+        bl->head[order] = bl->next[blk];
+    if (bl->next[blk] >= 0)
+        bl->prev[bl->next[blk]] = bl->prev[blk];
+    if (bl->head[order] < 0)
+        bl->nonempty &= ~(1u << order);
+    bl->state[blk] = 0;
+}
+
+/* the whole pool as one free block */
+static inline void buddy_list_init(struct buddy_lists *bl)
+{
+    int i;
+
+    bl->nonempty = 0;
+    for (i = 0; i < BUDDY_ORDERS; i++)
+        bl->head[i] = -1;
+    for (i = 0; i < BUDDY_LEAVES; i++)
+        bl->state[i] = 0;
+    buddy_list_push(bl, 0, BUDDY_ORDERS - 1);
+}
+
+/* returns the offset into the pool of a free block of at least size
+   bytes, now allocated, or -1 */
+static inline int buddy_list_alloc(struct buddy_lists *bl, int size)
+{
+    unsigned int fits;
+    int order, k;
+    int blk;
+
+    if (size <= 0 || size > ALLOC_SIZE)
+        return -1;
+
+    order = buddy_list_order(size);
+    fits  = bl->nonempty & ~((1u << order) - 1);
+    if (!fits)
+        return -1;
+
+    k   = __builtin_ctz(fits);
+    blk = bl->head[k];
+    buddy_list_unlink(bl, blk, k);
+
+    /* keep the lower half, free the upper, until it's small enough */
+    while (k > order)
+    {
+        k--;
+        buddy_list_push(bl, blk + (1 << k), k);
+    }
+
+    bl->state[blk] = BUDDY_USED | order;
+    return blk << BUDDY_MIN_SHIFT;
+}
+
+/* the size of the allocated block that starts at block_ref, or -1 if
+   there isn't one */
+static inline int buddy_list_size(struct buddy_lists *bl, int block_ref)
+{
+    int blk;
+
+    if (block_ref < 0 || block_ref >= ALLOC_SIZE ||
+        block_ref & (BUDDY_MIN_BLOCK - 1))
+        return -1;
+
+    blk = block_ref >> BUDDY_MIN_SHIFT;
+    if (!(bl->state[blk] & BUDDY_USED))
+        return -1;
+
+    return BUDDY_MIN_BLOCK << (bl->state[blk] & BUDDY_ORDER);
+}
+
+/* the allocated block that the byte at pos is in: returns its size
+   and leaves where it starts in *block_ref, or -1 if pos is free */
+static inline int buddy_list_find(struct buddy_lists *bl, int pos, int *block_ref)
+{
+    int blk, order;
+    unsigned char state;
+
+    if (pos < 0 || pos >= ALLOC_SIZE)
+        return -1;
+
+    /* blocks tile the pool, so going up through the places the one
+       pos is in could start finds it by the time order is its own */
+    for (order = 0; order < BUDDY_ORDERS; order++)
+    {
+        blk   = (pos >> BUDDY_MIN_SHIFT) & ~((1 << order) - 1);
+        state = bl->state[blk];
+        if (state && (state & BUDDY_ORDER) >= order)
+            break;
+    }
+    if (order == BUDDY_ORDERS || !(state & BUDDY_USED))
+        return -1;
+
+    *block_ref = blk << BUDDY_MIN_SHIFT;
+    return BUDDY_MIN_BLOCK << (state & BUDDY_ORDER);
+}
+
+/* frees the block that starts at block_ref; -1 if there isn't one */
+static inline int buddy_list_free(struct buddy_lists *bl, int block_ref)
+{
+    int blk, buddy;
+    int order;
+
+    if (block_ref < 0 || block_ref >= ALLOC_SIZE ||
+        block_ref & (BUDDY_MIN_BLOCK - 1))
+        return -1;
+
+    blk = block_ref >> BUDDY_MIN_SHIFT;
+    if (!(bl->state[blk] & BUDDY_USED))
+        return -1;
+    order = bl->state[blk] & BUDDY_ORDER;
+    bl->state[blk] = 0;
+
+    /* a free buddy of the same order: the two become one block */
+    while (order < BUDDY_ORDERS - 1)
+    {
+        buddy = blk ^ (1 << order);
+        if (bl->state[buddy] != (BUDDY_FREE | order))
+            break;
+
+        buddy_list_unlink(bl, buddy, order);
+        blk &= ~(1 << order);
+        order++;
+    }
+
+    buddy_list_push(bl, blk, order);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,148 @@
+/*  buddy_tree.h
+* ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+*
+*  The flat-tree buddy allocator mem_dev used before the free lists in
+*  buddy_list.h; buddy_bench still measures it against them.
+*
+*  The pool is described by an implicit complete binary tree in one
+*  array: node 0 is the whole pool, node i has children 2i+1 and 2i+2,
+*  and the nodes of each level cover the pool left to right.  The
+*  leaves are BUDDY_MIN_BLOCK bytes.  Each node holds one byte: one
+*  more than the order of the largest free block somewhere under it,
+*  or 0 if there is none.  A block of order k is BUDDY_MIN_BLOCK << k
+*  bytes, so the root starts out at BUDDY_ORDERS.
+*
+*  Allocating walks down from the root, always into a child that still
+*  has a big enough block, and then back up fixing the counts - two
+*  passes over one path, O(log N), no allocations.  A node whose two
+*  children are both entirely free is entirely free itself, which is
+*  all coalescing amounts to.  Everything under an allocated node (or
+*  an entirely free one) is left as "entirely free", so freeing finds
+*  its block by starting at the leaf under the block reference and
+*  going up to the first node marked allocated.
+*
+* ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
+
+#ifndef BUDDY_TREE_H
+#define BUDDY_TREE_H
+
+#include "buddy_alloc.h"
+
+#define BUDDY_NODES     (2 * BUDDY_LEAVES - 1)
+
+static inline int buddy_tree_order(int size)
+{
+    int order = 0;
+
+    while ((BUDDY_MIN_BLOCK << order) < size)
+        order++;
+
+    return order;
+}
+
+static inline unsigned char buddy_tree_max(unsigned char a, unsigned char b)
+{
+    return a > b ? a : b;
+}
+
+/* recompute the ancestors of node, whose children are of the given
+   order, after it has changed */
+static inline void buddy_tree_fix_up(unsigned char *tree, int node, int order)
+{
+    unsigned char left, right;
+
+    while (node > 0)
+    {
+        node = (node - 1) / 2;
+        order++;
+
+        left  = tree[2*node + 1];
+        right = tree[2*node + 2];
+
+        if (left == order && right == order)
+            tree[node] = order + 1;
+        else
+            tree[node] = buddy_tree_max(left, right);
+    }
+}
+
+/* tree has BUDDY_NODES bytes; marks the whole pool free */
+static inline void buddy_tree_init(unsigned char *tree)
+{
+    int node  = 0;
+    int order = BUDDY_ORDERS;
+    int width = 1;
+    int i;
+
+    while (order > 0)
+    {
+        for (i = 0; i < width; i++)
+            tree[node + i] = order;
+
+        node += width;
+        width *= 2;
+        order--;
+    }
+}
+
+/* returns the offset into the pool of a free block of at least size
+   bytes, now allocated, or -1 */
+static inline int buddy_tree_alloc(unsigned char *tree, int size)
+{
+    int node = 0;
+    int order;
+    int level;
+
+    if (size <= 0 || size > ALLOC_SIZE)
+        return -1;
+
+    order = buddy_tree_order(size);
+    if (tree[0] < order + 1)
+        return -1;
+
+    /* level counts down from the root's order to the block's */
+    for (level = BUDDY_ORDERS - 1; level > order; level--)
+    {
+        if (tree[2*node + 1] >= order + 1)
+            node = 2*node + 1;
+        else
+            node = 2*node + 2;
+    }
+
+    tree[node] = 0;
+    buddy_tree_fix_up(tree, node, order);
+
+    /* the node's place in its level, times its block size */
+    return (node + 1 - (1 << (BUDDY_ORDERS - 1 - order))) << (order + BUDDY_MIN_SHIFT);
+}
+
+/* frees the block that starts at block_ref; -1 if there isn't one */
+static inline int buddy_tree_free(unsigned char *tree, int block_ref)
+{
+    int node;
+    int order = 0;
+
+    if (block_ref < 0 || block_ref >= ALLOC_SIZE ||
+        block_ref & (BUDDY_MIN_BLOCK - 1))
+        return -1;
+
+    node = BUDDY_LEAVES - 1 + (block_ref >> BUDDY_MIN_SHIFT);
+    while (tree[node] != 0)
+    {
+        if (node == 0)
+            return -1;
+        node = (node - 1) / 2;
+        order++;
+    }
+
+    /* block_ref must be where the block starts, not inside it */
+    if (block_ref & ((BUDDY_MIN_BLOCK << order) - 1))
+        return -1;
+
+    tree[node] = order + 1;
+    buddy_tree_fix_up(tree, node, order);
+
+    return 0;
+}
+
+#endif
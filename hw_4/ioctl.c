@@ -17,11 +17,15 @@
 *
 * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
 
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <fcntl.h>      
 #include <unistd.h>     
 #include <sys/ioctl.h>      
+#include <sys/mman.h>
+#include <time.h>
 #include "buddy_alloc.h"
 
 int mem;
@@ -82,6 +86,22 @@ int read_mem(int mem, int ref, char *buf, int size)
     return bytes_rd;
 }
 
+/* map a block straight into our address space; ref has to be page
+   aligned, which blocks of a page or more always are */
+char *map_mem(int mem, int ref, int size)
+{
+    char *block;
+
+    block = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, mem, ref);
+    if (block == MAP_FAILED)
+    {
+        perror("mapping a block of memory has failed");
+        exit(EXIT_FAILURE);
+    }
+
+    return block;
+}
+
 int free_mem(int mem, int ref)
 {
     int ref_val;
@@ -96,20 +116,254 @@ int free_mem(int mem, int ref)
     return 0;
 }
 
-void main(void)
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench_line(const char *how, long bytes, double secs)
 {
-    mem = open(DEVICE_FILE_NAME, 0);
+    printf("%-22s %10.1f MB/s\n", how, bytes / secs / 1e6);
+}
+
+/* -b: move BENCH_BYTES in and out of one block every way there is.
+   The ioctls stop at a NUL and take at most BUFF_SIZE - 1 bytes of
+   anything else per call, so they get a chunk of 'x's at a time. */
+#define BENCH_BYTES (64 << 20)
+
+void bench_mem(int mem, int size)
+{
+    char *data, *back, *block;
+    long done;
+    double start;
+    int chunk = BUFF_SIZE - 1;
+    int ref_val;
+    int off;
+    int len;
+
+    data = malloc(size);
+    back = malloc(size);
+    if (data == NULL || back == NULL)
+    {
+        printf("out of memory.\n");
+        exit(EXIT_FAILURE);
+    }
+    for (off = 0; off < size; off++)
+        data[off] = 'a' + off % 26;
+
+    ref_val = get_mem(mem, size);
+    printf("moving %d MB through a %d byte block\n\n", BENCH_BYTES >> 20, size);
+
+    memset(buffer, 'x', chunk);
+    buffer[chunk] = '\0';
+    start = now();
+    for (done = 0; done < BENCH_BYTES; done += chunk)
+    {
+        off = done % (size - chunk);
+        if (ioctl(mem, IOCTL_WRITE_REF, ref_val + off) < 0 ||
+            ioctl(mem, IOCTL_FILL_WBUF, buffer) != chunk)
+        {
+            printf("IOCTL_FILL_WBUF has failed.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    bench_line("ioctl FILL_WBUF", done, now() - start);
+
+    start = now();
+    for (done = 0; done < BENCH_BYTES; done += len)
+    {
+        off = done % (size - chunk);
+        if (ioctl(mem, IOCTL_READ_REF, ref_val + off) < 0 ||
+            (len = ioctl(mem, IOCTL_FILL_RBUF, buffer)) <= 0)
+        {
+            printf("IOCTL_FILL_RBUF has failed.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    bench_line("ioctl FILL_RBUF", done, now() - start);
+
+    start = now();
+    for (done = 0; done < BENCH_BYTES; done += size)
+    {
+        if (pwrite(mem, data, size, ref_val) != size)
+        {
+            perror("pwrite");
+            exit(EXIT_FAILURE);
+        }
+    }
+    bench_line("pwrite", done, now() - start);
+
+    start = now();
+    for (done = 0; done < BENCH_BYTES; done += size)
+    {
+        if (pread(mem, back, size, ref_val) != size)
+        {
+            perror("pread");
+            exit(EXIT_FAILURE);
+        }
+    }
+    bench_line("pread", done, now() - start);
+
+    /* pread has to give back what pwrite put there, NULs and all */
+    if (memcmp(data, back, size) != 0)
+    {
+        printf("pread returned something other than was written.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (size >= getpagesize())
+    {
+        block = map_mem(mem, ref_val, size);
+        start = now();
+        for (done = 0; done < BENCH_BYTES; done += size)
+        {
+            memcpy(block, data, size);
+            memcpy(back, block, size);
+        }
+        bench_line("mmap + memcpy (both)", 2 * done, now() - start);
+        munmap(block, size);
+    }
+
+    free_mem(mem, ref_val);
+    free(data);
+    free(back);
+}
+
+/* -a: allocations and frees of BATCH_SIZE small blocks at a time,
+   one ioctl each and then one IOCTL_BATCH_MEM per BATCH_SIZE */
+#define BATCH_SIZE 1024
+
+void bench_batch(int mem, long ops)
+{
+    struct mem_batch_op op[BATCH_SIZE];
+    struct mem_batch batch = { BATCH_SIZE, 0, (uintptr_t)op };
+    double start, single, batched;
+    long done;
+    int i;
+
+    start = now();
+    for (done = 0; done < ops; done += 2 * BATCH_SIZE)
+    {
+        for (i = 0; i < BATCH_SIZE; i++)
+            op[i].result = ioctl(mem, IOCTL_ALLOC_MEM, BUDDY_MIN_BLOCK);
+        for (i = 0; i < BATCH_SIZE; i++)
+        {
+            if (op[i].result < 0 || ioctl(mem, IOCTL_FREE_MEM, op[i].result) < 0)
+            {
+                printf("a single alloc or free has failed.\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    single = done / (now() - start);
+
+    start = now();
+    for (done = 0; done < ops; done += 2 * BATCH_SIZE)
+    {
+        for (i = 0; i < BATCH_SIZE; i++)
+        {
+            op[i].op  = MEM_OP_ALLOC;
+            op[i].arg = BUDDY_MIN_BLOCK;
+        }
+        if (ioctl(mem, IOCTL_BATCH_MEM, &batch) != BATCH_SIZE)
+        {
+            perror("IOCTL_BATCH_MEM");
+            exit(EXIT_FAILURE);
+        }
+        for (i = 0; i < BATCH_SIZE; i++)
+        {
+            if (op[i].result < 0)
+            {
+                printf("a batched alloc has failed.\n");
+                exit(EXIT_FAILURE);
+            }
+            op[i].op  = MEM_OP_FREE;
+            op[i].arg = op[i].result;
+        }
+        if (ioctl(mem, IOCTL_BATCH_MEM, &batch) != BATCH_SIZE)
+        {
+            perror("IOCTL_BATCH_MEM");
+            exit(EXIT_FAILURE);
+        }
+        for (i = 0; i < BATCH_SIZE; i++)
+        {
+            if (op[i].result < 0)
+            {
+                printf("a batched free has failed.\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+
+    batched = done / (now() - start);
+
+    printf("%ld allocs and frees of %d bytes, %d live at a time\n\n",
+           done, BUDDY_MIN_BLOCK, BATCH_SIZE);
+    printf("%-22s %12.0f ops/s\n", "one ioctl per op", single);
+    printf("%-22s %12.0f ops/s  %.1fx\n", "IOCTL_BATCH_MEM", batched, batched / single);
+}
+
+int main(int argc, char *argv[])
+{
+    char *block;
+    int size = getpagesize();
+    int len;
+
+    mem = open(DEVICE_FILE_NAME, O_RDWR);
     if (mem < 0) 
     {
         printf("Can't open device file: [%s]\n", DEVICE_FILE_NAME);
         exit(EXIT_FAILURE);
     }
 
+    /* ioctl -b [block size]: the throughput benchmark instead */
+    if (argc > 1 && strcmp(argv[1], "-b") == 0)
+    {
+        size = argc > 2 ? atoi(argv[2]) : 1 << 20;
+        if (size < BUFF_SIZE || size > ALLOC_SIZE)
+        {
+            printf("the block has to be %d to %d bytes.\n", BUFF_SIZE, ALLOC_SIZE);
+            exit(EXIT_FAILURE);
+        }
+        bench_mem(mem, size);
+        close(mem);
+        exit(EXIT_SUCCESS);
+    }
+
+    /* ioctl -a [ops]: single against batched allocs and frees */
+    if (argc > 1 && strcmp(argv[1], "-a") == 0)
+    {
+        bench_batch(mem, argc > 2 ? atol(argv[2]) : 1000000);
+        close(mem);
+        exit(EXIT_SUCCESS);
+    }
+
     ref = get_mem(mem, 100);
     sprintf(buffer, "Hello buddy");
     write_mem(mem, ref, buffer);
     read_mem(mem, ref+3, buffer, 10);
     printf("buffer: %s\n", buffer);
     free_mem(mem, ref);
+
+    /* the same again without a copy: write through a mapping,
+       read back with the ioctls */
+    ref = get_mem(mem, size);
+    block = map_mem(mem, ref, size);
+    strcpy(block, "Hello mapped buddy");
+    read_mem(mem, ref, buffer, size);
+    printf("buffer: %s\n", buffer);
+    munmap(block, size);
+
+    /* and with plain pwrite/pread: the file offset is ref plus where
+       in the block, and a call stops short at the end of the block */
+    len = pwrite(mem, "Hello\0binary\0buddy", 19, ref + 8);
+    printf("bytes written: [%d]\n", len);
+    len = pread(mem, buffer, BUFF_SIZE, ref + size - 4);
+    printf("bytes read at the end of the block: [%d]\n", len);
+    free_mem(mem, ref);
     close(mem);
+    return 0;
 }
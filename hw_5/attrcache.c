@@ -0,0 +1,317 @@
+// Attribute and negative-dentry cache, see attrcache.h.
+//
+// The cache is split into shards by path hash, each with its own
+// lock, hash table and FIFO list for eviction; a full shard throws out
+// its oldest entry.  Each shard also has a generation number that
+// every drop bumps.  A getattr takes the generation before its lstat()
+// and the result is only cached if it hasn't moved, so an lstat()
+// that raced with a chmod() can't put the old mode back.
+
+#include "params.h"
+
+#include <errno.h>
+#include <fuse.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "attrcache.h"
+#include "instr.h"
+#include "log.h"
+
+#define AC_SHARDS  64
+#define AC_BUCKETS 1024
+
+struct ac_entry {
+    struct ac_entry *hnext;
+    struct ac_entry *older, *newer;     // the shard's FIFO
+    uint64_t hash;
+    uint64_t expires;                   // instr_now() time
+    int has_stat;
+    int err;                            // 0 or -ENOENT
+    struct stat st;
+    unsigned char acc_known, acc_ok;    // bit m: access(mask m) is known / was 0
+    char path[];
+};
+
+struct ac_shard {
+    pthread_mutex_t lock;
+    unsigned gen;                       // written under lock, read atomically
+    size_t count;
+    struct ac_entry *oldest, *newest;
+    struct ac_entry **buckets;
+    uint64_t hits, misses;
+};
+
+static struct {
+    struct ac_shard shards[AC_SHARDS];
+    uint64_t ttl_ns;
+    int running;
+} ac;
+
+// FNV-1a, as for trace path ids
+static uint64_t ac_hash(const char *path) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    while (*path) {
+        h ^= (unsigned char) *path++;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static struct ac_shard *ac_shard(uint64_t hash) {
+    return &ac.shards[hash % AC_SHARDS];
+}
+
+// the rest take the shard's lock held
+
+static struct ac_entry **ac_slot(struct ac_shard *s, uint64_t hash, const char *path) {
+    struct ac_entry **pp;
+
+    for (pp = &s->buckets[(hash / AC_SHARDS) % AC_BUCKETS]; *pp; pp = &(*pp)->hnext)
+        if ((*pp)->hash == hash && strcmp((*pp)->path, path) == 0) break;
+    return pp;
+}
+
+static void ac_remove(struct ac_shard *s, struct ac_entry **pp) {
+    struct ac_entry *e = *pp;
+
+    *pp = e->hnext;
+    if (e->older) e->older->newer = e->newer;
+    else s->oldest = e->newer;
+    if (e->newer) e->newer->older = e->older;
+    else s->newest = e->older;
+    s->count--;
+    free(e);
+}
+
+// the live entry for path, if there is one
+static struct ac_entry *ac_find(struct ac_shard *s, uint64_t hash, const char *path) {
+    struct ac_entry **pp = ac_slot(s, hash, path);
+
+    if (*pp == NULL) return NULL;
+    if ((*pp)->expires <= instr_now()) {
+        ac_remove(s, pp);
+        return NULL;
+    }
+    return *pp;
+}
+
+// find or make the entry to store a result in
+static struct ac_entry *ac_entry(struct ac_shard *s, uint64_t hash, const char *path) {
+    struct ac_entry **pp = ac_slot(s, hash, path), *e;
+    size_t len;
+
+    if (*pp) {
+        e = *pp;
+        if (e->expires > instr_now()) return e;
+        ac_remove(s, pp);
+    }
+
+    if (s->count >= ATTRCACHE_MAX / AC_SHARDS)
+        ac_remove(s, ac_slot(s, s->oldest->hash, s->oldest->path));
+
+    len = strlen(path);
+    e = calloc(1, sizeof(*e) + len + 1);
+    if (e == NULL) return NULL;
+    memcpy(e->path, path, len + 1);
+    e->hash = hash;
+    e->expires = instr_now() + ac.ttl_ns;
+
+    pp = &s->buckets[(hash / AC_SHARDS) % AC_BUCKETS];
+    e->hnext = *pp;
+    *pp = e;
+    e->older = s->newest;
+    if (s->newest) s->newest->newer = e;
+    else s->oldest = e;
+    s->newest = e;
+    s->count++;
+    return e;
+}
+
+int attrcache_get(const char *path, struct stat *st, int *err) {
+    uint64_t hash;
+    struct ac_shard *s;
+    struct ac_entry *e;
+    int hit = 0;
+
+    if (!ac.running || path == NULL) return 0;
+    hash = ac_hash(path);
+    s = ac_shard(hash);
+
+    pthread_mutex_lock(&s->lock);
+    e = ac_find(s, hash, path);
+    if (e && (e->has_stat || e->err)) {
+        *err = e->err;
+        if (e->err == 0) *st = e->st;
+        hit = 1;
+        s->hits++;
+    } else {
+        s->misses++;
+    }
+    pthread_mutex_unlock(&s->lock);
+    return hit;
+}
+
+unsigned attrcache_gen(const char *path) {
+    if (!ac.running || path == NULL) return 0;
+    return __atomic_load_n(&ac_shard(ac_hash(path))->gen, __ATOMIC_ACQUIRE);
+}
+
+void attrcache_put(const char *path, unsigned gen, const struct stat *st, int err) {
+    uint64_t hash;
+    struct ac_shard *s;
+    struct ac_entry *e;
+
+    if (!ac.running || path == NULL || (err != 0 && err != -ENOENT)) return;
+    hash = ac_hash(path);
+    s = ac_shard(hash);
+
+    pthread_mutex_lock(&s->lock);
+    if (s->gen == gen && (e = ac_entry(s, hash, path)) != NULL) {
+        e->err = err;
+        e->has_stat = err == 0;
+        if (err == 0) e->st = *st;
+        else e->acc_known = 0;
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+int attrcache_access(const char *path, int mask, int *err) {
+    uint64_t hash;
+    struct ac_shard *s;
+    struct ac_entry *e;
+    int hit = 0;
+
+    if (!ac.running || path == NULL || mask & ~7) return 0;
+    hash = ac_hash(path);
+    s = ac_shard(hash);
+
+    pthread_mutex_lock(&s->lock);
+    e = ac_find(s, hash, path);
+    if (e && e->err) {
+        *err = e->err;
+        hit = 1;
+    } else if (e && e->acc_known & (1 << mask)) {
+        *err = e->acc_ok & (1 << mask) ? 0 : -EACCES;
+        hit = 1;
+    }
+    if (hit) s->hits++;
+    else s->misses++;
+    pthread_mutex_unlock(&s->lock);
+    return hit;
+}
+
+void attrcache_put_access(const char *path, unsigned gen, int mask, int err) {
+    uint64_t hash;
+    struct ac_shard *s;
+    struct ac_entry *e;
+
+    if (!ac.running || path == NULL || mask & ~7) return;
+    if (err == -ENOENT) {
+        attrcache_put(path, gen, NULL, err);
+        return;
+    }
+    if (err != 0 && err != -EACCES) return;
+    hash = ac_hash(path);
+    s = ac_shard(hash);
+
+    pthread_mutex_lock(&s->lock);
+    if (s->gen == gen && (e = ac_entry(s, hash, path)) != NULL && e->err == 0) {
+        e->acc_known |= 1 << mask;
+        if (err == 0) e->acc_ok |= 1 << mask;
+        else e->acc_ok &= ~(1 << mask);
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+void attrcache_drop(const char *path) {
+    uint64_t hash;
+    struct ac_shard *s;
+    struct ac_entry **pp;
+
+    if (!ac.running || path == NULL) return;
+    hash = ac_hash(path);
+    s = ac_shard(hash);
+
+    pthread_mutex_lock(&s->lock);
+    __atomic_store_n(&s->gen, s->gen + 1, __ATOMIC_RELEASE);
+    pp = ac_slot(s, hash, path);
+    if (*pp) ac_remove(s, pp);
+    pthread_mutex_unlock(&s->lock);
+}
+
+void attrcache_drop_entry(const char *path) {
+    char parent[PATH_MAX];
+    const char *slash;
+
+    if (!ac.running || path == NULL) return;
+    attrcache_drop(path);
+
+    // its directory's mtime and (for subdirectories) link count
+    slash = strrchr(path, '/');
+    if (slash == NULL || slash - path >= PATH_MAX) return;
+    if (slash == path) {
+        attrcache_drop("/");
+    } else {
+        memcpy(parent, path, slash - path);
+        parent[slash - path] = '\0';
+        attrcache_drop(parent);
+    }
+}
+
+void attrcache_clear(void) {
+    struct ac_shard *s;
+    int i;
+
+    if (!ac.running) return;
+    for (i = 0; i < AC_SHARDS; i++) {
+        s = &ac.shards[i];
+        pthread_mutex_lock(&s->lock);
+        __atomic_store_n(&s->gen, s->gen + 1, __ATOMIC_RELEASE);
+        while (s->oldest)
+            ac_remove(s, ac_slot(s, s->oldest->hash, s->oldest->path));
+        pthread_mutex_unlock(&s->lock);
+    }
+}
+
+int attrcache_enabled(void) {
+    return ac.running;
+}
+
+int attrcache_start(unsigned ttl_ms) {
+    int i;
+
+    ac.ttl_ns = (uint64_t) ttl_ms * 1000000;
+    for (i = 0; i < AC_SHARDS; i++) {
+        pthread_mutex_init(&ac.shards[i].lock, NULL);
+        ac.shards[i].buckets = calloc(AC_BUCKETS, sizeof(*ac.shards[i].buckets));
+        if (ac.shards[i].buckets == NULL) return -ENOMEM;
+    }
+    ac.running = 1;
+    return 0;
+}
+
+void attrcache_stop(void) {
+    uint64_t hits = 0, misses = 0;
+    int i;
+
+    if (!ac.running) return;
+    for (i = 0; i < AC_SHARDS; i++) {
+        hits += ac.shards[i].hits;
+        misses += ac.shards[i].misses;
+    }
+    attrcache_clear();
+    ac.running = 0;
+
+    log_msg("    attrcache: %llu hits, %llu misses\n",
+            (unsigned long long) hits, (unsigned long long) misses);
+    for (i = 0; i < AC_SHARDS; i++) {
+        free(ac.shards[i].buckets);
+        pthread_mutex_destroy(&ac.shards[i].lock);
+    }
+}
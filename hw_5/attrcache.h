@@ -0,0 +1,48 @@
+#ifndef _ATTRCACHE_H_
+#define _ATTRCACHE_H_
+// Attribute and negative-dentry cache, turned on with -o attr_ttl=ms.
+//
+// Remembers, for up to -o attr_ttl milliseconds, what lstat() said
+// about a path -- including that it doesn't exist -- and what
+// access() said for each mask, so bb_getattr(), bb_fgetattr() and
+// bb_access() needn't walk the backing path every time.  bbfs drops
+// entries itself whenever one of its own operations changes them;
+// changes made to rootdir behind bbfs' back show up within the TTL.
+// Entries are keyed by the path FUSE hands us, so a file with more
+// than one hard link may show stale attributes under its other names
+// for up to the TTL too.
+
+#include <sys/types.h>
+
+#define ATTRCACHE_MAX 65536     // entries, across all shards
+
+struct stat;
+
+// called from bb_init() and bb_destroy()
+int attrcache_start(unsigned ttl_ms);
+void attrcache_stop(void);
+int attrcache_enabled(void);
+
+// Returns 1 and fills in st (*err 0) or *err (-ENOENT) if path is
+// cached, 0 if it isn't
+int attrcache_get(const char *path, struct stat *st, int *err);
+// Take this before the lstat() and hand it to attrcache_put(); a put
+// that raced with an invalidation is then ignored
+unsigned attrcache_gen(const char *path);
+// err is 0 (st valid) or -ENOENT; other errors aren't cached
+void attrcache_put(const char *path, unsigned gen, const struct stat *st, int err);
+
+// the same for access(path, mask); only 0, -EACCES and -ENOENT are
+// cached
+int attrcache_access(const char *path, int mask, int *err);
+void attrcache_put_access(const char *path, unsigned gen, int mask, int err);
+
+// Forget a path after changing its attributes; attrcache_drop_entry()
+// also forgets its parent directory, for ops that add or remove the
+// name itself.  attrcache_clear() forgets everything, which is what a
+// directory rename needs.
+void attrcache_drop(const char *path);
+void attrcache_drop_entry(const char *path);
+void attrcache_clear(void);
+
+#endif
@@ -0,0 +1,1189 @@
+/*
+   bbbench -- scripted workloads and log replay, bbfs against its own rootdir
+
+   usage: bbbench [-b bbfs] [-o options] [-u uid] [-d dir] [-w workload,...]
+                  [-B KiB,...] [-s MiB] [-n files] [-t seconds] [-r log] [-k]
+
+   Makes a scratch directory under -d (default $TMPDIR, or /tmp),
+   mounts -b (default ./bbfs) on it in the foreground with the -o
+   options and -u as the uid it takes (default ours), and runs every
+   workload twice: straight on the rootdir, then through the mount,
+   which sits on the same filesystem.  The results go to stdout as
+   JSON, one object per workload, block size and target, with ops/s,
+   MB/s and latency percentiles; the ones through bbfs also carry
+   "vs_raw", their ops/s over the rootdir's.  If the mount has stats,
+   .bbfs_stats is copied in at the end.  Progress goes to stderr.
+
+   The workloads (-w, default all but replay):
+     seq      write a -s MiB file (default 64) in each -B block size
+              (default 4,64,1024 KiB), fsync it, drop it from the page
+              cache and read it back, checking every block
+     rand     the same file, then -t seconds (default 2) each of
+              random block-aligned writes and reads
+     meta     create, stat, rename and unlink -n files (default 10000)
+     readdir  list a directory of -n files over and over for -t
+              seconds, first names only, then lstat()ing every entry
+     small    write -n files of 4 KiB each, then read them back
+     replay   -r's log, see below
+
+   -r replays a bbfs log: the text bbfs.log, or a binary bbfs.trace
+   from -o trace, told apart by the trace's magic.  With -r and no -w
+   that's all that runs.  Operations go one at a time, in order, as
+   fast as they'll go, on the same paths under each target; whatever
+   the log uses without making it first is made beforehand, outside
+   the timing, files as big as the log reads them.  Every kind of
+   operation gets its own "replay:<op>" result as well as the overall
+   "replay" one.  A binary trace has only one path per record, so its
+   renames, links and symlinks are skipped, as are chown and the
+   xattr calls that need a name; "skipped" counts them.  Logs from
+   -o lowlevel name inodes, not paths, and have nothing to replay.
+
+   bbfs won't run as root, so neither will this.  -k keeps the
+   scratch directory, bbfs.log and all, and says where it is.
+   */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/xattr.h>
+#include <time.h>
+#include <unistd.h>
+#include <utime.h>
+
+#include "hist.h"
+#include "trace.h"
+
+#define MAX_BLOCKS  16
+#define MAX_RESULTS 1024
+#define SMALL_SIZE  4096
+#define PREP_CHUNK  (1 << 20)
+
+enum { RAW, BBFS, NTARGETS };
+static const char *target_name[] = { "raw", "bbfs" };
+
+enum { WL_SEQ, WL_RAND, WL_META, WL_READDIR, WL_SMALL, WL_REPLAY, NWORKLOADS };
+static const char *workload_name[] = { "seq", "rand", "meta", "readdir", "small", "replay" };
+
+// one workload (or phase of one), block size and target
+struct result {
+    char workload[32];
+    size_t block;               // 0 if it has none
+    int target;
+    uint64_t ops, bytes, entries, errors, skipped;
+    double secs;
+    struct hist lat;            // ns per op
+};
+
+static struct result results[MAX_RESULTS];
+static int nresults;
+
+static const char *bbfs = "./bbfs", *options, *replay_file;
+static char scratch[4096], *root, *mnt, *target_dir[NTARGETS];
+static long size_mb = 64, nfiles = 10000;
+static double secs = 2;
+static size_t blocks[MAX_BLOCKS] = { 4 << 10, 64 << 10, 1 << 20 };
+static int nblocks = 3;
+static pid_t bbfs_pid;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int expired(uint64_t start) {
+    return now_ns() - start >= secs * 1e9;
+}
+
+static struct result *result_new(const char *workload, size_t block, int target) {
+    struct result *r;
+
+    if (nresults == MAX_RESULTS) {
+        fprintf(stderr, "bbbench: more than %d results\n", MAX_RESULTS);
+        exit(1);
+    }
+    r = &results[nresults++];
+    snprintf(r->workload, sizeof(r->workload), "%s", workload);
+    r->block = block;
+    r->target = target;
+    hist_init(&r->lat);
+    return r;
+}
+
+// one timed operation, started at t0, of bytes bytes if it worked
+static void result_op(struct result *r, uint64_t t0, int ok, size_t bytes) {
+    hist_add(&r->lat, now_ns() - t0);
+    r->ops++;
+    if (ok) r->bytes += bytes;
+    else r->errors++;
+}
+
+static void result_done(struct result *r, uint64_t start) {
+    r->secs = (now_ns() - start) / 1e9;
+}
+
+static const struct result *result_find(const char *workload, size_t block, int target) {
+    int i;
+
+    for (i = 0; i < nresults; i++)
+        if (results[i].target == target && results[i].block == block &&
+                strcmp(results[i].workload, workload) == 0)
+            return &results[i];
+    return NULL;
+}
+
+// every block starts with its own offset, so misplaced or mangled
+// data is caught without comparing all of it
+static void stamp(char *buf, size_t len, uint64_t off) {
+    memset(buf, 'a' + off / len % 26, len);
+    memcpy(buf, &off, sizeof(off));
+}
+
+static int stamped(const char *buf, size_t len, uint64_t off) {
+    uint64_t got;
+
+    memcpy(&got, buf, sizeof(got));
+    return got == off && buf[len - 1] == (char) ('a' + off / len % 26);
+}
+
+static void drop_cache(const char *path) {
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0) return;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+static int rm_one(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    return remove(path) < 0 && errno != ENOENT ? -1 : 0;
+}
+
+static void rm_rf(const char *path) {
+    nftw(path, rm_one, 64, FTW_DEPTH | FTW_PHYS);
+}
+
+// Write size bytes to path in block-sized writes and fsync it; with
+// r, every write is timed into it, the fsync only into its seconds.
+static int write_file(const char *path, size_t block, uint64_t size, struct result *r, char *buf) {
+    uint64_t off, start = now_ns(), t0;
+    int fd, ok;
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror(path);
+        if (r) r->errors++;
+        return -1;
+    }
+    for (off = 0; off < size; off += block) {
+        stamp(buf, block, off);
+        t0 = now_ns();
+        ok = write(fd, buf, block) == (ssize_t) block;
+        if (r) result_op(r, t0, ok, block);
+    }
+    if (fsync(fd) < 0 && r) r->errors++;
+    close(fd);
+    if (r) result_done(r, start);
+    return 0;
+}
+
+static void read_file(const char *path, size_t block, uint64_t size, struct result *r, char *buf) {
+    uint64_t off, start = now_ns(), t0;
+    int fd, ok;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        r->errors++;
+        return;
+    }
+    for (off = 0; off < size; off += block) {
+        t0 = now_ns();
+        ok = read(fd, buf, block) == (ssize_t) block;
+        result_op(r, t0, ok && stamped(buf, block, off), block);
+    }
+    close(fd);
+    result_done(r, start);
+}
+
+// -t seconds of random block-aligned pwrite()s or pread()s
+static void rand_io(const char *path, size_t block, uint64_t size, int writing, struct result *r,
+        char *buf) {
+    uint64_t rng = 0x9e3779b97f4a7c15ULL, nblk = size / block, off, start, t0;
+    int fd, ok;
+
+    fd = open(path, writing ? O_WRONLY : O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        r->errors++;
+        return;
+    }
+    start = now_ns();
+    do {
+        rng ^= rng << 13;
+        rng ^= rng >> 7;
+        rng ^= rng << 17;
+        off = rng % nblk * block;
+        if (writing) stamp(buf, block, off);
+
+        t0 = now_ns();
+        if (writing) ok = pwrite(fd, buf, block, off) == (ssize_t) block;
+        else ok = pread(fd, buf, block, off) == (ssize_t) block && stamped(buf, block, off);
+        result_op(r, t0, ok, block);
+    } while (!expired(start));
+    if (writing && fsync(fd) < 0) r->errors++;
+    close(fd);
+    result_done(r, start);
+}
+
+static void wl_seq(int t, const char *dir, char *buf) {
+    uint64_t size = (uint64_t) size_mb << 20;
+    char path[4096];
+    int i;
+
+    snprintf(path, sizeof(path), "%s/seq.dat", dir);
+    for (i = 0; i < nblocks; i++) {
+        write_file(path, blocks[i], size, result_new("seq_write", blocks[i], t), buf);
+        drop_cache(path);
+        read_file(path, blocks[i], size, result_new("seq_read", blocks[i], t), buf);
+    }
+    unlink(path);
+}
+
+static void wl_rand(int t, const char *dir, char *buf) {
+    uint64_t size = (uint64_t) size_mb << 20;
+    char path[4096];
+    int i;
+
+    snprintf(path, sizeof(path), "%s/rand.dat", dir);
+    for (i = 0; i < nblocks; i++) {
+        // stamped in this block size, so the random reads can check it
+        if (write_file(path, blocks[i], size, NULL, buf) < 0) continue;
+        rand_io(path, blocks[i], size, 1, result_new("rand_write", blocks[i], t), buf);
+        drop_cache(path);
+        rand_io(path, blocks[i], size, 0, result_new("rand_read", blocks[i], t), buf);
+    }
+    unlink(path);
+}
+
+static void wl_meta(int t, const char *dir) {
+    enum { CREATE, STAT, RENAME, UNLINK, NPHASES };
+    static const char *phase[] = { "create", "stat", "rename", "unlink" };
+    char path[4096], path2[4096];
+    uint64_t start, t0;
+    struct result *r;
+    struct stat st;
+    int p, ok, fd;
+    long i;
+
+    for (p = 0; p < NPHASES; p++) {
+        r = result_new(phase[p], 0, t);
+        start = now_ns();
+        for (i = 0; i < nfiles; i++) {
+            snprintf(path, sizeof(path), "%s/f%ld", dir, i);
+            snprintf(path2, sizeof(path2), "%s/g%ld", dir, i);
+            t0 = now_ns();
+            switch (p) {
+            case CREATE:
+                fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+                ok = fd >= 0 && close(fd) == 0;
+                break;
+            case STAT:
+                ok = lstat(path, &st) == 0;
+                break;
+            case RENAME:
+                ok = rename(path, path2) == 0;
+                break;
+            default:
+                ok = unlink(path2) == 0;
+                break;
+            }
+            result_op(r, t0, ok, 0);
+        }
+        result_done(r, start);
+    }
+}
+
+// every name in dir, and lstat() of each with stat_each; returns how
+// many there were, or -1
+static long list_dir(const char *dir, int stat_each) {
+    char path[4096];
+    struct dirent *d;
+    struct stat st;
+    long n = 0;
+    DIR *dp;
+
+    dp = opendir(dir);
+    if (dp == NULL) return -1;
+    while ((d = readdir(dp)) != NULL) {
+        if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0) continue;
+        if (stat_each) {
+            snprintf(path, sizeof(path), "%s/%s", dir, d->d_name);
+            if (lstat(path, &st) < 0) n = -nfiles - 1;
+        }
+        n++;
+    }
+    closedir(dp);
+    return n;
+}
+
+static void wl_readdir(int t, const char *dir) {
+    char path[4096];
+    uint64_t start, t0;
+    struct result *r;
+    int stat_each, fd;
+    long i, n;
+
+    for (i = 0; i < nfiles; i++) {
+        snprintf(path, sizeof(path), "%s/entry-with-a-longish-name.%ld", dir, i);
+        fd = open(path, O_WRONLY | O_CREAT, 0644);
+        if (fd >= 0) close(fd);
+    }
+    for (stat_each = 0; stat_each <= 1; stat_each++) {
+        r = result_new(stat_each ? "readdir_stat" : "readdir", 0, t);
+        start = now_ns();
+        do {
+            t0 = now_ns();
+            n = list_dir(dir, stat_each);
+            result_op(r, t0, n == nfiles, 0);
+            if (n > 0) r->entries += n;
+        } while (!expired(start));
+        result_done(r, start);
+    }
+}
+
+static void wl_small(int t, const char *dir, char *buf) {
+    struct result *w = result_new("small_write", SMALL_SIZE, t);
+    struct result *r = result_new("small_read", SMALL_SIZE, t);
+    char path[4096];
+    uint64_t start, t0;
+    int fd, ok;
+    long i;
+
+    start = now_ns();
+    for (i = 0; i < nfiles; i++) {
+        snprintf(path, sizeof(path), "%s/s%ld", dir, i);
+        stamp(buf, SMALL_SIZE, i * SMALL_SIZE);
+        t0 = now_ns();
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        ok = fd >= 0 && write(fd, buf, SMALL_SIZE) == SMALL_SIZE;
+        if (fd >= 0 && close(fd) < 0) ok = 0;
+        result_op(w, t0, ok, SMALL_SIZE);
+    }
+    result_done(w, start);
+
+    for (i = 0; i < nfiles; i++) {
+        snprintf(path, sizeof(path), "%s/s%ld", dir, i);
+        drop_cache(path);
+    }
+
+    start = now_ns();
+    for (i = 0; i < nfiles; i++) {
+        snprintf(path, sizeof(path), "%s/s%ld", dir, i);
+        t0 = now_ns();
+        fd = open(path, O_RDONLY);
+        ok = fd >= 0 && read(fd, buf, SMALL_SIZE) == SMALL_SIZE;
+        if (fd >= 0) close(fd);
+        result_op(r, t0, ok && stamped(buf, SMALL_SIZE, i * SMALL_SIZE), SMALL_SIZE);
+    }
+    result_done(r, start);
+}
+
+// ---- replay ----
+
+// Every path the log mentions, once.  The operations refer to them by
+// index; while replaying, a name also holds the fd its file is open on.
+struct name {
+    char *s;
+    uint64_t id;                // bb_trace_hash(s), or the trace's path_id
+    int fd, refs;
+    int pre;                    // the log expects it to be there already
+    int dir;                    // ... as a directory
+    int made;                   // or it makes it itself
+    uint64_t extent;            // and this big
+};
+
+static struct name *names;
+static size_t nnames, names_cap;
+static uint32_t *name_index;    // open addressing on id, 0 or names index + 1
+static size_t index_cap;
+
+// one logged operation
+struct rop {
+    uint16_t op;                // enum bb_op
+    uint32_t mode;              // mode for mkdir, mknod, chmod, create; mask for access
+    int64_t off;                // offset, or the size to truncate to
+    uint64_t size;
+    int32_t path, path2;        // names index, or -1
+};
+
+static struct rop *rops;
+static size_t nrops, rops_cap;
+static uint64_t replay_skipped;
+static char *rbuf;
+static size_t rbuf_size = SMALL_SIZE;
+
+static void *grow(void *p, size_t *cap, size_t size) {
+    *cap = *cap ? *cap * 2 : 1024;
+    p = realloc(p, *cap * size);
+    if (p == NULL) {
+        perror("bbbench");
+        exit(1);
+    }
+    return p;
+}
+
+// the name with this id (and string, if given), or -1
+static int32_t name_find(uint64_t id, const char *s) {
+    size_t i;
+
+    if (index_cap == 0) return -1;
+    for (i = id & (index_cap - 1); name_index[i]; i = (i + 1) & (index_cap - 1)) {
+        struct name *n = &names[name_index[i] - 1];
+
+        if (n->id == id && (s == NULL || strcmp(n->s, s) == 0)) return name_index[i] - 1;
+    }
+    return -1;
+}
+
+static void index_insert(size_t idx) {
+    size_t i;
+
+    for (i = names[idx].id & (index_cap - 1); name_index[i]; i = (i + 1) & (index_cap - 1)) ;
+    name_index[i] = idx + 1;
+}
+
+static int32_t name_add(uint64_t id, const char *s) {
+    int32_t idx = name_find(id, s);
+    size_t i;
+
+    if (idx >= 0) return idx;
+    if ((nnames + 1) * 2 > index_cap) {
+        index_cap = index_cap ? index_cap * 2 : 1024;
+        free(name_index);
+        name_index = calloc(index_cap, sizeof(*name_index));
+        if (name_index == NULL) {
+            perror("bbbench");
+            exit(1);
+        }
+        for (i = 0; i < nnames; i++) index_insert(i);
+    }
+    if (nnames == names_cap) names = grow(names, &names_cap, sizeof(*names));
+    memset(&names[nnames], 0, sizeof(names[nnames]));
+    names[nnames].s = strdup(s);
+    names[nnames].id = id;
+    index_insert(nnames);
+    return nnames++;
+}
+
+static int32_t intern(const char *s) {
+    return name_add(bb_trace_hash(s), s);
+}
+
+// Ops that can't be replayed are counted and dropped here; ones that
+// are only bookkeeping, and that the calls around them stand for
+// anyway, are dropped without counting.
+static void rop_add(struct rop *o) {
+    const char *p = o->path >= 0 ? names[o->path].s : NULL;
+
+    switch (o->op) {
+    case BB_OP_OPENDIR: case BB_OP_RELEASEDIR: case BB_OP_FLUSH: case BB_OP_FSYNCDIR:
+        return;
+    case BB_OP_READDIR:
+        // the rest of a listing that didn't fit in one buffer
+        if (o->off != 0) return;
+        break;
+    case BB_OP_RENAME: case BB_OP_LINK: case BB_OP_SYMLINK:
+        if (o->path2 < 0) goto skip;
+        break;
+    case BB_OP_CHOWN: case BB_OP_SETXATTR: case BB_OP_GETXATTR: case BB_OP_REMOVEXATTR:
+        goto skip;
+    }
+    // bbfs' own files only exist through the mount
+    if (p == NULL || strncmp(p, "/.bbfs_", 7) == 0) goto skip;
+
+    if (nrops == rops_cap) rops = grow(rops, &rops_cap, sizeof(*rops));
+    rops[nrops++] = *o;
+    if ((o->op == BB_OP_READ || o->op == BB_OP_WRITE) && o->size > rbuf_size) rbuf_size = o->size;
+    return;
+
+skip:
+    replay_skipped++;
+}
+
+static int op_by_name(const char *s, size_t len) {
+    unsigned op;
+
+    if (len == 8 && memcmp(s, "read_buf", 8) == 0) return BB_OP_READ;
+    if (len == 9 && memcmp(s, "write_buf", 9) == 0) return BB_OP_WRITE;
+    for (op = 0; op < BB_OP_COUNT; op++)
+        if (strlen(bb_op_name(op)) == len && memcmp(bb_op_name(op), s, len) == 0) return op;
+    return -1;
+}
+
+// the n-th (from 0) "quoted" string in s, interned, or -1
+static int32_t quoted(const char *s, int n) {
+    const char *p = s, *end;
+    char buf[4096];
+
+    for (;;) {
+        p = strchr(p, '"');
+        if (p == NULL) return -1;
+        end = strchr(p + 1, '"');
+        if (end == NULL) return -1;
+        if (n-- == 0) break;
+        p = end + 1;
+    }
+    if ((size_t) (end - p - 1) >= sizeof(buf)) return -1;
+    memcpy(buf, p + 1, end - p - 1);
+    buf[end - p - 1] = '\0';
+    return intern(buf);
+}
+
+// the number after key in s, if it's there
+static void field(const char *s, const char *key, int base, int64_t *v) {
+    const char *p = strstr(s, key);
+
+    if (p) *v = strtoll(p + strlen(key), NULL, base);
+}
+
+// One line of the text log.  The calls are the lines that start with
+// "bb_<op>(" -- see the log_msg()s at the top of every bb_*() in
+// bbfs.c; the rest are details and errors.
+static void parse_line(const char *line) {
+    struct rop o = { .path = -1, .path2 = -1, .mode = 0644 };
+    const char *paren;
+    int64_t v = 0;
+    int op;
+
+    if (strncmp(line, "bb_", 3) != 0) return;
+    paren = strchr(line, '(');
+    if (paren == NULL || (op = op_by_name(line + 3, paren - line - 3)) < 0) return;
+    o.op = op;
+    o.path = quoted(paren, 0);
+
+    switch (op) {
+    case BB_OP_RENAME: case BB_OP_LINK: case BB_OP_SYMLINK:
+        o.path2 = quoted(paren, 1);
+        break;
+    case BB_OP_READ: case BB_OP_WRITE:
+        field(paren, "size=", 10, &v);
+        o.size = v;
+        field(paren, "offset=", 10, &o.off);
+        break;
+    case BB_OP_TRUNCATE:
+        field(paren, "newsize=", 10, &o.off);
+        break;
+    case BB_OP_FTRUNCATE: case BB_OP_READDIR:
+        field(paren, "offset=", 10, &o.off);
+        break;
+    case BB_OP_MKNOD: case BB_OP_MKDIR: case BB_OP_CHMOD: case BB_OP_CREATE:
+        v = 0644;
+        field(paren, "mode=", 8, &v);
+        o.mode = v;
+        break;
+    case BB_OP_ACCESS:
+        v = F_OK;
+        field(paren, "mask=", 8, &v);
+        o.mode = v;
+        break;
+    }
+    rop_add(&o);
+}
+
+static int parse_text(FILE *in) {
+    char *line = NULL;
+    size_t cap = 0;
+
+    while (getline(&line, &cap, in) > 0) parse_line(line);
+    free(line);
+    return 0;
+}
+
+// A binary trace, as bbtrace reads it, except that paths are only
+// wanted for the records after them.
+static int parse_trace(FILE *in, const char *file) {
+    struct bb_trace_hdr hdr;
+    struct bb_trace_rec rec;
+    size_t padded;
+    char *name;
+
+    if (fread(&hdr, sizeof(hdr), 1, in) != 1 || hdr.version != BB_TRACE_VERSION ||
+            hdr.rec_size != sizeof(rec)) {
+        fprintf(stderr, "%s: not a bbfs trace this version of bbbench can read\n", file);
+        return -1;
+    }
+    while (fread(&rec, sizeof(rec), 1, in) == 1) {
+        struct rop o = { .path = -1, .path2 = -1, .mode = 0644 };
+
+        if (rec.op == BB_OP_PATHNAME) {
+            padded = (rec.size + sizeof(rec) - 1) / sizeof(rec) * sizeof(rec);
+            name = malloc(padded + 1);
+            if (name == NULL || fread(name, 1, padded, in) != padded) {
+                fprintf(stderr, "%s: truncated path record\n", file);
+                free(name);
+                return -1;
+            }
+            name[rec.size] = '\0';
+            name_add(rec.path_id, name);
+            free(name);
+            continue;
+        }
+        if (rec.op >= BB_OP_COUNT) continue;
+
+        o.op = rec.op;
+        o.path = name_find(rec.path_id, NULL);
+        o.off = rec.offset;
+        o.size = rec.size;
+        if (o.op == BB_OP_MKDIR) o.mode = 0755;
+        if (o.op == BB_OP_ACCESS) o.mode = F_OK;
+        rop_add(&o);
+    }
+    return 0;
+}
+
+static int parse_replay(const char *file) {
+    char magic[sizeof(BB_TRACE_MAGIC)] = "";
+    FILE *in;
+    int ret;
+
+    in = fopen(file, "rb");
+    if (in == NULL) {
+        perror(file);
+        return -1;
+    }
+    if (fread(magic, sizeof(magic), 1, in) == 1 &&
+            memcmp(magic, BB_TRACE_MAGIC, sizeof(BB_TRACE_MAGIC)) == 0) {
+        rewind(in);
+        ret = parse_trace(in, file);
+    } else {
+        rewind(in);
+        ret = parse_text(in);
+    }
+    fclose(in);
+    if (ret == 0 && nrops == 0) {
+        fprintf(stderr, "%s: nothing to replay\n", file);
+        ret = -1;
+    }
+    if (ret == 0) fprintf(stderr, "%s: %zu operations, %zu paths, %llu skipped\n", file, nrops,
+            nnames, (unsigned long long) replay_skipped);
+    return ret;
+}
+
+// Work out what the log found already there, by going through it
+// keeping track of what it made and removed.  A file it reads before
+// it writes it has to be as big as the reads go.
+static void replay_scan(void) {
+    enum { UNSEEN, PRE, MADE, GONE };
+    unsigned char *state = calloc(nnames ? nnames : 1, 1);
+    size_t i;
+
+    if (state == NULL) {
+        perror("bbbench");
+        exit(1);
+    }
+    for (i = 0; i < nrops; i++) {
+        struct rop *o = &rops[i];
+        struct name *n = &names[o->path];
+        unsigned char *s = &state[o->path];
+        int makes = o->op == BB_OP_CREATE || o->op == BB_OP_MKNOD || o->op == BB_OP_MKDIR;
+
+        // a symlink's path is what it points to, not a file
+        if (o->op == BB_OP_SYMLINK) {
+            if (state[o->path2] == UNSEEN) names[o->path2].made = 1;
+            state[o->path2] = MADE;
+            continue;
+        }
+        if (*s == UNSEEN && makes) n->made = 1;
+        if (*s == UNSEEN && !makes) {
+            n->pre = 1;
+            n->dir = o->op == BB_OP_READDIR || o->op == BB_OP_RMDIR;
+            *s = PRE;
+        }
+        if (*s == PRE && o->op == BB_OP_READ && o->off + o->size > n->extent)
+            n->extent = o->off + o->size;
+
+        if (makes || (*s == PRE && (o->op == BB_OP_WRITE || o->op == BB_OP_TRUNCATE ||
+                        o->op == BB_OP_FTRUNCATE)))
+            *s = MADE;
+        if (o->op == BB_OP_UNLINK || o->op == BB_OP_RMDIR || o->op == BB_OP_RENAME) *s = GONE;
+        if (o->path2 >= 0) {
+            if (state[o->path2] == UNSEEN) names[o->path2].made = 1;
+            state[o->path2] = MADE;
+        }
+    }
+    free(state);
+}
+
+// the directories above the log's path under dir, down to one the
+// log makes itself
+static void mkdir_parents(const char *dir, const char *path) {
+    char buf[4096], *rel, *p;
+    int32_t idx;
+
+    snprintf(buf, sizeof(buf), "%s%s", dir, path);
+    rel = buf + strlen(dir);
+    for (p = strchr(rel + 1, '/'); p; p = strchr(p + 1, '/')) {
+        *p = '\0';
+        idx = name_find(bb_trace_hash(rel), rel);
+        if (idx >= 0 && names[idx].made) return;
+        mkdir(buf, 0755);
+        *p = '/';
+    }
+}
+
+// make what the log expects to find under dir
+static void replay_prepare(const char *dir, char *buf) {
+    char path[4096];
+    uint64_t off, len;
+    size_t i;
+    int fd;
+
+    for (i = 0; i < nnames; i++) {
+        struct name *n = &names[i];
+
+        names[i].fd = -1;
+        names[i].refs = 0;
+        if (n->s[0] != '/' || n->s[1] == '\0') continue;
+        mkdir_parents(dir, n->s);
+        if (!n->pre) continue;
+        snprintf(path, sizeof(path), "%s%s", dir, n->s);
+        if (n->dir) {
+            mkdir(path, 0755);
+            continue;
+        }
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) continue;
+        for (off = 0; off < n->extent; off += len) {
+            len = n->extent - off < PREP_CHUNK ? n->extent - off : PREP_CHUNK;
+            memset(buf, 'a' + off / PREP_CHUNK % 26, len);
+            if (write(fd, buf, len) != (ssize_t) len) break;
+        }
+        close(fd);
+    }
+}
+
+// the fd the log's file is open on, opening it if the log didn't
+static int replay_fd(struct name *n, const char *path) {
+    if (n->fd < 0) n->fd = open(path, O_RDWR);
+    if (n->fd < 0) n->fd = open(path, O_RDONLY);
+    return n->fd;
+}
+
+// one operation; returns what the call did, < 0 being an error
+static ssize_t replay_one(const struct rop *o, const char *path, const char *path2) {
+    struct name *n = &names[o->path];
+    struct statvfs sv;
+    struct dirent *d;
+    struct stat st;
+    DIR *dp;
+    int fd;
+
+    switch (o->op) {
+    case BB_OP_GETATTR: case BB_OP_FGETATTR:
+        return lstat(path, &st);
+    case BB_OP_READLINK:
+        return readlink(path, rbuf, rbuf_size);
+    case BB_OP_MKNOD:
+        return mknod(path, o->mode & S_IFMT ? o->mode : S_IFREG | o->mode, 0);
+    case BB_OP_MKDIR:
+        return mkdir(path, o->mode & 07777);
+    case BB_OP_UNLINK:
+        return unlink(path);
+    case BB_OP_RMDIR:
+        return rmdir(path);
+    case BB_OP_SYMLINK:
+        return symlink(n->s, path2);
+    case BB_OP_RENAME:
+        return rename(path, path2);
+    case BB_OP_LINK:
+        return link(path, path2);
+    case BB_OP_CHMOD:
+        return chmod(path, o->mode & 07777);
+    case BB_OP_TRUNCATE:
+        return truncate(path, o->off);
+    case BB_OP_UTIME:
+        return utime(path, NULL);
+    case BB_OP_OPEN: case BB_OP_CREATE:
+        if (n->fd < 0)
+            n->fd = o->op == BB_OP_CREATE ? open(path, O_RDWR | O_CREAT, o->mode & 07777) :
+                replay_fd(n, path);
+        if (n->fd < 0) return -1;
+        n->refs++;
+        return 0;
+    case BB_OP_RELEASE:
+        if (n->refs > 0 && --n->refs == 0 && n->fd >= 0) {
+            close(n->fd);
+            n->fd = -1;
+        }
+        return 0;
+    case BB_OP_READ:
+        fd = replay_fd(n, path);
+        return fd < 0 ? -1 : pread(fd, rbuf, o->size, o->off);
+    case BB_OP_WRITE:
+        fd = replay_fd(n, path);
+        return fd < 0 ? -1 : pwrite(fd, rbuf, o->size, o->off);
+    case BB_OP_FSYNC:
+        fd = replay_fd(n, path);
+        return fd < 0 ? -1 : fsync(fd);
+    case BB_OP_FTRUNCATE:
+        fd = replay_fd(n, path);
+        return fd < 0 ? -1 : ftruncate(fd, o->off);
+    case BB_OP_STATFS:
+        return statvfs(path, &sv);
+    case BB_OP_LISTXATTR:
+        return llistxattr(path, rbuf, rbuf_size);
+    case BB_OP_ACCESS:
+        return access(path, o->mode);
+    case BB_OP_READDIR:
+        dp = opendir(path);
+        if (dp == NULL) return -1;
+        while ((d = readdir(dp)) != NULL) ;
+        closedir(dp);
+        return 0;
+    }
+    return 0;
+}
+
+static void wl_replay(int t, const char *dir, char *buf) {
+    struct result *all, *per[BB_OP_COUNT] = { NULL };
+    char path[4096], path2[4096], name[32];
+    uint64_t start, t0;
+    ssize_t ret;
+    size_t i;
+    unsigned op;
+
+    replay_prepare(dir, buf);
+    all = result_new("replay", 0, t);
+    all->skipped = replay_skipped;
+
+    start = now_ns();
+    for (i = 0; i < nrops; i++) {
+        const struct rop *o = &rops[i];
+
+        snprintf(path, sizeof(path), "%s%s", dir, names[o->path].s);
+        if (o->path2 >= 0) snprintf(path2, sizeof(path2), "%s%s", dir, names[o->path2].s);
+        if (per[o->op] == NULL) {
+            snprintf(name, sizeof(name), "replay:%s", bb_op_name(o->op));
+            per[o->op] = result_new(name, 0, t);
+        }
+
+        t0 = now_ns();
+        ret = replay_one(o, path, path2);
+        result_op(per[o->op], t0, ret >= 0, 0);
+        result_op(all, t0, ret >= 0, 0);
+        if (ret > 0 && (o->op == BB_OP_READ || o->op == BB_OP_WRITE)) {
+            per[o->op]->bytes += ret;
+            all->bytes += ret;
+        }
+    }
+    result_done(all, start);
+
+    // each kind of call by the time spent in it
+    for (op = 0; op < BB_OP_COUNT; op++)
+        if (per[op]) per[op]->secs = per[op]->lat.sum / 1e9;
+    for (i = 0; i < nnames; i++)
+        if (names[i].fd >= 0) close(names[i].fd);
+}
+
+// ---- mounting ----
+
+// run a command to completion, its output on our stderr
+static int run(char *const argv[]) {
+    pid_t pid;
+    int status;
+
+    pid = fork();
+    if (pid < 0) return -1;
+    if (pid == 0) {
+        dup2(2, 1);
+        execvp(argv[0], argv);
+        perror(argv[0]);
+        _exit(127);
+    }
+    if (waitpid(pid, &status, 0) < 0) return -1;
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+// bbfs in the foreground, in the scratch directory, where its log
+// and stats files land; returns once the mount is there
+static int mount_bbfs(uid_t uid) {
+    char uidbuf[32], *argv[8];
+    struct stat sm, sp;
+    int argc = 0, status, i;
+
+    snprintf(uidbuf, sizeof(uidbuf), "%u", uid);
+    argv[argc++] = (char *) bbfs;
+    argv[argc++] = "-f";
+    if (options) {
+        argv[argc++] = "-o";
+        argv[argc++] = (char *) options;
+    }
+    argv[argc++] = root;
+    argv[argc++] = mnt;
+    argv[argc++] = uidbuf;
+    argv[argc] = NULL;
+
+    bbfs_pid = fork();
+    if (bbfs_pid < 0) {
+        perror("fork");
+        return -1;
+    }
+    if (bbfs_pid == 0) {
+        // stdout is the JSON
+        dup2(2, 1);
+        if (chdir(scratch) < 0) _exit(127);
+        execv(bbfs, argv);
+        perror(bbfs);
+        _exit(127);
+    }
+
+    for (i = 0; i < 1000; i++) {
+        if (waitpid(bbfs_pid, &status, WNOHANG) == bbfs_pid) {
+            fprintf(stderr, "bbbench: %s exited before mounting\n", bbfs);
+            return -1;
+        }
+        if (stat(mnt, &sm) == 0 && stat(scratch, &sp) == 0 && sm.st_dev != sp.st_dev) return 0;
+        usleep(10000);
+    }
+    fprintf(stderr, "bbbench: %s didn't mount in 10 s\n", bbfs);
+    kill(bbfs_pid, SIGTERM);
+    waitpid(bbfs_pid, &status, 0);
+    return -1;
+}
+
+static void unmount_bbfs(void) {
+    char *argv[] = { "fusermount", "-u", mnt, NULL };
+    int status;
+
+    if (run(argv) < 0) {
+        fprintf(stderr, "bbbench: couldn't unmount %s\n", mnt);
+        kill(bbfs_pid, SIGTERM);
+    }
+    waitpid(bbfs_pid, &status, 0);
+}
+
+// ---- output ----
+
+static void json_str(const char *s) {
+    putchar('"');
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') printf("\\%c", *s);
+        else if ((unsigned char) *s < 0x20) printf("\\u%04x", *s);
+        else putchar(*s);
+    }
+    putchar('"');
+}
+
+static void json_result(const struct result *r, int last) {
+    const struct result *raw = r->target == BBFS ? result_find(r->workload, r->block, RAW) : NULL;
+    const struct hist *h = &r->lat;
+    double rate = r->secs > 0 ? r->ops / r->secs : 0;
+
+    printf("    {\"workload\": ");
+    json_str(r->workload);
+    printf(", \"block\": %zu, \"target\": \"%s\",\n", r->block, target_name[r->target]);
+    printf("     \"ops\": %llu, \"errors\": %llu, \"skipped\": %llu, \"seconds\": %.6f,\n",
+            (unsigned long long) r->ops, (unsigned long long) r->errors,
+            (unsigned long long) r->skipped, r->secs);
+    printf("     \"ops_per_s\": %.1f, \"mb_per_s\": %.2f", rate,
+            r->secs > 0 ? r->bytes / r->secs / 1e6 : 0);
+    if (r->entries) printf(", \"entries_per_s\": %.1f", r->secs > 0 ? r->entries / r->secs : 0);
+    if (raw && raw->secs > 0 && raw->ops > 0)
+        printf(", \"vs_raw\": %.3f", rate / (raw->ops / raw->secs));
+    printf(",\n     \"latency_us\": {\"mean\": %.2f, \"p50\": %.2f, \"p90\": %.2f, "
+            "\"p99\": %.2f, \"p99.9\": %.2f, \"max\": %.2f}}%s\n",
+            h->count ? h->sum / 1e3 / h->count : 0, hist_percentile(h, 50) / 1e3,
+            hist_percentile(h, 90) / 1e3, hist_percentile(h, 99) / 1e3,
+            hist_percentile(h, 99.9) / 1e3, h->max / 1e3, last ? "" : ",");
+}
+
+// .bbfs_stats from the mount, a line per string
+static void json_stats(void) {
+    char path[4096], *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    int first = 1;
+    FILE *in;
+
+    snprintf(path, sizeof(path), "%s/.bbfs_stats", mnt);
+    in = fopen(path, "r");
+    if (in == NULL) return;
+    printf(",\n  \"bbfs_stats\": [");
+    while ((len = getline(&line, &cap, in)) > 0) {
+        if (line[len - 1] == '\n') line[len - 1] = '\0';
+        printf(first ? "\n    " : ",\n    ");
+        json_str(line);
+        first = 0;
+    }
+    printf("\n  ]");
+    free(line);
+    fclose(in);
+}
+
+static void usage(void) {
+    fprintf(stderr, "usage: bbbench [-b bbfs] [-o options] [-u uid] [-d dir] [-w workload,...]\n"
+            "               [-B KiB,...] [-s MiB] [-n files] [-t seconds] [-r log] [-k]\n"
+            "workloads: seq rand meta readdir small replay\n");
+}
+
+int main(int argc, char *argv[]) {
+    const char *parent = getenv("TMPDIR");
+    char resolved[4096], *dir, *buf, *tok, *list = NULL;
+    int opt, keep = 0, want[NWORKLOADS] = { 0 }, w, t, i, ret = 0;
+    uid_t uid = getuid();
+    size_t maxblock;
+
+    while ((opt = getopt(argc, argv, "b:o:u:d:w:B:s:n:t:r:k")) != -1) {
+        switch (opt) {
+        case 'b': bbfs = optarg; break;
+        case 'o': options = optarg; break;
+        case 'u': uid = atoi(optarg); break;
+        case 'd': parent = optarg; break;
+        case 'w': list = optarg; break;
+        case 'B':
+            for (nblocks = 0, tok = strtok(optarg, ","); tok && nblocks < MAX_BLOCKS;
+                    tok = strtok(NULL, ","))
+                blocks[nblocks++] = strtoul(tok, NULL, 0) << 10;
+            break;
+        case 's': size_mb = atol(optarg); break;
+        case 'n': nfiles = atol(optarg); break;
+        case 't': secs = atof(optarg); break;
+        case 'r': replay_file = optarg; break;
+        case 'k': keep = 1; break;
+        default:
+            usage();
+            return 2;
+        }
+    }
+    if (list) {
+        for (tok = strtok(list, ","); tok; tok = strtok(NULL, ",")) {
+            for (w = 0; w < NWORKLOADS && strcmp(tok, workload_name[w]) != 0; w++) ;
+            if (w == NWORKLOADS) {
+                usage();
+                return 2;
+            }
+            want[w] = 1;
+        }
+    } else if (replay_file) {
+        want[WL_REPLAY] = 1;
+    } else {
+        for (w = 0; w < WL_REPLAY; w++) want[w] = 1;
+    }
+    for (i = 0, maxblock = SMALL_SIZE; i < nblocks; i++)
+        if (blocks[i] > maxblock) maxblock = blocks[i];
+    if (optind != argc || size_mb < 1 || nfiles < 1 || secs <= 0 || nblocks == 0 ||
+            (want[WL_REPLAY] && replay_file == NULL)) {
+        usage();
+        return 2;
+    }
+    for (i = 0; i < nblocks; i++)
+        if (blocks[i] < sizeof(uint64_t) || blocks[i] > ((size_t) size_mb << 20)) {
+            fprintf(stderr, "bbbench: block sizes go from 1 KiB to the file size\n");
+            return 2;
+        }
+    if (getuid() == 0 || geteuid() == 0) {
+        fprintf(stderr, "bbbench: bbfs won't run as root, so neither will this\n");
+        return 1;
+    }
+    // it runs in the scratch directory
+    if (realpath(bbfs, resolved) == NULL) {
+        perror(bbfs);
+        return 1;
+    }
+    bbfs = resolved;
+
+    if (want[WL_REPLAY]) {
+        if (parse_replay(replay_file) < 0) return 1;
+        replay_scan();
+        if (rbuf_size < PREP_CHUNK) rbuf_size = PREP_CHUNK;
+        rbuf = malloc(rbuf_size);
+        memset(rbuf, 'r', rbuf_size);
+    }
+    buf = malloc(maxblock > PREP_CHUNK ? maxblock : PREP_CHUNK);
+    if (buf == NULL || (want[WL_REPLAY] && rbuf == NULL)) {
+        perror("malloc");
+        return 1;
+    }
+
+    snprintf(scratch, sizeof(scratch), "%s/bbbench.XXXXXX", parent ? parent : "/tmp");
+    if (mkdtemp(scratch) == NULL) {
+        perror(scratch);
+        return 1;
+    }
+    if (asprintf(&root, "%s/root", scratch) < 0 || asprintf(&mnt, "%s/mnt", scratch) < 0 ||
+            asprintf(&target_dir[RAW], "%s/raw", root) < 0 ||
+            asprintf(&target_dir[BBFS], "%s/bbfs", mnt) < 0) {
+        perror("bbbench");
+        return 1;
+    }
+    if (mkdir(root, 0755) < 0 || mkdir(mnt, 0755) < 0 || mkdir(target_dir[RAW], 0755) < 0) {
+        perror(scratch);
+        return 1;
+    }
+    if (mount_bbfs(uid) < 0) {
+        if (!keep) rm_rf(scratch);
+        return 1;
+    }
+    if (mkdir(target_dir[BBFS], 0755) < 0) {
+        perror(target_dir[BBFS]);
+        ret = 1;
+    }
+
+    for (w = 0; w < NWORKLOADS && ret == 0; w++) {
+        if (!want[w]) continue;
+        for (t = 0; t < NTARGETS; t++) {
+            fprintf(stderr, "%s on %s\n", workload_name[w], target_name[t]);
+            if (asprintf(&dir, "%s/%s", target_dir[t], workload_name[w]) < 0 ||
+                    mkdir(dir, 0755) < 0) {
+                perror(target_dir[t]);
+                ret = 1;
+                break;
+            }
+            switch (w) {
+            case WL_SEQ: wl_seq(t, dir, buf); break;
+            case WL_RAND: wl_rand(t, dir, buf); break;
+            case WL_META: wl_meta(t, dir); break;
+            case WL_READDIR: wl_readdir(t, dir); break;
+            case WL_SMALL: wl_small(t, dir, buf); break;
+            case WL_REPLAY: wl_replay(t, dir, buf); break;
+            }
+            rm_rf(dir);
+            free(dir);
+        }
+    }
+
+    printf("{\n  \"bbfs\": ");
+    json_str(bbfs);
+    printf(",\n  \"options\": ");
+    json_str(options ? options : "");
+    printf(",\n  \"size_mb\": %ld, \"files\": %ld, \"seconds\": %g", size_mb, nfiles, secs);
+    if (replay_file) {
+        printf(",\n  \"replay\": ");
+        json_str(replay_file);
+    }
+    printf(",\n  \"results\": [\n");
+    for (i = 0; i < nresults; i++) json_result(&results[i], i == nresults - 1);
+    printf("  ]");
+    json_stats();
+    printf("\n}\n");
+
+    unmount_bbfs();
+    if (keep) fprintf(stderr, "bbbench: left everything in %s\n", scratch);
+    else rm_rf(scratch);
+    free(buf);
+    free(rbuf);
+    return ret;
+}
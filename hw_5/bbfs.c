@@ -24,45 +24,227 @@
 #include <fuse.h>
 #include <libgen.h>
 #include <limits.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/random.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/xattr.h>
 #include <math.h>
 #include <time.h>
 
+#include "attrcache.h"
+#include "bbfs.h"
+#include "compress.h"
+#include "dedup.h"
+#include "dircache.h"
+#include "instr.h"
+#include "journal.h"
 #include "log.h"
-
-int user_id = 0;
-unsigned char *byte;
-
-uid_t uid;
-/* local time */
-time_t lt;
+#include "loop.h"
+#include "lowlevel.h"
+#include "pgcache.h"
+#include "policy.h"
+#include "stats.h"
+#include "trace.h"
+#include "wbcache.h"
+#include "xform.h"
+
+// appends to a file take turns, see bb_file_new()
+#define BB_APPENDS 64
+static pthread_mutex_t bb_appends[BB_APPENDS] = {
+    [0 ... BB_APPENDS - 1] = PTHREAD_MUTEX_INITIALIZER
+};
 
 // Report errors to logfile and give -errno to caller
-static int bb_error(char *str) {
+int bb_error(char *str) {
     int ret = -errno;
-    log_msg("    ERROR %s: %s\n", str, strerror(errno));
+    log_err("%s: %s\n", str, strerror(errno));
     return ret;
 }
 
+// Whether name, in rootdir itself, is bbfs' own rather than part of
+// the filesystem: the chunk store, or the journal
+static int bb_hidden_n(const char *name, size_t len) {
+    return (dedup_enabled() && len == sizeof(DEDUP_DIR) - 1 &&
+            memcmp(name, DEDUP_DIR, len) == 0) ||
+        (journal_enabled() && len == sizeof(JOURNAL_FILE) - 1 &&
+         memcmp(name, JOURNAL_FILE, len) == 0);
+}
+
+int bb_hidden(const char *name) {
+    return bb_hidden_n(name, strlen(name));
+}
+
+// Whether path is one of bb_hidden()'s names or anything under one.
+// Hiding them isn't enough: a lookup that finds nothing is the
+// kernel's cue to go ahead with a create or rename, which would land
+// on the real thing.  So every call that makes, removes or renames a
+// name checks this first.
+int bb_reserved(const char *path) {
+    if (path[0] == '/') path++;
+    return bb_hidden_n(path, strcspn(path, "/"));
+}
+
 //  Check whether the given user is permitted to perform the given operation 
 //  on the given file
 
 //  All the paths I see are relative to the root of the mounted
-//  filesystem.  In order to get to the underlying filesystem, I need to
-//  have the mountpoint.  I'll save it away early on in main(), and then
-//  whenever I need a path for something I'll call this to construct
-//  it.
-static void bb_fullpath(char fpath[PATH_MAX], const char *path) {
-    strcpy(fpath, BB_DATA->rootdir);
-    strncat(fpath, path, PATH_MAX); // ridiculously long paths will
-    // break here
+//  filesystem.  Rather than glue them onto rootdir and have the kernel
+//  walk the whole thing again on every call, main() opens rootdir
+//  once and everything is resolved relative to that fd with the *at()
+//  calls.  With -o dir_cache, the path's parent directory comes out
+//  of a cache of directory fds (dircache.c) and only the last
+//  component is left to look up.  Either way a long path is no
+//  longer silently cut off at PATH_MAX.
+struct bb_path {
+    int dirfd;
+    const char *name;           // relative to dirfd, never empty
+    struct dircache_ent *dir;   // dirfd's reference, or NULL
+};
 
-    log_msg("    bb_fullpath:  rootdir = \"%s\", path = \"%s\", fpath = \"%s\"\n", BB_DATA->rootdir, path, fpath);
+static void bb_path_get(struct bb_path *p, const char *path) {
+    const char *slash;
+    int fd;
+
+    p->dirfd = BB_DATA->rootfd;
+    p->name = path[1] ? path + 1 : ".";
+    p->dir = NULL;
+
+    // a parent that can't be opened is left to the op itself to
+    // report, with whatever errno the full walk gives it
+    if (dircache_enabled() && (slash = strrchr(path, '/')) != path) {
+        fd = dircache_get(path, slash - path, &p->dir);
+        if (fd >= 0) {
+            p->dirfd = fd;
+            p->name = slash + 1;
+        }
+    }
+
+    log_msg("    bb_path:  path = \"%s\", dirfd = %d, name = \"%s\"\n", path, p->dirfd, p->name);
+}
+
+static void bb_path_put(struct bb_path *p) {
+    dircache_put(p->dir);
+}
+
+// truncate(), statvfs() and the xattr calls have no *at() versions;
+// they get the file named through the directory fd's /proc link
+static int bb_proc_path(char ppath[PATH_MAX], const struct bb_path *p) {
+    if (snprintf(ppath, PATH_MAX, "/proc/self/fd/%d/%s", p->dirfd, p->name) >= PATH_MAX)
+        return -ENAMETOOLONG;
+    return 0;
+}
+
+// Work out the nonce a keyed transform uses for this file.  It lives
+// in an xattr on the backing file so it survives renames and
+// remounts; a new (empty) file gets a random one.  Files that can't
+// carry the xattr, or non-empty files that predate it, fall back to
+// their inode number.
+static void bb_file_nonce(int fd, int created, unsigned char nonce[XFORM_NONCE_SIZE]) {
+    struct stat st;
+    uint64_t ino = 0;
+
+    if (fgetxattr(fd, XFORM_NONCE_XATTR, nonce, XFORM_NONCE_SIZE) == XFORM_NONCE_SIZE)
+        return;
+
+    if (fstat(fd, &st) == 0) ino = st.st_ino;
+
+    if ((created || st.st_size == 0) &&
+            getrandom(nonce, XFORM_NONCE_SIZE, 0) == XFORM_NONCE_SIZE) {
+        if (fsetxattr(fd, XFORM_NONCE_XATTR, nonce, XFORM_NONCE_SIZE, XATTR_CREATE) == 0)
+            return;
+        // somebody else opening the same new file got there first
+        if (errno == EEXIST &&
+                fgetxattr(fd, XFORM_NONCE_XATTR, nonce, XFORM_NONCE_SIZE) == XFORM_NONCE_SIZE)
+            return;
+    }
+
+    memset(nonce, 0, XFORM_NONCE_SIZE);
+    memcpy(nonce, &ino, sizeof(ino));
+}
+
+// Read file data as bb_write() left it, still transformed: the page
+// cache is shared by every handle on the file, whoever's transform and
+// key they have, so only bb_read() decodes, for its own caller.  Also
+// called from the page cache's read-ahead thread, which isn't a FUSE
+// thread, so this mustn't use BB_DATA.
+static ssize_t bb_fill(void *arg, char *buf, size_t size, off_t offset) {
+    struct bb_file *f = arg;
+
+    if (f->dd) return dedup_read(f->dd, f->fd, buf, size, offset);
+    if (f->cz) return compress_read(f->cz, f->fd, buf, size, offset);
+    return wbcache_read(f->wb, f->fd, buf, size, offset);
+}
+
+// fstat() an open file, with the size it has to its user rather than
+// the backing file's; returns what fstat() would
+static int bb_file_stat(struct bb_file *f, struct stat *st) {
+    if (fstat(f->fd, st) < 0) return -1;
+    dedup_stat(f->fd, "", st);
+    compress_stat(f->fd, "", st);
+    wbcache_stat(st);
+    return 0;
+}
+
+// Wrap a newly opened backing fd up as the struct bb_file that
+// fi->fh points to from now until bb_release().  uid and gid are the
+// caller's, which picks the transform (policy.c).
+int bb_file_new(struct fuse_file_info *fi, int fd, int created, uid_t uid, gid_t gid) {
+    struct bb_file *f;
+    struct policy pol;
+    unsigned char nonce[XFORM_NONCE_SIZE];
+    struct stat st;
+    int retstat, fl;
+
+    f = calloc(1, sizeof(*f));
+    if (f == NULL) return -ENOMEM;
+    f->fd = fd;
+    retstat = dedup_open(fd, &f->dd);
+    if (retstat == 0) retstat = compress_open(fd, &f->cz);
+    if (retstat < 0) {
+        dedup_close(f->dd);
+        free(f);
+        return retstat;
+    }
+    // dedup and compression keep their own tail of the file; a second
+    // cache of the same writes in front of them would only get in the
+    // way.  The journal logs writes as they come, or it would be no use.
+    f->jf = journal_open(fd, created || (fi->flags & O_TRUNC));
+    if (f->dd == NULL && f->cz == NULL && f->jf == NULL) f->wb = wbcache_get(fd);
+
+    // only callers with a policy entry have data transformed; every
+    // new file gets a nonce if anyone's transform is keyed, so whoever
+    // opens it later finds one there
+    if (policy_get(uid, gid, &pol) && !xform_is_identity(pol.xform))
+        f->xform = pol.xform;
+    if (policy_keyed()) {
+        bb_file_nonce(fd, created, nonce);
+        if (f->xform && f->xform->keyed) xform_file_key(f->key, pol.key, nonce);
+    }
+
+    // Appends to the same file take turns, so that one can find the
+    // end and write there before another moves it.  Data encoded for
+    // where it lands needs that: bb_write() appends it itself, at the
+    // end it found, which O_APPEND on fd would overrule.
+    if (fi->flags & O_APPEND) {
+        f->append = &bb_appends[fstat(fd, &st) == 0 ? (st.st_ino ^ st.st_dev) % BB_APPENDS : 0];
+        if (f->xform && ((fl = fcntl(fd, F_GETFL)) < 0 || fcntl(fd, F_SETFL, fl & ~O_APPEND) < 0))
+            log_err("bb_file_new: can't take O_APPEND off: %s\n", strerror(errno));
+    }
+    f->pc = pgcache_open(fd, bb_fill, f);
+
+    // with nothing to transform and no cache that has to see the
+    // data, bb_read_buf() and bb_write_buf() can leave it to the
+    // kernel to move it between /dev/fuse and the backing file
+    f->splice = !BB_DATA->nosplice && f->xform == NULL && f->wb == NULL && f->pc == NULL &&
+        f->dd == NULL && f->cz == NULL && f->jf == NULL;
+
+    fi->fh = (uintptr_t) f;
+    return 0;
 }
 
 ///////////////////////////////////////////////////////////
@@ -78,13 +260,26 @@ static void bb_fullpath(char fpath[PATH_MAX], const char *path) {
  */
 int bb_getattr(const char *path, struct stat *statbuf) {
     int retstat = 0;
-    char fpath[PATH_MAX];
+    struct bb_path p;
+    unsigned gen;
 
     log_msg("\nbb_getattr(path=\"%s\", statbuf=0x%08x)\n", path, statbuf);
-    bb_fullpath(fpath, path);
 
-    retstat = lstat(fpath, statbuf);
-    if (retstat != 0) retstat = bb_error("bb_getattr lstat");
+    if (bb_reserved(path)) return -ENOENT;
+
+    if (!attrcache_get(path, statbuf, &retstat)) {
+        gen = attrcache_gen(path);
+        bb_path_get(&p, path);
+        retstat = fstatat(p.dirfd, p.name, statbuf, AT_SYMLINK_NOFOLLOW);
+        if (retstat != 0) retstat = bb_error("bb_getattr fstatat");
+        else {
+            dedup_stat(p.dirfd, p.name, statbuf);
+            compress_stat(p.dirfd, p.name, statbuf);
+        }
+        bb_path_put(&p);
+        attrcache_put(path, gen, statbuf, retstat);
+    }
+    if (retstat == 0) wbcache_stat(statbuf);   // the file may be longer than it looks
     log_stat(statbuf);
     return retstat;
 }
@@ -103,17 +298,18 @@ int bb_getattr(const char *path, struct stat *statbuf) {
 // bb_readlink() code by Bernardo F Costa (thanks!)
 int bb_readlink(const char *path, char *link, size_t size) {
     int retstat = 0;
-    char fpath[PATH_MAX];
+    struct bb_path p;
 
     log_msg("bb_readlink(path=\"%s\", link=\"%s\", size=%d)\n", path,link,size);
-    bb_fullpath(fpath, path);
+    bb_path_get(&p, path);
 
-    retstat = readlink(fpath, link, size-1);
-    if (retstat < 0) retstat = bb_error("bb_readlink readlink");
+    retstat = readlinkat(p.dirfd, p.name, link, size-1);
+    if (retstat < 0) retstat = bb_error("bb_readlink readlinkat");
     else  {
         link[retstat] = '\0';
         retstat = 0;
     }
+    bb_path_put(&p);
     return retstat;
 }
 
@@ -124,66 +320,98 @@ int bb_readlink(const char *path, char *link, size_t size) {
  */
 int bb_mknod(const char *path, mode_t mode, dev_t dev) {
     int retstat = 0;
-    char fpath[PATH_MAX];
+    struct bb_path p;
 
     log_msg("\nbb_mknod(path=\"%s\", mode=0%3o, dev=%lld)\n", path, mode, dev);
-    bb_fullpath(fpath, path);
+    if (bb_reserved(path)) return -EPERM;
+    bb_path_get(&p, path);
 
     // On Linux this could just be 'mknod(path, mode, rdev)' but this
     //  is more portable
     if (S_ISREG(mode)) {
-        retstat = open(fpath, O_CREAT | O_EXCL | O_WRONLY, mode);
-        if (retstat < 0) retstat = bb_error("bb_mknod open");
+        retstat = openat(p.dirfd, p.name, O_CREAT | O_EXCL | O_WRONLY, mode);
+        if (retstat < 0) retstat = bb_error("bb_mknod openat");
         else {
             retstat = close(retstat);
             if (retstat < 0) retstat = bb_error("bb_mknod close");
         }
     } else if (S_ISFIFO(mode)) {
-        retstat = mkfifo(fpath, mode);
-        if (retstat < 0) retstat = bb_error("bb_mknod mkfifo");
+        retstat = mkfifoat(p.dirfd, p.name, mode);
+        if (retstat < 0) retstat = bb_error("bb_mknod mkfifoat");
     } else {
-        retstat = mknod(fpath, mode, dev);
-        if (retstat < 0) retstat = bb_error("bb_mknod mknod");
+        retstat = mknodat(p.dirfd, p.name, mode, dev);
+        if (retstat < 0) retstat = bb_error("bb_mknod mknodat");
     }
+    bb_path_put(&p);
+    if (retstat == 0) attrcache_drop_entry(path);
     return retstat;
 }
 
 /** Create a directory */
 int bb_mkdir(const char *path, mode_t mode) {
     int retstat = 0;
-    char fpath[PATH_MAX];
+    struct bb_path p;
 
     log_msg("\nbb_mkdir(path=\"%s\", mode=0%3o)\n", path, mode);
-    bb_fullpath(fpath, path);
+    if (bb_reserved(path)) return -EPERM;
+    bb_path_get(&p, path);
 
-    retstat = mkdir(fpath, mode);
-    if (retstat < 0) retstat = bb_error("bb_mkdir mkdir");
+    retstat = mkdirat(p.dirfd, p.name, mode);
+    if (retstat < 0) retstat = bb_error("bb_mkdir mkdirat");
+    else attrcache_drop_entry(path);
+    bb_path_put(&p);
     return retstat;
 }
 
 /** Remove a file */
 int bb_unlink(const char *path) {
     int retstat = 0;
-    char fpath[PATH_MAX];
+    struct bb_path p;
+    struct stat st;
+    int cached;
 
     log_msg("bb_unlink(path=\"%s\")\n", path);
-    bb_fullpath(fpath, path);
-
-    retstat = unlink(fpath);
-    if (retstat < 0) retstat = bb_error("bb_unlink unlink");
+    if (bb_reserved(path)) return -EPERM;
+    bb_path_get(&p, path);
+
+    // the inode number may be reused; don't let a new file inherit
+    // this one's cached pages.  A symlink may have stood in for a
+    // directory, with paths under it cached.
+    cached = (pgcache_enabled() || attrcache_enabled()) &&
+        fstatat(p.dirfd, p.name, &st, AT_SYMLINK_NOFOLLOW) == 0;
+
+    journal_ns_begin(0);
+    retstat = unlinkat(p.dirfd, p.name, 0);
+    // so that a replay doesn't bring it back
+    if (retstat == 0 && journal_unlink(p.dirfd, p.name) < 0) bb_error("bb_unlink journal_unlink");
+    journal_ns_end(0);
+    if (retstat < 0) retstat = bb_error("bb_unlink unlinkat");
+    else {
+        if (cached && S_ISLNK(st.st_mode)) attrcache_clear();
+        else attrcache_drop_entry(path);
+        dircache_drop_tree(path);
+        if (cached && st.st_nlink == 1) pgcache_invalidate_stat(&st);
+    }
+    bb_path_put(&p);
     return retstat;
 }
 
 /** Remove a directory */
 int bb_rmdir(const char *path) {
     int retstat = 0;
-    char fpath[PATH_MAX];
+    struct bb_path p;
 
     log_msg("bb_rmdir(path=\"%s\")\n", path);
-    bb_fullpath(fpath, path);
-
-    retstat = rmdir(fpath);
-    if (retstat < 0) retstat = bb_error("bb_rmdir rmdir");
+    if (bb_reserved(path)) return -EPERM;
+    bb_path_get(&p, path);
+
+    retstat = unlinkat(p.dirfd, p.name, AT_REMOVEDIR);
+    if (retstat < 0) retstat = bb_error("bb_rmdir unlinkat");
+    else {
+        attrcache_drop_entry(path);
+        dircache_drop_tree(path);
+    }
+    bb_path_put(&p);
     return retstat;
 }
 
@@ -194,13 +422,16 @@ int bb_rmdir(const char *path) {
 // unaltered, but insert the link into the mounted directory.
 int bb_symlink(const char *path, const char *link) {
     int retstat = 0;
-    char flink[PATH_MAX];
+    struct bb_path l;
 
     log_msg("\nbb_symlink(path=\"%s\", link=\"%s\")\n", path, link);
-    bb_fullpath(flink, link);
+    if (bb_reserved(link)) return -EPERM;
+    bb_path_get(&l, link);
 
-    retstat = symlink(path, flink);
-    if (retstat < 0) retstat = bb_error("bb_symlink symlink");
+    retstat = symlinkat(path, l.dirfd, l.name);
+    if (retstat < 0) retstat = bb_error("bb_symlink symlinkat");
+    else attrcache_drop_entry(link);
+    bb_path_put(&l);
     return retstat;
 }
 
@@ -208,29 +439,63 @@ int bb_symlink(const char *path, const char *link) {
 // both path and newpath are fs-relative
 int bb_rename(const char *path, const char *newpath) {
     int retstat = 0;
-    char fpath[PATH_MAX];
-    char fnewpath[PATH_MAX];
+    struct bb_path p, np;
+    struct stat st, dst;
+    int cached, tree;
 
     log_msg("\nbb_rename(fpath=\"%s\", newpath=\"%s\")\n", path, newpath);
-    bb_fullpath(fpath, path);
-    bb_fullpath(fnewpath, newpath);
-
-    retstat = rename(fpath, fnewpath);
-    if (retstat < 0) retstat = bb_error("bb_rename rename");
+    if (bb_reserved(path) || bb_reserved(newpath)) return -EPERM;
+    bb_path_get(&p, path);
+    bb_path_get(&np, newpath);
+
+    // the same goes for a file that the rename replaces
+    cached = (pgcache_enabled() || attrcache_enabled()) &&
+        fstatat(np.dirfd, np.name, &st, AT_SYMLINK_NOFOLLOW) == 0;
+    // a directory takes every path under it along, and so in effect
+    // does a symlink to one, moved or replaced
+    tree = attrcache_enabled() &&
+        ((fstatat(p.dirfd, p.name, &dst, AT_SYMLINK_NOFOLLOW) == 0 &&
+          (S_ISDIR(dst.st_mode) || S_ISLNK(dst.st_mode))) ||
+         (cached && S_ISLNK(st.st_mode)));
+
+    journal_ns_begin(1);
+    retstat = renameat(p.dirfd, p.name, np.dirfd, np.name);
+    journal_ns_end(1);
+    if (retstat < 0) retstat = bb_error("bb_rename renameat");
+    else {
+        if (tree) {
+            attrcache_clear();
+        } else {
+            attrcache_drop_entry(path);
+            attrcache_drop_entry(newpath);
+        }
+        dircache_drop_tree(path);
+        dircache_drop_tree(newpath);
+        if (cached && st.st_nlink == 1) pgcache_invalidate_stat(&st);
+    }
+    bb_path_put(&np);
+    bb_path_put(&p);
     return retstat;
 }
 
 /** Create a hard link to a file */
 int bb_link(const char *path, const char *newpath) {
     int retstat = 0;
-    char fpath[PATH_MAX], fnewpath[PATH_MAX];
+    struct bb_path p, np;
 
     log_msg("\nbb_link(path=\"%s\", newpath=\"%s\")\n", path, newpath);
-    bb_fullpath(fpath, path);
-    bb_fullpath(fnewpath, newpath);
-
-    retstat = link(fpath, fnewpath);
-    if (retstat < 0) retstat = bb_error("bb_link link");
+    if (bb_reserved(path) || bb_reserved(newpath)) return -EPERM;
+    bb_path_get(&p, path);
+    bb_path_get(&np, newpath);
+
+    retstat = linkat(p.dirfd, p.name, np.dirfd, np.name, 0);
+    if (retstat < 0) retstat = bb_error("bb_link linkat");
+    else {
+        attrcache_drop(path);       // st_nlink
+        attrcache_drop_entry(newpath);
+    }
+    bb_path_put(&np);
+    bb_path_put(&p);
     return retstat;
 }
 
@@ -238,46 +503,73 @@ int bb_link(const char *path, const char *newpath) {
 int bb_chmod(const char *path, mode_t mode) {
 
     int retstat = 0;
-    char fpath[PATH_MAX];
-
-    uid = getuid();
-    lt = time(NULL);
+    struct bb_path p;
+    struct fuse_context *ctx = fuse_get_context();
+    struct policy pol;
+    time_t lt = time(NULL);     // local time
+    char when[26];
 
     log_msg("\nbb_chmod(fpath=\"%s\", mode=0%03o)\n", path, mode);
-    bb_fullpath(fpath, path);
+    bb_path_get(&p, path);
 
-    if (user_id == uid)
-        retstat = chmod(fpath, mode);
+    if (policy_get(ctx->uid, ctx->gid, &pol))
+        retstat = fchmodat(p.dirfd, p.name, mode, 0);
     else
-        log_msg("\nIllegal op by user %d on file %s %s", user_id, path, ctime(&lt));
+        log_msg("\nIllegal op by user %d on file %s %s", ctx->uid, path, ctime_r(&lt, when));
 
-    if (retstat < 0) retstat = bb_error("bb_chmod chmod");
+    if (retstat < 0) retstat = bb_error("bb_chmod fchmodat");
+    else attrcache_drop(path);
+    bb_path_put(&p);
     return retstat;
 }
 
 /** Change the owner and group of a file */
 int bb_chown(const char *path, uid_t uid, gid_t gid) {
     int retstat = 0;
-    char fpath[PATH_MAX];
+    struct bb_path p;
 
     log_msg("\nbb_chown(path=\"%s\", uid=%d, gid=%d)\n", path, uid, gid);
-    bb_fullpath(fpath, path);
+    bb_path_get(&p, path);
 
-    retstat = chown(fpath, uid, gid);
-    if (retstat < 0) retstat = bb_error("bb_chown chown");
+    retstat = fchownat(p.dirfd, p.name, uid, gid, 0);
+    if (retstat < 0) retstat = bb_error("bb_chown fchownat");
+    else attrcache_drop(path);
+    bb_path_put(&p);
     return retstat;
 }
 
 /** Change the size of a file */
 int bb_truncate(const char *path, off_t newsize) {
     int retstat = 0;
-    char fpath[PATH_MAX];
+    struct bb_path p;
+    char ppath[PATH_MAX];
+    struct stat st;
+    int cached;
 
     log_msg("\nbb_truncate(path=\"%s\", newsize=%lld)\n", path, newsize);
-    bb_fullpath(fpath, path);
+    bb_path_get(&p, path);
+    retstat = bb_proc_path(ppath, &p);
+    if (retstat < 0) goto out;
+
+    // dirty data must land before the truncate, not on top of it
+    cached = (wbcache_enabled() || pgcache_enabled()) &&
+        fstatat(p.dirfd, p.name, &st, AT_SYMLINK_NOFOLLOW) == 0;
+    if (cached) {
+        retstat = wbcache_flush_stat(&st);
+        if (retstat < 0) goto out;
+    }
 
-    retstat = truncate(fpath, newsize);
-    if (retstat < 0) bb_error("bb_truncate truncate");
+    if (dedup_enabled()) retstat = dedup_truncate_path(ppath, newsize);
+    else if (compress_enabled()) retstat = compress_truncate_path(ppath, newsize);
+    else if (journal_enabled()) retstat = journal_truncate_path(ppath, newsize);
+    else retstat = truncate(ppath, newsize);
+    if (retstat < 0) retstat = bb_error("bb_truncate truncate");
+    else {
+        attrcache_drop(path);
+        if (cached) pgcache_invalidate_stat(&st);
+    }
+out:
+    bb_path_put(&p);
     return retstat;
 }
 
@@ -285,13 +577,23 @@ int bb_truncate(const char *path, off_t newsize) {
 /* note -- I'll want to change this as soon as 2.6 is in debian testing */
 int bb_utime(const char *path, struct utimbuf *ubuf) {
     int retstat = 0;
-    char fpath[PATH_MAX];
+    struct bb_path p;
+    struct timespec ts[2];
 
     log_msg("\nbb_utime(path=\"%s\", ubuf=0x%08x)\n", path, ubuf);
-    bb_fullpath(fpath, path);
-
-    retstat = utime(fpath, ubuf);
-    if (retstat < 0) retstat = bb_error("bb_utime utime");
+    bb_path_get(&p, path);
+
+    // utime() with no times means now, like utimensat() with none
+    if (ubuf) {
+        ts[0].tv_sec = ubuf->actime;
+        ts[0].tv_nsec = 0;
+        ts[1].tv_sec = ubuf->modtime;
+        ts[1].tv_nsec = 0;
+    }
+    retstat = utimensat(p.dirfd, p.name, ubuf ? ts : NULL, 0);
+    if (retstat < 0) retstat = bb_error("bb_utime utimensat");
+    else attrcache_drop(path);
+    bb_path_put(&p);
     return retstat;
 }
 
@@ -310,17 +612,24 @@ int bb_utime(const char *path, struct utimbuf *ubuf) {
 int bb_open(const char *path, struct fuse_file_info *fi) {
     int retstat = 0;
     int fd;
-    char fpath[PATH_MAX];
+    struct bb_path p;
 
     log_msg("\nbb_open(path\"%s\", fi=0x%08x)\n", path, fi);
-    bb_fullpath(fpath, path);  // path is relative to rootdir, must change it
-    // to a full path
+    bb_path_get(&p, path);  // path is relative to rootdir, must find the
+    // directory it's in
 
-    fd = open(fpath, fi->flags);  // uses system open to open or return an error
+    fd = openat(p.dirfd, p.name, fi->flags);  // uses system openat to open or return an error
     // returns a file despcriptor (> 0) on success
-    if (fd < 0) retstat = bb_error("bb_open open");
-
-    fi->fh = fd;  // sets the handle field of fi
+    if (fd < 0) fd = bb_error("bb_open openat");
+    bb_path_put(&p);
+    if (fd < 0) return fd;
+
+    // fi->fh gets our struct bb_file, which holds the descriptor
+    retstat = bb_file_new(fi, fd, 0, fuse_get_context()->uid, fuse_get_context()->gid);
+    if (retstat < 0) {
+        close(fd);
+        return retstat;
+    }
     log_fi(fi);   
     return retstat;  // This should be 0 - but we would like to return a file
     // descriptor.  Fuse automatically chooses a file descriptor
@@ -346,9 +655,7 @@ int bb_open(const char *path, struct fuse_file_info *fi) {
 int bb_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
 
     int retstat = 0;
-
-    byte = (unsigned char *)buf;
-    uid = getuid();
+    struct bb_file *f = BB_FILE(fi);
 
     log_msg("\nbb_read(path=\"%s\", buf=0x%08x, size=%d, offset=%lld, fi=0x%08x)\n", path, buf, size, offset, fi);
     // no need to get fpath on this one, since I work from fi->fh not the path
@@ -356,23 +663,20 @@ int bb_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_
 
     /*
      * The pread() function attempts to read the specified amount (size) of 
-     * data from the specified file descriptor (fi->fh), into the specified 
+     * data from the specified file descriptor (f->fd), into the specified 
      * buffer (buf) starting at a point in the file (offset).  Returns the
-     * number of bytes read.
+     * number of bytes read.  bb_fill() does that; the page cache, if
+     * there is one, calls it a page at a time.
      */
-    retstat = pread(fi->fh, byte, size, offset);
+    if (f->pc)
+        retstat = pgcache_read(f->pc, buf, size, offset);
+    else
+        retstat = bb_fill(f, buf, size, offset);
     if (retstat < 0) retstat = bb_error("bb_read read");
 
-    int i = 0;
-    if (user_id == uid)
-    {
-        while(*byte != '\0')
-        {
-            byte[i] = (byte[i] == 0) ? 255 : ((byte[i] - 1) % 256);
-            byte++;
-        }
-        i++;
-    }
+    // undo whatever bb_write() did, on exactly the bytes we got back
+    if (retstat > 0 && f->xform)
+        f->xform->apply(f->key, (unsigned char *) buf, retstat, offset, XFORM_DECODE);
 
     return retstat;
 }
@@ -391,27 +695,159 @@ int bb_write(const char *path, const char *buf, size_t size, off_t offset,
         struct fuse_file_info *fi) {
 
     int retstat = 0;
+    struct bb_file *f = BB_FILE(fi);
+    int append = fi->flags & O_APPEND;
+    off_t at = offset;      // where the data really lands, for the page cache
+    size_t span = size;
+    struct stat st;
 
-    byte = (unsigned char *)buf;
-    uid = getuid();
-
-    log_msg("\nbb_write(path=\"%s\", buf=0x%08x, size=%d, offset=%lld, fi=0x%08x, user_id: %d, uid: %d)\n", path, buf, size, offset, fi, user_id, uid);
+    log_msg("\nbb_write(path=\"%s\", buf=0x%08x, size=%d, offset=%lld, fi=0x%08x, xform: %s)\n", path, buf, size, offset, fi, f->xform ? f->xform->name : "none");
     // no need to get fpath on this one, since I work from fi->fh not the path
     log_fi(fi);
 
-    int i = 0;
-    if (user_id == uid)
-    {
-        while(*byte != '\0')
-        {
-            byte[i] = (byte[i] + 1) % 256;
-            byte++;
+    // An append that's transformed has to be encoded for the end of
+    // the file as it is when the data goes in, not for offset, which
+    // is only the kernel's idea of it.  So it finds the end itself,
+    // with other appends to the file held off, and writes there.
+    if (append) pthread_mutex_lock(f->append);
+    if (append && f->xform) {
+        if (bb_file_stat(f, &st) < 0) {
+            retstat = bb_error("bb_write fstat");
+            goto out;
         }
-        i++;
+        at = offset = st.st_size;
+        append = 0;
     }
 
-    retstat = pwrite(fi->fh, byte, size, offset);
+    // buf is FUSE's own request buffer and isn't looked at again
+    // after we return, so it's transformed in place rather than copied
+    if (f->xform)
+        f->xform->apply(f->key, (unsigned char *) buf, size, offset, XFORM_ENCODE);
+
+    // O_APPEND writes land wherever the end of the file is by then,
+    // not at offset, so they can't be cached; anything cached must go
+    // first.  Dedup and compression keep the end to themselves, so
+    // an append to one of theirs drops every cached page of the file.
+    if (f->dd) {
+        retstat = dedup_write(f->dd, f->fd, buf, size, append ? -1 : offset);
+        if (append) at = span = 0;
+    } else if (f->cz) {
+        retstat = compress_write(f->cz, f->fd, buf, size, append ? -1 : offset);
+        if (append) at = span = 0;
+    } else if (f->jf) {
+        if (append && f->pc && fstat(f->fd, &st) == 0) at = st.st_size;
+        retstat = journal_write(f->jf, f->fd, buf, size, append ? -1 : offset);
+    } else if (append) {
+        retstat = wbcache_flush(f->wb);
+        if (retstat < 0) goto out;
+        if (f->pc && fstat(f->fd, &st) == 0) at = st.st_size;
+        retstat = pwrite(f->fd, buf, size, offset);
+    } else {
+        retstat = wbcache_write(f->wb, f->fd, buf, size, offset);
+    }
     if (retstat < 0) retstat = bb_error("bb_write pwrite");
+    pgcache_invalidate(f->pc, at, span);
+    attrcache_drop(path);
+out:
+    if (fi->flags & O_APPEND) pthread_mutex_unlock(f->append);
+    return retstat;
+}
+
+/** Read data from an open file, into a buffer the caller frees
+ *
+ * Like read(), but the data may be handed back as a file descriptor
+ * and offset to copy it from, instead of in memory.  The fuse_bufvec
+ * and any memory it points to are freed by the caller.
+ *
+ * Introduced in version 2.9
+ */
+// For a file that can splice, the reply just names the backing fd and
+// FUSE splices the data from it into /dev/fuse without it ever
+// passing through here.  Anything else goes through bb_read().
+int bb_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset,
+        struct fuse_file_info *fi) {
+    int retstat = 0;
+    struct bb_file *f = BB_FILE(fi);
+    struct fuse_bufvec *src;
+    char *mem;
+
+    log_msg("\nbb_read_buf(path=\"%s\", bufp=0x%08x, size=%d, offset=%lld, fi=0x%08x)\n",
+            path, bufp, size, offset, fi);
+
+    src = malloc(sizeof(*src));
+    if (src == NULL) return -ENOMEM;
+    *src = FUSE_BUFVEC_INIT(size);
+
+    if (f->splice) {
+        log_fi(fi);
+        src->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+        src->buf[0].fd = f->fd;
+        src->buf[0].pos = offset;
+    } else {
+        mem = malloc(size ? size : 1);
+        if (mem == NULL) {
+            free(src);
+            return -ENOMEM;
+        }
+        retstat = bb_read(path, mem, size, offset, fi);
+        if (retstat < 0) {
+            free(mem);
+            free(src);
+            return retstat;
+        }
+        src->buf[0].mem = mem;
+        src->buf[0].size = retstat;
+    }
+
+    *bufp = src;
+    return 0;
+}
+
+/** Write contents of buffer to an open file
+ *
+ * Similar to the write() method, but data is supplied in a generic
+ * buffer.  Use fuse_buf_copy() to transfer data to the destination.
+ *
+ * Introduced in version 2.9
+ */
+// buf may be a pipe FUSE spliced the request into; for a file that
+// can splice it goes on into the backing file the same way.  Anything
+// else is gathered into memory and goes through bb_write().
+int bb_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset,
+        struct fuse_file_info *fi) {
+    int retstat = 0;
+    struct bb_file *f = BB_FILE(fi);
+    size_t size = fuse_buf_size(buf);
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+    char *mem;
+
+    log_msg("\nbb_write_buf(path=\"%s\", buf=0x%08x, size=%d, offset=%lld, fi=0x%08x)\n",
+            path, buf, size, offset, fi);
+
+    if (!f->splice) {
+        // already in memory, as it is without splice_write
+        if (buf->count == 1 && !(buf->buf[0].flags & FUSE_BUF_IS_FD))
+            return bb_write(path, buf->buf[0].mem, size, offset, fi);
+
+        mem = malloc(size ? size : 1);
+        if (mem == NULL) return -ENOMEM;
+        dst.buf[0].mem = mem;
+        retstat = fuse_buf_copy(&dst, buf, 0);
+        if (retstat >= 0) retstat = bb_write(path, mem, retstat, offset, fi);
+        free(mem);
+        return retstat;
+    }
+
+    log_fi(fi);
+    dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+    dst.buf[0].fd = f->fd;
+    dst.buf[0].pos = offset;
+    // taking turns with bb_write()'s appends
+    if (fi->flags & O_APPEND) pthread_mutex_lock(f->append);
+    retstat = fuse_buf_copy(&dst, buf, FUSE_BUF_SPLICE_NONBLOCK);
+    if (fi->flags & O_APPEND) pthread_mutex_unlock(f->append);
+    if (retstat < 0) log_err("bb_write_buf fuse_buf_copy: %s\n", strerror(-retstat));
+    attrcache_drop(path);
     return retstat;
 }
 
@@ -424,15 +860,20 @@ int bb_write(const char *path, const char *buf, size_t size, off_t offset,
  */
 int bb_statfs(const char *path, struct statvfs *statv) {
     int retstat = 0;
-    char fpath[PATH_MAX];
+    struct bb_path p;
+    char ppath[PATH_MAX];
 
     log_msg("\nbb_statfs(path=\"%s\", statv=0x%08x)\n", path, statv);
-    bb_fullpath(fpath, path);
+    bb_path_get(&p, path);
 
     // get stats for underlying filesystem
-    retstat = statvfs(fpath, statv);
-    if (retstat < 0) retstat = bb_error("bb_statfs statvfs");
-    log_statvfs(statv);
+    retstat = bb_proc_path(ppath, &p);
+    if (retstat == 0) {
+        retstat = statvfs(ppath, statv);
+        if (retstat < 0) retstat = bb_error("bb_statfs statvfs");
+        else log_statvfs(statv);
+    }
+    bb_path_put(&p);
     return retstat;
 }
 
@@ -465,6 +906,13 @@ int bb_flush(const char *path, struct fuse_file_info *fi) {
     log_msg("\nbb_flush(path=\"%s\", fi=0x%08x)\n", path, fi);
     // no need to get fpath on this one, since I work from fi->fh not the path
     log_fi(fi);
+
+    // called on every close(), so this is where a write error the
+    // write-back cache ran into gets reported
+    retstat = wbcache_flush(BB_FILE(fi)->wb);
+    if (retstat < 0) log_err("bb_flush: %s\n", strerror(-retstat));
+    // and the backing file's mtime only moves now
+    if (BB_FILE(fi)->wb) attrcache_drop(path);
     return retstat;
 }
 
@@ -488,9 +936,15 @@ int bb_release(const char *path, struct fuse_file_info *fi) {
     log_msg("\nbb_release(path=\"%s\", fi=0x%08x)\n", path, fi);
     log_fi(fi);
 
-    // We need to close the file.  Had we allocated any resources
-    // (buffers etc) we'd need to free them here as well.
-    retstat = close(fi->fh);
+    // We need to close the file, and free the struct bb_file that
+    // bb_open() or bb_create() allocated
+    pgcache_close(BB_FILE(fi)->pc);
+    wbcache_put(BB_FILE(fi)->wb);
+    dedup_close(BB_FILE(fi)->dd);
+    compress_close(BB_FILE(fi)->cz);
+    journal_close(BB_FILE(fi)->jf);
+    retstat = close(BB_FILE(fi)->fd);
+    free(BB_FILE(fi));
     return retstat;
 }
 
@@ -507,51 +961,100 @@ int bb_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
     log_msg("\nbb_fsync(path=\"%s\", datasync=%d, fi=0x%08x)\n",path,datasync,fi);
     log_fi(fi);
 
-    if (datasync) retstat = fdatasync(fi->fh);
-    else	retstat = fsync(fi->fh);
+    // nothing is on disk that's still in the write-back cache, nor
+    // the block being written to that hasn't been compressed (dedup
+    // writes everything through to the file as it comes)
+    retstat = wbcache_flush(BB_FILE(fi)->wb);
+    if (retstat < 0) return retstat;
+    if (BB_FILE(fi)->cz) {
+        retstat = compress_sync(BB_FILE(fi)->cz);
+        if (retstat < 0) return retstat;
+    }
+    // with the journal, what's logged is as good as in the file
+    if (BB_FILE(fi)->jf) return journal_sync(BB_FILE(fi)->jf, BB_FILE(fi)->fd);
+
+    if (datasync) retstat = fdatasync(BB_FILE(fi)->fd);
+    else	retstat = fsync(BB_FILE(fi)->fd);
 
-    if (retstat < 0) bb_error("bb_fsync fsync");
+    if (retstat < 0) retstat = bb_error("bb_fsync fsync");
     return retstat;
 }
 
 /** Set extended attributes */
 int bb_setxattr(const char *path, const char *name, const char *value, size_t size, int flags) {
     int retstat = 0;
-    char fpath[PATH_MAX];
+    struct bb_path p;
+    char ppath[PATH_MAX];
 
     log_msg("\nbb_setxattr(path=\"%s\", name=\"%s\", value=\"%s\", size=%d, flags=0x%08x)\n", path, name, value, size, flags);
-    bb_fullpath(fpath, path);
 
-    retstat = lsetxattr(fpath, name, value, size, flags);
-    if (retstat < 0) retstat = bb_error("bb_setxattr lsetxattr");
+    // the file's key, or its size, depends on these; hands off
+    if (bb_xattr_hidden(name)) return -EPERM;
+
+    bb_path_get(&p, path);
+    retstat = bb_proc_path(ppath, &p);
+    if (retstat == 0) {
+        retstat = lsetxattr(ppath, name, value, size, flags);
+        if (retstat < 0) retstat = bb_error("bb_setxattr lsetxattr");
+        else attrcache_drop(path);  // st_ctime, and access() under ACLs
+    }
+    bb_path_put(&p);
     return retstat;
 }
 
 /** Get extended attributes */
 int bb_getxattr(const char *path, const char *name, char *value, size_t size) {
     int retstat = 0;
-    char fpath[PATH_MAX];
+    struct bb_path p;
+    char ppath[PATH_MAX];
 
     log_msg("\nbb_getxattr(path = \"%s\", name = \"%s\", value = 0x%08x, size = %d)\n", path, name, value, size);
-    bb_fullpath(fpath, path);
 
-    retstat = lgetxattr(fpath, name, value, size);
-    if (retstat < 0) retstat = bb_error("bb_getxattr lgetxattr");
-    else log_msg("    value = \"%s\"\n", value);
+    if (bb_xattr_hidden(name)) return -ENODATA;
+
+    bb_path_get(&p, path);
+    retstat = bb_proc_path(ppath, &p);
+    if (retstat == 0) {
+        retstat = lgetxattr(ppath, name, value, size);
+        if (retstat < 0) retstat = bb_error("bb_getxattr lgetxattr");
+        else log_msg("    value = \"%s\"\n", value);
+    }
+    bb_path_put(&p);
     return retstat;
 }
 
 /** List extended attributes */
 int bb_listxattr(const char *path, char *list, size_t size) {
     int retstat = 0;
-    char fpath[PATH_MAX];
+    struct bb_path p;
+    char ppath[PATH_MAX];
     char *ptr;
+    size_t len;
 
     log_msg("bb_listxattr(path=\"%s\", list=0x%08x, size=%d)\n", path,list,size);
-    bb_fullpath(fpath, path);
+    bb_path_get(&p, path);
 
-    retstat = llistxattr(fpath, list, size);
-    if (retstat < 0) retstat = bb_error("bb_listxattr llistxattr");
+    retstat = bb_proc_path(ppath, &p);
+    if (retstat == 0) {
+        retstat = llistxattr(ppath, list, size);
+        if (retstat < 0) retstat = bb_error("bb_listxattr llistxattr");
+    }
+    bb_path_put(&p);
+    if (retstat < 0) return retstat;
+
+    // with size 0 the caller only wants to know how big a buffer to
+    // pass; there is no list to look at
+    if (size == 0) return retstat;
+
+    // leave out bbfs's own (see bb_setxattr())
+    for (ptr = list; ptr < list + retstat; )
+        if (bb_xattr_hidden(ptr)) {
+            len = strlen(ptr) + 1;
+            memmove(ptr, ptr + len, list + retstat - (ptr + len));
+            retstat -= len;
+        } else {
+            ptr += strlen(ptr) + 1;
+        }
 
     log_msg("    returned attributes (length %d):\n", retstat);
     for (ptr = list; ptr < list + retstat; ptr += strlen(ptr)+1)
@@ -562,13 +1065,21 @@ int bb_listxattr(const char *path, char *list, size_t size) {
 /** Remove extended attributes */
 int bb_removexattr(const char *path, const char *name) {
     int retstat = 0;
-    char fpath[PATH_MAX];
+    struct bb_path p;
+    char ppath[PATH_MAX];
 
     log_msg("\nbb_removexattr(path=\"%s\", name=\"%s\")\n", path, name);
-    bb_fullpath(fpath, path);
 
-    retstat = lremovexattr(fpath, name);
-    if (retstat < 0) retstat = bb_error("bb_removexattr lrmovexattr");
+    if (bb_xattr_hidden(name)) return -EPERM;
+
+    bb_path_get(&p, path);
+    retstat = bb_proc_path(ppath, &p);
+    if (retstat == 0) {
+        retstat = lremovexattr(ppath, name);
+        if (retstat < 0) retstat = bb_error("bb_removexattr lrmovexattr");
+        else attrcache_drop(path);
+    }
+    bb_path_put(&p);
     return retstat;
 }
 
@@ -580,22 +1091,59 @@ int bb_removexattr(const char *path, const char *name) {
  * Introduced in version 2.3
  */
 int bb_opendir(const char *path, struct fuse_file_info *fi) {
-    DIR *dp;
+    struct bb_dir *d;
     int retstat = 0;
-    char fpath[PATH_MAX];
+    int fd;
+    struct bb_path p;
 
     log_msg("\nbb_opendir(path=\"%s\", fi=0x%08x)\n", path, fi);
-    bb_fullpath(fpath, path);
 
-    dp = opendir(fpath);
-    if (dp == NULL) retstat = bb_error("bb_opendir opendir");
+    d = calloc(1, sizeof(*d) + strlen(path) + 1);
+    if (d == NULL) return -ENOMEM;
+    strcpy(d->path, path);
+
+    bb_path_get(&p, path);
+    fd = openat(p.dirfd, p.name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) retstat = bb_error("bb_opendir openat");
+    else if ((d->dp = fdopendir(fd)) == NULL) {
+        retstat = bb_error("bb_opendir fdopendir");
+        close(fd);
+    }
+    bb_path_put(&p);
 
-    fi->fh = (intptr_t) dp;
+    if (retstat < 0) {
+        free(d);
+        return retstat;
+    }
+    fi->fh = (uintptr_t) d;
 
     log_fi(fi);
     return retstat;
 }
 
+// With -o readdir_plus, stat an entry and put it in the attribute
+// cache.  The kernel (FUSE 2.9 has no READDIRPLUS) still asks for the
+// attributes of each name it goes on to use, but now it's answered
+// from the cache without going back to the disk; the stat here is
+// cheap, since the directory's inode is already at hand.
+static void bb_readdir_plus(struct bb_dir *d, const char *name, struct stat *st) {
+    char path[PATH_MAX];
+    size_t len = strlen(d->path);
+    unsigned gen;
+    int ret;
+
+    if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+        return;
+    if (snprintf(path, sizeof(path), "%s/%s", len > 1 ? d->path : "", name) >= (int) sizeof(path))
+        return;
+    gen = attrcache_gen(path);
+    ret = fstatat(dirfd(d->dp), name, st, AT_SYMLINK_NOFOLLOW);
+    if (ret < 0) return;
+    dedup_stat(dirfd(d->dp), name, st);
+    compress_stat(dirfd(d->dp), name, st);
+    attrcache_put(path, gen, st, 0);
+}
+
 /** Read directory
  * 
  * Uses function called 'filler' to insert directory entries into the 
@@ -619,37 +1167,55 @@ int bb_opendir(const char *path, struct fuse_file_info *fi) {
  * '1'.
  *
  */
+// This is mode 2: every entry goes to filler() with the offset of the
+// one after it (its d_off, which seekdir() takes back), and when the
+// buffer is full we stop and FUSE asks again from there.  So a
+// directory of any size is read a buffer at a time instead of all at
+// once, and a call that carries on from the last one doesn't seek.
 int bb_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
     int retstat = 0;
-    DIR *dp;
-    struct dirent *de;
+    struct bb_dir *d = BB_DIR(fi);
+    struct stat st;
+    int plus = BB_DATA->readdir_plus && attrcache_enabled();
+    int hide = strcmp(d->path, "/") == 0;
+    int n = 0;
 
     log_msg("\nbb_readdir(path=\"%s\", buf=0x%08x, filler=0x%08x, offset=%lld, fi=0x%08x)\n", path, buf, filler, offset, fi);
-    // once again, no need for fullpath -- but note that I need to cast fi->fh
-    dp = (DIR*) (uintptr_t) fi->fh;
-
-    // Every directory contains at least two entries: . and ..  If my
-    // first call to the system readdir() returns NULL I've got an
-    // error; near as I can tell, that's the only condition under
-    // which I can get an error from readdir()
-    de = readdir(dp);
-    if (de == 0) {
-        retstat = bb_error("bb_readdir readdir");
-        return retstat;
+
+    if (offset != d->offset) {
+        seekdir(d->dp, offset);
+        d->entry = NULL;
+        d->offset = offset;
     }
 
-    // This will copy the entire directory into the buffer.  The loop exits
-    // when either the system readdir() returns NULL, or filler()
-    // returns something non-zero.  The first case just means I've
-    // read the whole directory; the second means the buffer is full.
-    do {
-        log_msg("calling filler with name %s\n", de->d_name);
-        if (filler(buf, de->d_name, NULL, 0) != 0) {
-            log_msg("    ERROR bb_readdir filler:  buffer full");
-            return -ENOMEM;
+    // an entry that didn't fit last time is kept for next time
+    for (;;) {
+        if (d->entry == NULL) {
+            errno = 0;
+            d->entry = readdir(d->dp);
+            if (d->entry == NULL) {
+                // an error after some entries waits for the next call
+                if (errno && n == 0) retstat = bb_error("bb_readdir readdir");
+                break;
+            }
         }
-    } while ((de = readdir(dp)) != NULL);
+        // the chunk store and the journal aren't part of the filesystem
+        if (hide && bb_hidden(d->entry->d_name)) {
+            d->offset = d->entry->d_off;
+            d->entry = NULL;
+            continue;
+        }
+        memset(&st, 0, sizeof(st));
+        st.st_ino = d->entry->d_ino;
+        st.st_mode = d->entry->d_type << 12;
+        if (plus) bb_readdir_plus(d, d->entry->d_name, &st);
+        if (filler(buf, d->entry->d_name, &st, d->entry->d_off) != 0) break;
+        d->offset = d->entry->d_off;
+        d->entry = NULL;
+        n++;
+    }
 
+    log_msg("    bb_readdir: %d entries, up to offset %lld\n", n, (long long) d->offset);
     log_fi(fi);
     return retstat;
 }
@@ -664,7 +1230,8 @@ int bb_releasedir(const char *path, struct fuse_file_info *fi) {
     log_msg("\nbb_releasedir(path=\"%s\", fi=0x%08x)\n", path, fi);
     log_fi(fi);
 
-    closedir((DIR*) (uintptr_t) fi->fh);
+    closedir(BB_DIR(fi)->dp);
+    free(BB_DIR(fi));
     return retstat;
 }
 
@@ -696,12 +1263,115 @@ int bb_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi) {
  * Introduced in version 2.3
  * Changed in version 2.6
  */
+// Ask the kernel for requests as big as it and libfuse will do, so a
+// MiB of I/O takes a few round trips instead of one per page, unless
+// told otherwise.  max_write and max_readahead arrive already set to
+// the most that's allowed and can only be lowered.  What comes of it
+// goes in the log and the stats.
+static void bb_init_conn(struct fuse_conn_info *conn) {
+    struct bb_state *bb_data = BB_DATA;
+    char desc[256];
+    int writeback = 0;
+
+    if (!bb_data->small_writes)
+        conn->want |= conn->capable & FUSE_CAP_BIG_WRITES;
+    if (bb_data->io_write_kb && ((size_t) bb_data->io_write_kb << 10) < conn->max_write)
+        conn->max_write = bb_data->io_write_kb << 10;
+    if (bb_data->io_readahead_kb && ((size_t) bb_data->io_readahead_kb << 10) < conn->max_readahead)
+        conn->max_readahead = bb_data->io_readahead_kb << 10;
+
+    // several reads of one file in flight at once; the loop threads
+    // (loop.c) and the page cache both cope
+    if (bb_data->sync_read) {
+        conn->async_read = 0;
+        conn->want &= ~FUSE_CAP_ASYNC_READ;
+    } else {
+        conn->want |= conn->capable & FUSE_CAP_ASYNC_READ;
+    }
+
+    // let the kernel splice file data through /dev/fuse where it can;
+    // bb_read_buf() and bb_write_buf() decide file by file
+    if (!bb_data->nosplice)
+        conn->want |= conn->capable &
+            (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+
+    // only newer libfuse and kernels cache writes in the kernel
+#ifdef FUSE_CAP_WRITEBACK_CACHE
+    if (bb_data->writeback)
+        conn->want |= conn->capable & FUSE_CAP_WRITEBACK_CACHE;
+    writeback = !!(conn->want & FUSE_CAP_WRITEBACK_CACHE);
+#endif
+    if (bb_data->writeback && !writeback)
+        log_msg("    bb_init: no kernel write-back cache to be had\n");
+
+    snprintf(desc, sizeof(desc), "proto %u.%u, max_write %u, max_readahead %u, "
+            "big_writes %d, async_read %d, splice read/write/move %d/%d/%d, writeback %d",
+            conn->proto_major, conn->proto_minor, conn->max_write, conn->max_readahead,
+            !!(conn->want & FUSE_CAP_BIG_WRITES),
+            conn->async_read || (conn->want & FUSE_CAP_ASYNC_READ),
+            !!(conn->want & FUSE_CAP_SPLICE_READ), !!(conn->want & FUSE_CAP_SPLICE_WRITE),
+            !!(conn->want & FUSE_CAP_SPLICE_MOVE), writeback);
+    log_msg("    bb_init: %s\n", desc);
+    stats_conn(desc);
+}
+
 // Undocumented but extraordinarily useful fact:  the fuse_context is
 // set up before this function is called, and
 // fuse_get_context()->private_data returns the user_data passed to
 // fuse_main().  
 void *bb_init(struct fuse_conn_info *conn) {
 
+    // we're in the (possibly daemonized) filesystem process now, so
+    // the log flusher thread can be started
+    log_start(BB_DATA);
+    if (!BB_DATA->nostats && stats_start(BB_DATA->stats_fd) < 0)
+        log_err("bb_init: can't start stats\n");
+    if (!BB_DATA->trace) stats_section(log_report);
+    if (BB_DATA->wb_cache_mb &&
+            wbcache_start((size_t) BB_DATA->wb_cache_mb << 20, BB_DATA->wb_age_ms) < 0)
+        log_err("bb_init: can't start the write-back cache\n");
+    if (BB_DATA->pg_cache_mb &&
+            pgcache_start((size_t) BB_DATA->pg_cache_mb << 20,
+                BB_DATA->pg_ra_kb ? (size_t) BB_DATA->pg_ra_kb << 10 : PGCACHE_READAHEAD) < 0)
+        log_err("bb_init: can't start the page cache\n");
+    if (BB_DATA->attr_ttl_ms && attrcache_start(BB_DATA->attr_ttl_ms) < 0)
+        log_err("bb_init: can't start the attribute cache\n");
+    if (BB_DATA->dir_cache && dircache_start(BB_DATA->rootfd, BB_DATA->dir_cache) < 0)
+        log_err("bb_init: can't start the directory cache\n");
+    if (BB_DATA->dedup) {
+        if (dedup_start(BB_DATA->rootfd, (size_t) (BB_DATA->dedup_cache_mb ?
+                        BB_DATA->dedup_cache_mb : DEDUP_CACHE_MB) << 20, BB_DATA->dedup_gc) < 0)
+            log_err("bb_init: can't start dedup\n");
+        else
+            stats_section(dedup_report);
+    }
+    if (BB_DATA->compress && BB_DATA->dedup) {
+        // a chunk store of compressed blocks would never find two alike
+        log_msg("    bb_init: compress doesn't go with dedup, leaving it off\n");
+    } else if (BB_DATA->compress) {
+        if (compress_start(BB_DATA->compress) < 0)
+            log_err("bb_init: can't start compression at level %u\n", BB_DATA->compress);
+        else
+            stats_section(compress_report);
+    }
+    if (BB_DATA->journal && (dedup_enabled() || compress_enabled())) {
+        // they write files in their own layouts, which replay knows nothing of
+        log_msg("    bb_init: the journal doesn't go with dedup or compress, leaving it off\n");
+    } else if (BB_DATA->journal) {
+        if (journal_start(BB_DATA->rootfd, BB_DATA->rootdir, (size_t) (BB_DATA->journal_mb ?
+                        BB_DATA->journal_mb : JOURNAL_MB) << 20, BB_DATA->journal_ms) < 0)
+            log_err("bb_init: can't start the journal\n");
+        else
+            stats_section(journal_report);
+    }
+    if (BB_DATA->policy_file) {
+        if (policy_start() < 0)
+            log_err("bb_init: SIGHUP won't reload %s\n", BB_DATA->policy_file);
+        stats_section(policy_report);
+    }
+
+    bb_init_conn(conn);
+
     log_msg("\nbb_init()\n");
     return BB_DATA;  // a macro in param.h - invokes get_fuse_context
 }
@@ -715,6 +1385,18 @@ void *bb_init(struct fuse_conn_info *conn) {
  */
 void bb_destroy(void *userdata) {
     log_msg("\nbb_destroy(userdata=0x%08x)\n", userdata);
+
+    dircache_stop();
+    attrcache_stop();
+    pgcache_stop();
+    wbcache_stop();
+    dedup_stop();
+    compress_stop();
+    journal_stop();
+    policy_stop();
+    stats_stop();
+    // get everything still sitting in the log rings onto disk
+    log_close();
 }
 
 /**
@@ -730,13 +1412,19 @@ void bb_destroy(void *userdata) {
  */
 int bb_access(const char *path, int mask) {
     int retstat = 0;
-    char fpath[PATH_MAX];
+    struct bb_path p;
+    unsigned gen;
 
     log_msg("\nbb_access(path=\"%s\", mask=0%o)\n", path, mask);
-    bb_fullpath(fpath, path);
 
-    retstat = access(fpath, mask);
-    if (retstat < 0) retstat = bb_error("bb_access access");
+    if (attrcache_access(path, mask, &retstat)) return retstat;
+
+    gen = attrcache_gen(path);
+    bb_path_get(&p, path);
+    retstat = faccessat(p.dirfd, p.name, mask, 0);
+    if (retstat < 0) retstat = bb_error("bb_access faccessat");
+    bb_path_put(&p);
+    attrcache_put_access(path, gen, mask, retstat);
     return retstat;
 }
 
@@ -754,16 +1442,40 @@ int bb_access(const char *path, int mask) {
  */
 int bb_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
     int retstat = 0;
-    char fpath[PATH_MAX];
+    struct bb_path p;
+    struct stat st;
+    int cached;
     int fd;
 
     log_msg("\nbb_create(path=\"%s\", mode=0%03o, fi=0x%08x)\n", path, mode, fi);
-    bb_fullpath(fpath, path);
+    if (bb_reserved(path)) return -EPERM;
+    bb_path_get(&p, path);
+
+    // O_TRUNC on a file that's already there: as in bb_truncate(),
+    // dirty data must land before the truncate, not on top of it,
+    // and what was cached of the old contents goes after
+    cached = (wbcache_enabled() || pgcache_enabled()) &&
+        fstatat(p.dirfd, p.name, &st, AT_SYMLINK_NOFOLLOW) == 0;
+    if (cached) {
+        retstat = wbcache_flush_stat(&st);
+        if (retstat < 0) {
+            bb_path_put(&p);
+            return retstat;
+        }
+    }
 
-    fd = creat(fpath, mode);
-    if (fd < 0) retstat = bb_error("bb_create creat");
+    fd = openat(p.dirfd, p.name, O_CREAT | O_WRONLY | O_TRUNC, mode);  // creat()
+    if (fd < 0) fd = bb_error("bb_create openat");
+    bb_path_put(&p);
+    if (fd < 0) return fd;
+    if (cached) pgcache_invalidate_stat(&st);
+    attrcache_drop_entry(path);
 
-    fi->fh = fd;
+    retstat = bb_file_new(fi, fd, 1, fuse_get_context()->uid, fuse_get_context()->gid);
+    if (retstat < 0) {
+        close(fd);
+        return retstat;
+    }
 
     log_fi(fi);
     return retstat;
@@ -788,8 +1500,18 @@ int bb_ftruncate(const char *path, off_t offset, struct fuse_file_info *fi) {
             path, offset, fi);
     log_fi(fi);
 
-    retstat = ftruncate(fi->fh, offset);
+    retstat = wbcache_flush(BB_FILE(fi)->wb);
+    if (retstat < 0) return retstat;
+
+    if (BB_FILE(fi)->dd) retstat = dedup_truncate(BB_FILE(fi)->dd, BB_FILE(fi)->fd, offset);
+    else if (BB_FILE(fi)->cz) retstat = compress_truncate(BB_FILE(fi)->cz, BB_FILE(fi)->fd, offset);
+    else if (BB_FILE(fi)->jf) retstat = journal_truncate(BB_FILE(fi)->jf, BB_FILE(fi)->fd, offset);
+    else retstat = ftruncate(BB_FILE(fi)->fd, offset);
     if (retstat < 0) retstat = bb_error("bb_ftruncate ftruncate");
+    else {
+        pgcache_invalidate(BB_FILE(fi)->pc, 0, 0);
+        attrcache_drop(path);
+    }
     return retstat;
 }
 
@@ -815,7 +1537,7 @@ int bb_fgetattr(const char *path, struct stat *statbuf, struct fuse_file_info *f
             path, statbuf, fi);
     log_fi(fi);
 
-    retstat = fstat(fi->fh, statbuf);
+    retstat = bb_file_stat(BB_FILE(fi), statbuf);
     if (retstat < 0) retstat = bb_error("bb_fgetattr fstat");
     log_stat(statbuf);
     return retstat;
@@ -856,7 +1578,9 @@ struct fuse_operations bb_oper = {
     .access = bb_access,
     .create = bb_create,
     .ftruncate = bb_ftruncate,
-    .fgetattr = bb_fgetattr
+    .fgetattr = bb_fgetattr,
+    .write_buf = bb_write_buf,
+    .read_buf = bb_read_buf
 };
 
 void bb_usage() {
@@ -864,6 +1588,48 @@ void bb_usage() {
     abort();
 }
 
+// bbfs' own -o options.  fuse_opt_parse() fills these into bb_state
+// and passes everything else on to fuse_setup().
+#define BB_OPT(t, p, v) { t, offsetof(struct bb_state, p), v }
+
+static struct fuse_opt bb_opts[] = {
+    BB_OPT("log_sync",          log_sync, 1),
+    BB_OPT("log_ring=%u",       log_ring_kb, 0),
+    BB_OPT("log_policy=%s",     log_policy, 0),
+    BB_OPT("log_level=%s",      log_level, 0),
+    BB_OPT("log_ops=%s",        log_ops, 0),
+    BB_OPT("log_sample=%u",     log_sample, 0),
+    BB_OPT("trace",             trace, 1),
+    BB_OPT("nostats",           nostats, 1),
+    BB_OPT("xform=%s",          xform_name, 0),
+    BB_OPT("key=%s",            key_hex, 0),
+    BB_OPT("keyfile=%s",        keyfile, 0),
+    BB_OPT("policy=%s",         policy_file, 0),
+    BB_OPT("workers=%u",        workers, 0),
+    BB_OPT("wb_cache=%u",       wb_cache_mb, 0),
+    BB_OPT("wb_age=%u",         wb_age_ms, 0),
+    BB_OPT("pg_cache=%u",       pg_cache_mb, 0),
+    BB_OPT("pg_readahead=%u",   pg_ra_kb, 0),
+    BB_OPT("attr_ttl=%u",       attr_ttl_ms, 0),
+    BB_OPT("dir_cache=%u",      dir_cache, 0),
+    BB_OPT("lowlevel",          lowlevel, 1),
+    BB_OPT("nosplice",          nosplice, 1),
+    BB_OPT("io_write=%u",       io_write_kb, 0),
+    BB_OPT("io_readahead=%u",   io_readahead_kb, 0),
+    BB_OPT("small_writes",      small_writes, 1),
+    BB_OPT("sync_read",         sync_read, 1),
+    BB_OPT("writeback",         writeback, 1),
+    BB_OPT("readdir_plus",      readdir_plus, 1),
+    BB_OPT("dedup",             dedup, 1),
+    BB_OPT("dedup_cache=%u",    dedup_cache_mb, 0),
+    BB_OPT("dedup_gc",          dedup_gc, 1),
+    BB_OPT("compress=%u",       compress, 0),
+    BB_OPT("journal",           journal, 1),
+    BB_OPT("journal_size=%u",   journal_mb, 0),
+    BB_OPT("journal_ms=%u",     journal_ms, 0),
+    FUSE_OPT_END
+};
+
 /* argv should be as follows:
    argv[0] = the command bbfs
    argv[argc-3] = the root directory
@@ -873,7 +1639,11 @@ void bb_usage() {
 int main(int argc, char *argv[]) {
     int fuse_stat;
     struct bb_state *bb_data;
-    user_id = atoi(argv[3]); 
+    struct fuse_args args;
+    struct fuse *fuse;
+    char *mountpoint;
+    int multithreaded;
+    uid_t uid;
 
     // bbfs doesn't do any access checking on its own (the comment
     // blocks in fuse.h mention some of the functions that need
@@ -897,34 +1667,131 @@ int main(int argc, char *argv[]) {
     if ((argc < 4) || (argv[argc-3][0] == '-') || (argv[argc-2][0] == '-'))
         bb_usage();
 
-    bb_data = malloc(sizeof(struct bb_state));
+    bb_data = calloc(1, sizeof(struct bb_state));
     if (bb_data == NULL) {
         perror("main calloc");
         abort();
     }
+    uid = atoi(argv[argc-1]);
 
     // Pull the rootdir out of the argument list and save it in
     // bb_data->rootdir
     bb_data->rootdir = realpath(argv[argc-3], NULL);
+    // ... and open it; every path is looked up relative to this fd
+    bb_data->rootfd = open(argv[argc-3], O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (bb_data->rootfd < 0) {
+        perror(argv[argc-3]);
+        return 1;
+    }
     argv[argc-3] = argv[argc-2];
     argv[argc-2] = NULL;
     argv[argc-1] = NULL;
     argc -= 2;
 
-    fprintf(stderr, "uid: %d\n", user_id);
+    fprintf(stderr, "uid: %d\n", uid);
+
+    // pick out our own mount options
+    args = (struct fuse_args) FUSE_ARGS_INIT(argc, argv);
+    if (fuse_opt_parse(&args, bb_data, bb_opts, NULL) == -1)
+        bb_usage();
+
+    // the content transform, "shift" being what bbfs always did
+    bb_data->xform = xform_lookup(bb_data->xform_name ? bb_data->xform_name : "shift");
+    if (bb_data->xform == NULL) {
+        const struct xform_ops *x;
+
+        fprintf(stderr, "unknown xform \"%s\", try one of:", bb_data->xform_name);
+        for (x = xform_ops_list; x->name; x++) fprintf(stderr, " %s", x->name);
+        fprintf(stderr, "\n");
+        return 1;
+    }
+    // a mount key is needed for a keyed xform, and may be wanted by
+    // entries in the policy file even if not
+    errno = 0;
+    if ((bb_data->xform->keyed || bb_data->key_hex || bb_data->keyfile) &&
+            policy_key(bb_data->key_hex, bb_data->keyfile, bb_data->master_key) < 0) {
+        if (bb_data->keyfile && !bb_data->key_hex && errno) perror(bb_data->keyfile);
+        fprintf(stderr, "xform %s needs -o key=<64 hex digits> or -o keyfile=<file>\n",
+                bb_data->xform->name);
+        return 1;
+    }
+    fprintf(stderr, "xform: %s\n", bb_data->xform->name);
+
+    // who else gets which xform and key
+    if (policy_load(uid, bb_data->xform,
+                bb_data->key_hex || bb_data->keyfile ? bb_data->master_key : NULL,
+                bb_data->policy_file) < 0)
+        return 1;
+
+    // Let the kernel keep attributes and dentries, found or not, as
+    // long as we do.  These go in front of the user's own options, so
+    // an explicit -o attr_timeout=... still wins.  (The low-level API
+    // has no such options; lowlevel.c puts the TTL in its replies.)
+    if (bb_data->attr_ttl_ms && !bb_data->lowlevel) {
+        char timeouts[128];
+        double t = bb_data->attr_ttl_ms / 1000.0;
+
+        snprintf(timeouts, sizeof(timeouts),
+                "-oentry_timeout=%g,attr_timeout=%g,negative_timeout=%g", t, t, t);
+        fuse_opt_insert_arg(&args, 1, timeouts);
+    }
+
+    if (bb_data->workers > LOOP_WORKERS_MAX) {
+        fprintf(stderr, "workers=%u is more than %d\n", bb_data->workers, LOOP_WORKERS_MAX);
+        return 1;
+    }
+
+    // what of it to log, until SIGUSR2 says otherwise
+    if (log_set_level(bb_data->log_level) < 0) {
+        fprintf(stderr, "log_level is one of off, error, call and detail\n");
+        return 1;
+    }
+    if (log_set_ops(bb_data->log_ops) < 0) {
+        fprintf(stderr, "log_ops is a list of operations like read:write or -getattr:-access\n");
+        return 1;
+    }
+    log_set_sample(bb_data->log_sample);
 
     // open the log file and save its handle
     bb_data->logfile = log_open();
 
+    // unless told otherwise, every call is timed by wrappers around
+    // bb_oper (instr.c) for the stats, and in trace mode recorded too;
+    // otherwise they pick what of each call goes into the text log
+    if (bb_data->trace)
+        bb_data->trace_fd = trace_open();
+    if (!bb_data->nostats)
+        bb_data->stats_fd = stats_open();
+    instr_wrap(&bb_oper, (bb_data->nostats ? 0 : INSTR_STATS) |
+            (bb_data->trace ? INSTR_TRACE : INSTR_LOG));
+
+    // the inode-based backend takes it from here
+    if (bb_data->lowlevel) return lowlevel_main(&args, bb_data);
+
     // turn over control to fuse
-    fprintf(stderr, "about to call fuse_main\n");
+    fprintf(stderr, "about to call fuse_setup\n");
 
     /* bb_oper - the struct fuse_operations we constructed
        bb_data - bb_state where bb_state holds just the logfile and rootdir
        invokes the init function
+
+       This is fuse_main() taken apart so that -o workers=N can run
+       our own fixed-size thread pool (loop.c) instead of
+       fuse_loop_mt(); -s still means a single thread.
        */
-    fuse_stat = fuse_main(argc, argv, &bb_oper, bb_data);
-    fprintf(stderr, "fuse_main returned %d\n", fuse_stat);
+    fuse = fuse_setup(args.argc, args.argv, &bb_oper, sizeof(bb_oper),
+            &mountpoint, &multithreaded, bb_data);
+    if (fuse == NULL) return 1;
+
+    if (!multithreaded)
+        fuse_stat = fuse_loop(fuse);
+    else if (bb_data->workers > 0)
+        fuse_stat = loop_run(fuse_get_session(fuse), bb_data->workers);
+    else
+        fuse_stat = fuse_loop_mt(fuse);
+
+    fuse_teardown(fuse, mountpoint);
+    fprintf(stderr, "fuse loop returned %d\n", fuse_stat);
 
-    return fuse_stat;
+    return fuse_stat ? 1 : 0;
 }
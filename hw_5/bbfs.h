@@ -0,0 +1,42 @@
+#ifndef _BBFS_H_
+#define _BBFS_H_
+// What the low-level backend (lowlevel.c) borrows from bbfs.c.  Once a
+// file is open everything goes through its struct bb_file, whichever
+// API opened it, so these work the same under both; they don't look
+// at the path, which lowlevel.c passes as NULL.
+
+#include <string.h>
+#include <sys/types.h>
+
+struct fuse_bufvec;
+struct fuse_conn_info;
+struct fuse_file_info;
+
+int bb_error(char *str);
+int bb_hidden(const char *name);
+int bb_reserved(const char *path);
+int bb_file_new(struct fuse_file_info *fi, int fd, int created, uid_t uid, gid_t gid);
+
+void *bb_init(struct fuse_conn_info *conn);
+void bb_destroy(void *userdata);
+int bb_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
+int bb_write(const char *path, const char *buf, size_t size, off_t offset,
+        struct fuse_file_info *fi);
+int bb_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset,
+        struct fuse_file_info *fi);
+int bb_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset,
+        struct fuse_file_info *fi);
+int bb_flush(const char *path, struct fuse_file_info *fi);
+int bb_release(const char *path, struct fuse_file_info *fi);
+int bb_fsync(const char *path, int datasync, struct fuse_file_info *fi);
+int bb_ftruncate(const char *path, off_t offset, struct fuse_file_info *fi);
+
+// bbfs keeps its own state about a file in "user.bbfs.*" xattrs on
+// the backing file (the transform's nonce, dedup's size); the xattr
+// calls don't let anyone see or touch them
+#define BB_XATTR_PREFIX "user.bbfs."
+static inline int bb_xattr_hidden(const char *name) {
+    return strncmp(name, BB_XATTR_PREFIX, sizeof(BB_XATTR_PREFIX) - 1) == 0;
+}
+
+#endif
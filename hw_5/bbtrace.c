@@ -0,0 +1,237 @@
+/*
+   bbtrace -- decoder for the binary traces written by bbfs -o trace
+
+   usage: bbtrace [-c | -s] [tracefile]
+
+   With no flags every record is printed as a line of text; -c prints
+   CSV instead, and -s prints a per-operation summary with latency
+   percentiles and a histogram.  The trace file defaults to
+   bbfs.trace in the current directory.
+   */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "hist.h"
+#include "trace.h"
+
+// path_id -> name, open addressing
+struct path_ent {
+    uint64_t id;
+    char *name;
+};
+
+static struct path_ent *paths;
+static size_t npaths, path_cap;
+
+static void path_insert(uint64_t id, char *name);
+
+static void path_grow(void) {
+    struct path_ent *old = paths;
+    size_t old_cap = path_cap, i;
+
+    path_cap = path_cap ? path_cap * 2 : 1024;
+    paths = calloc(path_cap, sizeof(*paths));
+    if (paths == NULL) {
+        perror("bbtrace");
+        exit(EXIT_FAILURE);
+    }
+    npaths = 0;
+    for (i = 0; i < old_cap; i++)
+        if (old[i].name) path_insert(old[i].id, old[i].name);
+    free(old);
+}
+
+static void path_insert(uint64_t id, char *name) {
+    size_t i;
+
+    if ((npaths + 1) * 2 > path_cap) path_grow();
+    for (i = id & (path_cap - 1); paths[i].name; i = (i + 1) & (path_cap - 1))
+        if (paths[i].id == id) {
+            free(name);
+            return;
+        }
+    paths[i].id = id;
+    paths[i].name = name;
+    npaths++;
+}
+
+static const char *path_lookup(uint64_t id) {
+    size_t i;
+
+    if (path_cap == 0 || id == 0) return "-";
+    for (i = id & (path_cap - 1); paths[i].name; i = (i + 1) & (path_cap - 1))
+        if (paths[i].id == id) return paths[i].name;
+    return "?";
+}
+
+// CSV fields need quoting if the path has commas or quotes in it
+static void csv_path(const char *p) {
+    if (strpbrk(p, ",\"\n") == NULL) {
+        fputs(p, stdout);
+        return;
+    }
+    putchar('"');
+    for (; *p; p++) {
+        if (*p == '"') putchar('"');
+        putchar(*p);
+    }
+    putchar('"');
+}
+
+static void print_summary(struct hist *lat, uint64_t *bytes, uint64_t *errors,
+        uint64_t spliced, uint64_t dropped, double span) {
+    unsigned op;
+    int i, lo, hi, width;
+    uint64_t peak, n;
+
+    printf("%-12s %10s %8s %12s %10s %10s %10s %10s %10s\n",
+            "op", "count", "errors", "MB", "mean_us", "p50_us",
+            "p99_us", "p99.9_us", "max_us");
+    for (op = 0; op < BB_OP_COUNT; op++) {
+        struct hist *h = &lat[op];
+        if (h->count == 0) continue;
+        printf("%-12s %10" PRIu64 " %8" PRIu64 " %12.2f %10.2f %10.2f %10.2f %10.2f %10.2f\n",
+                bb_op_name(op), h->count, errors[op], bytes[op] / 1e6,
+                h->sum / 1e3 / h->count,
+                hist_percentile(h, 50) / 1e3, hist_percentile(h, 99) / 1e3,
+                hist_percentile(h, 99.9) / 1e3, h->max / 1e3);
+    }
+    if (spliced)
+        printf("\n%" PRIu64 " spliced reads aren't in the MB: bbfs never saw their size\n",
+                spliced);
+    if (span > 0) printf("\ntrace covers %.3f s\n", span);
+    if (dropped) printf("%" PRIu64 " records were dropped by bbfs\n", dropped);
+
+    // one histogram per op, with the sub-buckets folded into powers
+    // of two to keep it readable
+    for (op = 0; op < BB_OP_COUNT; op++) {
+        uint64_t pow2[64] = { 0 };
+        struct hist *h = &lat[op];
+
+        if (h->count == 0) continue;
+        for (i = 0; i < HIST_BUCKETS; i++)
+            if (h->bucket[i])
+                pow2[63 - __builtin_clzll(hist_bucket_high(i) | 1)] += h->bucket[i];
+
+        for (lo = 0; pow2[lo] == 0; lo++) ;
+        for (hi = 63; pow2[hi] == 0; hi--) ;
+        for (peak = 0, i = lo; i <= hi; i++)
+            if (pow2[i] > peak) peak = pow2[i];
+
+        printf("\n%s latency (ns):\n", bb_op_name(op));
+        for (i = lo; i <= hi; i++) {
+            n = pow2[i];
+            width = (int) (n * 50 / peak);
+            printf("  %12" PRIu64 " .. %-12" PRIu64 " %10" PRIu64 " |%.*s\n",
+                    i ? (uint64_t) 1 << i : 0, ((uint64_t) 2 << i) - 1, n,
+                    width, "##################################################");
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    struct bb_trace_hdr hdr;
+    struct bb_trace_rec rec;
+    struct hist lat[BB_OP_COUNT];
+    uint64_t bytes[BB_OP_COUNT] = { 0 }, errors[BB_OP_COUNT] = { 0 };
+    uint64_t dropped = 0, spliced = 0, first = 0, last = 0;
+    const char *file = BB_TRACE_FILE;
+    int csv = 0, summary = 0, c;
+    unsigned op;
+    size_t padded;
+    char *name;
+    FILE *in;
+
+    while ((c = getopt(argc, argv, "cs")) != -1) {
+        switch (c) {
+        case 'c': csv = 1; break;
+        case 's': summary = 1; break;
+        default:
+            fprintf(stderr, "usage: bbtrace [-c | -s] [tracefile]\n");
+            return 1;
+        }
+    }
+    if (optind < argc) file = argv[optind];
+
+    in = fopen(file, "rb");
+    if (in == NULL) {
+        perror(file);
+        return 1;
+    }
+    if (fread(&hdr, sizeof(hdr), 1, in) != 1 ||
+            memcmp(hdr.magic, BB_TRACE_MAGIC, sizeof(BB_TRACE_MAGIC)) != 0) {
+        fprintf(stderr, "%s: not a bbfs trace\n", file);
+        return 1;
+    }
+    if (hdr.version != BB_TRACE_VERSION || hdr.rec_size != sizeof(rec)) {
+        fprintf(stderr, "%s: trace version %u, record size %u; expected %u, %zu\n",
+                file, hdr.version, hdr.rec_size, BB_TRACE_VERSION, sizeof(rec));
+        return 1;
+    }
+
+    for (op = 0; op < BB_OP_COUNT; op++) hist_init(&lat[op]);
+    if (csv) printf("time,tid,op,path,offset,size,result,latency_ns\n");
+
+    while (fread(&rec, sizeof(rec), 1, in) == 1) {
+        if (rec.op == BB_OP_PATHNAME) {
+            padded = (rec.size + sizeof(rec) - 1) / sizeof(rec) * sizeof(rec);
+            name = malloc(padded + 1);
+            if (name == NULL || fread(name, 1, padded, in) != padded) {
+                fprintf(stderr, "%s: truncated path record\n", file);
+                break;
+            }
+            name[rec.size] = '\0';
+            path_insert(rec.path_id, name);
+            continue;
+        }
+        if (rec.op == BB_OP_DROPPED) {
+            dropped += rec.size;
+            if (!csv && !summary)
+                printf("%17s [%" PRIu64 " records dropped]\n", "", rec.size);
+            continue;
+        }
+
+        if (first == 0 || rec.ts < first) first = rec.ts;
+        if (rec.ts + rec.latency > last) last = rec.ts + rec.latency;
+
+        if (summary) {
+            if (rec.op >= BB_OP_COUNT) continue;
+            hist_add(&lat[rec.op], rec.latency);
+            if (rec.result < 0) errors[rec.op]++;
+            else if (rec.flags & BB_TRACE_SPLICED) spliced++;
+            else if (rec.op == BB_OP_READ || rec.op == BB_OP_WRITE)
+                bytes[rec.op] += rec.result;
+        } else if (csv) {
+            uint64_t wall = hdr.real_ns + (rec.ts - hdr.mono_ns);
+            printf("%" PRIu64 ".%09" PRIu64 ",%u,%s,", wall / 1000000000,
+                    wall % 1000000000, rec.tid, bb_op_name(rec.op));
+            csv_path(path_lookup(rec.path_id));
+            // a spliced read's result is left empty: it isn't known
+            printf(",%" PRId64 ",%" PRIu64 ",", rec.offset, rec.size);
+            if (!(rec.flags & BB_TRACE_SPLICED)) printf("%d", rec.result);
+            printf(",%u\n", rec.latency);
+        } else {
+            printf("%17.6f %7u %-11s %s", (rec.ts - hdr.mono_ns) / 1e9,
+                    rec.tid, bb_op_name(rec.op), path_lookup(rec.path_id));
+            if (rec.offset || rec.size)
+                printf(" off=%" PRId64 " size=%" PRIu64, rec.offset, rec.size);
+            if (rec.result < 0)
+                printf(" = %s", strerror(-rec.result));
+            else if (rec.flags & BB_TRACE_SPLICED)
+                printf(" = ? (spliced)");
+            else
+                printf(" = %d", rec.result);
+            printf(" (%.1f us)\n", rec.latency / 1e3);
+        }
+    }
+    fclose(in);
+
+    if (summary)
+        print_summary(lat, bytes, errors, spliced, dropped, last > first ? (last - first) / 1e9 : 0);
+    return 0;
+}
@@ -0,0 +1,98 @@
+// Portable ChaCha20 and HChaCha20, see chacha20.h
+
+#include <stdint.h>
+#include <string.h>
+
+#include "chacha20.h"
+
+#define ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+#define QR(a, b, c, d)                          \
+    a += b; d ^= a; d = ROTL32(d, 16);          \
+    c += d; b ^= c; b = ROTL32(b, 12);          \
+    a += b; d ^= a; d = ROTL32(d, 8);           \
+    c += d; b ^= c; b = ROTL32(b, 7)
+
+static uint32_t load32(const uint8_t *p) {
+    return (uint32_t) p[0] | (uint32_t) p[1] << 8 |
+        (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static void store32(uint8_t *p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+// "expand 32-byte k"
+static const uint32_t sigma[4] = { 0x61707865, 0x3320646e, 0x79622d32, 0x6b206574 };
+
+static void chacha20_rounds(uint32_t x[16]) {
+    int i;
+
+    for (i = 0; i < 10; i++) {
+        QR(x[0], x[4], x[8],  x[12]);
+        QR(x[1], x[5], x[9],  x[13]);
+        QR(x[2], x[6], x[10], x[14]);
+        QR(x[3], x[7], x[11], x[15]);
+        QR(x[0], x[5], x[10], x[15]);
+        QR(x[1], x[6], x[11], x[12]);
+        QR(x[2], x[7], x[8],  x[13]);
+        QR(x[3], x[4], x[9],  x[14]);
+    }
+}
+
+static void chacha20_block(const uint32_t in[16], uint8_t out[CHACHA20_BLOCK_SIZE]) {
+    uint32_t x[16];
+    int i;
+
+    memcpy(x, in, sizeof(x));
+    chacha20_rounds(x);
+    for (i = 0; i < 16; i++)
+        store32(out + 4 * i, x[i] + in[i]);
+}
+
+void chacha20_xor(const uint8_t key[CHACHA20_KEY_SIZE], uint64_t nonce,
+        uint64_t pos, uint8_t *buf, size_t len) {
+    uint8_t ks[CHACHA20_BLOCK_SIZE];
+    uint32_t in[16];
+    uint64_t block = pos / CHACHA20_BLOCK_SIZE;
+    size_t skip = pos % CHACHA20_BLOCK_SIZE, n, i;
+
+    memcpy(in, sigma, sizeof(sigma));
+    for (i = 0; i < 8; i++) in[4 + i] = load32(key + 4 * i);
+    in[14] = nonce;
+    in[15] = nonce >> 32;
+
+    while (len > 0) {
+        in[12] = block;
+        in[13] = block >> 32;
+        chacha20_block(in, ks);
+
+        n = CHACHA20_BLOCK_SIZE - skip;
+        if (n > len) n = len;
+        for (i = 0; i < n; i++) buf[i] ^= ks[skip + i];
+
+        buf += n;
+        len -= n;
+        skip = 0;
+        block++;
+    }
+}
+
+void hchacha20(uint8_t subkey[CHACHA20_KEY_SIZE],
+        const uint8_t key[CHACHA20_KEY_SIZE], const uint8_t nonce[16]) {
+    uint32_t x[16];
+    int i;
+
+    memcpy(x, sigma, sizeof(sigma));
+    for (i = 0; i < 8; i++) x[4 + i] = load32(key + 4 * i);
+    for (i = 0; i < 4; i++) x[12 + i] = load32(nonce + 4 * i);
+
+    chacha20_rounds(x);
+    for (i = 0; i < 4; i++) {
+        store32(subkey + 4 * i, x[i]);
+        store32(subkey + 16 + 4 * i, x[12 + i]);
+    }
+}
@@ -0,0 +1,21 @@
+#ifndef _CHACHA20_H_
+#define _CHACHA20_H_
+// ChaCha20 (D. J. Bernstein's original variant: 64-bit block counter,
+// 64-bit nonce) and HChaCha20 for deriving per-file subkeys.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CHACHA20_KEY_SIZE   32
+#define CHACHA20_BLOCK_SIZE 64
+
+// XOR the keystream starting at byte 'pos' of the stream into buf.
+// Any pos works, so a file can be en/decrypted at arbitrary offsets.
+void chacha20_xor(const uint8_t key[CHACHA20_KEY_SIZE], uint64_t nonce,
+        uint64_t pos, uint8_t *buf, size_t len);
+
+// subkey = HChaCha20(key, nonce)
+void hchacha20(uint8_t subkey[CHACHA20_KEY_SIZE],
+        const uint8_t key[CHACHA20_KEY_SIZE], const uint8_t nonce[16]);
+
+#endif
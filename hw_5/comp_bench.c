@@ -0,0 +1,238 @@
+/*
+   comp_bench -- throughput of -o compress, at different compression ratios
+
+   usage: comp_bench [-t seconds] [-s MiB] [dir ...]
+
+   With no dirs, times the lz.c codec itself on 64 KiB blocks, the
+   size bbfs compresses, for data made to compress about 1:1 (random
+   bytes), 2:1, 4:1, 8:1 and 32:1, at levels 1, 3, 6 and 9, for -t
+   seconds (default 1) each.  It prints the ratio it got and MB/s each
+   way; every block is checked on the way back.
+
+   Given dirs, mounted with -o compress=N or not, writes a file of -s
+   MiB (default 256) of each kind of data under every one in 1 MiB
+   writes, fsyncs it, drops it from the kernel's page cache and reads
+   it back, checking it.  It prints MiB/s each way and how much disk
+   the file took (st_blocks) over its size.  Mounting the same rootdir
+   once with and once without -o compress shows what it costs and what
+   it saves; how much of that is the level shows from mounts with
+   different levels.  Dirs also work as they are, without bbfs.
+   */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lz.h"
+
+#define BLOCK   (64 << 10)
+#define IO_SIZE (1 << 20)
+#define RUN     256         // bytes of data of one kind at a time
+
+static const int ratios[] = { 1, 2, 4, 8, 32 };
+static const int levels[] = { 1, 3, 6, 9 };
+#define NRATIOS (sizeof(ratios) / sizeof(ratios[0]))
+#define NLEVELS (sizeof(levels) / sizeof(levels[0]))
+
+static double secs = 1;
+static long size_mb = 256;
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t rng = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t next(void) {
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+// Data that compresses about ratio:1.  One RUN in every ratio is
+// random, the rest repeat a line of text, so every block comes out
+// about the same and none is all zeros.  The offset goes into every
+// run so it's checked where it lands.
+static void fill(unsigned char *buf, size_t len, uint64_t off, int ratio) {
+    static const char text[] = "the quick brown fox jumps over the lazy dog, again. ";
+    size_t i, j;
+    uint64_t v;
+
+    for (i = 0; i < len; i += RUN) {
+        if ((off + i) / RUN % ratio == 0) {
+            for (j = 0; j < RUN; j += sizeof(v)) {
+                v = next();
+                memcpy(buf + i + j, &v, sizeof(v));
+            }
+        } else {
+            for (j = 0; j < RUN; j++) buf[i + j] = text[(i + j) % (sizeof(text) - 1)];
+        }
+        v = off + i;
+        memcpy(buf + i, &v, sizeof(v));
+    }
+}
+
+static int filled(const unsigned char *buf, size_t len, uint64_t off) {
+    uint64_t got;
+    size_t i;
+
+    for (i = 0; i < len; i += RUN) {
+        memcpy(&got, buf + i, sizeof(got));
+        if (got != off + i) return 0;
+    }
+    return 1;
+}
+
+// the codec alone, over nblocks blocks of data in src
+static void bench_codec(int ratio, int level, const unsigned char *src, size_t nblocks,
+        long *errors) {
+    unsigned char *dst, *out;
+    size_t *lens, i, in = 0, packed = 0;
+    double start, csecs, dsecs;
+    long passes = 0;
+    ssize_t n;
+
+    dst = malloc(nblocks * LZ_BOUND(BLOCK));
+    lens = malloc(nblocks * sizeof(*lens));
+    out = malloc(BLOCK);
+    if (dst == NULL || lens == NULL || out == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    start = now();
+    do {
+        for (i = 0; i < nblocks; i++)
+            lens[i] = lz_compress(src + i * BLOCK, BLOCK, dst + i * LZ_BOUND(BLOCK),
+                    LZ_BOUND(BLOCK), level);
+        passes++;
+        csecs = now() - start;
+    } while (csecs < secs);
+    for (i = 0; i < nblocks; i++) {
+        in += BLOCK;
+        packed += lens[i];
+    }
+
+    start = now();
+    passes = 0;
+    do {
+        for (i = 0; i < nblocks; i++) {
+            n = lz_decompress(dst + i * LZ_BOUND(BLOCK), lens[i], out, BLOCK);
+            if (passes == 0 && (n != BLOCK || memcmp(out, src + i * BLOCK, BLOCK) != 0))
+                (*errors)++;
+        }
+        passes++;
+        dsecs = now() - start;
+    } while (dsecs < secs);
+
+    printf("%6d:1 %6d %8.2f %12.0f %12.0f\n", ratio, level, (double) in / packed,
+            in * (double) passes / csecs / 1e6, in * (double) passes / dsecs / 1e6);
+    fflush(stdout);
+    free(dst);
+    free(lens);
+    free(out);
+}
+
+// write, then read back, a file of data compressing ratio:1
+static void bench_dir(const char *dir, int ratio, unsigned char *buf, long *errors) {
+    uint64_t total = (uint64_t) size_mb << 20, off;
+    double start, wrate, rrate;
+    char path[4096];
+    struct stat st;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/comp_bench.dat", dir);
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror(path);
+        (*errors)++;
+        return;
+    }
+    start = now();
+    for (off = 0; off < total; off += IO_SIZE) {
+        fill(buf, IO_SIZE, off, ratio);
+        if (write(fd, buf, IO_SIZE) != IO_SIZE) (*errors)++;
+    }
+    if (fsync(fd) < 0) (*errors)++;
+    wrate = size_mb / (now() - start);
+    close(fd);
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(path);
+        (*errors)++;
+        return;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    start = now();
+    for (off = 0; off < total; off += IO_SIZE)
+        if (read(fd, buf, IO_SIZE) != IO_SIZE || !filled(buf, IO_SIZE, off)) (*errors)++;
+    rrate = size_mb / (now() - start);
+    close(fd);
+    unlink(path);
+
+    printf("%-32s %6d:1 %11.0f %11.0f %8.2f\n", dir, ratio, wrate, rrate,
+            (double) st.st_blocks * 512 / total);
+    fflush(stdout);
+}
+
+static void usage(void) {
+    fprintf(stderr, "usage: comp_bench [-t seconds] [-s MiB] [dir ...]\n");
+}
+
+int main(int argc, char *argv[]) {
+    unsigned char *buf;
+    size_t r, l, nblocks = 256;     // 16 MiB, well out of the caches
+    long errors = 0;
+    int opt, i;
+
+    while ((opt = getopt(argc, argv, "t:s:")) != -1) {
+        switch (opt) {
+        case 't': secs = atof(optarg); break;
+        case 's': size_mb = atol(optarg); break;
+        default:
+            usage();
+            return 2;
+        }
+    }
+    if (secs <= 0 || size_mb < 1) {
+        usage();
+        return 2;
+    }
+    buf = malloc(nblocks * BLOCK > IO_SIZE ? nblocks * BLOCK : IO_SIZE);
+    if (buf == NULL) {
+        perror("malloc");
+        return 1;
+    }
+
+    if (optind == argc) {
+        printf("lz on %d KiB blocks, %zu MiB of each\n\n", BLOCK >> 10, nblocks * BLOCK >> 20);
+        printf("%8s %6s %8s %12s %12s\n", "data", "level", "ratio", "comp MB/s", "decomp MB/s");
+        for (r = 0; r < NRATIOS; r++) {
+            fill(buf, nblocks * BLOCK, 0, ratios[r]);
+            for (l = 0; l < NLEVELS; l++)
+                bench_codec(ratios[r], levels[l], buf, nblocks, &errors);
+        }
+    } else {
+        printf("%ld MiB files\n\n", size_mb);
+        printf("%-32s %8s %11s %11s %8s\n", "dir", "data", "write MiB/s", "read MiB/s", "disk");
+        for (i = optind; i < argc; i++)
+            for (r = 0; r < NRATIOS; r++)
+                bench_dir(argv[i], ratios[r], buf, &errors);
+    }
+
+    free(buf);
+    if (errors) printf("\n%ld errors\n", errors);
+    return errors ? 1 : 0;
+}
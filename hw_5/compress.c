@@ -0,0 +1,657 @@
+// Per-block compression, see compress.h.
+//
+// Open files are kept in a table by (st_dev, st_ino), under cz.lock,
+// which is never held while waiting for a file's own lock.  Reads of
+// a file share its lock; writes, truncates and the last close take it
+// alone.  The headers in a file's index are filled in as blocks are
+// first read, possibly by several readers at once, so they're read
+// and written atomically.  Headers are in host byte order.
+
+#include "params.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+#include "compress.h"
+#include "instr.h"
+#include "log.h"
+#include "lz.h"
+
+#define CZ_FILES    1024
+#define CZ_HDR      4
+#define CZ_STORED   0x80000000u     // header flag: the block is stored as is
+#define CZ_UNKNOWN  UINT32_MAX      // index entry not read yet
+// what a block has to compress to for it to save at least a page
+#define CZ_PACKED_MAX (COMPRESS_BLOCK - 4096 - CZ_HDR)
+#define CZ_PAGE(n)  (((n) + 4095) & ~(off_t) 4095)
+
+struct compress_file {
+    pthread_rwlock_t lock;
+    dev_t dev;
+    ino_t ino;
+    int refs;                   // under cz.lock
+    struct compress_file *hnext;    // under cz.lock
+    uint64_t shown;             // st_size for getattr; written under lock,
+                                // read atomically
+
+    int loaded;
+    int fd;                     // our own read-write descriptor, -1 until needed
+    int marked;                 // the xattr has been set
+    uint64_t size;
+    int size_dirty;             // ... but not to this size yet
+    uint32_t *index;            // every block's header, CZ_UNKNOWN until read
+    size_t nindex;
+
+    // the block last written to, decompressed, and room to compress it
+    int64_t wblk;               // -1: none
+    unsigned char *wbuf;        // COMPRESS_BLOCK, then the scratch space
+    int wdirty;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    struct compress_file *files[CZ_FILES];
+    int running;
+    int level;
+    int nopunch;                // the backing filesystem can't punch holes
+
+    // counters, atomic
+    uint64_t blocks, stored, zero, bytes_in, bytes_out, ns_compress;
+    uint64_t blocks_read, ns_decompress;
+} cz = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+#define CZ_ADD(counter, v) __atomic_add_fetch(&cz.counter, (v), __ATOMIC_RELAXED)
+#define CZ_GET(counter) ((unsigned long long) __atomic_load_n(&cz.counter, __ATOMIC_RELAXED))
+
+static ssize_t cz_pread_all(int fd, void *buf, size_t len, off_t off) {
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < len) {
+        n = pread(fd, (char *) buf + done, len - done, off + done);
+        if (n < 0) return -1;
+        if (n == 0) break;
+        done += n;
+    }
+    return done;
+}
+
+// The header for block i, from the index or else from the disk.  A
+// block past the end of the backing file, or punched out, reads as a
+// header of 0: all zeros.
+static int cz_header(struct compress_file *cf, int fd, size_t i, uint32_t *hdrp) {
+    uint32_t hdr = __atomic_load_n(&cf->index[i], __ATOMIC_RELAXED), len;
+    ssize_t n;
+
+    if (hdr == CZ_UNKNOWN) {
+        n = cz_pread_all(fd, &hdr, CZ_HDR, (off_t) i * COMPRESS_SLOT);
+        if (n < 0) return -errno;
+        if (n < CZ_HDR) hdr = 0;
+        len = hdr & ~CZ_STORED;
+        if ((hdr & CZ_STORED) ? len != COMPRESS_BLOCK : len > CZ_PACKED_MAX) {
+            log_err("compress: ino %lu block %zu: bad header 0x%08x\n",
+                    (unsigned long) cf->ino, i, hdr);
+            return -EIO;
+        }
+        __atomic_store_n(&cf->index[i], hdr, __ATOMIC_RELAXED);
+    }
+    *hdrp = hdr;
+    return 0;
+}
+
+// Block i, decompressed, into out; scratch holds the compressed data
+// on the way.  Blocks past the end of the file are all zeros.
+static int cz_load(struct compress_file *cf, int fd, size_t i, unsigned char *out,
+        unsigned char *scratch) {
+    uint32_t hdr, len;
+    uint64_t t0;
+    ssize_t n;
+    int ret;
+
+    if ((int64_t) i == cf->wblk) {
+        if (out != cf->wbuf) memcpy(out, cf->wbuf, COMPRESS_BLOCK);
+        return 0;
+    }
+    if (i >= cf->nindex) {
+        memset(out, 0, COMPRESS_BLOCK);
+        return 0;
+    }
+    ret = cz_header(cf, fd, i, &hdr);
+    if (ret < 0) return ret;
+    len = hdr & ~CZ_STORED;
+    if (len == 0) {
+        memset(out, 0, COMPRESS_BLOCK);
+        return 0;
+    }
+
+    t0 = instr_now();
+    n = cz_pread_all(fd, hdr & CZ_STORED ? out : scratch, len, (off_t) i * COMPRESS_SLOT + CZ_HDR);
+    if (n < 0) return -errno;
+    if ((size_t) n < len) return -EIO;
+    if (!(hdr & CZ_STORED)) {
+        n = lz_decompress(scratch, len, out, COMPRESS_BLOCK);
+        if (n < 0) {
+            log_err("compress: ino %lu block %zu doesn't decompress\n",
+                    (unsigned long) cf->ino, i);
+            return -EIO;
+        }
+        memset(out + n, 0, COMPRESS_BLOCK - n);
+    }
+    CZ_ADD(blocks_read, 1);
+    CZ_ADD(ns_decompress, instr_now() - t0);
+    return 0;
+}
+
+// the part of block i's slot past what it holds, or all of it, back
+// to the filesystem
+static void cz_punch(struct compress_file *cf, size_t i, off_t used) {
+    off_t start = CZ_PAGE(used);
+
+    if (cz.nopunch || start >= COMPRESS_SLOT) return;
+    if (fallocate(cf->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                (off_t) i * COMPRESS_SLOT + start, COMPRESS_SLOT - start) < 0 &&
+            errno == EOPNOTSUPP) {
+        log_msg("    compress: can't punch holes here, blocks will take their full size\n");
+        cz.nopunch = 1;
+    }
+}
+
+// Compress data as block i and write it through our own fd; scratch
+// has room for CZ_HDR + COMPRESS_BLOCK bytes
+static int cz_store(struct compress_file *cf, size_t i, const unsigned char *data,
+        unsigned char *scratch) {
+    struct iovec iov[2];
+    uint32_t hdr, zero = 0;
+    uint64_t t0 = instr_now();
+    size_t len, done, want;
+    ssize_t n;
+
+    if (data[0] == 0 && memcmp(data, data + 1, COMPRESS_BLOCK - 1) == 0) {
+        // a hole reads as a 0 header, but not every filesystem has them
+        if (pwrite(cf->fd, &zero, CZ_HDR, (off_t) i * COMPRESS_SLOT) < 0) return -errno;
+        cz_punch(cf, i, 0);
+        __atomic_store_n(&cf->index[i], 0, __ATOMIC_RELAXED);
+        CZ_ADD(zero, 1);
+        CZ_ADD(bytes_in, COMPRESS_BLOCK);
+        return 0;
+    }
+
+    len = lz_compress(data, COMPRESS_BLOCK, scratch, CZ_PACKED_MAX, cz.level);
+    if (len == 0) {
+        // not worth it
+        hdr = COMPRESS_BLOCK | CZ_STORED;
+        iov[1].iov_base = (void *) data;
+        len = COMPRESS_BLOCK;
+        CZ_ADD(stored, 1);
+    } else {
+        hdr = len;
+        iov[1].iov_base = scratch;
+    }
+    iov[0].iov_base = &hdr;
+    iov[0].iov_len = CZ_HDR;
+    iov[1].iov_len = len;
+
+    want = CZ_HDR + len;
+    n = pwritev(cf->fd, iov, 2, (off_t) i * COMPRESS_SLOT);
+    if (n < 0) return -errno;
+    for (done = n; done < want; done += n) {
+        // short writes are rare enough to just finish off byte-wise
+        n = pwrite(cf->fd, done < CZ_HDR ? (char *) &hdr + done : (char *) iov[1].iov_base + done - CZ_HDR,
+                done < CZ_HDR ? CZ_HDR - done : want - done, (off_t) i * COMPRESS_SLOT + done);
+        if (n < 0) return -errno;
+    }
+    cz_punch(cf, i, want);
+    __atomic_store_n(&cf->index[i], hdr, __ATOMIC_RELAXED);
+
+    CZ_ADD(blocks, 1);
+    CZ_ADD(bytes_in, COMPRESS_BLOCK);
+    CZ_ADD(bytes_out, want);
+    CZ_ADD(ns_compress, instr_now() - t0);
+    return 0;
+}
+
+// Everything below takes the file's lock held for writing.
+
+static void cz_show(struct compress_file *cf) {
+    __atomic_store_n(&cf->shown, cf->size, __ATOMIC_RELAXED);
+}
+
+static int cz_flush(struct compress_file *cf) {
+    int ret;
+
+    if (!cf->wdirty) return 0;
+    ret = cz_store(cf, cf->wblk, cf->wbuf, cf->wbuf + COMPRESS_BLOCK);
+    if (ret == 0) cf->wdirty = 0;
+    return ret;
+}
+
+// make the index cover n blocks; new ones are holes
+static int cz_grow(struct compress_file *cf, size_t n) {
+    uint32_t *index;
+
+    if (n <= cf->nindex) return 0;
+    index = realloc(cf->index, n * sizeof(*index));
+    if (index == NULL) return -ENOMEM;
+    memset(index + cf->nindex, 0, (n - cf->nindex) * sizeof(*index));
+    cf->index = index;
+    cf->nindex = n;
+    return 0;
+}
+
+static int cz_save_size(struct compress_file *cf) {
+    if (cf->marked && !cf->size_dirty) return 0;
+    if (fsetxattr(cf->fd, COMPRESS_XATTR, &cf->size, sizeof(cf->size), 0) < 0) return -errno;
+    cf->marked = 1;
+    cf->size_dirty = 0;
+    return 0;
+}
+
+// what we write through: fd may be write-only or O_APPEND
+static int cz_writable(struct compress_file *cf, int fd) {
+    char proc[64];
+
+    if (cf->fd < 0) {
+        snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+        cf->fd = open(proc, O_RDWR | O_CLOEXEC);
+        if (cf->fd < 0) return -errno;
+    }
+    // the xattr goes on before any block does, so a file never holds
+    // blocks without saying so
+    if (!cf->marked) return cz_save_size(cf);
+    return 0;
+}
+
+// Last close: get everything out to the backing file
+static void cz_finish(struct compress_file *cf) {
+    struct stat st;
+    int ret;
+
+    if (!cf->loaded || cf->fd < 0) return;
+    if (fstat(cf->fd, &st) < 0 || st.st_nlink == 0) return;
+    ret = cz_flush(cf);
+    if (ret == 0) ret = cz_save_size(cf);
+    if (ret < 0)
+        log_err("compress: ino %lu: %s\n", (unsigned long) cf->ino, strerror(-ret));
+}
+
+static int cz_load_state(struct compress_file *cf, int fd, const struct stat *st) {
+    uint64_t size = 0;
+
+    // an empty file may still have the xattr of what it was before
+    // O_TRUNC; it's put right at the first write
+    if (st->st_size > 0 &&
+            fgetxattr(fd, COMPRESS_XATTR, &size, sizeof(size)) != sizeof(size))
+        return -EIO;
+    cf->size = size;
+    cf->nindex = (size + COMPRESS_BLOCK - 1) / COMPRESS_BLOCK;
+    if (cf->nindex) {
+        cf->index = malloc(cf->nindex * sizeof(*cf->index));
+        if (cf->index == NULL) return -ENOMEM;
+        memset(cf->index, 0xff, cf->nindex * sizeof(*cf->index));
+    }
+    cf->marked = st->st_size > 0;
+    return 0;
+}
+
+static unsigned cz_file_hash(dev_t dev, ino_t ino) {
+    return (unsigned) ((ino * 0x9e3779b97f4a7c15ULL ^ dev) >> 22) % CZ_FILES;
+}
+
+int compress_open(int fd, struct compress_file **cfp) {
+    struct compress_file *cf, *ncf;
+    struct stat st;
+    unsigned h;
+    int ret = 0;
+
+    *cfp = NULL;
+    if (!cz.running) return 0;
+    if (fstat(fd, &st) < 0) return -errno;
+    if (!S_ISREG(st.st_mode)) return 0;
+
+    ncf = calloc(1, sizeof(*ncf));
+    if (ncf == NULL) return -ENOMEM;
+    ncf->wbuf = malloc(COMPRESS_BLOCK + CZ_HDR + COMPRESS_BLOCK);
+    if (ncf->wbuf == NULL) {
+        free(ncf);
+        return -ENOMEM;
+    }
+    pthread_rwlock_init(&ncf->lock, NULL);
+    ncf->dev = st.st_dev;
+    ncf->ino = st.st_ino;
+    ncf->refs = 1;
+    ncf->fd = -1;
+    ncf->wblk = -1;
+
+    // a plain file that was here before stays one, unless it's open
+    // already as a compressed one
+    h = cz_file_hash(st.st_dev, st.st_ino);
+    pthread_mutex_lock(&cz.lock);
+    for (cf = cz.files[h]; cf; cf = cf->hnext)
+        if (cf->dev == st.st_dev && cf->ino == st.st_ino) {
+            cf->refs++;
+            break;
+        }
+    if (cf == NULL && (st.st_size == 0 || fgetxattr(fd, COMPRESS_XATTR, NULL, 0) >= 0)) {
+        ncf->hnext = cz.files[h];
+        cz.files[h] = cf = ncf;
+        ncf = NULL;
+    }
+    pthread_mutex_unlock(&cz.lock);
+
+    if (ncf) {
+        pthread_rwlock_destroy(&ncf->lock);
+        free(ncf->wbuf);
+        free(ncf);
+    }
+    if (cf == NULL) return 0;
+
+    pthread_rwlock_wrlock(&cf->lock);
+    if (!cf->loaded) {
+        ret = cz_load_state(cf, fd, &st);
+        if (ret == 0) {
+            cf->loaded = 1;
+            cz_show(cf);
+        }
+    }
+    pthread_rwlock_unlock(&cf->lock);
+
+    if (ret < 0) {
+        compress_close(cf);
+        return ret;
+    }
+    *cfp = cf;
+    return 0;
+}
+
+void compress_close(struct compress_file *cf) {
+    struct compress_file **pp;
+
+    if (cf == NULL) return;
+
+    // the last one out writes the file out, holding a reference of its
+    // own so that an open() meanwhile finds it written
+    pthread_mutex_lock(&cz.lock);
+    if (--cf->refs > 0) {
+        pthread_mutex_unlock(&cz.lock);
+        return;
+    }
+    cf->refs = 1;
+    pthread_mutex_unlock(&cz.lock);
+
+    pthread_rwlock_wrlock(&cf->lock);
+    cz_finish(cf);
+    pthread_rwlock_unlock(&cf->lock);
+
+    pthread_mutex_lock(&cz.lock);
+    if (--cf->refs > 0) {
+        pthread_mutex_unlock(&cz.lock);
+        return;
+    }
+    for (pp = &cz.files[cz_file_hash(cf->dev, cf->ino)]; *pp != cf; pp = &(*pp)->hnext)
+        ;
+    *pp = cf->hnext;
+    pthread_mutex_unlock(&cz.lock);
+
+    if (cf->fd >= 0) close(cf->fd);
+    free(cf->index);
+    free(cf->wbuf);
+    pthread_rwlock_destroy(&cf->lock);
+    free(cf);
+}
+
+ssize_t compress_read(struct compress_file *cf, int fd, void *buf, size_t len, off_t off) {
+    unsigned char *scratch, *block, *out = buf;
+    size_t done = 0, i, boff, n;
+    int ret = 0;
+
+    // room for the compressed data, and for a block only partly wanted
+    scratch = malloc(2 * COMPRESS_BLOCK);
+    if (scratch == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    block = scratch + COMPRESS_BLOCK;
+
+    pthread_rwlock_rdlock(&cf->lock);
+    if ((uint64_t) off >= cf->size) len = 0;
+    else if (len > cf->size - off) len = cf->size - off;
+    while (done < len) {
+        i = (off + done) / COMPRESS_BLOCK;
+        boff = (off + done) % COMPRESS_BLOCK;
+        n = COMPRESS_BLOCK - boff;
+        if (n > len - done) n = len - done;
+        if (n == COMPRESS_BLOCK) {
+            ret = cz_load(cf, fd, i, out + done, scratch);
+        } else {
+            ret = cz_load(cf, fd, i, block, scratch);
+            if (ret == 0) memcpy(out + done, block + boff, n);
+        }
+        if (ret < 0) break;
+        done += n;
+    }
+    pthread_rwlock_unlock(&cf->lock);
+
+    free(scratch);
+    if (ret < 0 && done == 0) {
+        errno = -ret;
+        return -1;
+    }
+    return done;
+}
+
+ssize_t compress_write(struct compress_file *cf, int fd, const void *buf, size_t len, off_t off) {
+    const unsigned char *in = buf;
+    size_t done = 0, i, boff, n;
+    int ret;
+
+    pthread_rwlock_wrlock(&cf->lock);
+    ret = cz_writable(cf, fd);
+    if (off < 0) off = cf->size;
+    if (ret == 0 && len) ret = cz_grow(cf, (off + len + COMPRESS_BLOCK - 1) / COMPRESS_BLOCK);
+
+    while (ret == 0 && done < len) {
+        i = (off + done) / COMPRESS_BLOCK;
+        boff = (off + done) % COMPRESS_BLOCK;
+        n = COMPRESS_BLOCK - boff;
+        if (n > len - done) n = len - done;
+
+        if ((int64_t) i != cf->wblk) {
+            ret = cz_flush(cf);
+            if (ret < 0) break;
+            // a whole block needn't go through the buffer
+            if (n == COMPRESS_BLOCK) {
+                ret = cz_store(cf, i, in + done, cf->wbuf + COMPRESS_BLOCK);
+                if (ret == 0) done += n;
+                continue;
+            }
+            // blocks past the old end read as zeros
+            ret = cz_load(cf, cf->fd, i, cf->wbuf, cf->wbuf + COMPRESS_BLOCK);
+            if (ret < 0) {
+                cf->wblk = -1;
+                break;
+            }
+            cf->wblk = i;
+        }
+        memcpy(cf->wbuf + boff, in + done, n);
+        cf->wdirty = 1;
+        done += n;
+    }
+
+    if (done > 0 && (uint64_t) off + done > cf->size) {
+        cf->size = off + done;
+        cf->size_dirty = 1;
+        cz_show(cf);
+    }
+    pthread_rwlock_unlock(&cf->lock);
+
+    if (done == 0 && ret < 0) {
+        errno = -ret;
+        return -1;
+    }
+    return done;
+}
+
+int compress_truncate(struct compress_file *cf, int fd, off_t size) {
+    size_t nb = (size + COMPRESS_BLOCK - 1) / COMPRESS_BLOCK, cut = size % COMPRESS_BLOCK;
+    int ret;
+
+    pthread_rwlock_wrlock(&cf->lock);
+    ret = cz_writable(cf, fd);
+    if (ret == 0) ret = cz_flush(cf);
+
+    if (ret == 0 && (uint64_t) size < cf->size) {
+        // what's left of the last block has to read as zeros past the
+        // end, should the file grow again
+        if (cut) {
+            ret = cz_load(cf, cf->fd, nb - 1, cf->wbuf, cf->wbuf + COMPRESS_BLOCK);
+            if (ret == 0) {
+                memset(cf->wbuf + cut, 0, COMPRESS_BLOCK - cut);
+                cf->wblk = nb - 1;
+                cf->wdirty = 1;
+                ret = cz_flush(cf);
+            } else {
+                cf->wblk = -1;
+            }
+        }
+        if (cf->wblk >= (int64_t) nb) cf->wblk = -1;
+        if (ret == 0 && ftruncate(cf->fd, (off_t) nb * COMPRESS_SLOT) < 0) ret = -errno;
+        if (ret == 0) cf->nindex = nb;
+    } else if (ret == 0) {
+        ret = cz_grow(cf, nb);
+    }
+
+    if (ret == 0) {
+        cf->size = size;
+        cf->size_dirty = 1;
+        ret = cz_save_size(cf);
+    }
+    cz_show(cf);
+    pthread_rwlock_unlock(&cf->lock);
+
+    if (ret < 0) {
+        errno = -ret;
+        return -1;
+    }
+    return 0;
+}
+
+int compress_truncate_path(const char *path, off_t size) {
+    struct compress_file *cf;
+    int fd, ret, err;
+
+    fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    ret = compress_open(fd, &cf);
+    if (ret < 0) {
+        close(fd);
+        errno = -ret;
+        return -1;
+    }
+    if (cf) {
+        ret = compress_truncate(cf, fd, size);
+        err = errno;
+        compress_close(cf);
+    } else {
+        ret = ftruncate(fd, size);
+        err = errno;
+    }
+    close(fd);
+    errno = err;
+    return ret;
+}
+
+int compress_sync(struct compress_file *cf) {
+    int ret = 0;
+
+    pthread_rwlock_wrlock(&cf->lock);
+    if (cf->fd >= 0) {
+        ret = cz_flush(cf);
+        if (ret == 0) ret = cz_save_size(cf);
+    }
+    pthread_rwlock_unlock(&cf->lock);
+    return ret;
+}
+
+void compress_stat(int dirfd, const char *name, struct stat *st) {
+    struct compress_file *cf;
+    char proc[PATH_MAX];
+    uint64_t size = 0;
+
+    if (!cz.running || !S_ISREG(st->st_mode)) return;
+
+    // an open file knows best, even while its last block is in memory
+    pthread_mutex_lock(&cz.lock);
+    for (cf = cz.files[cz_file_hash(st->st_dev, st->st_ino)]; cf; cf = cf->hnext)
+        if (cf->dev == st->st_dev && cf->ino == st->st_ino) {
+            size = __atomic_load_n(&cf->shown, __ATOMIC_RELAXED);
+            break;
+        }
+    pthread_mutex_unlock(&cz.lock);
+    if (cf) {
+        st->st_size = size;
+        return;
+    }
+
+    // an empty backing file is an empty file, whatever the xattr says
+    if (st->st_size == 0) return;
+    if (name[0]) snprintf(proc, sizeof(proc), "/proc/self/fd/%d/%s", dirfd, name);
+    else snprintf(proc, sizeof(proc), "/proc/self/fd/%d", dirfd);
+    if (getxattr(proc, COMPRESS_XATTR, &size, sizeof(size)) == sizeof(size))
+        st->st_size = size;
+}
+
+int compress_enabled(void) {
+    return cz.running;
+}
+
+int compress_start(int level) {
+    if (level < 1 || level > LZ_LEVEL_MAX) return -EINVAL;
+    cz.level = level;
+    cz.running = 1;
+    return 0;
+}
+
+void compress_stop(void) {
+    struct compress_file *cf;
+    size_t i;
+
+    if (!cz.running) return;
+    cz.running = 0;
+
+    // everything's been released by now, but just in case
+    for (i = 0; i < CZ_FILES; i++)
+        while ((cf = cz.files[i]) != NULL) {
+            cz.files[i] = cf->hnext;
+            if (cf->fd >= 0) close(cf->fd);
+            free(cf->index);
+            free(cf->wbuf);
+            free(cf);
+        }
+
+    log_msg("    compress: %llu blocks written, %llu bytes in, %llu out\n",
+            CZ_GET(blocks) + CZ_GET(zero), CZ_GET(bytes_in), CZ_GET(bytes_out));
+}
+
+void compress_report(FILE *out) {
+    unsigned long long in = CZ_GET(bytes_in), stored = CZ_GET(bytes_out);
+    unsigned long long nread = CZ_GET(blocks_read) * COMPRESS_BLOCK;
+    double csecs = CZ_GET(ns_compress) / 1e9, dsecs = CZ_GET(ns_decompress) / 1e9;
+
+    fprintf(out, "compress: level %d, %llu blocks written: %llu stored as is, %llu all zeros\n",
+            cz.level, CZ_GET(blocks) + CZ_GET(zero), CZ_GET(stored), CZ_GET(zero));
+    fprintf(out, "compress: %llu bytes in, %llu bytes stored: ratio %.2f\n",
+            in, stored, stored ? (double) in / stored : 0.0);
+    fprintf(out, "compress: compressing %.3f s (%.2f MB/s), decompressing %.3f s for %llu blocks (%.2f MB/s)\n",
+            csecs, csecs > 0 ? in / 1e6 / csecs : 0.0,
+            dsecs, CZ_GET(blocks_read), dsecs > 0 ? nread / 1e6 / dsecs : 0.0);
+}
@@ -0,0 +1,68 @@
+#ifndef _COMPRESS_H_
+#define _COMPRESS_H_
+// Per-block compression of file data, turned on with -o compress=LEVEL.
+//
+// A file is stored as independently compressed COMPRESS_BLOCK-sized
+// blocks (lz.c).  Block i lives at a fixed place in the backing file,
+// i * COMPRESS_SLOT: a 4-byte header giving its compressed length,
+// then the compressed data; the rest of the slot is punched out of the
+// backing file, so it takes no space on disk.  Since a block's place
+// is fixed, the index from a file offset to the data for it is just
+// that multiplication plus the lengths, which are read as blocks are
+// first touched and then kept.  A read decompresses only the blocks
+// it covers, and a write rewrites only the blocks it touches.  A
+// block that doesn't compress by at least a page is stored as is, and
+// one that's all zeros not at all.  The file's real size is kept in
+// the COMPRESS_XATTR xattr, so getattr doesn't have to open it.
+//
+// There is one struct compress_file per backing inode, shared by
+// every open handle on it like the write-back cache's.  It keeps the
+// block last written to decompressed, so a run of small writes into
+// a block compresses it once, when the writes move on.  Only files
+// that are empty when opened become compressed; files that were there
+// before are left as they are.  Decompressed blocks are not cached
+// here: -o pg_cache does that, above this.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#define COMPRESS_XATTR  "user.bbfs.compress"
+
+#define COMPRESS_BLOCK  (64 << 10)
+#define COMPRESS_SLOT   (COMPRESS_BLOCK + 4096)
+
+struct stat;
+struct compress_file;
+
+// called from bb_init() and bb_destroy(); level is 1 to LZ_LEVEL_MAX
+int compress_start(int level);
+void compress_stop(void);
+int compress_enabled(void);
+
+// The state for the regular file open on fd, one reference per open
+// handle.  *cfp is left NULL if compression is off or the file isn't
+// one it handles; returns 0 or -errno.
+int compress_open(int fd, struct compress_file **cfp);
+void compress_close(struct compress_file *cf);
+
+// fd is the caller's descriptor for the file; these return what
+// pread()/pwrite()/ftruncate() would.  An offset of -1 appends.
+ssize_t compress_read(struct compress_file *cf, int fd, void *buf, size_t len, off_t off);
+ssize_t compress_write(struct compress_file *cf, int fd, const void *buf, size_t len, off_t off);
+int compress_truncate(struct compress_file *cf, int fd, off_t size);
+// truncate() for a file that may not be open; path may be a /proc link
+int compress_truncate_path(const char *path, off_t size);
+// get the block being written and the size into the backing file;
+// returns 0 or -errno
+int compress_sync(struct compress_file *cf);
+
+// make st_size the file's real size; name is relative to dirfd, or ""
+// for dirfd itself
+void compress_stat(int dirfd, const char *name, struct stat *st);
+
+// the "compress:" lines in the stats
+void compress_report(FILE *out);
+
+#endif
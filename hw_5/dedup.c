@@ -0,0 +1,1435 @@
+// Deduplicating chunk store, see dedup.h.
+//
+// Three tables, each under its own lock: the open files by (st_dev,
+// st_ino), the index of every chunk in the store, and an LRU cache of
+// chunk contents.  A file's rwlock may be held while taking the index
+// or cache lock, never the other way round, and the file table's lock
+// is never held while waiting for a file.  Reads of a deduplicated
+// file share its lock; everything that changes it takes it alone.
+//
+// A manifest is a struct dd_header followed by one struct dd_disk_ent
+// per chunk, in host byte order.  A chunk is a file named by the hex
+// of its hash, in one of 256 subdirectories of the store.  New chunks
+// are written under a temporary name and renamed into place, so a
+// chunk that's there at all is whole.
+//
+// Turning a file into a manifest or back overwrites it in place, which
+// a crash could leave half done.  So first the manifest goes into a
+// pending record in the store, "pend.<dev>.<ino>", and that and every
+// chunk it names are synced; then the backing file is rewritten and
+// synced, and the record removed.  The xattr is set before a pack
+// starts on the file and removed after an unpack is done with it, so
+// a record is only still good while the file's xattr matches it.  The
+// next open of a file with a good record finishes what was started
+// (dd_replay()); any other record is stale, and goes.
+
+#include "params.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+#include "dedup.h"
+#include "instr.h"
+#include "log.h"
+#include "xxhash.h"
+
+#define DD_HASH_SIZE 16
+#define DD_FILES     1024
+// the top 13 bits of the rolling hash are all 0 once every 8 KiB
+#define DD_MASK      0xfff8000000000000ULL
+
+struct dd_header {
+    char magic[8];
+    uint64_t size;              // of the file's data
+    uint64_t count;             // chunks
+};
+static const char dd_magic[8] = "BBFSDD1";
+
+// a pending record: this, then the manifest
+struct dd_pending {
+    char magic[8];
+    uint32_t op;                // DD_PACK or DD_UNPACK
+    uint32_t pad;
+};
+static const char dd_pend_magic[8] = "BBFSDP1";
+
+enum {
+    DD_PACK,                    // the backing file is becoming the manifest
+    DD_UNPACK,                  // ... or the data the manifest names
+};
+
+struct dd_disk_ent {
+    unsigned char hash[DD_HASH_SIZE];
+    uint32_t len;
+    uint32_t pad;
+};
+
+struct dd_ent {
+    uint64_t off;
+    uint32_t len;
+    unsigned char hash[DD_HASH_SIZE];
+};
+
+enum {
+    DD_RAW,                     // the backing file holds the data itself
+    DD_STREAM,                  // written from 0 on; chunked as it comes,
+                                // and written to the backing file as usual
+    DD_MANIFEST,                // the backing file is a manifest
+};
+
+struct dedup_file {
+    pthread_rwlock_t lock;
+    dev_t dev;
+    ino_t ino;
+    int refs;                   // under dd.lock
+    struct dedup_file *hnext;   // under dd.lock
+    uint64_t shown;             // st_size for getattr, UINT64_MAX to leave
+                                // it alone; written under lock, read atomically
+
+    int loaded;
+    int state;
+    int fd;                     // our own read-write descriptor, -1 until needed
+    int dirty;                  // DD_RAW: written since it was opened
+    uint64_t size;
+    struct dd_ent *ents;        // DD_STREAM, DD_MANIFEST: the chunks so far
+    size_t n, cap;
+    unsigned char *tail;        // DD_STREAM: what's past the last chunk,
+                                // for cutting the next one
+    size_t tail_len;
+};
+
+struct dd_chunk {
+    struct dd_chunk *next;
+    unsigned char hash[DD_HASH_SIZE];
+    int mark;                   // dedup_gc: some manifest uses it
+};
+
+struct dd_cached {
+    struct dd_cached *hnext;
+    struct dd_cached *prev, *next;  // LRU list, most recent first
+    unsigned char hash[DD_HASH_SIZE];
+    size_t len;
+    unsigned char data[];
+};
+
+static struct {
+    pthread_mutex_t lock;       // open files
+    struct dedup_file *files[DD_FILES];
+
+    pthread_mutex_t ilock;      // chunk index
+    struct dd_chunk **index;
+    size_t nindex;              // buckets, a power of two
+    size_t count;
+
+    pthread_mutex_t clock;      // chunk cache
+    struct dd_cached **cache;
+    size_t ncache;              // buckets, a power of two
+    struct dd_cached *head, *tail;
+    size_t used, cap;
+
+    int storefd;
+    int running;
+    uint64_t gear[256];
+    unsigned tmpseq;
+    // chunks stored, and how many of them were when the store was last
+    // synced; atomic
+    uint64_t put_seq, synced_seq;
+
+    // counters, atomic
+    uint64_t bytes_in, chunks_in, bytes_new, chunks_new;
+    uint64_t ns_write, bytes_read, ns_read;
+    uint64_t hits, misses, packed, unpacked;
+    uint64_t gc_files, gc_bytes, gc_freed, gc_missing;
+    int gc_ran;
+} dd = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .ilock = PTHREAD_MUTEX_INITIALIZER,
+    .clock = PTHREAD_MUTEX_INITIALIZER,
+    .storefd = -1,
+};
+
+#define DD_ADD(counter, v) __atomic_add_fetch(&dd.counter, (v), __ATOMIC_RELAXED)
+#define DD_GET(counter) ((unsigned long long) __atomic_load_n(&dd.counter, __ATOMIC_RELAXED))
+
+static void dd_hash(const void *data, size_t len, unsigned char hash[DD_HASH_SIZE]) {
+    uint64_t h[2];
+
+    h[0] = xxh64(data, len, 0);
+    h[1] = xxh64(data, len, 0x9e3779b97f4a7c15ULL);
+    memcpy(hash, h, DD_HASH_SIZE);
+}
+
+static uint64_t dd_hash_word(const unsigned char hash[DD_HASH_SIZE]) {
+    uint64_t v;
+
+    memcpy(&v, hash, sizeof(v));
+    return v;
+}
+
+// "ab/ab..." -- 2 + 1 + 32 hex digits
+static void dd_name(char name[40], const unsigned char hash[DD_HASH_SIZE]) {
+    int i;
+
+    snprintf(name, 4, "%02x/", hash[0]);
+    for (i = 0; i < DD_HASH_SIZE; i++)
+        snprintf(name + 3 + 2 * i, 3, "%02x", hash[i]);
+}
+
+static ssize_t dd_pread_all(int fd, void *buf, size_t len, off_t off) {
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < len) {
+        n = pread(fd, (char *) buf + done, len - done, off + done);
+        if (n < 0) return -1;
+        if (n == 0) break;
+        done += n;
+    }
+    return done;
+}
+
+static int dd_pwrite_all(int fd, const void *buf, size_t len, off_t off) {
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < len) {
+        n = pwrite(fd, (const char *) buf + done, len - done, off + done);
+        if (n < 0) return -errno;
+        done += n;
+    }
+    return 0;
+}
+
+// Where the next chunk of the n bytes at p ends.  The gear hash only
+// remembers the last 64 bytes it's seen, so a boundary depends on the
+// data just before it and not on where the chunk started.
+static size_t dd_cut(const unsigned char *p, size_t n) {
+    uint64_t fp = 0;
+    size_t i;
+
+    if (n <= DEDUP_CHUNK_MIN) return n;
+    if (n > DEDUP_CHUNK_MAX) n = DEDUP_CHUNK_MAX;
+    for (i = DEDUP_CHUNK_MIN; i < n; i++) {
+        fp = (fp << 1) + dd.gear[p[i]];
+        if ((fp & DD_MASK) == 0) return i + 1;
+    }
+    return n;
+}
+
+// The index.  The rest take dd.ilock held.
+
+static struct dd_chunk **dd_islot(const unsigned char hash[DD_HASH_SIZE]) {
+    struct dd_chunk **pp;
+
+    for (pp = &dd.index[dd_hash_word(hash) & (dd.nindex - 1)]; *pp; pp = &(*pp)->next)
+        if (memcmp((*pp)->hash, hash, DD_HASH_SIZE) == 0) break;
+    return pp;
+}
+
+static int dd_iadd(const unsigned char hash[DD_HASH_SIZE]) {
+    struct dd_chunk **nb, *c, *next;
+    size_t i, nn, h;
+
+    if (dd.count >= 2 * dd.nindex) {
+        nn = 2 * dd.nindex;
+        nb = calloc(nn, sizeof(*nb));
+        if (nb != NULL) {
+            for (i = 0; i < dd.nindex; i++)
+                for (c = dd.index[i]; c; c = next) {
+                    next = c->next;
+                    h = dd_hash_word(c->hash) & (nn - 1);
+                    c->next = nb[h];
+                    nb[h] = c;
+                }
+            free(dd.index);
+            dd.index = nb;
+            dd.nindex = nn;
+        }
+        // else just let the chains grow
+    }
+
+    c = calloc(1, sizeof(*c));
+    if (c == NULL) return -ENOMEM;
+    memcpy(c->hash, hash, DD_HASH_SIZE);
+    h = dd_hash_word(hash) & (dd.nindex - 1);
+    c->next = dd.index[h];
+    dd.index[h] = c;
+    dd.count++;
+    return 0;
+}
+
+// Store a chunk unless the store has it already
+static int dd_put(const unsigned char hash[DD_HASH_SIZE], const void *data, size_t len) {
+    char name[40], tmp[32];
+    int fd, found, ret;
+
+    DD_ADD(chunks_in, 1);
+    DD_ADD(bytes_in, len);
+
+    pthread_mutex_lock(&dd.ilock);
+    found = *dd_islot(hash) != NULL;
+    pthread_mutex_unlock(&dd.ilock);
+    if (found) return 0;
+
+    // two writers of the same new chunk each write their own copy, and
+    // the second rename() just replaces the first with the same thing
+    dd_name(name, hash);
+    snprintf(tmp, sizeof(tmp), "tmp.%d.%u", (int) getpid(),
+            __atomic_add_fetch(&dd.tmpseq, 1, __ATOMIC_RELAXED));
+    fd = openat(dd.storefd, tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) return -errno;
+    ret = dd_pwrite_all(fd, data, len, 0);
+    if (close(fd) < 0 && ret == 0) ret = -errno;
+    if (ret == 0 && renameat(dd.storefd, tmp, dd.storefd, name) < 0) ret = -errno;
+    if (ret < 0) {
+        unlinkat(dd.storefd, tmp, 0);
+        return ret;
+    }
+    // not synced yet; dd_pend() sees to that before anything uses it
+    __atomic_add_fetch(&dd.put_seq, 1, __ATOMIC_RELEASE);
+
+    // if the index can't take it, it's written again next time
+    pthread_mutex_lock(&dd.ilock);
+    if (*dd_islot(hash) == NULL && dd_iadd(hash) == 0) {
+        DD_ADD(chunks_new, 1);
+        DD_ADD(bytes_new, len);
+    }
+    pthread_mutex_unlock(&dd.ilock);
+    return 0;
+}
+
+// The chunk cache.  These two take dd.clock held.
+
+static struct dd_cached **dd_cslot(const unsigned char hash[DD_HASH_SIZE]) {
+    struct dd_cached **pp;
+
+    for (pp = &dd.cache[dd_hash_word(hash) & (dd.ncache - 1)]; *pp; pp = &(*pp)->hnext)
+        if (memcmp((*pp)->hash, hash, DD_HASH_SIZE) == 0) break;
+    return pp;
+}
+
+static void dd_lru_unlink(struct dd_cached *c) {
+    if (c->prev) c->prev->next = c->next;
+    else dd.head = c->next;
+    if (c->next) c->next->prev = c->prev;
+    else dd.tail = c->prev;
+}
+
+static void dd_lru_push(struct dd_cached *c) {
+    c->prev = NULL;
+    c->next = dd.head;
+    if (dd.head) dd.head->prev = c;
+    else dd.tail = c;
+    dd.head = c;
+}
+
+// Copy n bytes from offset coff of a chunk that's len bytes long
+static int dd_chunk_read(const unsigned char hash[DD_HASH_SIZE], size_t len, size_t coff,
+        void *dst, size_t n) {
+    struct dd_cached *c, **pp;
+    char name[40];
+    ssize_t got;
+    int fd, ret;
+
+    pthread_mutex_lock(&dd.clock);
+    c = *dd_cslot(hash);
+    if (c && c->len == len) {
+        memcpy(dst, c->data + coff, n);
+        dd_lru_unlink(c);
+        dd_lru_push(c);
+        pthread_mutex_unlock(&dd.clock);
+        DD_ADD(hits, 1);
+        return 0;
+    }
+    pthread_mutex_unlock(&dd.clock);
+    DD_ADD(misses, 1);
+
+    c = malloc(sizeof(*c) + len);
+    if (c == NULL) return -ENOMEM;
+    memcpy(c->hash, hash, DD_HASH_SIZE);
+    c->len = len;
+
+    dd_name(name, hash);
+    fd = openat(dd.storefd, name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        ret = -errno;
+        log_err("dedup: chunk %s: %s\n", name, strerror(errno));
+        free(c);
+        return ret;
+    }
+    got = dd_pread_all(fd, c->data, len, 0);
+    ret = got < 0 ? -errno : (size_t) got != len ? -EIO : 0;
+    close(fd);
+    if (ret < 0) {
+        log_err("dedup: chunk %s: %s\n", name, strerror(-ret));
+        free(c);
+        return ret;
+    }
+    memcpy(dst, c->data + coff, n);
+
+    pthread_mutex_lock(&dd.clock);
+    pp = dd_cslot(hash);
+    if (*pp || len > dd.cap) {
+        pthread_mutex_unlock(&dd.clock);
+        free(c);
+        return 0;
+    }
+    c->hnext = NULL;
+    *pp = c;
+    dd_lru_push(c);
+    dd.used += len;
+    while (dd.used > dd.cap) {
+        struct dd_cached *old = dd.tail;
+
+        dd_lru_unlink(old);
+        for (pp = dd_cslot(old->hash); *pp != old; pp = &(*pp)->hnext)
+            ;
+        *pp = old->hnext;
+        dd.used -= old->len;
+        free(old);
+    }
+    pthread_mutex_unlock(&dd.clock);
+    return 0;
+}
+
+// Manifests
+
+// Read the manifest for a file of 'size' bytes from fd, where it
+// starts at base and takes up the rest; -EINVAL if what's there isn't
+// one
+static int dd_load(int fd, off_t base, uint64_t size, struct dd_ent **entsp, size_t *np) {
+    struct dd_header hdr;
+    struct dd_disk_ent *disk;
+    struct dd_ent *ents;
+    struct stat st;
+    uint64_t off = 0;
+    size_t i, bytes;
+
+    if (fstat(fd, &st) < 0) return -errno;
+    if (dd_pread_all(fd, &hdr, sizeof(hdr), base) != sizeof(hdr)) return -EINVAL;
+    if (memcmp(hdr.magic, dd_magic, sizeof(dd_magic)) != 0 || hdr.size != size ||
+            hdr.count == 0 || hdr.count > size / DEDUP_CHUNK_MIN + 1 ||
+            (uint64_t) st.st_size != base + sizeof(hdr) + hdr.count * sizeof(*disk))
+        return -EINVAL;
+
+    bytes = hdr.count * sizeof(*disk);
+    disk = malloc(bytes);
+    ents = malloc(hdr.count * sizeof(*ents));
+    if (disk == NULL || ents == NULL) {
+        free(disk);
+        free(ents);
+        return -ENOMEM;
+    }
+    if (dd_pread_all(fd, disk, bytes, base + sizeof(hdr)) != (ssize_t) bytes) {
+        free(disk);
+        free(ents);
+        return -EINVAL;
+    }
+    for (i = 0; i < hdr.count; i++) {
+        if (disk[i].len == 0 || disk[i].len > DEDUP_CHUNK_MAX) break;
+        ents[i].off = off;
+        ents[i].len = disk[i].len;
+        memcpy(ents[i].hash, disk[i].hash, DD_HASH_SIZE);
+        off += disk[i].len;
+    }
+    free(disk);
+    if (i < hdr.count || off != size) {
+        free(ents);
+        return -EINVAL;
+    }
+    *entsp = ents;
+    *np = hdr.count;
+    return 0;
+}
+
+// df's manifest, to go in *bytes bytes at the start of a pending
+// record; NULL if there's no memory
+static struct dd_pending *dd_manifest(struct dedup_file *df, int op, size_t *bytes) {
+    struct dd_pending *pend;
+    struct dd_header *hdr;
+    struct dd_disk_ent *disk;
+    size_t i;
+
+    *bytes = sizeof(*pend) + sizeof(*hdr) + df->n * sizeof(*disk);
+    pend = calloc(1, *bytes);
+    if (pend == NULL) return NULL;
+    memcpy(pend->magic, dd_pend_magic, sizeof(dd_pend_magic));
+    pend->op = op;
+    hdr = (struct dd_header *) (pend + 1);
+    memcpy(hdr->magic, dd_magic, sizeof(dd_magic));
+    hdr->size = df->size;
+    hdr->count = df->n;
+    disk = (struct dd_disk_ent *) (hdr + 1);
+    for (i = 0; i < df->n; i++) {
+        memcpy(disk[i].hash, df->ents[i].hash, DD_HASH_SIZE);
+        disk[i].len = df->ents[i].len;
+    }
+    return pend;
+}
+
+static void dd_pend_name(char name[48], dev_t dev, ino_t ino) {
+    snprintf(name, 48, "pend.%llx.%llx", (unsigned long long) dev, (unsigned long long) ino);
+}
+
+// Put the pending record for df in the store, and make sure it and
+// every chunk stored so far are on the disk
+static int dd_pend(struct dedup_file *df, const struct dd_pending *pend, size_t bytes) {
+    char name[48], tmp[32];
+    uint64_t seq;
+    int fd, ret;
+
+    dd_pend_name(name, df->dev, df->ino);
+    snprintf(tmp, sizeof(tmp), "tmp.%d.%u", (int) getpid(),
+            __atomic_add_fetch(&dd.tmpseq, 1, __ATOMIC_RELAXED));
+    fd = openat(dd.storefd, tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) return -errno;
+    ret = dd_pwrite_all(fd, pend, bytes, 0);
+    if (ret == 0 && fdatasync(fd) < 0) ret = -errno;
+    if (close(fd) < 0 && ret == 0) ret = -errno;
+    if (ret == 0 && renameat(dd.storefd, tmp, dd.storefd, name) < 0) ret = -errno;
+    if (ret < 0) {
+        unlinkat(dd.storefd, tmp, 0);
+        return ret;
+    }
+
+    // new chunks can be anywhere in the store, so one syncfs() gets
+    // them and the record's name; with none, fsync() the name will do
+    seq = __atomic_load_n(&dd.put_seq, __ATOMIC_ACQUIRE);
+    if (seq != __atomic_load_n(&dd.synced_seq, __ATOMIC_RELAXED)) {
+        if (syncfs(dd.storefd) < 0) return -errno;
+        __atomic_store_n(&dd.synced_seq, seq, __ATOMIC_RELAXED);
+    } else if (fsync(dd.storefd) < 0) {
+        return -errno;
+    }
+    return 0;
+}
+
+static void dd_unpend(struct dedup_file *df) {
+    char name[48];
+
+    dd_pend_name(name, df->dev, df->ino);
+    unlinkat(dd.storefd, name, 0);
+}
+
+// Write the manifest in a pending record over the backing file on fd,
+// once the xattr is set
+static int dd_write_manifest(int fd, const struct dd_pending *pend, size_t bytes) {
+    bytes -= sizeof(*pend);
+    if (dd_pwrite_all(fd, pend + 1, bytes, 0) < 0 || ftruncate(fd, bytes) < 0 ||
+            fsync(fd) < 0)
+        return -errno;
+    return 0;
+}
+
+// Write the data of a manifest's chunks over the backing file on fd;
+// the caller removes the xattr once it's done
+static int dd_write_data(int fd, const struct dd_ent *ents, size_t n, uint64_t size) {
+    unsigned char *buf;
+    size_t i;
+    int ret = 0;
+
+    buf = malloc(DEDUP_CHUNK_MAX);
+    if (buf == NULL) return -ENOMEM;
+    for (i = 0; i < n && ret == 0; i++) {
+        ret = dd_chunk_read(ents[i].hash, ents[i].len, 0, buf, ents[i].len);
+        if (ret == 0) ret = dd_pwrite_all(fd, buf, ents[i].len, ents[i].off);
+    }
+    free(buf);
+    if (ret == 0 && (ftruncate(fd, size) < 0 || fsync(fd) < 0)) ret = -errno;
+    return ret;
+}
+
+// Make the backing file df's manifest.  Returns -errno if the file is
+// still as it was; once it's been touched, a failure is left for the
+// pending record to put right at the next open, and it's 0.
+static int dd_commit(struct dedup_file *df) {
+    struct dd_pending *pend;
+    size_t bytes;
+    int ret;
+
+    pend = dd_manifest(df, DD_PACK, &bytes);
+    if (pend == NULL) return -ENOMEM;
+    ret = dd_pend(df, pend, bytes);
+    if (ret == 0 && fsetxattr(df->fd, DEDUP_XATTR, &df->size, sizeof(df->size), 0) < 0) {
+        ret = -errno;
+        dd_unpend(df);
+    } else if (ret == 0) {
+        ret = dd_write_manifest(df->fd, pend, bytes);
+        if (ret == 0) dd_unpend(df);
+        else log_err("dedup: ino %lu: manifest: %s, left pending\n",
+                (unsigned long) df->ino, strerror(-ret));
+        ret = 0;
+    }
+    free(pend);
+    return ret;
+}
+
+// Finish what a crash interrupted on the file on fd, if anything.
+// Returns 1 if the file was changed, 0 if not, or -errno.
+static int dd_replay(struct dedup_file *df, int fd) {
+    struct dd_pending pend;
+    struct dd_header hdr;
+    struct dd_ent *ents;
+    char name[48], proc[64];
+    uint64_t size;
+    size_t n, bytes;
+    struct dd_pending *man;
+    int pfd, rfd, ret;
+
+    dd_pend_name(name, df->dev, df->ino);
+    pfd = openat(dd.storefd, name, O_RDONLY | O_CLOEXEC);
+    if (pfd < 0) return errno == ENOENT ? 0 : -errno;
+    ret = -EINVAL;
+    if (dd_pread_all(pfd, &pend, sizeof(pend), 0) == sizeof(pend) &&
+            memcmp(pend.magic, dd_pend_magic, sizeof(dd_pend_magic)) == 0 &&
+            (pend.op == DD_PACK || pend.op == DD_UNPACK) &&
+            dd_pread_all(pfd, &hdr, sizeof(hdr), sizeof(pend)) == sizeof(hdr))
+        ret = dd_load(pfd, sizeof(pend), hdr.size, &ents, &n);
+    close(pfd);
+    if (ret == -EINVAL ||
+            fgetxattr(fd, DEDUP_XATTR, &size, sizeof(size)) != sizeof(size) || size != hdr.size) {
+        // done with, or not about this file at all: an inode number
+        // that's been used again, say
+        if (ret == 0) free(ents);
+        unlinkat(dd.storefd, name, 0);
+        return 0;
+    }
+    if (ret < 0) return ret;
+
+    // fd may be read-only
+    snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+    rfd = open(proc, O_RDWR | O_CLOEXEC);
+    if (rfd < 0) {
+        ret = -errno;
+    } else if (pend.op == DD_PACK) {
+        df->ents = ents;
+        df->n = n;
+        df->size = hdr.size;
+        man = dd_manifest(df, DD_PACK, &bytes);
+        df->ents = NULL;
+        df->n = 0;
+        ret = man ? dd_write_manifest(rfd, man, bytes) : -ENOMEM;
+        free(man);
+    } else {
+        ret = dd_write_data(rfd, ents, n, hdr.size);
+        if (ret == 0 && (fremovexattr(rfd, DEDUP_XATTR) < 0 || fsync(rfd) < 0)) ret = -errno;
+    }
+    if (rfd >= 0) close(rfd);
+    free(ents);
+    if (ret < 0) {
+        log_err("dedup: ino %lu: can't finish the %s a crash cut short: %s\n",
+                (unsigned long) df->ino, pend.op == DD_PACK ? "pack" : "unpack", strerror(-ret));
+        return ret;
+    }
+    unlinkat(dd.storefd, name, 0);
+    log_msg("    dedup: ino %lu: finished the %s a crash cut short\n",
+            (unsigned long) df->ino, pend.op == DD_PACK ? "pack" : "unpack");
+    return 1;
+}
+
+// Everything below takes the file's lock held for writing.
+
+static void dd_show(struct dedup_file *df) {
+    __atomic_store_n(&df->shown, df->state == DD_RAW ? UINT64_MAX : df->size, __ATOMIC_RELAXED);
+}
+
+static void dd_forget_chunks(struct dedup_file *df) {
+    free(df->ents);
+    df->ents = NULL;
+    df->n = df->cap = 0;
+    free(df->tail);
+    df->tail = NULL;
+    df->tail_len = 0;
+}
+
+// the file's next chunk
+static int dd_emit(struct dedup_file *df, const unsigned char *data, size_t len) {
+    struct dd_ent *e;
+    size_t cap;
+    int ret;
+
+    if (df->n == df->cap) {
+        cap = df->cap ? 2 * df->cap : 64;
+        e = realloc(df->ents, cap * sizeof(*e));
+        if (e == NULL) return -ENOMEM;
+        df->ents = e;
+        df->cap = cap;
+    }
+    e = &df->ents[df->n];
+    e->off = df->n ? e[-1].off + e[-1].len : 0;
+    e->len = len;
+    dd_hash(data, len, e->hash);
+    ret = dd_put(e->hash, data, len);
+    if (ret < 0) return ret;
+    df->n++;
+    return 0;
+}
+
+// cut whatever's in the tail into chunks, boundary or no boundary
+static int dd_drain(struct dedup_file *df) {
+    size_t cut;
+    int ret;
+
+    while (df->tail_len > 0) {
+        cut = dd_cut(df->tail, df->tail_len);
+        ret = dd_emit(df, df->tail, cut);
+        if (ret < 0) return ret;
+        memmove(df->tail, df->tail + cut, df->tail_len - cut);
+        df->tail_len -= cut;
+    }
+    return 0;
+}
+
+// Give up on chunking as the data comes, leaving the file plain; for a
+// DD_STREAM file, the data is there already
+static void dd_raw(struct dedup_file *df) {
+    dd_forget_chunks(df);
+    df->state = DD_RAW;
+    df->dirty = 1;
+    dd_show(df);
+}
+
+// Append to a DD_STREAM file.  The data goes to the backing file as
+// it would without dedup, so a crash doesn't lose it, and then into
+// the tail.  The tail is only cut once it holds a whole
+// DEDUP_CHUNK_MAX, so every boundary is found with as much data after
+// it as a chunk can have.
+static int dd_stream(struct dedup_file *df, const unsigned char *buf, size_t len) {
+    size_t take, cut;
+    uint64_t end = df->size + len;
+    int ret;
+
+    // a file opened with O_TRUNC starts out a stream whatever it was,
+    // so an xattr it had as a manifest may still be there
+    if (df->size == 0 && fremovexattr(df->fd, DEDUP_XATTR) < 0 &&
+            errno != ENODATA && errno != ENOTSUP)
+        return -errno;
+    ret = dd_pwrite_all(df->fd, buf, len, df->size);
+    if (ret < 0) return ret;
+
+    if (df->tail == NULL && (df->tail = malloc(DEDUP_CHUNK_MAX)) == NULL) ret = -ENOMEM;
+    while (ret == 0 && len > 0) {
+        take = DEDUP_CHUNK_MAX - df->tail_len;
+        if (take > len) take = len;
+        memcpy(df->tail + df->tail_len, buf, take);
+        df->tail_len += take;
+        df->size += take;
+        buf += take;
+        len -= take;
+
+        if (df->tail_len == DEDUP_CHUNK_MAX) {
+            cut = dd_cut(df->tail, df->tail_len);
+            ret = dd_emit(df, df->tail, cut);
+            if (ret < 0) break;
+            memmove(df->tail, df->tail + cut, df->tail_len - cut);
+            df->tail_len -= cut;
+        }
+    }
+    if (ret < 0) {
+        // the data's safe; it's chunked at the last close instead
+        log_err("dedup: ino %lu: %s, chunking it later\n",
+                (unsigned long) df->ino, strerror(-ret));
+        dd_raw(df);
+        df->size = end;
+    }
+    return 0;
+}
+
+// Turn a DD_STREAM or DD_MANIFEST file back into a plain one, with a
+// pending record in case of a crash, see the top of the file
+static int dd_unpack(struct dedup_file *df) {
+    struct dd_pending *pend;
+    size_t bytes;
+    int ret;
+
+    if (df->state == DD_MANIFEST) {
+        pend = dd_manifest(df, DD_UNPACK, &bytes);
+        if (pend == NULL) return -ENOMEM;
+        ret = dd_pend(df, pend, bytes);
+        free(pend);
+        if (ret == 0) ret = dd_write_data(df->fd, df->ents, df->n, df->size);
+        if (ret == 0 && fremovexattr(df->fd, DEDUP_XATTR) < 0 && errno != ENODATA &&
+                errno != ENOTSUP)
+            ret = -errno;
+        if (ret == 0 && fsync(df->fd) < 0) ret = -errno;
+        // on failure, the record stays, and the next open tries again
+        if (ret < 0) return ret;
+        dd_unpend(df);
+    }
+
+    dd_raw(df);
+    DD_ADD(unpacked, 1);
+    return 0;
+}
+
+// Chunk a plain file that's been written to, and make it a manifest
+static int dd_pack(struct dedup_file *df) {
+    unsigned char *buf;
+    size_t have = 0, cut;
+    uint64_t off = 0;
+    ssize_t n;
+    int eof = 0, ret = 0;
+
+    buf = malloc(DEDUP_CHUNK_MAX);
+    if (buf == NULL) return -ENOMEM;
+    dd_forget_chunks(df);
+    for (;;) {
+        while (!eof && have < DEDUP_CHUNK_MAX) {
+            n = pread(df->fd, buf + have, DEDUP_CHUNK_MAX - have, off);
+            if (n < 0) {
+                ret = -errno;
+                goto out;
+            }
+            if (n == 0) eof = 1;
+            have += n;
+            off += n;
+        }
+        if (have == 0) break;
+        cut = dd_cut(buf, have);
+        ret = dd_emit(df, buf, cut);
+        if (ret < 0) goto out;
+        memmove(buf, buf + cut, have - cut);
+        have -= cut;
+    }
+    df->size = off;
+    ret = dd_commit(df);
+out:
+    free(buf);
+    if (ret < 0) {
+        dd_forget_chunks(df);
+        return ret;
+    }
+    df->state = DD_MANIFEST;
+    df->dirty = 0;
+    dd_show(df);
+    DD_ADD(packed, 1);
+    return 0;
+}
+
+// Last close: leave the backing file as a manifest if it's worth it
+static void dd_finish(struct dedup_file *df) {
+    struct stat st;
+    uint64_t t0 = instr_now();
+    int ret = 0;
+
+    // never written, or unlinked while open: nothing to keep
+    if (!df->loaded || df->fd < 0) return;
+    if (fstat(df->fd, &st) < 0 || st.st_nlink == 0) return;
+
+    if (df->state == DD_STREAM && df->size > 0) {
+        if (df->size < DEDUP_FILE_MIN) {
+            // too small to chunk, and so never was
+            dd_raw(df);
+        } else {
+            ret = dd_drain(df);
+            if (ret == 0) ret = dd_commit(df);
+            if (ret == 0) {
+                free(df->tail);
+                df->tail = NULL;
+                df->state = DD_MANIFEST;
+                DD_ADD(packed, 1);
+            } else {
+                // the data is in the file already; leave it there
+                dd_raw(df);
+            }
+        }
+    } else if (df->state == DD_RAW && df->dirty && st.st_size >= DEDUP_FILE_MIN) {
+        ret = dd_pack(df);
+    }
+    dd_show(df);
+    DD_ADD(ns_write, instr_now() - t0);
+    if (ret < 0)
+        log_err("dedup: ino %lu: %s\n", (unsigned long) df->ino, strerror(-ret));
+}
+
+// Work out what the backing file on fd holds
+static int dd_load_state(struct dedup_file *df, int fd, struct stat *st) {
+    char proc[64];
+    uint64_t size;
+    int rfd, ret;
+
+    ret = dd_replay(df, fd);
+    if (ret < 0) return ret;
+    if (ret > 0 && fstat(fd, st) < 0) return -errno;
+
+    df->state = DD_RAW;
+    df->size = st->st_size;
+    if (st->st_size == 0) {
+        df->state = DD_STREAM;
+        return 0;
+    }
+    if (fgetxattr(fd, DEDUP_XATTR, &size, sizeof(size)) != sizeof(size)) return 0;
+
+    // fd may be write-only
+    snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+    rfd = open(proc, O_RDONLY | O_CLOEXEC);
+    if (rfd < 0) return -errno;
+    ret = dd_load(rfd, 0, size, &df->ents, &df->n);
+    close(rfd);
+    if (ret == -EINVAL) {
+        log_err("dedup: ino %lu has a bad manifest, taking it as a plain file\n",
+                (unsigned long) df->ino);
+        fremovexattr(fd, DEDUP_XATTR);
+        return 0;
+    }
+    if (ret < 0) return ret;
+    df->cap = df->n;
+    df->size = size;
+    df->state = DD_MANIFEST;
+    return 0;
+}
+
+// what we write through: fd may be write-only or O_APPEND
+static int dd_writable(struct dedup_file *df, int fd) {
+    char proc[64];
+
+    if (df->fd >= 0) return 0;
+    snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+    df->fd = open(proc, O_RDWR | O_CLOEXEC);
+    return df->fd < 0 ? -errno : 0;
+}
+
+static unsigned dd_file_hash(dev_t dev, ino_t ino) {
+    return (unsigned) ((ino * 0x9e3779b97f4a7c15ULL ^ dev) >> 22) % DD_FILES;
+}
+
+int dedup_open(int fd, struct dedup_file **dfp) {
+    struct dedup_file *df, *ndf;
+    struct stat st;
+    unsigned h;
+    int ret = 0;
+
+    *dfp = NULL;
+    if (!dd.running) return 0;
+    if (fstat(fd, &st) < 0) return -errno;
+    if (!S_ISREG(st.st_mode)) return 0;
+
+    ndf = calloc(1, sizeof(*ndf));
+    if (ndf == NULL) return -ENOMEM;
+    pthread_rwlock_init(&ndf->lock, NULL);
+    ndf->dev = st.st_dev;
+    ndf->ino = st.st_ino;
+    ndf->refs = 1;
+    ndf->fd = -1;
+    ndf->shown = UINT64_MAX;
+
+    h = dd_file_hash(st.st_dev, st.st_ino);
+    pthread_mutex_lock(&dd.lock);
+    for (df = dd.files[h]; df; df = df->hnext)
+        if (df->dev == st.st_dev && df->ino == st.st_ino) {
+            df->refs++;
+            break;
+        }
+    if (df == NULL) {
+        ndf->hnext = dd.files[h];
+        dd.files[h] = df = ndf;
+        ndf = NULL;
+    }
+    pthread_mutex_unlock(&dd.lock);
+
+    if (ndf) {
+        pthread_rwlock_destroy(&ndf->lock);
+        free(ndf);
+    }
+
+    pthread_rwlock_wrlock(&df->lock);
+    if (!df->loaded) {
+        ret = dd_load_state(df, fd, &st);
+        if (ret == 0) {
+            df->loaded = 1;
+            dd_show(df);
+        }
+    }
+    pthread_rwlock_unlock(&df->lock);
+
+    if (ret < 0) {
+        dedup_close(df);
+        return ret;
+    }
+    *dfp = df;
+    return 0;
+}
+
+void dedup_close(struct dedup_file *df) {
+    struct dedup_file **pp;
+
+    if (df == NULL) return;
+
+    // the last one out finishes the file off, holding a reference of
+    // its own so that an open() meanwhile finds it finished
+    pthread_mutex_lock(&dd.lock);
+    if (--df->refs > 0) {
+        pthread_mutex_unlock(&dd.lock);
+        return;
+    }
+    df->refs = 1;
+    pthread_mutex_unlock(&dd.lock);
+
+    pthread_rwlock_wrlock(&df->lock);
+    dd_finish(df);
+    pthread_rwlock_unlock(&df->lock);
+
+    pthread_mutex_lock(&dd.lock);
+    if (--df->refs > 0) {
+        pthread_mutex_unlock(&dd.lock);
+        return;
+    }
+    for (pp = &dd.files[dd_file_hash(df->dev, df->ino)]; *pp != df; pp = &(*pp)->hnext)
+        ;
+    *pp = df->hnext;
+    pthread_mutex_unlock(&dd.lock);
+
+    if (df->fd >= 0) close(df->fd);
+    dd_forget_chunks(df);
+    pthread_rwlock_destroy(&df->lock);
+    free(df);
+}
+
+ssize_t dedup_read(struct dedup_file *df, int fd, void *buf, size_t len, off_t off) {
+    struct dd_ent *e;
+    uint64_t t0, end, pos;
+    size_t lo, hi, mid, coff, n, done = 0;
+    ssize_t ret;
+
+    pthread_rwlock_rdlock(&df->lock);
+    if (df->state == DD_RAW) {
+        ret = pread(fd, buf, len, off);
+        pthread_rwlock_unlock(&df->lock);
+        return ret;
+    }
+
+    t0 = instr_now();
+    ret = 0;
+    if ((uint64_t) off >= df->size) len = 0;
+    else if (len > df->size - off) len = df->size - off;
+    end = df->n ? df->ents[df->n - 1].off + df->ents[df->n - 1].len : 0;
+
+    // the last chunk that starts at or before off
+    lo = 0;
+    hi = df->n;
+    while (hi - lo > 1) {
+        mid = (lo + hi) / 2;
+        if (df->ents[mid].off <= (uint64_t) off) lo = mid;
+        else hi = mid;
+    }
+    while (done < len && (pos = off + done) < end) {
+        e = &df->ents[lo++];
+        coff = pos - e->off;
+        n = e->len - coff;
+        if (n > len - done) n = len - done;
+        ret = dd_chunk_read(e->hash, e->len, coff, (char *) buf + done, n);
+        if (ret < 0) break;
+        done += n;
+    }
+    if (ret == 0 && done < len) {
+        memcpy((char *) buf + done, df->tail + (off + done - end), len - done);
+        done = len;
+    }
+    pthread_rwlock_unlock(&df->lock);
+
+    DD_ADD(bytes_read, done);
+    DD_ADD(ns_read, instr_now() - t0);
+    if (ret < 0) {
+        errno = -ret;
+        return -1;
+    }
+    return done;
+}
+
+ssize_t dedup_write(struct dedup_file *df, int fd, const void *buf, size_t len, off_t off) {
+    uint64_t t0 = instr_now();
+    ssize_t ret;
+
+    pthread_rwlock_wrlock(&df->lock);
+    ret = dd_writable(df, fd);
+    if (ret == 0 && off < 0) off = df->size;
+
+    if (ret == 0 && df->state == DD_STREAM && (uint64_t) off == df->size) {
+        ret = dd_stream(df, buf, len);
+        if (ret == 0) ret = len;
+        DD_ADD(ns_write, instr_now() - t0);
+    } else if (ret == 0) {
+        // anywhere else, the file has to be plain
+        if (df->state != DD_RAW) ret = dd_unpack(df);
+        if (ret == 0) {
+            ret = pwrite(df->fd, buf, len, off);
+            if (ret < 0) ret = -errno;
+            else {
+                df->dirty = 1;
+                if ((uint64_t) off + ret > df->size) df->size = off + ret;
+            }
+        }
+    }
+    dd_show(df);
+    pthread_rwlock_unlock(&df->lock);
+
+    if (ret < 0) {
+        errno = -ret;
+        return -1;
+    }
+    return ret;
+}
+
+int dedup_truncate(struct dedup_file *df, int fd, off_t size) {
+    int ret;
+
+    pthread_rwlock_wrlock(&df->lock);
+    ret = dd_writable(df, fd);
+    if (ret == 0 && size == 0) {
+        // start again from nothing, which makes it a stream again
+        if (fremovexattr(df->fd, DEDUP_XATTR) < 0 && errno != ENODATA && errno != ENOTSUP)
+            ret = -errno;
+        else if (ftruncate(df->fd, 0) < 0)
+            ret = -errno;
+        else {
+            dd_forget_chunks(df);
+            df->state = DD_STREAM;
+            df->size = 0;
+            df->dirty = 0;
+        }
+    } else if (ret == 0) {
+        if (df->state != DD_RAW) ret = dd_unpack(df);
+        if (ret == 0 && ftruncate(df->fd, size) < 0) ret = -errno;
+        if (ret == 0) {
+            df->size = size;
+            df->dirty = 1;
+        }
+    }
+    dd_show(df);
+    pthread_rwlock_unlock(&df->lock);
+
+    if (ret < 0) {
+        errno = -ret;
+        return -1;
+    }
+    return 0;
+}
+
+int dedup_truncate_path(const char *path, off_t size) {
+    struct dedup_file *df;
+    int fd, ret, err;
+
+    fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    ret = dedup_open(fd, &df);
+    if (ret < 0) {
+        close(fd);
+        errno = -ret;
+        return -1;
+    }
+    if (df) {
+        ret = dedup_truncate(df, fd, size);
+        err = errno;
+        dedup_close(df);
+    } else {
+        ret = ftruncate(fd, size);
+        err = errno;
+    }
+    close(fd);
+    errno = err;
+    return ret;
+}
+
+void dedup_stat(int dirfd, const char *name, struct stat *st) {
+    struct dedup_file *df;
+    char proc[PATH_MAX];
+    uint64_t size = UINT64_MAX;
+
+    if (!dd.running || !S_ISREG(st->st_mode)) return;
+
+    // an open file knows best, even while its backing file is empty
+    pthread_mutex_lock(&dd.lock);
+    for (df = dd.files[dd_file_hash(st->st_dev, st->st_ino)]; df; df = df->hnext)
+        if (df->dev == st->st_dev && df->ino == st->st_ino) {
+            size = __atomic_load_n(&df->shown, __ATOMIC_RELAXED);
+            break;
+        }
+    pthread_mutex_unlock(&dd.lock);
+    if (df) {
+        if (size != UINT64_MAX) st->st_size = size;
+        return;
+    }
+
+    // a manifest is never empty
+    if (st->st_size == 0) return;
+    if (name[0]) snprintf(proc, sizeof(proc), "/proc/self/fd/%d/%s", dirfd, name);
+    else snprintf(proc, sizeof(proc), "/proc/self/fd/%d", dirfd);
+    if (getxattr(proc, DEDUP_XATTR, &size, sizeof(size)) == sizeof(size))
+        st->st_size = size;
+}
+
+// Mark every chunk the manifests under dfd use
+static void dd_gc_mark(int dfd, int top) {
+    struct dd_chunk *c;
+    struct dd_ent *ents;
+    struct dirent *de;
+    struct stat st;
+    uint64_t size;
+    size_t n, i;
+    DIR *dp;
+    int fd, type;
+
+    fd = openat(dfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0 || (dp = fdopendir(fd)) == NULL) {
+        if (fd >= 0) close(fd);
+        return;
+    }
+    while ((de = readdir(dp)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+        if (top && strcmp(de->d_name, DEDUP_DIR) == 0) continue;
+
+        type = de->d_type;
+        if (type == DT_UNKNOWN) {
+            if (fstatat(dirfd(dp), de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) continue;
+            type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+        }
+        if (type == DT_DIR) {
+            fd = openat(dirfd(dp), de->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (fd >= 0) {
+                dd_gc_mark(fd, 0);
+                close(fd);
+            }
+        } else if (type == DT_REG) {
+            fd = openat(dirfd(dp), de->d_name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+            if (fd < 0) continue;
+            if (fgetxattr(fd, DEDUP_XATTR, &size, sizeof(size)) == sizeof(size) &&
+                    dd_load(fd, 0, size, &ents, &n) == 0) {
+                pthread_mutex_lock(&dd.ilock);
+                for (i = 0; i < n; i++) {
+                    c = *dd_islot(ents[i].hash);
+                    if (c) c->mark = 1;
+                    else dd.gc_missing++;
+                }
+                pthread_mutex_unlock(&dd.ilock);
+                dd.gc_files++;
+                dd.gc_bytes += size;
+                free(ents);
+            }
+            close(fd);
+        }
+    }
+    closedir(dp);
+}
+
+// ... and the ones pending records use, whose files may not say so yet
+static void dd_gc_mark_pending(void) {
+    struct dd_pending pend;
+    struct dd_header hdr;
+    struct dd_chunk *c;
+    struct dd_ent *ents;
+    struct dirent *de;
+    size_t n, i;
+    DIR *dp;
+    int fd;
+
+    fd = openat(dd.storefd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0 || (dp = fdopendir(fd)) == NULL) {
+        if (fd >= 0) close(fd);
+        return;
+    }
+    while ((de = readdir(dp)) != NULL) {
+        if (strncmp(de->d_name, "pend.", 5) != 0) continue;
+        fd = openat(dd.storefd, de->d_name, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) continue;
+        if (dd_pread_all(fd, &pend, sizeof(pend), 0) == sizeof(pend) &&
+                dd_pread_all(fd, &hdr, sizeof(hdr), sizeof(pend)) == sizeof(hdr) &&
+                dd_load(fd, sizeof(pend), hdr.size, &ents, &n) == 0) {
+            pthread_mutex_lock(&dd.ilock);
+            for (i = 0; i < n; i++) {
+                c = *dd_islot(ents[i].hash);
+                if (c) c->mark = 1;
+            }
+            pthread_mutex_unlock(&dd.ilock);
+            free(ents);
+        }
+        close(fd);
+    }
+    closedir(dp);
+}
+
+// ... and remove the rest
+static void dd_gc_sweep(void) {
+    struct dd_chunk **pp, *c;
+    char name[40];
+    size_t i;
+
+    pthread_mutex_lock(&dd.ilock);
+    for (i = 0; i < dd.nindex; i++)
+        for (pp = &dd.index[i]; (c = *pp) != NULL; ) {
+            if (c->mark) {
+                c->mark = 0;
+                pp = &c->next;
+                continue;
+            }
+            dd_name(name, c->hash);
+            unlinkat(dd.storefd, name, 0);
+            *pp = c->next;
+            free(c);
+            dd.count--;
+            dd.gc_freed++;
+        }
+    pthread_mutex_unlock(&dd.ilock);
+}
+
+static int dd_unhex(const char *s, unsigned char *out, size_t len) {
+    unsigned v;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        if (sscanf(s + 2 * i, "%2x", &v) != 1) return -1;
+        out[i] = v;
+    }
+    return s[2 * len] == '\0' ? 0 : -1;
+}
+
+// Build the index from what's in the store, making the 256
+// subdirectories as needed and clearing out half-written chunks
+static int dd_scan(void) {
+    unsigned char hash[DD_HASH_SIZE];
+    struct dirent *de;
+    char sub[4];
+    DIR *dp;
+    int fd, i, ret;
+
+    fd = openat(dd.storefd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0 || (dp = fdopendir(fd)) == NULL) {
+        ret = -errno;
+        if (fd >= 0) close(fd);
+        return ret;
+    }
+    while ((de = readdir(dp)) != NULL)
+        if (strncmp(de->d_name, "tmp.", 4) == 0) unlinkat(dd.storefd, de->d_name, 0);
+    closedir(dp);
+
+    for (i = 0; i < 256; i++) {
+        snprintf(sub, sizeof(sub), "%02x", i);
+        if (mkdirat(dd.storefd, sub, 0700) < 0 && errno != EEXIST) return -errno;
+        fd = openat(dd.storefd, sub, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0 || (dp = fdopendir(fd)) == NULL) {
+            ret = -errno;
+            if (fd >= 0) close(fd);
+            return ret;
+        }
+        while ((de = readdir(dp)) != NULL) {
+            if (dd_unhex(de->d_name, hash, DD_HASH_SIZE) < 0 || hash[0] != i) continue;
+            if (dd_iadd(hash) < 0) {
+                closedir(dp);
+                return -ENOMEM;
+            }
+        }
+        closedir(dp);
+    }
+    return 0;
+}
+
+int dedup_enabled(void) {
+    return dd.running;
+}
+
+int dedup_start(int rootfd, size_t cache, int gc) {
+    uint64_t x = 0x243f6a8885a308d3ULL, z;
+    int i, ret;
+
+    // the gear table is fixed, so chunks come out the same every mount
+    for (i = 0; i < 256; i++) {
+        z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        dd.gear[i] = z ^ (z >> 31);
+    }
+
+    if (mkdirat(rootfd, DEDUP_DIR, 0700) < 0 && errno != EEXIST) return -errno;
+    dd.storefd = openat(rootfd, DEDUP_DIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dd.storefd < 0) return -errno;
+
+    dd.nindex = 1024;
+    dd.index = calloc(dd.nindex, sizeof(*dd.index));
+    dd.cap = cache;
+    for (dd.ncache = 64; dd.ncache < cache / DEDUP_CHUNK_AVG; dd.ncache *= 2)
+        ;
+    dd.cache = calloc(dd.ncache, sizeof(*dd.cache));
+    if (dd.index == NULL || dd.cache == NULL) return -ENOMEM;
+
+    ret = dd_scan();
+    if (ret < 0) return ret;
+    // chunks from before the mount may not have reached the disk yet
+    dd.put_seq = 1;
+    dd.synced_seq = 0;
+    log_msg("    dedup: %llu chunks in the store\n", (unsigned long long) dd.count);
+
+    if (gc) {
+        dd_gc_mark(rootfd, 1);
+        dd_gc_mark_pending();
+        dd_gc_sweep();
+        dd.gc_ran = 1;
+        log_msg("    dedup: gc: %llu files hold %llu bytes, %llu chunks removed, %llu missing\n",
+                DD_GET(gc_files), DD_GET(gc_bytes), DD_GET(gc_freed), DD_GET(gc_missing));
+    }
+    dd.running = 1;
+    return 0;
+}
+
+void dedup_stop(void) {
+    struct dedup_file *df;
+    struct dd_chunk *c;
+    struct dd_cached *cc;
+    size_t i;
+
+    if (!dd.running) return;
+    dd.running = 0;
+
+    // everything's been released by now, but just in case
+    for (i = 0; i < DD_FILES; i++)
+        while ((df = dd.files[i]) != NULL) {
+            dd.files[i] = df->hnext;
+            if (df->fd >= 0) close(df->fd);
+            dd_forget_chunks(df);
+            free(df);
+        }
+    for (i = 0; i < dd.nindex; i++)
+        while ((c = dd.index[i]) != NULL) {
+            dd.index[i] = c->next;
+            free(c);
+        }
+    while ((cc = dd.head) != NULL) {
+        dd.head = cc->next;
+        free(cc);
+    }
+    free(dd.index);
+    free(dd.cache);
+    dd.index = NULL;
+    dd.cache = NULL;
+    dd.count = dd.used = 0;
+    dd.tail = NULL;
+    close(dd.storefd);
+    dd.storefd = -1;
+
+    log_msg("    dedup: %llu bytes chunked, %llu of them new; %llu files packed, %llu unpacked\n",
+            DD_GET(bytes_in), DD_GET(bytes_new), DD_GET(packed), DD_GET(unpacked));
+}
+
+void dedup_report(FILE *out) {
+    unsigned long long in = DD_GET(bytes_in), fresh = DD_GET(bytes_new);
+    double wsecs = DD_GET(ns_write) / 1e9, rsecs = DD_GET(ns_read) / 1e9;
+
+    fprintf(out, "dedup: %llu chunks in the store, %llu added since mount\n",
+            (unsigned long long) __atomic_load_n(&dd.count, __ATOMIC_RELAXED), DD_GET(chunks_new));
+    fprintf(out, "dedup: chunked %llu bytes in %llu chunks, %llu bytes new: ratio %.2f\n",
+            in, DD_GET(chunks_in), fresh, fresh ? (double) in / fresh : 0.0);
+    fprintf(out, "dedup: chunking took %.3f s (%.2f MB/s), reading chunks %.3f s for %llu bytes (%.2f MB/s)\n",
+            wsecs, wsecs > 0 ? in / 1e6 / wsecs : 0.0,
+            rsecs, DD_GET(bytes_read), rsecs > 0 ? DD_GET(bytes_read) / 1e6 / rsecs : 0.0);
+    fprintf(out, "dedup: chunk cache %llu hits, %llu misses; %llu files packed, %llu unpacked\n",
+            DD_GET(hits), DD_GET(misses), DD_GET(packed), DD_GET(unpacked));
+    if (dd.gc_ran)
+        fprintf(out, "dedup: gc at mount: %llu files hold %llu bytes, %llu chunks removed\n",
+                DD_GET(gc_files), DD_GET(gc_bytes), DD_GET(gc_freed));
+}
@@ -0,0 +1,75 @@
+#ifndef _DEDUP_H_
+#define _DEDUP_H_
+// Content-defined deduplication of file data, turned on with -o dedup.
+//
+// A file's data is cut into chunks wherever a rolling hash over the
+// last few bytes hits a pattern, so a boundary depends only on the
+// data around it and an insertion early in a file doesn't shift every
+// chunk after it.  Each chunk is stored once, named by its 128-bit
+// hash, under rootdir/.bbfs_chunks (hidden from the mount), and the
+// backing file itself shrinks to a manifest: a header and the list of
+// its chunks.  Its real size is kept in the DEDUP_XATTR xattr so
+// getattr doesn't have to open it.
+//
+// There is one struct dedup_file per backing inode, shared by every
+// open handle on it like the write-back cache's.  A file written from
+// the start in one sequential stream -- a copy, a download, a build
+// artifact -- is chunked as bb_write() goes; anything else is just
+// chunked when the last handle is released.  Either way, the data goes
+// to the backing file as usual until then, so fsync() of it and a
+// crash before it's chunked work as they would without dedup; and a
+// crash while the backing file turns into a manifest, or back, is put
+// right the next time the file is opened.  Writing into the middle of a deduplicated file, or
+// truncating it to anything but 0, turns it back into a plain file
+// first.  Files shorter than DEDUP_FILE_MIN are left as they are.
+//
+// Chunks nothing refers to any more are only removed by -o dedup_gc,
+// which sweeps the store once at mount time.  dedup sits below the
+// content transform: chunks hold the transformed data, so with a
+// keyed transform only identical chunks of the same file dedup.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#define DEDUP_XATTR     "user.bbfs.dedup"
+#define DEDUP_DIR       ".bbfs_chunks"
+
+#define DEDUP_CHUNK_MIN (2 << 10)
+#define DEDUP_CHUNK_AVG (8 << 10)
+#define DEDUP_CHUNK_MAX (64 << 10)
+#define DEDUP_FILE_MIN  (16 << 10)
+
+#define DEDUP_CACHE_MB  64
+
+struct stat;
+struct dedup_file;
+
+// called from bb_init() and bb_destroy(); cache is in bytes
+int dedup_start(int rootfd, size_t cache, int gc);
+void dedup_stop(void);
+int dedup_enabled(void);
+
+// The state for the regular file open on fd, one reference per open
+// handle.  *dfp is left NULL if dedup is off or fd isn't a regular
+// file; returns 0 or -errno.
+int dedup_open(int fd, struct dedup_file **dfp);
+void dedup_close(struct dedup_file *df);
+
+// fd is the caller's descriptor for the file; these return what
+// pread()/pwrite()/ftruncate() would.  An offset of -1 appends.
+ssize_t dedup_read(struct dedup_file *df, int fd, void *buf, size_t len, off_t off);
+ssize_t dedup_write(struct dedup_file *df, int fd, const void *buf, size_t len, off_t off);
+int dedup_truncate(struct dedup_file *df, int fd, off_t size);
+// truncate() for a file that may not be open; path may be a /proc link
+int dedup_truncate_path(const char *path, off_t size);
+
+// make st_size the file's real size; name is relative to dirfd, or ""
+// for dirfd itself
+void dedup_stat(int dirfd, const char *name, struct stat *st);
+
+// the "dedup:" lines in the stats
+void dedup_report(FILE *out);
+
+#endif
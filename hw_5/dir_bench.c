@@ -0,0 +1,174 @@
+/*
+   dir_bench -- listing very large directories through a mounted bbfs
+
+   usage: dir_bench [-n entries[,entries...]] [-p passes] [-k] dir [dir ...]
+
+   Fills a directory with entries empty files (by default one of
+   100000 and one of 1000000) under every dir given, then times what
+   ls and ls -l do to it: read the whole directory, and read it while
+   lstat()ing every name.  The best of -p passes (default 3) is
+   reported, in entries per second.  The directories are named
+   dir_bench.N and are removed afterwards unless -k is given, in which
+   case a later run finds them already filled and skips straight to
+   the listing.
+
+   Directories this size take bbfs many readdir calls to hand over.
+   To see what -o readdir_plus does, mount the same rootdir twice,
+   once with -o attr_ttl=N,readdir_plus and once with just
+   -o attr_ttl=N, and give both mountpoints; the last column is each
+   one's rate over the first one's.  Mount them with
+   -o attr_timeout=0,entry_timeout=0 too, or the kernel's own cache
+   hides everything after the first pass.
+   */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+enum { PHASE_LIST, PHASE_STAT, NPHASES };
+static const char *phase_name[] = { "list", "list+stat" };
+
+#define MAX_SIZES 8
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// make the directory and its n files, unless it's already there
+static int fill(const char *path, long n) {
+    char name[4096];
+    long i;
+    int fd;
+
+    if (mkdir(path, 0755) < 0) {
+        if (errno == EEXIST) return 0;
+        perror(path);
+        return -1;
+    }
+    for (i = 0; i < n; i++) {
+        snprintf(name, sizeof(name), "%s/f%ld", path, i);
+        fd = open(name, O_WRONLY | O_CREAT | O_EXCL, 0644);
+        if (fd < 0) {
+            perror(name);
+            return -1;
+        }
+        close(fd);
+    }
+    return 0;
+}
+
+static void empty(const char *path, long n) {
+    char name[4096];
+    long i;
+
+    for (i = 0; i < n; i++) {
+        snprintf(name, sizeof(name), "%s/f%ld", path, i);
+        unlink(name);
+    }
+    rmdir(path);
+}
+
+// one pass over the directory; returns entries per second
+static double run(const char *path, int phase, long n, long *errors) {
+    char name[4096];
+    struct dirent *de;
+    struct stat st;
+    double start = now();
+    long count = 0;
+    DIR *dp;
+
+    dp = opendir(path);
+    if (dp == NULL) {
+        perror(path);
+        (*errors)++;
+        return 0;
+    }
+    errno = 0;
+    while ((de = readdir(dp)) != NULL) {
+        if (de->d_name[0] == '.') continue;
+        count++;
+        if (phase == PHASE_STAT) {
+            snprintf(name, sizeof(name), "%s/%s", path, de->d_name);
+            if (lstat(name, &st) < 0) (*errors)++;
+        }
+    }
+    if (errno) {
+        perror(path);
+        (*errors)++;
+    }
+    closedir(dp);
+    if (count != n) {
+        fprintf(stderr, "%s: %ld entries, not %ld\n", path, count, n);
+        (*errors)++;
+    }
+    return count / (now() - start);
+}
+
+static void usage(void) {
+    fprintf(stderr, "usage: dir_bench [-n entries[,entries...]] [-p passes] [-k] dir [dir ...]\n");
+}
+
+int main(int argc, char *argv[]) {
+    char path[3072], *tok, *end;   // leaves room for a name in fill() and run()
+    double rate, best, first[MAX_SIZES][NPHASES];
+    long sizes[MAX_SIZES] = { 100000, 1000000 }, passes = 3, errors = 0;
+    int opt, i, s, p, n, nsizes = 2, keep = 0;
+
+    while ((opt = getopt(argc, argv, "n:p:k")) != -1) {
+        switch (opt) {
+        case 'n':
+            for (nsizes = 0, tok = strtok(optarg, ","); tok; tok = strtok(NULL, ",")) {
+                if (nsizes == MAX_SIZES) break;
+                sizes[nsizes] = strtol(tok, &end, 10);
+                if (*end || sizes[nsizes] < 1) break;
+                nsizes++;
+            }
+            if (tok) nsizes = 0;
+            break;
+        case 'p': passes = atol(optarg); break;
+        case 'k': keep = 1; break;
+        default:
+            usage();
+            return 2;
+        }
+    }
+    if (optind == argc || nsizes < 1 || passes < 1) {
+        usage();
+        return 2;
+    }
+
+    printf("best of %ld\n\n", passes);
+    printf("%-32s %8s %-10s %12s %8s\n", "dir", "entries", "phase", "entries/s", "vs first");
+
+    for (i = optind; i < argc; i++) {
+        for (s = 0; s < nsizes; s++) {
+            snprintf(path, sizeof(path), "%s/dir_bench.%ld", argv[i], sizes[s]);
+            if (fill(path, sizes[s]) < 0) return 1;
+            for (p = 0; p < NPHASES; p++) {
+                for (best = 0, n = 0; n < passes; n++) {
+                    rate = run(path, p, sizes[s], &errors);
+                    if (rate > best) best = rate;
+                }
+                if (i == optind) first[s][p] = best;
+                printf("%-32s %8ld %-10s %12.0f %7.2fx\n", argv[i], sizes[s], phase_name[p],
+                        best, first[s][p] ? best / first[s][p] : 0);
+                fflush(stdout);
+            }
+            if (!keep) empty(path, sizes[s]);
+        }
+    }
+
+    if (errors) printf("\n%ld errors\n", errors);
+    return errors ? 1 : 0;
+}
@@ -0,0 +1,218 @@
+// Directory fd cache, see dircache.h.
+//
+// One lock covers a hash table and an LRU list of entries.  An entry
+// holds a reference for being in the table and one for each caller
+// using its fd; the fd is closed when the last one goes, so eviction
+// or a drop never pulls an fd out from under an op that's using it.
+// A generation number, bumped by every drop, keeps a directory opened
+// before a rename from being cached under its old name after it.
+
+#include "params.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dircache.h"
+#include "log.h"
+
+struct dircache_ent {
+    struct dircache_ent *hnext;
+    struct dircache_ent *prev, *next;   // LRU list, most recent first
+    uint64_t hash;
+    unsigned refs;
+    int fd;
+    size_t len;
+    char path[];
+};
+
+static struct {
+    pthread_mutex_t lock;
+    struct dircache_ent **buckets;
+    size_t nbuckets;                    // a power of two
+    struct dircache_ent *head, *tail;
+    unsigned count, max;
+    unsigned gen;
+    int rootfd;
+    int running;
+    uint64_t hits, misses;
+} dc = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static uint64_t dc_hash(const char *path, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    while (len--) {
+        h ^= (unsigned char) *path++;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+// the rest take dc.lock held
+
+static struct dircache_ent **dc_slot(uint64_t hash, const char *path, size_t len) {
+    struct dircache_ent **pp;
+
+    for (pp = &dc.buckets[hash & (dc.nbuckets - 1)]; *pp; pp = &(*pp)->hnext)
+        if ((*pp)->hash == hash && (*pp)->len == len && memcmp((*pp)->path, path, len) == 0)
+            break;
+    return pp;
+}
+
+static void dc_unref(struct dircache_ent *e) {
+    if (--e->refs == 0) {
+        close(e->fd);
+        free(e);
+    }
+}
+
+static void dc_unlink_lru(struct dircache_ent *e) {
+    if (e->prev) e->prev->next = e->next;
+    else dc.head = e->next;
+    if (e->next) e->next->prev = e->prev;
+    else dc.tail = e->prev;
+}
+
+static void dc_push_lru(struct dircache_ent *e) {
+    e->prev = NULL;
+    e->next = dc.head;
+    if (dc.head) dc.head->prev = e;
+    else dc.tail = e;
+    dc.head = e;
+}
+
+static void dc_remove(struct dircache_ent *e) {
+    struct dircache_ent **pp = dc_slot(e->hash, e->path, e->len);
+
+    *pp = e->hnext;
+    dc_unlink_lru(e);
+    dc.count--;
+    dc_unref(e);
+}
+
+int dircache_get(const char *dir, size_t len, struct dircache_ent **ref) {
+    struct dircache_ent *e, *found;
+    uint64_t hash;
+    unsigned gen;
+    char rel[PATH_MAX];
+    int fd;
+
+    *ref = NULL;
+    if (len <= 1) return dc.rootfd;
+    if (len >= PATH_MAX) return -ENAMETOOLONG;
+    hash = dc_hash(dir, len);
+
+    pthread_mutex_lock(&dc.lock);
+    e = *dc_slot(hash, dir, len);
+    if (e) {
+        e->refs++;
+        dc_unlink_lru(e);
+        dc_push_lru(e);
+        dc.hits++;
+        pthread_mutex_unlock(&dc.lock);
+        *ref = e;
+        return e->fd;
+    }
+    dc.misses++;
+    gen = dc.gen;
+    pthread_mutex_unlock(&dc.lock);
+
+    // the walk itself happens unlocked
+    memcpy(rel, dir + 1, len - 1);
+    rel[len - 1] = '\0';
+    fd = openat(dc.rootfd, rel, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return -errno;
+
+    e = malloc(sizeof(*e) + len);
+    if (e == NULL) {
+        close(fd);
+        return -ENOMEM;
+    }
+    e->hash = hash;
+    e->refs = 1;
+    e->fd = fd;
+    e->len = len;
+    memcpy(e->path, dir, len);
+
+    pthread_mutex_lock(&dc.lock);
+    found = *dc_slot(hash, dir, len);
+    if (found) {
+        // somebody else got there first; use theirs
+        found->refs++;
+        pthread_mutex_unlock(&dc.lock);
+        close(fd);
+        free(e);
+        *ref = found;
+        return found->fd;
+    }
+    if (gen == dc.gen) {
+        if (dc.count >= dc.max) dc_remove(dc.tail);
+        e->refs++;
+        e->hnext = dc.buckets[hash & (dc.nbuckets - 1)];
+        dc.buckets[hash & (dc.nbuckets - 1)] = e;
+        dc_push_lru(e);
+        dc.count++;
+    }
+    // else it may have been renamed since; use it just this once
+    pthread_mutex_unlock(&dc.lock);
+    *ref = e;
+    return fd;
+}
+
+void dircache_put(struct dircache_ent *ref) {
+    if (ref == NULL) return;
+    pthread_mutex_lock(&dc.lock);
+    dc_unref(ref);
+    pthread_mutex_unlock(&dc.lock);
+}
+
+void dircache_drop_tree(const char *path) {
+    struct dircache_ent *e, *next;
+    size_t len;
+
+    if (!dc.running) return;
+    len = strlen(path);
+
+    pthread_mutex_lock(&dc.lock);
+    dc.gen++;
+    for (e = dc.head; e; e = next) {
+        next = e->next;
+        if (e->len >= len && memcmp(e->path, path, len) == 0 &&
+                (e->len == len || e->path[len] == '/'))
+            dc_remove(e);
+    }
+    pthread_mutex_unlock(&dc.lock);
+}
+
+int dircache_enabled(void) {
+    return dc.running;
+}
+
+int dircache_start(int rootfd, unsigned max) {
+    dc.rootfd = rootfd;
+    dc.max = max ? max : 1;
+    for (dc.nbuckets = 16; dc.nbuckets < 2 * (size_t) dc.max; dc.nbuckets *= 2)
+        ;
+    dc.buckets = calloc(dc.nbuckets, sizeof(*dc.buckets));
+    if (dc.buckets == NULL) return -ENOMEM;
+    dc.running = 1;
+    return 0;
+}
+
+void dircache_stop(void) {
+    if (!dc.running) return;
+
+    pthread_mutex_lock(&dc.lock);
+    while (dc.head) dc_remove(dc.head);
+    pthread_mutex_unlock(&dc.lock);
+    dc.running = 0;
+
+    log_msg("    dircache: %llu hits, %llu misses\n",
+            (unsigned long long) dc.hits, (unsigned long long) dc.misses);
+    free(dc.buckets);
+}
@@ -0,0 +1,35 @@
+#ifndef _DIRCACHE_H_
+#define _DIRCACHE_H_
+// Directory fd cache, turned on with -o dir_cache=N.
+//
+// bbfs resolves every path relative to a directory fd instead of
+// gluing it onto rootdir.  Without the cache that fd is rootdir's, so
+// the kernel still walks the whole path each time; with it, bbfs
+// keeps O_PATH fds for up to N recently used directories, keyed by
+// their path under the mountpoint, and resolves just the last
+// component against the right one.
+//
+// bbfs drops cached fds itself when it renames or removes a
+// directory (or anything that might be a symlink to one).  A
+// directory renamed in rootdir behind bbfs' back keeps being found
+// under its old name until it falls out of the cache.
+
+#include <stddef.h>
+
+struct dircache_ent;
+
+// called from bb_init() and bb_destroy(); rootfd must stay open
+int dircache_start(int rootfd, unsigned max);
+void dircache_stop(void);
+int dircache_enabled(void);
+
+// Returns an O_PATH fd for the directory named by the first len
+// bytes of dir (a FUSE path, "/" for rootdir itself), or -errno.
+// Hand *ref back to dircache_put() when done with the fd.
+int dircache_get(const char *dir, size_t len, struct dircache_ent **ref);
+void dircache_put(struct dircache_ent *ref);
+
+// forget path and everything under it
+void dircache_drop_tree(const char *path);
+
+#endif
@@ -0,0 +1,252 @@
+/*
+   fsync_bench -- small durable writes, the way a database commits
+
+   usage: fsync_bench [-t max threads] [-s seconds] [-b block size] [-m MiB] dir [dir ...]
+
+   For 1, 2, 4, ... up to max threads (default 8), every thread
+   pwrite()s one -b byte block (default 4096) at a random place in its
+   own -m MiB file (default 64), then fsync()s it, over and over for -s
+   seconds (default 3).  Prints the fsyncs per second across all
+   threads and the 50th and 99th percentile latency of one write plus
+   fsync, for every dir given.
+
+   Without -o journal each fsync flushes a block somewhere in the
+   middle of a file; with it, each one is an append to one log, and
+   concurrent ones share a sync.  Mount the same rootdir with and
+   without -o journal and give both mountpoints: the last column is
+   each one's rate over the first one's.  The "journal:" lines in
+   .bbfs_stats say how many fsyncs each log sync covered.
+
+   A dir whose .bbfs_stats has "journal:" lines is a journaled mount's
+   root, and before its runs the log's name there, .bbfs_journal, has
+   to turn away a create and a rename onto it with EPERM; either one
+   getting through would have truncated or replaced the live log.
+   */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_THREADS 256
+#define MAX_SAMPLES (1 << 20)
+
+static const char *dir;
+static double secs = 3;
+static size_t bs = 4096;
+static size_t file_mb = 64;
+static pthread_barrier_t barrier;
+
+struct worker {
+    pthread_t thread;
+    int id;
+    long ops, errors;
+    float *lat;                 // microseconds, one per op up to MAX_SAMPLES
+};
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *worker(void *arg) {
+    struct worker *w = arg;
+    char path[4096], *buf;
+    uint64_t rng = 0x9e3779b97f4a7c15ULL * (w->id + 1), blocks = (file_mb << 20) / bs, off;
+    double start, t;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/fsync_bench.%d", dir, w->id);
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    buf = malloc(bs);
+    if (fd < 0 || buf == NULL) {
+        perror(path);
+        w->errors++;
+        pthread_barrier_wait(&barrier);
+        return NULL;
+    }
+    memset(buf, 'a' + w->id % 26, bs);
+    // the whole file is there first, so the timed writes overwrite
+    // rather than extend it
+    if (ftruncate(fd, (off_t) blocks * bs) < 0 || fsync(fd) < 0) w->errors++;
+
+    pthread_barrier_wait(&barrier);
+    start = now();
+    do {
+        rng ^= rng << 13;
+        rng ^= rng >> 7;
+        rng ^= rng << 17;
+        off = rng % blocks * bs;
+        memcpy(buf, &off, sizeof(off));
+
+        t = now();
+        if (pwrite(fd, buf, bs, off) != (ssize_t) bs || fsync(fd) < 0) w->errors++;
+        if (w->ops < MAX_SAMPLES) w->lat[w->ops] = (now() - t) * 1e6;
+        w->ops++;
+    } while (now() - start < secs);
+
+    close(fd);
+    unlink(path);
+    free(buf);
+    return NULL;
+}
+
+// whether d is the root of a mount with -o journal
+static int journaled(const char *d) {
+    char path[4096], line[256];
+    FILE *f;
+    int found = 0;
+
+    snprintf(path, sizeof(path), "%s/.bbfs_stats", d);
+    f = fopen(path, "r");
+    if (f == NULL) return 0;
+    while (!found && fgets(line, sizeof(line), f)) found = strncmp(line, "journal:", 8) == 0;
+    fclose(f);
+    return found;
+}
+
+// The create goes first: without the check it fails anyway, since the
+// log is there, where a rename would go through and replace it.
+// Returns how many of the two got anything but EPERM.
+static long check_journal_name(const char *d) {
+    char path[4096], from[4096];
+    long errors = 0;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/.bbfs_journal", d);
+    fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fd >= 0 || errno != EPERM) {
+        fprintf(stderr, "%s: create: %s\n", path, fd >= 0 ? "went through" : strerror(errno));
+        if (fd >= 0) close(fd);
+        return 1;
+    }
+
+    snprintf(from, sizeof(from), "%s/fsync_bench.rename", d);
+    fd = open(from, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror(from);
+        return 1;
+    }
+    close(fd);
+    if (rename(from, path) == 0 || errno != EPERM) {
+        fprintf(stderr, "%s: rename onto it: %s\n", path,
+                access(from, F_OK) < 0 ? "went through" : strerror(errno));
+        errors++;
+    }
+    unlink(from);
+    return errors;
+}
+
+static int cmp_float(const void *a, const void *b) {
+    float x = *(const float *) a, y = *(const float *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+// one run with n threads; returns fsyncs per second
+static double run(int n, struct worker *w, double *p50, double *p99, long *errors) {
+    float *all;
+    long ops = 0, samples = 0, i, k;
+    double start, elapsed;
+
+    pthread_barrier_init(&barrier, NULL, n + 1);
+    for (i = 0; i < n; i++) {
+        w[i].id = i;
+        w[i].ops = w[i].errors = 0;
+        pthread_create(&w[i].thread, NULL, worker, &w[i]);
+    }
+    pthread_barrier_wait(&barrier);
+    start = now();
+    for (i = 0; i < n; i++) pthread_join(w[i].thread, NULL);
+    elapsed = now() - start;
+    pthread_barrier_destroy(&barrier);
+
+    for (i = 0; i < n; i++) {
+        ops += w[i].ops;
+        samples += w[i].ops < MAX_SAMPLES ? w[i].ops : MAX_SAMPLES;
+        *errors += w[i].errors;
+    }
+    *p50 = *p99 = 0;
+    all = malloc((samples ? samples : 1) * sizeof(*all));
+    if (all && samples) {
+        for (i = 0, k = 0; i < n; i++) {
+            long m = w[i].ops < MAX_SAMPLES ? w[i].ops : MAX_SAMPLES;
+
+            memcpy(all + k, w[i].lat, m * sizeof(*all));
+            k += m;
+        }
+        qsort(all, samples, sizeof(*all), cmp_float);
+        *p50 = all[samples / 2];
+        *p99 = all[samples * 99 / 100];
+    }
+    free(all);
+    return ops / elapsed;
+}
+
+static void usage(void) {
+    fprintf(stderr, "usage: fsync_bench [-t max threads] [-s seconds] [-b block size] [-m MiB] "
+            "dir [dir ...]\n");
+}
+
+int main(int argc, char *argv[]) {
+    static double first[64];
+    struct worker *w;
+    double rate, p50, p99;
+    long errors = 0;
+    int opt, max = 8, n, i, k;
+
+    while ((opt = getopt(argc, argv, "t:s:b:m:")) != -1) {
+        switch (opt) {
+        case 't': max = atoi(optarg); break;
+        case 's': secs = atof(optarg); break;
+        case 'b': bs = strtoul(optarg, NULL, 0); break;
+        case 'm': file_mb = strtoul(optarg, NULL, 0); break;
+        default:
+            usage();
+            return 2;
+        }
+    }
+    if (optind == argc || max < 1 || max > MAX_THREADS || secs <= 0 || bs < sizeof(uint64_t) ||
+            file_mb < 1 || (file_mb << 20) < bs) {
+        usage();
+        return 2;
+    }
+    w = calloc(max, sizeof(*w));
+    for (i = 0; w && i < max; i++) {
+        w[i].lat = malloc(MAX_SAMPLES * sizeof(*w[i].lat));
+        if (w[i].lat == NULL) break;
+    }
+    if (w == NULL || i < max) {
+        perror("malloc");
+        return 1;
+    }
+
+    printf("%zu byte writes, each fsync()ed, %g s per run\n\n", bs, secs);
+    printf("%-32s %7s %10s %10s %10s %8s\n", "dir", "threads", "fsyncs/s", "p50 us", "p99 us",
+            "vs first");
+    for (i = optind; i < argc; i++) {
+        dir = argv[i];
+        if (journaled(dir)) errors += check_journal_name(dir);
+        for (n = 1, k = 0; n <= max; n *= 2, k++) {
+            rate = run(n, w, &p50, &p99, &errors);
+            if (i == optind) first[k] = rate;
+            printf("%-32s %7d %10.0f %10.0f %10.0f %7.2fx\n", dir, n, rate, p50, p99,
+                    first[k] ? rate / first[k] : 0);
+            fflush(stdout);
+        }
+    }
+
+    for (i = 0; i < max; i++) free(w[i].lat);
+    free(w);
+    if (errors) printf("\n%ld errors\n", errors);
+    return errors ? 1 : 0;
+}
@@ -0,0 +1,62 @@
+// Log-linear histograms, see hist.h
+
+#include <stdint.h>
+#include <string.h>
+
+#include "hist.h"
+
+void hist_init(struct hist *h) {
+    memset(h, 0, sizeof(*h));
+    h->min = UINT64_MAX;
+}
+
+void hist_add(struct hist *h, uint64_t v) {
+    h->bucket[hist_index(v)]++;
+    h->count++;
+    h->sum += v;
+    if (v < h->min) h->min = v;
+    if (v > h->max) h->max = v;
+}
+
+void hist_merge(struct hist *dst, const struct hist *src) {
+    int i;
+
+    for (i = 0; i < HIST_BUCKETS; i++)
+        dst->bucket[i] += src->bucket[i];
+    dst->count += src->count;
+    dst->sum += src->sum;
+    if (src->min < dst->min) dst->min = src->min;
+    if (src->max > dst->max) dst->max = src->max;
+}
+
+// largest value that lands in bucket idx
+uint64_t hist_bucket_high(int idx) {
+    int e;
+    uint64_t sub;
+
+    if (idx < HIST_SUB) return idx;
+    e = idx / HIST_SUB + HIST_SUB_BITS - 1;
+    sub = HIST_SUB | (idx & (HIST_SUB - 1));
+    return ((sub + 1) << (e - HIST_SUB_BITS)) - 1;
+}
+
+// Value at or below which pct percent of the samples fall, reported
+// as the top of the bucket it's in (clamped to the real maximum)
+uint64_t hist_percentile(const struct hist *h, double pct) {
+    uint64_t want, seen = 0, v;
+    int i;
+
+    if (h->count == 0) return 0;
+    want = (uint64_t) (pct / 100.0 * h->count + 0.5);
+    if (want < 1) want = 1;
+    if (want > h->count) want = h->count;
+
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->bucket[i];
+        if (seen >= want) {
+            v = hist_bucket_high(i);
+            return v > h->max ? h->max : v;
+        }
+    }
+    return h->max;
+}
@@ -0,0 +1,37 @@
+#ifndef _HIST_H_
+#define _HIST_H_
+// Log-linear latency histogram in the style of HdrHistogram: every
+// power of two is split into HIST_SUB linear sub-buckets, so any
+// recorded value is known to within 1/HIST_SUB (~6%) no matter how
+// large it is, and recording is just a couple of shifts.
+
+#include <stdint.h>
+
+#define HIST_SUB_BITS 4
+#define HIST_SUB      (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS  ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct hist {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint64_t bucket[HIST_BUCKETS];
+};
+
+static inline int hist_index(uint64_t v) {
+    int e;
+
+    if (v < HIST_SUB) return v;
+    e = 63 - __builtin_clzll(v);
+    return (e - HIST_SUB_BITS + 1) * HIST_SUB +
+        ((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+void hist_init(struct hist *h);
+void hist_add(struct hist *h, uint64_t v);
+void hist_merge(struct hist *dst, const struct hist *src);
+uint64_t hist_bucket_high(int idx);
+uint64_t hist_percentile(const struct hist *h, double pct);
+
+#endif
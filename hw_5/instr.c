@@ -0,0 +1,280 @@
+// Instrumentation wrappers around bb_oper, see instr.h.
+//
+// Rather than touching each bb_* function, instr_wrap() swaps every
+// entry in bb_oper for a wrapper that times the real call and hands
+// the outcome to stats.c and/or trace.c.  The wrappers also answer
+// for the stats control file (/.bbfs_stats), which doesn't exist in
+// rootdir, and bracket the call with log_call() and log_call_done()
+// so the text log can be filtered by operation.  With stats and
+// tracing both turned off nothing is timed, and the wrappers are
+// just those two calls.
+
+#include "params.h"
+
+#include <errno.h>
+#include <fuse.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "instr.h"
+#include "log.h"
+#include "stats.h"
+#include "trace.h"
+
+static struct fuse_operations real;
+static int instr_what;
+
+#define INSTR_TIMED (INSTR_STATS | INSTR_TRACE)
+
+static inline uint64_t instr_start(int op) {
+    if (instr_what & INSTR_LOG) log_call(op);
+    return instr_what & INSTR_TIMED ? instr_now() : 0;
+}
+
+static inline void instr_done(int op, const char *path, int64_t offset,
+        uint64_t size, int result, unsigned flags, uint64_t t0) {
+    uint64_t lat;
+
+    if (instr_what & INSTR_LOG) log_call_done();
+    if (!(instr_what & INSTR_TIMED)) return;
+    lat = instr_now() - t0;
+    if (instr_what & INSTR_STATS) stats_record(op, lat, result, flags);
+    if (instr_what & INSTR_TRACE) trace_emit(op, path, offset, size, result, flags, t0, lat);
+}
+
+#define INSTR(op, path, off, size, call)                        \
+    uint64_t t0 = instr_start(BB_OP_##op);                      \
+    int ret = (call);                                           \
+    instr_done(BB_OP_##op, (path), (off), (size), ret, 0, t0);  \
+    return ret
+
+// true for the stats control file, which never reaches bbfs proper
+#define CTL(path) ((instr_what & INSTR_STATS) && stats_is_ctl(path))
+
+static int in_getattr(const char *path, struct stat *st) {
+    if (CTL(path)) return stats_ctl_getattr(st);
+    INSTR(GETATTR, path, 0, 0, real.getattr(path, st));
+}
+
+static int in_readlink(const char *path, char *link, size_t size) {
+    INSTR(READLINK, path, 0, size, real.readlink(path, link, size));
+}
+
+static int in_mknod(const char *path, mode_t mode, dev_t dev) {
+    if (CTL(path)) return -EEXIST;
+    INSTR(MKNOD, path, 0, 0, real.mknod(path, mode, dev));
+}
+
+static int in_mkdir(const char *path, mode_t mode) {
+    if (CTL(path)) return -EEXIST;
+    INSTR(MKDIR, path, 0, 0, real.mkdir(path, mode));
+}
+
+static int in_unlink(const char *path) {
+    if (CTL(path)) return -EPERM;
+    INSTR(UNLINK, path, 0, 0, real.unlink(path));
+}
+
+static int in_rmdir(const char *path) {
+    INSTR(RMDIR, path, 0, 0, real.rmdir(path));
+}
+
+// 'link' is the name inside the filesystem, 'path' is just the target
+static int in_symlink(const char *path, const char *link) {
+    if (CTL(link)) return -EEXIST;
+    INSTR(SYMLINK, link, 0, 0, real.symlink(path, link));
+}
+
+static int in_rename(const char *path, const char *newpath) {
+    if (CTL(path) || CTL(newpath)) return -EPERM;
+    INSTR(RENAME, path, 0, 0, real.rename(path, newpath));
+}
+
+static int in_link(const char *path, const char *newpath) {
+    if (CTL(path) || CTL(newpath)) return -EPERM;
+    INSTR(LINK, path, 0, 0, real.link(path, newpath));
+}
+
+static int in_chmod(const char *path, mode_t mode) {
+    if (CTL(path)) return -EPERM;
+    INSTR(CHMOD, path, 0, 0, real.chmod(path, mode));
+}
+
+static int in_chown(const char *path, uid_t uid, gid_t gid) {
+    if (CTL(path)) return -EPERM;
+    INSTR(CHOWN, path, 0, 0, real.chown(path, uid, gid));
+}
+
+static int in_truncate(const char *path, off_t newsize) {
+    if (CTL(path)) return -EACCES;
+    INSTR(TRUNCATE, path, newsize, 0, real.truncate(path, newsize));
+}
+
+static int in_utime(const char *path, struct utimbuf *ubuf) {
+    if (CTL(path)) return -EPERM;
+    INSTR(UTIME, path, 0, 0, real.utime(path, ubuf));
+}
+
+static int in_open(const char *path, struct fuse_file_info *fi) {
+    if (CTL(path)) return stats_ctl_open(fi);
+    INSTR(OPEN, path, 0, 0, real.open(path, fi));
+}
+
+static int in_read(const char *path, char *buf, size_t size, off_t offset,
+        struct fuse_file_info *fi) {
+    if (CTL(path)) return stats_ctl_read(buf, size, offset, fi);
+    INSTR(READ, path, offset, size, real.read(path, buf, size, offset, fi));
+}
+
+static int in_write(const char *path, const char *buf, size_t size,
+        off_t offset, struct fuse_file_info *fi) {
+    INSTR(WRITE, path, offset, size, real.write(path, buf, size, offset, fi));
+}
+
+// the control file has no read_buf of its own, so it's read into
+// memory for FUSE to reply from
+static int ctl_read_buf(struct fuse_bufvec **bufp, size_t size, off_t offset,
+        struct fuse_file_info *fi) {
+    struct fuse_bufvec *src;
+    char *mem;
+    int ret;
+
+    src = malloc(sizeof(*src));
+    mem = malloc(size ? size : 1);
+    if (src == NULL || mem == NULL) {
+        free(src);
+        free(mem);
+        return -ENOMEM;
+    }
+    ret = stats_ctl_read(mem, size, offset, fi);
+    if (ret < 0) {
+        free(src);
+        free(mem);
+        return ret;
+    }
+    *src = FUSE_BUFVEC_INIT(ret);
+    src->buf[0].mem = mem;
+    *bufp = src;
+    return 0;
+}
+
+// read_buf returns 0, so the byte count recorded is the buffer's
+// size.  That's only what was read for one in memory: a spliced one's
+// size is what was asked for, and how much of it the file really had
+// only comes out when FUSE splices it, after we're done.  So those
+// record no bytes and are marked BB_TRACE_SPLICED instead.
+static int in_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size,
+        off_t offset, struct fuse_file_info *fi) {
+    uint64_t t0;
+    int ret;
+
+    if (CTL(path)) return ctl_read_buf(bufp, size, offset, fi);
+    t0 = instr_start(BB_OP_READ);
+    ret = real.read_buf(path, bufp, size, offset, fi);
+    if (ret < 0)
+        instr_done(BB_OP_READ, path, offset, size, ret, 0, t0);
+    else if ((*bufp)->buf[0].flags & FUSE_BUF_IS_FD)
+        instr_done(BB_OP_READ, path, offset, size, 0, BB_TRACE_SPLICED, t0);
+    else
+        instr_done(BB_OP_READ, path, offset, size, (int) fuse_buf_size(*bufp), 0, t0);
+    return ret;
+}
+
+static int in_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset,
+        struct fuse_file_info *fi) {
+    INSTR(WRITE, path, offset, fuse_buf_size(buf), real.write_buf(path, buf, offset, fi));
+}
+
+static int in_statfs(const char *path, struct statvfs *statv) {
+    INSTR(STATFS, path, 0, 0, real.statfs(path, statv));
+}
+
+static int in_flush(const char *path, struct fuse_file_info *fi) {
+    if (CTL(path)) return 0;
+    INSTR(FLUSH, path, 0, 0, real.flush(path, fi));
+}
+
+static int in_release(const char *path, struct fuse_file_info *fi) {
+    if (CTL(path)) return stats_ctl_release(fi);
+    INSTR(RELEASE, path, 0, 0, real.release(path, fi));
+}
+
+static int in_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+    if (CTL(path)) return 0;
+    INSTR(FSYNC, path, 0, 0, real.fsync(path, datasync, fi));
+}
+
+static int in_setxattr(const char *path, const char *name, const char *value,
+        size_t size, int flags) {
+    INSTR(SETXATTR, path, 0, size, real.setxattr(path, name, value, size, flags));
+}
+
+static int in_getxattr(const char *path, const char *name, char *value,
+        size_t size) {
+    INSTR(GETXATTR, path, 0, size, real.getxattr(path, name, value, size));
+}
+
+static int in_listxattr(const char *path, char *list, size_t size) {
+    INSTR(LISTXATTR, path, 0, size, real.listxattr(path, list, size));
+}
+
+static int in_removexattr(const char *path, const char *name) {
+    INSTR(REMOVEXATTR, path, 0, 0, real.removexattr(path, name));
+}
+
+static int in_opendir(const char *path, struct fuse_file_info *fi) {
+    INSTR(OPENDIR, path, 0, 0, real.opendir(path, fi));
+}
+
+static int in_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+        off_t offset, struct fuse_file_info *fi) {
+    INSTR(READDIR, path, offset, 0, real.readdir(path, buf, filler, offset, fi));
+}
+
+static int in_releasedir(const char *path, struct fuse_file_info *fi) {
+    INSTR(RELEASEDIR, path, 0, 0, real.releasedir(path, fi));
+}
+
+static int in_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi) {
+    INSTR(FSYNCDIR, path, 0, 0, real.fsyncdir(path, datasync, fi));
+}
+
+static int in_access(const char *path, int mask) {
+    if (CTL(path)) return (mask & W_OK) ? -EACCES : 0;
+    INSTR(ACCESS, path, 0, 0, real.access(path, mask));
+}
+
+static int in_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+    if (CTL(path)) return -EEXIST;
+    INSTR(CREATE, path, 0, 0, real.create(path, mode, fi));
+}
+
+static int in_ftruncate(const char *path, off_t offset, struct fuse_file_info *fi) {
+    INSTR(FTRUNCATE, path, offset, 0, real.ftruncate(path, offset, fi));
+}
+
+static int in_fgetattr(const char *path, struct stat *st,
+        struct fuse_file_info *fi) {
+    if (CTL(path)) return stats_ctl_getattr(st);
+    INSTR(FGETATTR, path, 0, 0, real.fgetattr(path, st, fi));
+}
+
+// init and destroy are left alone: they run before the log rings
+// and stats exist and after they're gone.
+void instr_wrap(struct fuse_operations *ops, int what) {
+    real = *ops;
+    instr_what = what;
+
+#define WRAP(name) if (ops->name) ops->name = in_##name
+    WRAP(getattr);    WRAP(readlink);   WRAP(mknod);      WRAP(mkdir);
+    WRAP(unlink);     WRAP(rmdir);      WRAP(symlink);    WRAP(rename);
+    WRAP(link);       WRAP(chmod);      WRAP(chown);      WRAP(truncate);
+    WRAP(utime);      WRAP(open);       WRAP(read);       WRAP(write);
+    WRAP(statfs);     WRAP(flush);      WRAP(release);    WRAP(fsync);
+    WRAP(setxattr);   WRAP(getxattr);   WRAP(listxattr);  WRAP(removexattr);
+    WRAP(opendir);    WRAP(readdir);    WRAP(releasedir); WRAP(fsyncdir);
+    WRAP(access);     WRAP(create);     WRAP(ftruncate);  WRAP(fgetattr);
+    WRAP(write_buf);  WRAP(read_buf);
+#undef WRAP
+}
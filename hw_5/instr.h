@@ -0,0 +1,26 @@
+#ifndef _INSTR_H_
+#define _INSTR_H_
+// Instrumentation layer: instr_wrap() replaces each entry in bb_oper
+// with a wrapper that times the real bb_* call and passes the result
+// on to the live statistics (stats.c) and/or the binary trace
+// (trace.c), and tells log.c which call is under way so it can pick
+// what of it to log.
+
+#include <stdint.h>
+#include <time.h>
+
+#define INSTR_STATS 0x1
+#define INSTR_TRACE 0x2
+#define INSTR_LOG   0x4
+
+struct fuse_operations;
+void instr_wrap(struct fuse_operations *ops, int what);
+
+static inline uint64_t instr_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#endif
@@ -0,0 +1,815 @@
+// Write-ahead journal, see journal.h.
+//
+// The log file is a superblock, then a ring of jn.size bytes of
+// records, each a struct jn_rec, the path it's about, then any data,
+// padded to 8 bytes.  Records that don't fit before the end of the
+// ring are preceded by a JN_WRAP record, or by nothing if there isn't
+// room for one, and start again at the front.  The superblock says
+// where the oldest record that may not be in the files yet is, and
+// its sequence number; replay goes from there for as long as each
+// record has the next number and its checksum is right.  Checksums
+// are seeded with a number picked at every mount, so records left in
+// the ring from an earlier mount never pass for new ones.
+//
+// jn.lock covers the ring.  Records are written to the log under it,
+// which keeps them in order and makes jn.tail the end of what's
+// written; the fdatasync()s and checkpoints happen without it.
+// jn.ns is held for reading from finding a handle's path to logging
+// under it, and for writing across a rename or unlink.  Appends and
+// truncates to a file also hold its jn.ends stripe, so an O_APPEND
+// write's end can't move between finding it and writing there through
+// another handle.
+
+#include "params.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "instr.h"
+#include "journal.h"
+#include "log.h"
+#include "xxhash.h"
+
+#define JN_MAGIC    0x4a424242u     // "BBBJ"
+#define JN_VERSION  1
+#define JN_SUPER    4096            // the superblock's share of the file
+#define JN_PIECE    (256 << 10)     // writes are logged this much at a time
+#define JN_ENDS     64              // stripes of jn.ends
+#define JN_ALIGN(n) (((n) + 7) & ~(size_t) 7)
+
+enum {
+    JN_WRITE = 1,
+    JN_TRUNCATE,
+    JN_UNLINK,
+    JN_WRAP,
+};
+
+struct jn_super {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t size;              // of the ring
+    uint64_t head;              // the oldest record still needed, in the ring
+    uint64_t seq;               // ... and its number
+    uint64_t run;               // checksum seed for this mount's records
+    uint64_t sum;
+};
+
+struct jn_rec {
+    uint32_t magic;
+    uint16_t type;
+    uint16_t pathlen;
+    uint32_t len;               // data after the path
+    uint32_t mode;              // JN_WRITE, JN_TRUNCATE: to create the file with
+    uint64_t seq;
+    uint64_t off;               // JN_WRITE: where; JN_TRUNCATE: the size
+    uint64_t sum;               // of the record with sum 0, the path and the data
+};
+
+struct journal_file {
+    pthread_mutex_t lock;
+    unsigned gen;               // of jn.gen when path was found
+    size_t pathlen;             // 0: not logged (unlinked, or not under rootdir)
+    uint32_t mode;
+    pthread_mutex_t *end;       // the file's jn.ends stripe
+    int direct;                 // written without being logged
+    char path[PATH_MAX];        // relative to rootdir
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t space;       // a checkpoint has made room
+    pthread_cond_t synced;      // an fdatasync() of the log is done
+    pthread_cond_t applied;     // a logged change has been made
+    pthread_cond_t wake;        // for the checkpointer
+    pthread_rwlock_t ns;
+    pthread_mutex_t settle;
+    pthread_mutex_t ends[JN_ENDS];  // by inode, see above
+    pthread_t checkpointer;
+    int running, stopping;
+
+    int rootfd, fd;
+    char root[PATH_MAX];
+    size_t rootlen;
+    uint64_t size, run, ms;
+    uint64_t tail, used;        // in the ring
+    uint64_t seq;               // the next record's
+    uint64_t synced_seq;        // records before this one are durable
+    int syncing, checkpointing, want;
+    unsigned epoch, applying[2];    // changes logged but not yet made
+    unsigned gen;               // bumped by every rename and unlink
+    int renamed;                // since the last syncfs()
+
+    // counters, under lock
+    uint64_t records, bytes, syncs, sync_calls, checkpoints, waits, replayed;
+    uint64_t ns_sync, ns_checkpoint;
+} jn = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .space = PTHREAD_COND_INITIALIZER,
+    .synced = PTHREAD_COND_INITIALIZER,
+    .applied = PTHREAD_COND_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+    .settle = PTHREAD_MUTEX_INITIALIZER,
+    .ends = { [0 ... JN_ENDS - 1] = PTHREAD_MUTEX_INITIALIZER },
+    .fd = -1,
+};
+
+static uint64_t jn_super_sum(struct jn_super *sb) {
+    struct jn_super t = *sb;
+
+    t.sum = 0;
+    return xxh64(&t, sizeof(t), 0);
+}
+
+static uint64_t jn_rec_sum(const struct jn_rec *r, uint64_t body) {
+    struct jn_rec t = *r;
+
+    t.sum = 0;
+    return xxh64(&t, sizeof(t), body);
+}
+
+static int jn_write_super(uint64_t head, uint64_t seq) {
+    struct jn_super sb = {
+        .magic = JN_MAGIC,
+        .version = JN_VERSION,
+        .size = jn.size,
+        .head = head,
+        .seq = seq,
+        .run = jn.run,
+    };
+
+    sb.sum = jn_super_sum(&sb);
+    if (pwrite(jn.fd, &sb, sizeof(sb), 0) != sizeof(sb)) return errno ? -errno : -EIO;
+    if (fdatasync(jn.fd) < 0) return -errno;
+    return 0;
+}
+
+// Everything logged so far goes into the files for good, and its
+// room in the ring is free again.  Called with jn.lock, which it
+// drops while syncing.
+static int jn_checkpoint(void) {
+    uint64_t head, seq, used, t0;
+    unsigned e;
+    int ret = 0;
+
+    // one at a time; someone else's may leave nothing for this one
+    while (jn.checkpointing) pthread_cond_wait(&jn.space, &jn.lock);
+    if (jn.used == 0) return 0;
+    jn.checkpointing = 1;
+    t0 = instr_now();
+
+    // what's logged up to here has to have been done, too
+    head = jn.tail;
+    seq = jn.seq;
+    used = jn.used;
+    e = jn.epoch++;
+    while (jn.applying[e & 1] > 0) pthread_cond_wait(&jn.applied, &jn.lock);
+    pthread_mutex_unlock(&jn.lock);
+
+    // the files are all on one filesystem, the log's
+    if (syncfs(jn.fd) < 0) ret = -errno;
+
+    pthread_mutex_lock(&jn.lock);
+    // the superblock has to say so before the room is reused, or a
+    // replay would run into new records where it expects old ones
+    if (ret == 0) ret = jn_write_super(head, seq);
+    if (ret == 0) {
+        jn.used -= used;
+        if (jn.synced_seq < seq) jn.synced_seq = seq;
+        jn.checkpoints++;
+        jn.ns_checkpoint += instr_now() - t0;
+    } else {
+        log_err("journal checkpoint: %s\n", strerror(-ret));
+    }
+    jn.checkpointing = 0;
+    jn.want = 0;
+    pthread_cond_broadcast(&jn.space);
+    pthread_cond_broadcast(&jn.synced);
+    return ret;
+}
+
+// Append a record, waiting for room if need be.  On success the caller
+// has a change to make, and calls jn_applied() with *epoch once it has.
+static int jn_append(int type, const char *path, size_t pathlen, uint32_t mode, uint64_t off,
+        const void *data, size_t len, unsigned *epoch) {
+    static const char pad[8];
+    struct jn_rec r = {
+        .magic = JN_MAGIC,
+        .type = type,
+        .pathlen = pathlen,
+        .len = len,
+        .mode = mode,
+        .off = off,
+    };
+    struct iovec iov[4];
+    size_t need = JN_ALIGN(sizeof(r) + pathlen + len), waste;
+    uint64_t body;
+    ssize_t n;
+
+    body = xxh64(data, len, xxh64(path, pathlen, 0));
+
+    pthread_mutex_lock(&jn.lock);
+    for (;;) {
+        waste = jn.tail + need > jn.size ? jn.size - jn.tail : 0;
+        if (jn.used + waste + need <= jn.size) break;
+        jn.want = 1;
+        jn.waits++;
+        pthread_cond_signal(&jn.wake);
+        pthread_cond_wait(&jn.space, &jn.lock);
+    }
+
+    if (waste) {
+        if (waste >= sizeof(r)) {
+            struct jn_rec w = { .magic = JN_MAGIC, .type = JN_WRAP, .seq = jn.seq };
+
+            w.sum = jn_rec_sum(&w, jn.run);
+            if (pwrite(jn.fd, &w, sizeof(w), JN_SUPER + jn.tail) != sizeof(w)) goto fail;
+            jn.seq++;
+        }
+        jn.tail = 0;
+        jn.used += waste;
+    }
+
+    r.seq = jn.seq;
+    r.sum = jn_rec_sum(&r, body ^ jn.run);
+    iov[0].iov_base = &r;
+    iov[0].iov_len = sizeof(r);
+    iov[1].iov_base = (void *) path;
+    iov[1].iov_len = pathlen;
+    iov[2].iov_base = (void *) data;
+    iov[2].iov_len = len;
+    iov[3].iov_base = (void *) pad;
+    iov[3].iov_len = need - (sizeof(r) + pathlen + len);
+    n = pwritev(jn.fd, iov, 4, JN_SUPER + jn.tail);
+    if (n != (ssize_t) need) goto fail;
+
+    jn.tail += need;
+    if (jn.tail == jn.size) jn.tail = 0;
+    jn.used += need;
+    jn.seq++;
+    jn.records++;
+    jn.bytes += need;
+    *epoch = jn.epoch;
+    jn.applying[*epoch & 1]++;
+    if (jn.used > jn.size / 2 && !jn.want) {
+        jn.want = 1;
+        pthread_cond_signal(&jn.wake);
+    }
+    pthread_mutex_unlock(&jn.lock);
+    return 0;
+
+fail:
+    // a partly written record fails its checksum, and ends a replay
+    // right there; nothing after it is logged until it's overwritten
+    n = errno ? -errno : -EIO;
+    pthread_mutex_unlock(&jn.lock);
+    log_err("journal append: %s\n", strerror(-n));
+    return n;
+}
+
+static void jn_applied(unsigned epoch) {
+    pthread_mutex_lock(&jn.lock);
+    if (--jn.applying[epoch & 1] == 0) pthread_cond_broadcast(&jn.applied);
+    pthread_mutex_unlock(&jn.lock);
+}
+
+// A rename can't be redone from the log, so it has to be on disk
+// before anything logged after it can refer to the names it changed.
+// Called with jn.ns held for reading, so no rename is under way.
+static int jn_settle(void) {
+    int ret = 0;
+
+    if (!__atomic_load_n(&jn.renamed, __ATOMIC_ACQUIRE)) return 0;
+    pthread_mutex_lock(&jn.settle);
+    if (jn.renamed) {
+        if (syncfs(jn.fd) < 0) ret = -errno;
+        else __atomic_store_n(&jn.renamed, 0, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&jn.settle);
+    return ret;
+}
+
+// Where fd is, under rootdir, as of the last rename or unlink.  A file
+// that's been unlinked isn't logged: a replay would bring it back.
+// Called with jf->lock and jn.ns.
+static int jn_path(struct journal_file *jf, int fd) {
+    unsigned gen = __atomic_load_n(&jn.gen, __ATOMIC_ACQUIRE);
+    char proc[64], *real;
+    struct stat st;
+
+    if (jf->gen == gen) return jf->pathlen > 0;
+    jf->gen = gen;
+    jf->pathlen = 0;
+
+    snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+    if (fstat(fd, &st) < 0 || st.st_nlink == 0) return 0;
+    real = realpath(proc, NULL);
+    if (real == NULL) return 0;
+    if (strncmp(real, jn.root, jn.rootlen) == 0 && real[jn.rootlen] == '/' &&
+            strlen(real + jn.rootlen + 1) < sizeof(jf->path)) {
+        strcpy(jf->path, real + jn.rootlen + 1);
+        jf->pathlen = strlen(jf->path);
+        jf->mode = st.st_mode & 07777;
+    }
+    free(real);
+    return jf->pathlen > 0;
+}
+
+static ssize_t jn_pwrite_all(int fd, const void *buf, size_t len, off_t off) {
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < len) {
+        n = pwrite(fd, (const char *) buf + done, len - done, off + done);
+        if (n < 0) return done ? (ssize_t) done : -1;
+        done += n;
+    }
+    return done;
+}
+
+ssize_t journal_write(struct journal_file *jf, int fd, const void *buf, size_t len, off_t off) {
+    const char *p = buf;
+    size_t done = 0, piece;
+    unsigned epoch;
+    struct stat st;
+    ssize_t n = 0;
+    int ret = 0, locked = 0;
+
+    pthread_rwlock_rdlock(&jn.ns);
+    pthread_mutex_lock(&jf->lock);
+    if (!jn_path(jf, fd)) {
+        jf->direct = 1;
+        n = off < 0 ? write(fd, buf, len) : pwrite(fd, buf, len, off);
+        goto out;
+    }
+    ret = jn_settle();
+    if (ret < 0) {
+        errno = -ret;
+        n = -1;
+        goto out;
+    }
+
+    // an O_APPEND write lands wherever the end is; pin that down first,
+    // and keep other handles' appends and truncates off it until it's
+    // written
+    if (off < 0) {
+        pthread_mutex_lock(jf->end);
+        locked = 1;
+        if (fstat(fd, &st) < 0) {
+            n = -1;
+            goto out;
+        }
+        off = st.st_size;
+    }
+
+    while (done < len) {
+        piece = len - done < JN_PIECE ? len - done : JN_PIECE;
+        ret = jn_append(JN_WRITE, jf->path, jf->pathlen, jf->mode, off + done, p + done, piece,
+                &epoch);
+        if (ret < 0) break;
+        n = jn_pwrite_all(fd, p + done, piece, off + done);
+        jn_applied(epoch);
+        if (n < 0) break;
+        done += n;
+        if ((size_t) n < piece) break;
+    }
+    if (done > 0) n = done;
+    else if (ret < 0) {
+        errno = -ret;
+        n = -1;
+    }
+
+out:
+    if (locked) pthread_mutex_unlock(jf->end);
+    pthread_mutex_unlock(&jf->lock);
+    pthread_rwlock_unlock(&jn.ns);
+    return n;
+}
+
+int journal_truncate(struct journal_file *jf, int fd, off_t size) {
+    unsigned epoch;
+    int ret = 0;
+
+    pthread_rwlock_rdlock(&jn.ns);
+    pthread_mutex_lock(&jf->lock);
+    pthread_mutex_lock(jf->end);
+    if (jn_path(jf, fd)) {
+        ret = jn_settle();
+        if (ret == 0) ret = jn_append(JN_TRUNCATE, jf->path, jf->pathlen, jf->mode, size, NULL, 0, &epoch);
+        if (ret == 0) {
+            if (ftruncate(fd, size) < 0) ret = -errno;
+            jn_applied(epoch);
+        }
+    } else {
+        jf->direct = 1;
+        if (ftruncate(fd, size) < 0) ret = -errno;
+    }
+    pthread_mutex_unlock(jf->end);
+    pthread_mutex_unlock(&jf->lock);
+    pthread_rwlock_unlock(&jn.ns);
+
+    if (ret < 0) {
+        errno = -ret;
+        return -1;
+    }
+    return 0;
+}
+
+int journal_truncate_path(const char *path, off_t size) {
+    struct journal_file *jf;
+    int fd, ret, err;
+
+    fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    jf = journal_open(fd, 0);
+    if (jf) {
+        ret = journal_truncate(jf, fd, size);
+        err = errno;
+        journal_close(jf);
+    } else {
+        ret = ftruncate(fd, size);
+        err = errno;
+    }
+    close(fd);
+    errno = err;
+    return ret;
+}
+
+int journal_sync(struct journal_file *jf, int fd) {
+    uint64_t want, upto, t0;
+    int ret = 0, direct;
+
+    pthread_mutex_lock(&jf->lock);
+    direct = jf->direct;
+    pthread_mutex_unlock(&jf->lock);
+
+    // anything that went straight to the file has to be synced there
+    if (direct && fdatasync(fd) < 0) return -errno;
+
+    // Group commit: one fdatasync() of the log covers every record
+    // written before it started, so whoever finds one going waits for
+    // it (and maybe the next) rather than starting their own.  fsync()
+    // covers writes through every handle on the file, so it waits for
+    // everything logged so far, not just this handle's.
+    pthread_mutex_lock(&jn.lock);
+    jn.sync_calls++;
+    want = jn.seq;
+    while (ret == 0 && jn.synced_seq < want) {
+        if (jn.syncing) {
+            pthread_cond_wait(&jn.synced, &jn.lock);
+            continue;
+        }
+        jn.syncing = 1;
+        upto = jn.seq;
+        pthread_mutex_unlock(&jn.lock);
+
+        t0 = instr_now();
+        if (fdatasync(jn.fd) < 0) ret = -errno;
+
+        pthread_mutex_lock(&jn.lock);
+        jn.syncing = 0;
+        if (ret == 0 && jn.synced_seq < upto) jn.synced_seq = upto;
+        jn.syncs++;
+        jn.ns_sync += instr_now() - t0;
+        pthread_cond_broadcast(&jn.synced);
+    }
+    pthread_mutex_unlock(&jn.lock);
+    return ret;
+}
+
+struct journal_file *journal_open(int fd, int trunc) {
+    struct journal_file *jf;
+    struct stat st;
+
+    if (!jn.running) return NULL;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) return NULL;
+    jf = malloc(sizeof(*jf));
+    if (jf == NULL) return NULL;
+    pthread_mutex_init(&jf->lock, NULL);
+    jf->gen = __atomic_load_n(&jn.gen, __ATOMIC_ACQUIRE) - 1;   // look it up
+    jf->pathlen = 0;
+    jf->end = &jn.ends[(st.st_ino ^ st.st_dev) % JN_ENDS];
+    jf->direct = 0;
+
+    // earlier writes to the file mustn't come back over what's written
+    // after the truncate
+    if (trunc && journal_truncate(jf, fd, 0) < 0)
+        log_err("journal_open: can't log the truncate: %s\n", strerror(errno));
+    return jf;
+}
+
+void journal_close(struct journal_file *jf) {
+    if (jf == NULL) return;
+    pthread_mutex_destroy(&jf->lock);
+    free(jf);
+}
+
+void journal_ns_begin(int rename) {
+    if (!jn.running) return;
+    pthread_rwlock_wrlock(&jn.ns);
+    if (rename) {
+        pthread_mutex_lock(&jn.lock);
+        jn_checkpoint();
+        pthread_mutex_unlock(&jn.lock);
+    }
+}
+
+void journal_ns_end(int rename) {
+    if (!jn.running) return;
+    // every handle looks its path up again
+    __atomic_add_fetch(&jn.gen, 1, __ATOMIC_RELEASE);
+    if (rename) jn.renamed = 1;
+    pthread_rwlock_unlock(&jn.ns);
+}
+
+int journal_unlink(int dirfd, const char *name) {
+    char proc[64], *real, *path;
+    const char *rel;
+    unsigned epoch;
+    int ret;
+
+    // with nothing logged, there's nothing a replay could bring back
+    if (!jn.running || __atomic_load_n(&jn.used, __ATOMIC_RELAXED) == 0) return 0;
+
+    snprintf(proc, sizeof(proc), "/proc/self/fd/%d", dirfd);
+    real = realpath(proc, NULL);
+    if (real == NULL) return -1;
+    ret = 0;
+    if (strncmp(real, jn.root, jn.rootlen) == 0 &&
+            (real[jn.rootlen] == '/' || real[jn.rootlen] == '\0')) {
+        rel = real + jn.rootlen + (real[jn.rootlen] == '/');
+        ret = jn_settle();
+        if (ret == 0 && asprintf(&path, "%s%s%s", rel, rel[0] ? "/" : "", name) < 0)
+            ret = -ENOMEM;
+        if (ret == 0) {
+            ret = jn_append(JN_UNLINK, path, strlen(path), 0, 0, NULL, 0, &epoch);
+            if (ret == 0) jn_applied(epoch);
+            free(path);
+        }
+    }
+    free(real);
+    if (ret < 0) {
+        errno = -ret;
+        return -1;
+    }
+    return 0;
+}
+
+// The checkpointer: every jn.ms, or when the ring is half full
+static void *jn_checkpointer(void *arg) {
+    struct timespec ts;
+
+    pthread_mutex_lock(&jn.lock);
+    while (!jn.stopping) {
+        if (!jn.want) {
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec += (ts.tv_nsec + jn.ms * 1000000) / 1000000000;
+            ts.tv_nsec = (ts.tv_nsec + jn.ms * 1000000) % 1000000000;
+            pthread_cond_timedwait(&jn.wake, &jn.lock, &ts);
+            if (jn.stopping) break;
+        }
+        jn_checkpoint();
+        jn.want = 0;
+    }
+    pthread_mutex_unlock(&jn.lock);
+    return NULL;
+}
+
+// Replay
+
+// open a file a record names, making it and the directories above it
+// if a crash lost them
+static int jn_replay_open(const char *path, uint32_t mode) {
+    char dir[PATH_MAX], *slash;
+    int fd;
+
+    fd = openat(jn.rootfd, path, O_WRONLY | O_CREAT | O_NOFOLLOW | O_CLOEXEC, mode);
+    if (fd >= 0 || errno != ENOENT) return fd;
+
+    snprintf(dir, sizeof(dir), "%s", path);
+    for (slash = strchr(dir, '/'); slash; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        if (mkdirat(jn.rootfd, dir, 0755) < 0 && errno != EEXIST) return -1;
+        *slash = '/';
+    }
+    return openat(jn.rootfd, path, O_WRONLY | O_CREAT | O_NOFOLLOW | O_CLOEXEC, mode);
+}
+
+// a record can't name anything outside rootdir
+static int jn_name_ok(const char *name) {
+    const char *p;
+
+    if (name[0] == '/') return 0;
+    for (p = name; p; p = strchr(p, '/')) {
+        if (*p == '/') p++;
+        if (p[0] == '.' && p[1] == '.' && (p[2] == '/' || p[2] == '\0')) return 0;
+    }
+    return 1;
+}
+
+static int jn_replay_one(const struct jn_rec *r, const char *path, const char *data) {
+    int fd, ret = 0;
+
+    if (r->type == JN_UNLINK) {
+        if (unlinkat(jn.rootfd, path, 0) < 0 && errno != ENOENT) return -errno;
+        return 0;
+    }
+    fd = jn_replay_open(path, r->mode);
+    if (fd < 0) return -errno;
+    if (r->type == JN_WRITE) {
+        if (jn_pwrite_all(fd, data, r->len, r->off) != (ssize_t) r->len) ret = errno ? -errno : -EIO;
+    } else if (ftruncate(fd, r->off) < 0) {
+        ret = -errno;
+    }
+    close(fd);
+    return ret;
+}
+
+// Apply every record after the checkpoint sb names, in order; returns
+// how many there were, or -errno
+static long jn_replay(const struct jn_super *sb) {
+    uint64_t pos = sb->head, seq = sb->seq, body;
+    struct jn_rec r;
+    char *rec = NULL, *path;
+    size_t len, cap = 0;
+    long count = 0;
+    int ret;
+
+    for (;;) {
+        if (sb->size - pos < sizeof(r)) pos = 0;
+        if (pread(jn.fd, &r, sizeof(r), JN_SUPER + pos) != sizeof(r)) break;
+        if (r.magic != JN_MAGIC || r.seq != seq) break;
+        if (r.type == JN_WRAP) {
+            if (r.sum != jn_rec_sum(&r, sb->run)) break;
+            pos = 0;
+            seq++;
+            continue;
+        }
+        len = JN_ALIGN(sizeof(r) + r.pathlen + r.len);
+        if (r.type < JN_WRITE || r.type > JN_UNLINK || r.pathlen == 0 || len > sb->size - pos)
+            break;
+        if (len > cap) {
+            char *t = realloc(rec, len + 1);
+            if (t == NULL) {
+                free(rec);
+                return -ENOMEM;
+            }
+            rec = t;
+            cap = len;
+        }
+        if (pread(jn.fd, rec, len, JN_SUPER + pos) != (ssize_t) len) break;
+        path = rec + sizeof(r);
+        body = xxh64(path + r.pathlen, r.len, xxh64(path, r.pathlen, 0));
+        if (r.sum != jn_rec_sum(&r, body ^ sb->run)) break;
+
+        // the data goes right after the path; the path is copied out
+        // to NUL-terminate it
+        {
+            char name[PATH_MAX];
+
+            if (r.pathlen >= sizeof(name) || memchr(path, '\0', r.pathlen)) break;
+            memcpy(name, path, r.pathlen);
+            name[r.pathlen] = '\0';
+            if (!jn_name_ok(name)) break;
+            ret = jn_replay_one(&r, name, path + r.pathlen);
+        }
+        if (ret < 0)
+            log_err("journal replay: record %llu: %s\n",
+                    (unsigned long long) r.seq, strerror(-ret));
+        count++;
+        seq++;
+        pos += len;
+        if (pos == sb->size) pos = 0;
+    }
+    free(rec);
+    jn.seq = seq;
+    return count;
+}
+
+int journal_enabled(void) {
+    return jn.running;
+}
+
+int journal_start(int rootfd, const char *rootdir, size_t size, unsigned ms) {
+    struct jn_super sb;
+    pthread_rwlockattr_t attr;
+    long count = 0;
+    int ret;
+
+    if (realpath(rootdir, jn.root) == NULL) return -errno;
+    jn.rootlen = strlen(jn.root);
+    if (jn.rootlen == 1) jn.rootlen = 0;    // rootdir is /
+    jn.rootfd = rootfd;
+    jn.size = size & ~(uint64_t) 7;
+    jn.ms = ms ? ms : JOURNAL_MS;
+
+    jn.fd = openat(rootfd, JOURNAL_FILE, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if (jn.fd < 0) return -errno;
+
+    // whatever the last mount left
+    if (pread(jn.fd, &sb, sizeof(sb), 0) == sizeof(sb) && sb.magic == JN_MAGIC &&
+            sb.version == JN_VERSION && sb.sum == jn_super_sum(&sb) && sb.head < sb.size) {
+        count = jn_replay(&sb);
+        if (count < 0 || (count > 0 && syncfs(jn.fd) < 0)) {
+            ret = count < 0 ? (int) count : -errno;
+            log_err("journal_start: replay: %s\n", strerror(-ret));
+            goto fail;
+        }
+        if (count) log_msg("    journal_start: replayed %ld records\n", count);
+    }
+    jn.replayed = count;
+
+    // a new, empty ring, allocated up front so that fdatasync() has
+    // only the data to write, never the file's size
+    if (ftruncate(jn.fd, JN_SUPER + jn.size) < 0) {
+        ret = -errno;
+        goto fail;
+    }
+    fallocate(jn.fd, 0, 0, JN_SUPER + jn.size);
+    if (getrandom(&jn.run, sizeof(jn.run), 0) != sizeof(jn.run))
+        jn.run = instr_now() ^ (uint64_t) getpid() << 32;
+    jn.tail = jn.used = 0;
+    jn.synced_seq = jn.seq;
+    ret = jn_write_super(0, jn.seq);
+    if (ret < 0) goto fail;
+
+    pthread_rwlockattr_init(&attr);
+    // renames mustn't wait out a steady stream of writes
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&jn.ns, &attr);
+    pthread_rwlockattr_destroy(&attr);
+
+    jn.stopping = 0;
+    ret = pthread_create(&jn.checkpointer, NULL, jn_checkpointer, NULL);
+    if (ret != 0) {
+        ret = -ret;
+        pthread_rwlock_destroy(&jn.ns);
+        goto fail;
+    }
+    jn.running = 1;
+    return 0;
+
+fail:
+    close(jn.fd);
+    jn.fd = -1;
+    return ret;
+}
+
+// Called from bb_destroy(), after every file is released: a last
+// checkpoint leaves the log empty, so the next mount has nothing to do
+void journal_stop(void) {
+    if (!jn.running) return;
+
+    pthread_mutex_lock(&jn.lock);
+    jn.stopping = 1;
+    pthread_cond_signal(&jn.wake);
+    pthread_mutex_unlock(&jn.lock);
+    pthread_join(jn.checkpointer, NULL);
+
+    pthread_mutex_lock(&jn.lock);
+    jn_checkpoint();
+    pthread_mutex_unlock(&jn.lock);
+
+    log_msg("    journal: %llu records, %llu log syncs, %llu checkpoints\n",
+            (unsigned long long) jn.records, (unsigned long long) jn.syncs,
+            (unsigned long long) jn.checkpoints);
+    jn.running = 0;
+    pthread_rwlock_destroy(&jn.ns);
+    close(jn.fd);
+    jn.fd = -1;
+}
+
+void journal_report(FILE *out) {
+    unsigned long long records, bytes, syncs, calls, ckpts, waits, used;
+    double sync_ms, ckpt_ms;
+
+    pthread_mutex_lock(&jn.lock);
+    records = jn.records;
+    bytes = jn.bytes;
+    syncs = jn.syncs;
+    calls = jn.sync_calls;
+    ckpts = jn.checkpoints;
+    waits = jn.waits;
+    used = jn.used;
+    sync_ms = jn.ns_sync / 1e6;
+    ckpt_ms = jn.ns_checkpoint / 1e6;
+    pthread_mutex_unlock(&jn.lock);
+
+    fprintf(out, "journal: %llu records, %llu bytes logged, %llu of %llu bytes in use, "
+            "%llu replayed at mount\n",
+            records, bytes, used, (unsigned long long) jn.size,
+            (unsigned long long) jn.replayed);
+    fprintf(out, "journal: %llu fsyncs took %llu log syncs (%.2f each, %.3f ms average)\n",
+            calls, syncs, calls ? (double) syncs / calls : 0.0, syncs ? sync_ms / syncs : 0.0);
+    fprintf(out, "journal: %llu checkpoints (%.1f ms average), %llu waits for room\n",
+            ckpts, ckpts ? ckpt_ms / ckpts : 0.0, waits);
+}
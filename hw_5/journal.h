@@ -0,0 +1,76 @@
+#ifndef _JOURNAL_H_
+#define _JOURNAL_H_
+// A write-ahead journal for file data, turned on with -o journal.
+//
+// Every write, truncate and unlink is appended to one sequential log,
+// rootdir/JOURNAL_FILE (hidden from the mount, which can't make,
+// remove or rename anything by that name), before it's done to
+// the backing file.  fsync() then only has to make the log durable,
+// not the files: one fdatasync() of one file, all of it appended in
+// order, where it would otherwise be a seek and a flush per file.
+// Concurrent fsync()s share that fdatasync() -- whoever gets there
+// first syncs everything logged so far, and the rest wait for it --
+// so the more writers sync at once, the fewer syncs each one costs.
+//
+// A background thread checkpoints: once the log is half full, or
+// every journal_ms, it syncs the backing filesystem, after which
+// everything logged so far is in the files themselves and the space
+// in the log can be used again.  At mount time, whatever was logged
+// after the last checkpoint is replayed into the files, in order, so
+// whatever had been fsync()ed is there after a crash, and nothing is
+// left with some of its logged writes and not others that came before.
+//
+// The log names files by their path under rootdir, so a rename
+// checkpoints first: the paths in the log are never out of date.
+// What's logged is what reaches the backing file, after the content
+// transform, so replaying needs no keys.  Metadata other than a
+// file's size and existence (mode, owner, times, directories) is
+// left to the backing filesystem.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#define JOURNAL_FILE    ".bbfs_journal"
+
+#define JOURNAL_MB      64
+#define JOURNAL_MS      5000
+
+struct journal_file;
+
+// called from bb_init() and bb_destroy(); replays whatever is in the
+// log first.  size is in bytes.
+int journal_start(int rootfd, const char *rootdir, size_t size, unsigned ms);
+void journal_stop(void);
+int journal_enabled(void);
+
+// A handle's view of the journal, NULL if it's off or fd isn't a
+// regular file.  trunc says the file was just truncated to 0 by the
+// open itself, which has to be logged too.
+struct journal_file *journal_open(int fd, int trunc);
+void journal_close(struct journal_file *jf);
+
+// log, then do; these return what pwrite()/ftruncate() would.  An
+// offset of -1 appends, at the end as logged even with other handles
+// appending to the file at once.
+ssize_t journal_write(struct journal_file *jf, int fd, const void *buf, size_t len, off_t off);
+int journal_truncate(struct journal_file *jf, int fd, off_t size);
+// truncate() for a file that may not be open; path may be a /proc link
+int journal_truncate_path(const char *path, off_t size);
+// make everything this handle has logged durable; returns 0 or -errno
+int journal_sync(struct journal_file *jf, int fd);
+
+// A rename or unlink goes between these, so no write is logged under
+// a path it's changing.  The log can't redo a rename, so one checkpoints
+// first and is synced before anything is logged after it.
+// journal_unlink() logs the unlink of dirfd/name, once it's done;
+// returns 0, or -1 and errno.
+void journal_ns_begin(int rename);
+void journal_ns_end(int rename);
+int journal_unlink(int dirfd, const char *name);
+
+// the "journal:" lines in the stats
+void journal_report(FILE *out);
+
+#endif
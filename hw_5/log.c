@@ -5,16 +5,58 @@
 
 #include "params.h"
 
+#include <fcntl.h>
 #include <fuse.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
 
 #include "log.h"
+#include "logring.h"
+#include "trace.h"
+
+// cleared in binary trace mode, where the records come from trace.c
+static int log_text = 1;
+
+// the calls there are most of, which log_sample thins out
+#define LOG_SAMPLED ((1ULL << BB_OP_READ) | (1ULL << BB_OP_WRITE) | \
+      (1ULL << BB_OP_GETATTR) | (1ULL << BB_OP_FGETATTR))
+
+// What's logged, see log.h.  The settings are read without the lock;
+// it only keeps two reloads from running at once.
+static struct {
+   int level;
+   uint64_t ops;                 // a bit per enum bb_op
+   unsigned sample;              // 1 in this many of LOG_SAMPLED
+   unsigned seen[BB_OP_COUNT];   // calls of each sampled op so far
+   int ctl_dir;                  // where bbfs was started, for LOG_CTL_FILE
+   volatile sig_atomic_t reload;
+   pthread_mutex_t lock;
+} lf = {
+   .level = LOG_DETAIL,
+   .ops = ~0ULL,
+   .sample = 1,
+   .ctl_dir = -1,
+   .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+// bbfs.log, from log_open().  Kept here rather than taken from
+// BB_DATA: the flusher threads, the policy reloader and the like
+// log too, and fuse_get_context() has no private_data for them.
+static FILE *log_file;
+
+// set while this thread is in a call that isn't being logged
+static __thread int log_skip;
+
+static const char *const level_names[] = { "off", "error", "call", "detail" };
 
 FILE *log_open() {
    FILE *logfile;
@@ -30,22 +72,259 @@ FILE *log_open() {
    // set logfile to line buffering - I/O is stored a line at a time
    // and then flushed
    setvbuf(logfile, NULL, _IOLBF, 0);
+   log_file = logfile;
+
+   // LOG_CTL_FILE goes next to bbfs.log, wherever fuse_main() moves us
+   lf.ctl_dir = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
    return logfile;
 }
 
+int log_set_level(const char *name) {
+   int i;
+
+   if (name == NULL) return 0;
+   for (i = LOG_OFF; i <= LOG_DETAIL; i++)
+      if (strcmp(name, level_names[i]) == 0) {
+         __atomic_store_n(&lf.level, i, __ATOMIC_RELAXED);
+         return 0;
+      }
+   return -1;
+}
+
+// "read:write" logs just those, "-getattr" everything else, and
+// "none:read" or "all:-read" say what to start from
+int log_set_ops(const char *list) {
+   char buf[512], *tok, *save;
+   uint64_t ops = 0;
+   unsigned op;
+   int drop;
+
+   if (list == NULL) return 0;
+   if (strlen(list) >= sizeof(buf)) return -1;
+   strcpy(buf, list);
+   if (buf[0] == '-') ops = ~0ULL;
+   for (tok = strtok_r(buf, ":", &save); tok; tok = strtok_r(NULL, ":", &save)) {
+      drop = tok[0] == '-';
+      if (drop) tok++;
+      if (strcmp(tok, "all") == 0) {
+         ops = drop ? 0 : ~0ULL;
+         continue;
+      }
+      if (strcmp(tok, "none") == 0) {
+         ops = 0;
+         continue;
+      }
+      for (op = 0; op < BB_OP_COUNT && strcmp(tok, bb_op_name(op)) != 0; op++) ;
+      if (op == BB_OP_COUNT) return -1;
+      if (drop) ops &= ~(1ULL << op);
+      else ops |= 1ULL << op;
+   }
+   __atomic_store_n(&lf.ops, ops, __ATOMIC_RELAXED);
+   return 0;
+}
+
+void log_set_sample(unsigned n) {
+   __atomic_store_n(&lf.sample, n ? n : 1, __ATOMIC_RELAXED);
+}
+
+static void log_sigusr2(int sig) {
+   lf.reload = 1;
+}
+
+// SIGUSR2 only sets lf.reload; the next thread to log anything reads
+// LOG_CTL_FILE, one "key=value" at a time
+static void log_reload(void) {
+   char buf[1024], *tok, *save, *val;
+   const char *bad = NULL;
+   ssize_t n = -1;
+   unsigned long v;
+   int fd;
+
+   pthread_mutex_lock(&lf.lock);
+   if (!lf.reload) {
+      pthread_mutex_unlock(&lf.lock);
+      return;
+   }
+   lf.reload = 0;
+   fd = openat(lf.ctl_dir, LOG_CTL_FILE, O_RDONLY | O_CLOEXEC);
+   if (fd >= 0) {
+      n = read(fd, buf, sizeof(buf) - 1);
+      close(fd);
+   }
+   if (n < 0) bad = LOG_CTL_FILE;
+   else buf[n] = '\0';
+
+   for (tok = n < 0 ? NULL : strtok_r(buf, " \t\n,", &save); tok;
+         tok = strtok_r(NULL, " \t\n,", &save)) {
+      val = strchr(tok, '=');
+      if (val == NULL) {
+         bad = tok;
+         continue;
+      }
+      *val++ = '\0';
+      if (strcmp(tok, "level") == 0) {
+         if (log_set_level(val) < 0) bad = val;
+      } else if (strcmp(tok, "ops") == 0) {
+         if (log_set_ops(val) < 0) bad = val;
+      } else if (strcmp(tok, "sample") == 0) {
+         v = strtoul(val, &val, 10);
+         if (*val) bad = tok;
+         else log_set_sample(v);
+      } else {
+         bad = tok;
+      }
+   }
+   pthread_mutex_unlock(&lf.lock);
+   if (bad) log_err("log_reload: can't make sense of %s\n", bad);
+}
+
+// Whether to log the call this thread is starting; the answer holds
+// until log_call_done().
+int log_call(int op) {
+   unsigned sample;
+
+   if (lf.reload) log_reload();
+   log_skip = 1;
+   if (__atomic_load_n(&lf.level, __ATOMIC_RELAXED) < LOG_CALL) return 0;
+   if (!(__atomic_load_n(&lf.ops, __ATOMIC_RELAXED) & (1ULL << op))) return 0;
+   sample = __atomic_load_n(&lf.sample, __ATOMIC_RELAXED);
+   if (sample > 1 && (LOG_SAMPLED & (1ULL << op)) &&
+         __atomic_fetch_add(&lf.seen[op], 1, __ATOMIC_RELAXED) % sample != 0)
+      return 0;
+   log_skip = 0;
+   return 1;
+}
+
+void log_call_done(void) {
+   log_skip = 0;
+}
+
+// log_fi() and friends, which are only worth it at LOG_DETAIL
+static int log_details(void) {
+   return log_text && !log_skip && __atomic_load_n(&lf.level, __ATOMIC_RELAXED) >= LOG_DETAIL;
+}
+
+void log_report(FILE *out) {
+   uint64_t ops = __atomic_load_n(&lf.ops, __ATOMIC_RELAXED);
+   unsigned op, sample = __atomic_load_n(&lf.sample, __ATOMIC_RELAXED);
+   const char *sep = "";
+
+   fprintf(out, "log: level %s, ops ", level_names[__atomic_load_n(&lf.level, __ATOMIC_RELAXED)]);
+   if ((ops & ((1ULL << BB_OP_COUNT) - 1)) == (1ULL << BB_OP_COUNT) - 1) {
+      fprintf(out, "all");
+   } else {
+      for (op = 0; op < BB_OP_COUNT; op++)
+         if (ops & (1ULL << op)) {
+            fprintf(out, "%s%s", sep, bb_op_name(op));
+            sep = ":";
+         }
+      if (*sep == '\0') fprintf(out, "none");
+   }
+   if (sample > 1) fprintf(out, ", 1 in %u of read:write:getattr:fgetattr", sample);
+   fprintf(out, "\n");
+}
+
+// Hand logging over to the ring buffers in logring.c.  This can't
+// happen in log_open(): fuse_main() forks into the background after
+// main() has called us, and the flusher thread wouldn't survive the
+// fork.  So bb_init() calls this instead.
+void log_start(struct bb_state *state) {
+   struct sigaction sa;
+   size_t ring_size;
+   int policy = LOGRING_DROP;
+   int ret;
+
+   memset(&sa, 0, sizeof(sa));
+   sa.sa_handler = log_sigusr2;
+   sa.sa_flags = SA_RESTART;
+   sigemptyset(&sa.sa_mask);
+   sigaction(SIGUSR2, &sa, NULL);
+
+   log_file = state->logfile;
+
+   // the binary trace can only be written through the rings
+   if (state->log_sync && !state->trace) return;
+
+   if (state->log_policy && strcmp(state->log_policy, "block") == 0)
+      policy = LOGRING_BLOCK;
+   ring_size = (size_t) (state->log_ring_kb ? state->log_ring_kb : 256) << 10;
+
+   // nothing should be sitting in the stdio buffer, but make sure
+   // it lands before anything the flusher writes
+   fflush(state->logfile);
+   if (state->trace)
+      ret = logring_start(state->trace_fd, ring_size, policy, trace_drop_note);
+   else
+      ret = logring_start(fileno(state->logfile), ring_size, policy, NULL);
+   if (ret < 0) {
+      fprintf(state->logfile, "log_start: falling back to synchronous logging: %s\n",
+            strerror(-ret));
+      return;
+   }
+
+   if (state->trace) log_text = 0;
+}
+
+// Make sure everything logged so far is in bbfs.log
+void log_flush(void) {
+   if (logring_active()) logring_flush();
+   else if (log_file) fflush(log_file);
+}
+
+// Drain and stop the flusher thread; anything logged afterwards goes
+// straight to the FILE again.
+void log_close(void) {
+   signal(SIGUSR2, SIG_IGN);
+   logring_stop();
+}
+
+static void log_vmsg(int err, const char *format, va_list ap) {
+   int level;
+
+   if (!log_text) return;
+   if (lf.reload) log_reload();
+   // an error gets through whatever call it's in
+   level = __atomic_load_n(&lf.level, __ATOMIC_RELAXED);
+   if (err) {
+      if (level < LOG_ERROR) return;
+   } else if (log_skip || level < LOG_CALL) {
+      return;
+   }
+
+   // Normally the line is formatted into this thread's log ring and
+   // written out later by the flusher thread (see logring.c).
+   if (logring_active())
+      logring_vprintf(format, ap);
+   else if (log_file)
+      // write data (ap) formatted as in (format) to the stream
+      // (logfile) log_open() handed main() for bb_data, from any
+      // thread, FUSE's or not
+      vfprintf(log_file, format, ap);
+}
+
 void log_msg(const char *format, ...) {
    va_list ap;
+
    // Initialize the object of type va_list passed as argument ap to hold 
    // the information needed to retrieve the additional arguments after 
    // parameter 'format' with function vfprint.
    va_start(ap, format);
+   log_vmsg(0, format, ap);
+   va_end(ap);
+}
+
+// The same, for an error: it's logged at every level but off, with
+// "    ERROR " in front.
+void log_err(const char *format, ...) {
+   char line[256];
+   va_list ap;
 
-   // write data (ap) formatted as in (format) to the stream (logfile)
-   // BB_DATA defined in params.h:
-   // #define BB_DATA ((struct bb_state*)fuse_get_context()->private_data)
-   // hence the call below extracts the logfile from the private data
-   // that was entered in main of bbfs.c (as bb_data in the call to fuse_main)
-   vfprintf(BB_DATA->logfile, format, ap);
+   va_start(ap, format);
+   if (snprintf(line, sizeof(line), "    ERROR %s", format) < (int) sizeof(line))
+      log_vmsg(1, line, ap);
+   else
+      log_vmsg(1, format, ap);
+   va_end(ap);
 }
     
 // This dumps all the information in a struct fuse_file_info.  The struct
@@ -56,6 +335,8 @@ void log_msg(const char *format, ...) {
 
 
 void log_fi (struct fuse_file_info *fi) {
+   if (!log_details()) return;
+
    /** Open flags.  Available in open() and release() */
    log_struct(fi, flags, 0x%08x, );      // int flags;
    
@@ -87,6 +368,8 @@ void log_fi (struct fuse_file_info *fi) {
 // This dumps the info from a struct stat.  The struct is defined in
 // <bits/stat.h>; this is indirectly included from <fcntl.h>
 void log_stat(struct stat *si) {
+   if (!log_details()) return;
+
    //  dev_t     st_dev;     /* ID of device containing file */
    log_struct(si, st_dev, %lld, );
 	
@@ -128,6 +411,8 @@ void log_stat(struct stat *si) {
 }
 
 void log_statvfs(struct statvfs *sv) {
+   if (!log_details()) return;
+
    //  unsigned long  f_bsize;    /* file system block size */
    log_struct(sv, f_bsize, %ld, );
 	
@@ -163,6 +448,8 @@ void log_statvfs(struct statvfs *sv) {
 }
 
 void log_utime(struct utimbuf *buf) {
+   if (!log_details()) return;
+
    //    time_t actime;
    log_struct(buf, actime, 0x%08lx, );
    
@@ -7,10 +7,48 @@
   log_msg("    " #field " = " #format "\n", typecast st->field)
 
 FILE *log_open(void);
+void log_start(struct bb_state *state);
+void log_flush(void);
+void log_close(void);
 void log_fi (struct fuse_file_info *fi);
 void log_stat(struct stat *si);
 void log_statvfs(struct statvfs *sv);
 void log_utime(struct utimbuf *buf);
 
 void log_msg(const char *format, ...);
+// an error, logged at LOG_ERROR and up; the message goes without the
+// "    ERROR " every error line starts with
+void log_err(const char *format, ...) __attribute__((format(printf, 1, 2)));
+
+// What goes into bbfs.log.  Each level logs what the ones before it
+// do and more: errors are what log_err() logs, a call is its
+// "bb_<op>(...)" line and whatever else it logs about itself, and
+// details are the structs log_fi() and friends dump.  Calls are also
+// filtered by operation, and read, write, getattr and fgetattr, the
+// ones there are most of, can be sampled 1 in N; a call left out
+// still logs its errors.  Set with -o log_level, log_ops and
+// log_sample, and changed while mounted by writing the same settings
+// to LOG_CTL_FILE, next to bbfs.log, and sending bbfs SIGUSR2, e.g.
+// "level=call ops=-getattr:-access sample=100"; what the file doesn't
+// mention stays as it was.  Only the path API's calls, the ones
+// instr.c wraps, are told apart; -o lowlevel goes by the level alone.
+#define LOG_OFF     0
+#define LOG_ERROR   1
+#define LOG_CALL    2
+#define LOG_DETAIL  3           // the default: everything
+
+#define LOG_CTL_FILE "bbfs.logctl"
+
+// each returns 0, or -1 if it can't make sense of its argument; NULL
+// leaves things as they are
+int log_set_level(const char *name);
+int log_set_ops(const char *list);  // op:op..., "all", "none", -op to drop one
+void log_set_sample(unsigned n);
+
+// around each wrapped call, which log_call() says whether to log
+int log_call(int op);
+void log_call_done(void);
+
+// the "log:" line in the stats
+void log_report(FILE *out);
 #endif
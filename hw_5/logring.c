@@ -0,0 +1,351 @@
+// Lock-free per-thread ring buffers behind log_msg().
+//
+// Each logging thread owns one ring.  The thread is the only writer
+// of the ring's head and the flusher is the only writer of its tail,
+// so the two sides only need acquire/release ordering on those two
+// counters -- no locks on the logging path.  The mutex below is only
+// taken when a thread logs for the first time (to put its ring on
+// the list), and by the flusher when it sleeps.
+
+#include "params.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "logring.h"
+
+#define CACHELINE 64
+
+// max iovecs handed to a single writev() by the flusher
+#define LOGRING_IOV_MAX 64
+
+struct logring {
+    // producer side
+    uint64_t head __attribute__((aligned(CACHELINE)));
+    uint64_t dropped;
+
+    // consumer side
+    uint64_t tail __attribute__((aligned(CACHELINE)));
+    uint64_t reported;      // drops already noted in the log
+    int orphaned;           // owning thread has exited
+
+    char *buf;
+    size_t mask;
+    struct logring *next;
+};
+
+static struct {
+    int fd;
+    size_t ring_size;
+    int policy;
+    logring_note_t note;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;    // kicks the flusher
+    pthread_cond_t done;    // flusher finished a requested pass
+    pthread_key_t key;
+
+    struct logring *rings;
+    int running;
+    uint64_t flush_req;
+    uint64_t flush_done;
+} lr = {
+    .fd = -1,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+};
+
+static __thread struct logring *my_ring;
+
+// pthread key destructor: the ring can't be freed here since the
+// flusher may still be draining it, so just hand it over
+static void logring_orphan(void *arg) {
+    struct logring *r = arg;
+    __atomic_store_n(&r->orphaned, 1, __ATOMIC_RELEASE);
+}
+
+static struct logring *logring_register(void) {
+    struct logring *r;
+
+    r = calloc(1, sizeof(*r));
+    if (r == NULL) return NULL;
+    r->buf = malloc(lr.ring_size);
+    if (r->buf == NULL) {
+        free(r);
+        return NULL;
+    }
+    r->mask = lr.ring_size - 1;
+
+    pthread_mutex_lock(&lr.lock);
+    r->next = lr.rings;
+    __atomic_store_n(&lr.rings, r, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&lr.lock);
+
+    pthread_setspecific(lr.key, r);
+    my_ring = r;
+    return r;
+}
+
+static void logring_kick(void) {
+    pthread_cond_signal(&lr.wake);
+}
+
+// Queue len bytes as one record.  Returns 0, or -1 if the record was
+// dropped (full ring, or no ring could be allocated).
+int logring_write(const char *data, size_t len) {
+    struct logring *r = my_ring;
+    uint64_t head, tail;
+    size_t size, pos, first;
+
+    if (r == NULL && (r = logring_register()) == NULL) return -1;
+
+    size = r->mask + 1;
+    if (len > size) return -1;
+    head = r->head;
+
+    for (;;) {
+        tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+        if (size - (head - tail) >= len) break;
+
+        if (lr.policy == LOGRING_DROP) {
+            __atomic_store_n(&r->dropped, r->dropped + 1, __ATOMIC_RELAXED);
+            logring_kick();
+            return -1;
+        }
+
+        // LOGRING_BLOCK: let the flusher catch up
+        if (!logring_active()) return -1;
+        logring_kick();
+        nanosleep(&(struct timespec){ 0, 100000 }, NULL);
+    }
+
+    pos = head & r->mask;
+    first = size - pos;
+    if (first > len) first = len;
+    memcpy(r->buf + pos, data, first);
+    memcpy(r->buf, data + first, len - first);
+    __atomic_store_n(&r->head, head + len, __ATOMIC_RELEASE);
+
+    // don't wait for the timer if we're filling up
+    if (head + len - tail > size / 2) logring_kick();
+    return 0;
+}
+
+void logring_vprintf(const char *format, va_list ap) {
+    char line[LOGRING_LINE_MAX];
+    int len;
+
+    len = vsnprintf(line, sizeof(line), format, ap);
+    if (len < 0) return;
+    if (len >= (int) sizeof(line)) len = sizeof(line) - 1;
+    logring_write(line, len);
+}
+
+static size_t logring_text_note(char *buf, size_t len, uint64_t dropped) {
+    int n;
+
+    n = snprintf(buf, len, "\n[log: dropped %llu records]\n",
+            (unsigned long long) dropped);
+    return n < 0 ? 0 : (size_t) n < len ? (size_t) n : len - 1;
+}
+
+// writev() the whole iovec array, coping with short writes
+static void logring_writev(struct iovec *iov, int cnt) {
+    ssize_t n;
+
+    while (cnt > 0) {
+        n = writev(lr.fd, iov, cnt);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return;   // nowhere to report it; the data is lost
+        }
+        while (cnt > 0 && (size_t) n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt > 0) {
+            iov->iov_base = (char *) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+}
+
+// One pass over every ring.  Data is written straight out of the
+// rings and the tails are only advanced once writev() has returned.
+static void logring_drain(void) {
+    struct iovec iov[LOGRING_IOV_MAX];
+    struct logring *pend[LOGRING_IOV_MAX / 2];
+    uint64_t pend_head[LOGRING_IOV_MAX / 2];
+    char notes[LOGRING_IOV_MAX / 2][64];
+    int niov = 0, npend = 0, i;
+    struct logring *r;
+    uint64_t head, tail, dropped;
+    size_t pos, len, first;
+
+    for (r = __atomic_load_n(&lr.rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+        head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        tail = r->tail;
+        dropped = __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+        if (head == tail && dropped == r->reported) continue;
+
+        if (niov + 3 > LOGRING_IOV_MAX) {
+            logring_writev(iov, niov);
+            for (i = 0; i < npend; i++)
+                __atomic_store_n(&pend[i]->tail, pend_head[i], __ATOMIC_RELEASE);
+            niov = npend = 0;
+        }
+
+        if (dropped != r->reported) {
+            len = lr.note(notes[npend], sizeof(notes[npend]),
+                    dropped - r->reported);
+            iov[niov].iov_base = notes[npend];
+            iov[niov++].iov_len = len;
+            r->reported = dropped;
+        }
+
+        len = head - tail;
+        pos = tail & r->mask;
+        first = r->mask + 1 - pos;
+        if (first > len) first = len;
+        if (first > 0) {
+            iov[niov].iov_base = r->buf + pos;
+            iov[niov++].iov_len = first;
+        }
+        if (len > first) {
+            iov[niov].iov_base = r->buf;
+            iov[niov++].iov_len = len - first;
+        }
+        pend[npend] = r;
+        pend_head[npend++] = head;
+    }
+
+    if (niov > 0) logring_writev(iov, niov);
+    for (i = 0; i < npend; i++)
+        __atomic_store_n(&pend[i]->tail, pend_head[i], __ATOMIC_RELEASE);
+}
+
+// free rings whose threads have gone away, once they're empty.
+// Called with lr.lock held; the flusher is the only one that ever
+// unlinks, so the lock-free walk in logring_drain() stays safe.
+static void logring_reap(void) {
+    struct logring **pp = &lr.rings, *r;
+
+    while ((r = *pp) != NULL) {
+        if (__atomic_load_n(&r->orphaned, __ATOMIC_ACQUIRE) &&
+                __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == r->tail &&
+                r->dropped == r->reported) {
+            *pp = r->next;
+            free(r->buf);
+            free(r);
+        } else
+            pp = &r->next;
+    }
+}
+
+static void *logring_flusher(void *arg) {
+    struct timespec ts;
+    uint64_t req;
+
+    pthread_mutex_lock(&lr.lock);
+    while (lr.running) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += LOGRING_FLUSH_MS * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        if (lr.flush_req == lr.flush_done)
+            pthread_cond_timedwait(&lr.wake, &lr.lock, &ts);
+
+        req = lr.flush_req;
+        pthread_mutex_unlock(&lr.lock);
+        logring_drain();
+        pthread_mutex_lock(&lr.lock);
+
+        logring_reap();
+        lr.flush_done = req;
+        pthread_cond_broadcast(&lr.done);
+    }
+    pthread_mutex_unlock(&lr.lock);
+
+    // last pass once everybody has been told to stop
+    logring_drain();
+    return NULL;
+}
+
+// ring_size is rounded up to a power of two so positions can be
+// masked instead of divided, and is at least 64 KiB so that the
+// longest log line always fits
+int logring_start(int fd, size_t ring_size, int policy, logring_note_t note) {
+    size_t size = 65536;
+    int ret;
+
+    while (size < ring_size && size < (SIZE_MAX >> 1)) size <<= 1;
+
+    lr.fd = fd;
+    lr.ring_size = size;
+    lr.policy = policy;
+    lr.note = note ? note : logring_text_note;
+
+    ret = pthread_key_create(&lr.key, logring_orphan);
+    if (ret != 0) return -ret;
+
+    lr.running = 1;
+    ret = pthread_create(&lr.thread, NULL, logring_flusher, NULL);
+    if (ret != 0) {
+        lr.running = 0;
+        pthread_key_delete(lr.key);
+        return -ret;
+    }
+    return 0;
+}
+
+int logring_active(void) {
+    return __atomic_load_n(&lr.running, __ATOMIC_ACQUIRE);
+}
+
+// Block until everything logged before the call is in the file
+void logring_flush(void) {
+    uint64_t want;
+
+    if (!logring_active()) return;
+
+    pthread_mutex_lock(&lr.lock);
+    want = ++lr.flush_req;
+    pthread_cond_signal(&lr.wake);
+    while (lr.running && lr.flush_done < want)
+        pthread_cond_wait(&lr.done, &lr.lock);
+    pthread_mutex_unlock(&lr.lock);
+}
+
+void logring_stop(void) {
+    struct logring *r, *next;
+
+    if (!logring_active()) return;
+
+    pthread_mutex_lock(&lr.lock);
+    __atomic_store_n(&lr.running, 0, __ATOMIC_RELEASE);
+    pthread_cond_signal(&lr.wake);
+    pthread_mutex_unlock(&lr.lock);
+    pthread_join(lr.thread, NULL);
+
+    for (r = lr.rings; r; r = next) {
+        next = r->next;
+        free(r->buf);
+        free(r);
+    }
+    lr.rings = NULL;
+    my_ring = NULL;
+    pthread_key_delete(lr.key);
+}
@@ -0,0 +1,35 @@
+#ifndef _LOGRING_H_
+#define _LOGRING_H_
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Asynchronous backend for log_msg().  Every thread that logs gets
+// its own single-producer/single-consumer byte ring, so the FUSE
+// worker threads never take a lock or make a syscall to log a line.
+// A dedicated flusher thread drains all of the rings into the log
+// file with one writev() per pass.
+
+// what to do when a thread's ring is full
+#define LOGRING_DROP  0   // throw the record away and count it
+#define LOGRING_BLOCK 1   // wait for the flusher to make room
+
+// longest single log_msg() record; anything longer is truncated
+#define LOGRING_LINE_MAX 8192
+
+// how long the flusher sleeps between passes if nobody wakes it
+#define LOGRING_FLUSH_MS 50
+
+// Formats the record the flusher writes when a ring has dropped
+// 'dropped' records; returns its length (at most len).  The default
+// writes a line of text.
+typedef size_t (*logring_note_t)(char *buf, size_t len, uint64_t dropped);
+
+int logring_start(int fd, size_t ring_size, int policy, logring_note_t note);
+int logring_active(void);
+void logring_vprintf(const char *format, va_list ap);
+int logring_write(const char *data, size_t len);
+void logring_flush(void);
+void logring_stop(void);
+
+#endif
@@ -0,0 +1,118 @@
+// Fixed-size worker pool for the FUSE request loop, see loop.h.
+//
+// Every worker blocks reading /dev/fuse and handles whatever request
+// it gets, the way fuse_loop_mt() does, but there are exactly as many
+// of them as asked for; that makes it possible to measure how bbfs
+// scales with the number of threads.  Workers run with all signals
+// blocked so the ones fuse_setup() handles land on the main thread,
+// which just waits for a worker to see the filesystem go away and
+// then cancels the rest.
+
+#include "params.h"
+
+#include <errno.h>
+#include <fuse.h>
+#include <fuse_lowlevel.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "loop.h"
+
+struct loop {
+    struct fuse_session *se;
+    struct fuse_chan *ch;
+    size_t bufsize;
+    sem_t done;
+    int error;
+};
+
+static void *loop_worker(void *arg) {
+    struct loop *l = arg;
+    struct fuse_chan *ch;
+    struct fuse_buf fbuf;
+    char *buf;
+    int res;
+
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    buf = malloc(l->bufsize);
+    if (buf == NULL) {
+        l->error = -1;
+        fuse_session_exit(l->se);
+        sem_post(&l->done);
+        return NULL;
+    }
+
+    while (!fuse_session_exited(l->se)) {
+        memset(&fbuf, 0, sizeof(fbuf));
+        fbuf.mem = buf;
+        fbuf.size = l->bufsize;
+        ch = l->ch;
+
+        // the read is where we may be cancelled, never halfway
+        // through a request
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        res = fuse_session_receive_buf(l->se, &fbuf, &ch);
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+        if (res == -EINTR) continue;
+        if (res <= 0) {
+            // 0 (or ENODEV) means we've been unmounted
+            if (res < 0 && res != -ENODEV) l->error = -1;
+            break;
+        }
+        fuse_session_process_buf(l->se, &fbuf, ch);
+    }
+
+    free(buf);
+    fuse_session_exit(l->se);
+    sem_post(&l->done);
+    return NULL;
+}
+
+int loop_run(struct fuse_session *se, int workers) {
+    struct loop l;
+    pthread_t *threads;
+    sigset_t all, old;
+    int i, n, ret;
+
+    memset(&l, 0, sizeof(l));
+    l.se = se;
+    l.ch = fuse_session_next_chan(l.se, NULL);
+    l.bufsize = fuse_chan_bufsize(l.ch);
+    if (sem_init(&l.done, 0, 0) < 0) return -1;
+
+    threads = calloc(workers, sizeof(*threads));
+    if (threads == NULL) return -1;
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    for (n = 0; n < workers; n++) {
+        ret = pthread_create(&threads[n], NULL, loop_worker, &l);
+        if (ret != 0) {
+            log_err("loop_run: pthread_create: %s\n", strerror(ret));
+            break;
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (n == 0) {
+        l.error = -1;
+    } else {
+        // a signal handler that calls fuse_session_exit() interrupts
+        // the wait; so does a worker finishing
+        while (!fuse_session_exited(l.se))
+            if (sem_wait(&l.done) == 0) break;
+    }
+
+    fuse_session_exit(l.se);
+    for (i = 0; i < n; i++) pthread_cancel(threads[i]);
+    for (i = 0; i < n; i++) pthread_join(threads[i], NULL);
+
+    free(threads);
+    sem_destroy(&l.done);
+    return l.error;
+}
@@ -0,0 +1,16 @@
+#ifndef _LOOP_H_
+#define _LOOP_H_
+// bbfs' own request loop: a fixed pool of worker threads, sized with
+// -o workers=N, in place of fuse_loop_mt()'s grow-on-demand pool.
+
+struct fuse_session;
+
+#define LOOP_WORKERS_MAX 256
+
+// Run until the filesystem is unmounted or bbfs is signalled.
+// Returns 0 on a clean exit, -1 if reading from the kernel failed.
+// Takes the session of either API: fuse_get_session() for bbfs.c's
+// struct fuse, or lowlevel.c's own.
+int loop_run(struct fuse_session *se, int workers);
+
+#endif
@@ -0,0 +1,891 @@
+// bbfs on the low-level FUSE API, see lowlevel.h.
+//
+// A node id is the address of the struct ll_inode behind it, except
+// for FUSE_ROOT_ID, which is rootdir.  The table is a hash on the
+// backing (st_dev, st_ino), so every name for the same file -- hard
+// links, or the same name looked up twice -- shares one entry and
+// one lookup count; an entry is freed, and its O_PATH fd closed,
+// when forget() brings the count to zero.  Holding that fd also keeps
+// the backing inode alive, so its number can't be reused by another
+// file while the kernel still knows it.
+//
+// Operations on the inode itself run on its fd with the *at() calls
+// and AT_EMPTY_PATH; those with no such form (chmod, truncate, the
+// xattrs, reopening for read/write) go through /proc/self/fd.
+
+#include "params.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse.h>
+#include <fuse_lowlevel.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/xattr.h>
+
+#include "bbfs.h"
+#include "compress.h"
+#include "dedup.h"
+#include "journal.h"
+#include "log.h"
+#include "loop.h"
+#include "lowlevel.h"
+#include "pgcache.h"
+#include "policy.h"
+#include "wbcache.h"
+
+struct bb_state *bb_lowlevel_data;
+
+struct ll_inode {
+    struct ll_inode *next;      // hash chain
+    int fd;                     // O_PATH | O_NOFOLLOW
+    dev_t dev;
+    ino_t ino;
+    uint64_t nlookup;           // what the kernel thinks it holds
+};
+
+static struct {
+    pthread_mutex_t lock;
+    struct ll_inode **buckets;
+    size_t nbuckets;            // a power of two
+    size_t count;
+    struct ll_inode root;
+    double timeout;             // entry and attribute timeout, seconds
+} ll = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+#define LL_BUCKETS_MIN 4096
+
+static struct ll_inode *ll_inode(fuse_ino_t ino) {
+    if (ino == FUSE_ROOT_ID) return &ll.root;
+    return (struct ll_inode *) (uintptr_t) ino;
+}
+
+static int ll_fd(fuse_ino_t ino) {
+    return ll_inode(ino)->fd;
+}
+
+// /proc/self/fd/N for an inode's fd
+static void ll_proc(char buf[64], int fd) {
+    snprintf(buf, 64, "/proc/self/fd/%d", fd);
+}
+
+// Report errors to logfile and to the kernel
+static void ll_error(fuse_req_t req, char *str) {
+    fuse_reply_err(req, -bb_error(str));
+}
+
+// bb_reserved() for a name in a directory; only rootdir has any
+static int ll_reserved(fuse_ino_t parent, const char *name) {
+    return parent == FUSE_ROOT_ID && bb_reserved(name);
+}
+
+// the hash table; these take ll.lock held
+
+static size_t ll_hash(dev_t dev, ino_t ino) {
+    uint64_t h = ((uint64_t) dev * 0x9e3779b97f4a7c15ULL) ^ (uint64_t) ino;
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h & (ll.nbuckets - 1);
+}
+
+static struct ll_inode **ll_slot(dev_t dev, ino_t ino) {
+    struct ll_inode **pp;
+
+    for (pp = &ll.buckets[ll_hash(dev, ino)]; *pp; pp = &(*pp)->next)
+        if ((*pp)->dev == dev && (*pp)->ino == ino) break;
+    return pp;
+}
+
+// double the table once it averages two entries a bucket; if there's
+// no memory for that, longer chains will have to do
+static void ll_grow(void) {
+    struct ll_inode **old = ll.buckets, *in, *next;
+    size_t i, n = ll.nbuckets;
+
+    ll.buckets = calloc(2 * n, sizeof(*ll.buckets));
+    if (ll.buckets == NULL) {
+        ll.buckets = old;
+        return;
+    }
+    ll.nbuckets = 2 * n;
+    for (i = 0; i < n; i++)
+        for (in = old[i]; in; in = next) {
+            next = in->next;
+            in->next = ll.buckets[ll_hash(in->dev, in->ino)];
+            ll.buckets[ll_hash(in->dev, in->ino)] = in;
+        }
+    free(old);
+}
+
+static void ll_unref(fuse_ino_t ino, uint64_t n) {
+    struct ll_inode *in = ll_inode(ino), **pp;
+
+    if (in == &ll.root) return;
+
+    pthread_mutex_lock(&ll.lock);
+    in->nlookup -= n < in->nlookup ? n : in->nlookup;
+    if (in->nlookup == 0) {
+        pp = ll_slot(in->dev, in->ino);
+        *pp = in->next;
+        ll.count--;
+    } else {
+        in = NULL;
+    }
+    pthread_mutex_unlock(&ll.lock);
+
+    if (in) {
+        close(in->fd);
+        free(in);
+    }
+}
+
+// Look name up in parent and fill in e for fuse_reply_entry(),
+// counting one more lookup of the inode it finds
+static int ll_lookup_entry(fuse_ino_t parent, const char *name, struct fuse_entry_param *e) {
+    struct ll_inode *in;
+    int fd, ret;
+
+    memset(e, 0, sizeof(*e));
+    // the chunk store and the journal aren't part of the filesystem
+    if (ll_reserved(parent, name)) return -ENOENT;
+    fd = openat(ll_fd(parent), name, O_PATH | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) return -errno;
+    if (fstatat(fd, "", &e->attr, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW) < 0) {
+        ret = -errno;
+        close(fd);
+        return ret;
+    }
+    dedup_stat(fd, "", &e->attr);
+    compress_stat(fd, "", &e->attr);
+
+    pthread_mutex_lock(&ll.lock);
+    in = *ll_slot(e->attr.st_dev, e->attr.st_ino);
+    if (in) {
+        in->nlookup++;
+    } else if ((in = calloc(1, sizeof(*in))) != NULL) {
+        in->fd = fd;
+        in->dev = e->attr.st_dev;
+        in->ino = e->attr.st_ino;
+        in->nlookup = 1;
+        in->next = ll.buckets[ll_hash(in->dev, in->ino)];
+        ll.buckets[ll_hash(in->dev, in->ino)] = in;
+        if (++ll.count > 2 * ll.nbuckets) ll_grow();
+        fd = -1;
+    }
+    pthread_mutex_unlock(&ll.lock);
+
+    if (fd >= 0) close(fd);
+    if (in == NULL) return -ENOMEM;
+
+    wbcache_stat(&e->attr);
+    e->ino = (uintptr_t) in;
+    e->attr_timeout = ll.timeout;
+    e->entry_timeout = ll.timeout;
+    return 0;
+}
+
+// reply to an op that created name in parent
+static void ll_reply_entry(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    struct fuse_entry_param e;
+    int ret;
+
+    ret = ll_lookup_entry(parent, name, &e);
+    if (ret < 0) fuse_reply_err(req, -ret);
+    else fuse_reply_entry(req, &e);
+}
+
+static void ll_init(void *userdata, struct fuse_conn_info *conn) {
+    bb_init(conn);
+}
+
+static void ll_destroy(void *userdata) {
+    bb_destroy(userdata);
+}
+
+static void ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    struct fuse_entry_param e;
+    int ret;
+
+    log_msg("\nll_lookup(parent=%lu, name=\"%s\")\n", parent, name);
+
+    ret = ll_lookup_entry(parent, name, &e);
+    if (ret == -ENOENT && BB_DATA->attr_ttl_ms) {
+        // node id 0: the kernel may remember that it isn't there
+        e.ino = 0;
+        e.entry_timeout = ll.timeout;
+        fuse_reply_entry(req, &e);
+    } else if (ret < 0) {
+        log_err("ll_lookup: %s\n", strerror(-ret));
+        fuse_reply_err(req, -ret);
+    } else {
+        log_stat(&e.attr);
+        fuse_reply_entry(req, &e);
+    }
+}
+
+static void ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup) {
+    ll_unref(ino, nlookup);
+    fuse_reply_none(req);
+}
+
+static void ll_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets) {
+    size_t i;
+
+    for (i = 0; i < count; i++) ll_unref(forgets[i].ino, forgets[i].nlookup);
+    fuse_reply_none(req);
+}
+
+static void ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    struct stat st;
+
+    log_msg("\nll_getattr(ino=%lu)\n", ino);
+
+    if (fstatat(ll_fd(ino), "", &st, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW) < 0) {
+        ll_error(req, "ll_getattr fstatat");
+        return;
+    }
+    dedup_stat(ll_fd(ino), "", &st);
+    compress_stat(ll_fd(ino), "", &st);
+    wbcache_stat(&st);   // the file may be longer than it looks
+    log_stat(&st);
+    fuse_reply_attr(req, &st, ll.timeout);
+}
+
+// truncate() by inode, as bb_truncate() does it by path
+static int ll_truncate(int fd, off_t size) {
+    char proc[64];
+    struct stat st;
+    int retstat, cached;
+
+    // dirty data must land before the truncate, not on top of it
+    cached = (wbcache_enabled() || pgcache_enabled()) &&
+        fstatat(fd, "", &st, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW) == 0;
+    if (cached) {
+        retstat = wbcache_flush_stat(&st);
+        if (retstat < 0) return retstat;
+    }
+
+    ll_proc(proc, fd);
+    if (dedup_enabled()) retstat = dedup_truncate_path(proc, size);
+    else if (compress_enabled()) retstat = compress_truncate_path(proc, size);
+    else if (journal_enabled()) retstat = journal_truncate_path(proc, size);
+    else retstat = truncate(proc, size);
+    if (retstat < 0) return bb_error("ll_setattr truncate");
+    if (cached) pgcache_invalidate_stat(&st);
+    return 0;
+}
+
+static void ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set,
+        struct fuse_file_info *fi) {
+    int fd = ll_fd(ino);
+    char proc[64];
+    struct timespec ts[2];
+    const struct fuse_ctx *ctx = fuse_req_ctx(req);
+    struct policy pol;
+    time_t lt;
+    char when[26];
+    int retstat = 0;
+
+    log_msg("\nll_setattr(ino=%lu, to_set=0x%x, fi=0x%08x)\n", ino, to_set, fi);
+    ll_proc(proc, fd);
+
+    if (to_set & FUSE_SET_ATTR_MODE) {
+        // the same rule as bb_chmod()
+        if (policy_get(ctx->uid, ctx->gid, &pol)) {
+            retstat = chmod(proc, attr->st_mode);
+            if (retstat < 0) retstat = bb_error("ll_setattr chmod");
+        } else {
+            lt = time(NULL);
+            log_msg("\nIllegal op by user %d on inode %lu %s", ctx->uid, ino, ctime_r(&lt, when));
+        }
+    }
+    if (retstat == 0 && to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)) {
+        retstat = fchownat(fd, "",
+                to_set & FUSE_SET_ATTR_UID ? attr->st_uid : (uid_t) -1,
+                to_set & FUSE_SET_ATTR_GID ? attr->st_gid : (gid_t) -1,
+                AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW);
+        if (retstat < 0) retstat = bb_error("ll_setattr fchownat");
+    }
+    if (retstat == 0 && to_set & FUSE_SET_ATTR_SIZE) {
+        if (fi) retstat = bb_ftruncate(NULL, attr->st_size, fi);
+        else retstat = ll_truncate(fd, attr->st_size);
+    }
+    if (retstat == 0 && to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME)) {
+        ts[0].tv_nsec = UTIME_OMIT;
+        ts[1].tv_nsec = UTIME_OMIT;
+        if (to_set & FUSE_SET_ATTR_ATIME_NOW) ts[0].tv_nsec = UTIME_NOW;
+        else if (to_set & FUSE_SET_ATTR_ATIME) ts[0] = attr->st_atim;
+        if (to_set & FUSE_SET_ATTR_MTIME_NOW) ts[1].tv_nsec = UTIME_NOW;
+        else if (to_set & FUSE_SET_ATTR_MTIME) ts[1] = attr->st_mtim;
+        retstat = utimensat(AT_FDCWD, proc, ts, 0);
+        if (retstat < 0) retstat = bb_error("ll_setattr utimensat");
+    }
+
+    if (retstat < 0) fuse_reply_err(req, -retstat);
+    else ll_getattr(req, ino, fi);
+}
+
+static void ll_readlink(fuse_req_t req, fuse_ino_t ino) {
+    char link[PATH_MAX + 1];
+    ssize_t n;
+
+    log_msg("\nll_readlink(ino=%lu)\n", ino);
+
+    n = readlinkat(ll_fd(ino), "", link, sizeof(link) - 1);
+    if (n < 0) {
+        ll_error(req, "ll_readlink readlinkat");
+        return;
+    }
+    link[n] = '\0';
+    fuse_reply_readlink(req, link);
+}
+
+static void ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t dev) {
+    int retstat;
+
+    log_msg("\nll_mknod(parent=%lu, name=\"%s\", mode=0%3o, dev=%lld)\n", parent, name, mode, dev);
+    if (ll_reserved(parent, name)) {
+        fuse_reply_err(req, EPERM);
+        return;
+    }
+
+    // as in bb_mknod()
+    if (S_ISREG(mode)) {
+        retstat = openat(ll_fd(parent), name, O_CREAT | O_EXCL | O_WRONLY, mode);
+        if (retstat < 0) retstat = bb_error("ll_mknod openat");
+        else {
+            retstat = close(retstat);
+            if (retstat < 0) retstat = bb_error("ll_mknod close");
+        }
+    } else if (S_ISFIFO(mode)) {
+        retstat = mkfifoat(ll_fd(parent), name, mode);
+        if (retstat < 0) retstat = bb_error("ll_mknod mkfifoat");
+    } else {
+        retstat = mknodat(ll_fd(parent), name, mode, dev);
+        if (retstat < 0) retstat = bb_error("ll_mknod mknodat");
+    }
+
+    if (retstat < 0) fuse_reply_err(req, -retstat);
+    else ll_reply_entry(req, parent, name);
+}
+
+static void ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) {
+    log_msg("\nll_mkdir(parent=%lu, name=\"%s\", mode=0%3o)\n", parent, name, mode);
+    if (ll_reserved(parent, name)) {
+        fuse_reply_err(req, EPERM);
+        return;
+    }
+
+    if (mkdirat(ll_fd(parent), name, mode) < 0) ll_error(req, "ll_mkdir mkdirat");
+    else ll_reply_entry(req, parent, name);
+}
+
+static void ll_symlink(fuse_req_t req, const char *link, fuse_ino_t parent, const char *name) {
+    log_msg("\nll_symlink(link=\"%s\", parent=%lu, name=\"%s\")\n", link, parent, name);
+    if (ll_reserved(parent, name)) {
+        fuse_reply_err(req, EPERM);
+        return;
+    }
+
+    if (symlinkat(link, ll_fd(parent), name) < 0) ll_error(req, "ll_symlink symlinkat");
+    else ll_reply_entry(req, parent, name);
+}
+
+static void ll_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, const char *newname) {
+    char proc[64];
+
+    log_msg("\nll_link(ino=%lu, newparent=%lu, newname=\"%s\")\n", ino, newparent, newname);
+    if (ll_reserved(newparent, newname)) {
+        fuse_reply_err(req, EPERM);
+        return;
+    }
+
+    // linkat() with AT_EMPTY_PATH needs CAP_DAC_READ_SEARCH; the /proc
+    // link doesn't
+    ll_proc(proc, ll_fd(ino));
+    if (linkat(AT_FDCWD, proc, ll_fd(newparent), newname, AT_SYMLINK_FOLLOW) < 0)
+        ll_error(req, "ll_link linkat");
+    else
+        ll_reply_entry(req, newparent, newname);
+}
+
+static void ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    struct stat st;
+    int cached, ret;
+
+    log_msg("\nll_unlink(parent=%lu, name=\"%s\")\n", parent, name);
+    if (ll_reserved(parent, name)) {
+        fuse_reply_err(req, EPERM);
+        return;
+    }
+
+    // the kernel may still hold the inode (and with it our fd), but
+    // the pages go the way bb_unlink() lets them go
+    cached = pgcache_enabled() &&
+        fstatat(ll_fd(parent), name, &st, AT_SYMLINK_NOFOLLOW) == 0 && st.st_nlink == 1;
+
+    journal_ns_begin(0);
+    ret = unlinkat(ll_fd(parent), name, 0);
+    // so that a replay doesn't bring it back
+    if (ret == 0 && journal_unlink(ll_fd(parent), name) < 0) bb_error("ll_unlink journal_unlink");
+    journal_ns_end(0);
+    if (ret < 0) {
+        ll_error(req, "ll_unlink unlinkat");
+        return;
+    }
+    if (cached) pgcache_invalidate_stat(&st);
+    fuse_reply_err(req, 0);
+}
+
+static void ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    log_msg("\nll_rmdir(parent=%lu, name=\"%s\")\n", parent, name);
+    if (ll_reserved(parent, name)) {
+        fuse_reply_err(req, EPERM);
+        return;
+    }
+
+    if (unlinkat(ll_fd(parent), name, AT_REMOVEDIR) < 0) ll_error(req, "ll_rmdir unlinkat");
+    else fuse_reply_err(req, 0);
+}
+
+static void ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+        fuse_ino_t newparent, const char *newname) {
+    struct stat st;
+    int cached, ret;
+
+    log_msg("\nll_rename(parent=%lu, name=\"%s\", newparent=%lu, newname=\"%s\")\n",
+            parent, name, newparent, newname);
+    if (ll_reserved(parent, name) || ll_reserved(newparent, newname)) {
+        fuse_reply_err(req, EPERM);
+        return;
+    }
+
+    // the same goes for a file that the rename replaces
+    cached = pgcache_enabled() &&
+        fstatat(ll_fd(newparent), newname, &st, AT_SYMLINK_NOFOLLOW) == 0 && st.st_nlink == 1;
+
+    journal_ns_begin(1);
+    ret = renameat(ll_fd(parent), name, ll_fd(newparent), newname);
+    journal_ns_end(1);
+    if (ret < 0) {
+        ll_error(req, "ll_rename renameat");
+        return;
+    }
+    if (cached) pgcache_invalidate_stat(&st);
+    fuse_reply_err(req, 0);
+}
+
+static void ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    char proc[64];
+    int fd, ret;
+
+    log_msg("\nll_open(ino=%lu, fi=0x%08x)\n", ino, fi);
+
+    // an O_PATH fd can't be read or written; open the file afresh
+    ll_proc(proc, ll_fd(ino));
+    fd = open(proc, fi->flags & ~O_NOFOLLOW);
+    if (fd < 0) {
+        ll_error(req, "ll_open open");
+        return;
+    }
+
+    ret = bb_file_new(fi, fd, 0, fuse_req_ctx(req)->uid, fuse_req_ctx(req)->gid);
+    if (ret < 0) {
+        close(fd);
+        fuse_reply_err(req, -ret);
+        return;
+    }
+    log_fi(fi);
+    fuse_reply_open(req, fi);
+}
+
+static void ll_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode,
+        struct fuse_file_info *fi) {
+    struct fuse_entry_param e;
+    struct stat st;
+    int fd, ret, cached, created;
+
+    log_msg("\nll_create(parent=%lu, name=\"%s\", mode=0%03o, fi=0x%08x)\n", parent, name, mode, fi);
+    if (ll_reserved(parent, name)) {
+        fuse_reply_err(req, EPERM);
+        return;
+    }
+
+    // as in ll_truncate(), when O_TRUNC finds the file already there
+    cached = (fi->flags & O_TRUNC) && (wbcache_enabled() || pgcache_enabled()) &&
+        fstatat(ll_fd(parent), name, &st, AT_SYMLINK_NOFOLLOW) == 0;
+    if (cached) {
+        ret = wbcache_flush_stat(&st);
+        if (ret < 0) {
+            fuse_reply_err(req, -ret);
+            return;
+        }
+    }
+
+    fd = openat(ll_fd(parent), name, (fi->flags | O_CREAT) & ~O_NOFOLLOW, mode);
+    if (fd < 0) {
+        ll_error(req, "ll_create openat");
+        return;
+    }
+    if (cached) pgcache_invalidate_stat(&st);
+
+    // without O_EXCL the file may have been there already, data and
+    // all; it only counts as new if it's empty now
+    created = (fi->flags & (O_EXCL | O_TRUNC)) || (fstat(fd, &st) == 0 && st.st_size == 0);
+    ret = bb_file_new(fi, fd, created, fuse_req_ctx(req)->uid, fuse_req_ctx(req)->gid);
+    if (ret < 0) {
+        close(fd);
+        fuse_reply_err(req, -ret);
+        return;
+    }
+    ret = ll_lookup_entry(parent, name, &e);
+    if (ret < 0) {
+        bb_release(NULL, fi);
+        fuse_reply_err(req, -ret);
+        return;
+    }
+    log_fi(fi);
+    fuse_reply_create(req, &e, fi);
+}
+
+// bb_read_buf() hands back either the data or, for a file that can
+// splice, just where to splice it from
+static void ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+        struct fuse_file_info *fi) {
+    struct fuse_bufvec *src;
+    int n;
+
+    n = bb_read_buf(NULL, &src, size, offset, fi);
+    if (n < 0) {
+        fuse_reply_err(req, -n);
+        return;
+    }
+    fuse_reply_data(req, src, FUSE_BUF_SPLICE_MOVE);
+    if (!(src->buf[0].flags & FUSE_BUF_IS_FD)) free(src->buf[0].mem);
+    free(src);
+}
+
+static void ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv, off_t offset,
+        struct fuse_file_info *fi) {
+    int n;
+
+    n = bb_write_buf(NULL, bufv, offset, fi);
+    if (n < 0) fuse_reply_err(req, -n);
+    else fuse_reply_write(req, n);
+}
+
+static void ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    fuse_reply_err(req, -bb_flush(NULL, fi));
+}
+
+static void ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    fuse_reply_err(req, -bb_release(NULL, fi));
+}
+
+static void ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi) {
+    fuse_reply_err(req, -bb_fsync(NULL, datasync, fi));
+}
+
+static void ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    struct bb_dir *d;
+    int fd;
+
+    log_msg("\nll_opendir(ino=%lu, fi=0x%08x)\n", ino, fi);
+
+    // the same handle bb_readdir() uses, with no path to go with it
+    d = calloc(1, sizeof(*d) + 1);
+    if (d == NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    fd = openat(ll_fd(ino), ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0 || (d->dp = fdopendir(fd)) == NULL) {
+        ll_error(req, "ll_opendir fdopendir");
+        if (fd >= 0) close(fd);
+        free(d);
+        return;
+    }
+
+    fi->fh = (uintptr_t) d;
+    log_fi(fi);
+    fuse_reply_open(req, fi);
+}
+
+static void ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+        struct fuse_file_info *fi) {
+    struct bb_dir *d = BB_DIR(fi);
+    struct stat st;
+    char *buf, *p;
+    size_t rem, len;
+    int hide = ino == FUSE_ROOT_ID;
+    int err = 0;
+
+    log_msg("\nll_readdir(ino=%lu, size=%d, offset=%lld, fi=0x%08x)\n", ino, size, offset, fi);
+
+    buf = malloc(size);
+    if (buf == NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    if (offset != d->offset) {
+        seekdir(d->dp, offset);
+        d->entry = NULL;
+        d->offset = offset;
+    }
+
+    // an entry that didn't fit last time is kept for next time
+    for (p = buf, rem = size; ; ) {
+        if (d->entry == NULL) {
+            errno = 0;
+            d->entry = readdir(d->dp);
+            if (d->entry == NULL) {
+                err = errno;
+                break;
+            }
+        }
+        if (hide && bb_hidden(d->entry->d_name)) {
+            d->offset = d->entry->d_off;
+            d->entry = NULL;
+            continue;
+        }
+        memset(&st, 0, sizeof(st));
+        st.st_ino = d->entry->d_ino;
+        st.st_mode = d->entry->d_type << 12;
+        len = fuse_add_direntry(req, p, rem, d->entry->d_name, &st, d->entry->d_off);
+        if (len > rem) break;
+        p += len;
+        rem -= len;
+        d->offset = d->entry->d_off;
+        d->entry = NULL;
+    }
+
+    // an error after some entries waits for the next call
+    if (err && rem == size) {
+        log_err("ll_readdir readdir: %s\n", strerror(err));
+        fuse_reply_err(req, err);
+    } else {
+        fuse_reply_buf(req, buf, size - rem);
+    }
+    free(buf);
+}
+
+static void ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    struct bb_dir *d = BB_DIR(fi);
+
+    log_msg("\nll_releasedir(ino=%lu, fi=0x%08x)\n", ino, fi);
+
+    closedir(d->dp);
+    free(d);
+    fuse_reply_err(req, 0);
+}
+
+static void ll_fsyncdir(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi) {
+    // nothing, like bb_fsyncdir()
+    log_msg("\nll_fsyncdir(ino=%lu, datasync=%d, fi=0x%08x)\n", ino, datasync, fi);
+    fuse_reply_err(req, 0);
+}
+
+static void ll_statfs(fuse_req_t req, fuse_ino_t ino) {
+    struct statvfs statv;
+
+    log_msg("\nll_statfs(ino=%lu)\n", ino);
+
+    if (fstatvfs(ll_fd(ino), &statv) < 0) {
+        ll_error(req, "ll_statfs fstatvfs");
+        return;
+    }
+    log_statvfs(&statv);
+    fuse_reply_statfs(req, &statv);
+}
+
+// The xattr calls follow the /proc link to the inode itself, symlink
+// or not; bbfs's own xattrs stay hidden as in bb_setxattr().
+
+static void ll_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name, const char *value,
+        size_t size, int flags) {
+    char proc[64];
+
+    log_msg("\nll_setxattr(ino=%lu, name=\"%s\", size=%d, flags=0x%08x)\n", ino, name, size, flags);
+
+    if (bb_xattr_hidden(name)) {
+        fuse_reply_err(req, EPERM);
+        return;
+    }
+    ll_proc(proc, ll_fd(ino));
+    if (setxattr(proc, name, value, size, flags) < 0) ll_error(req, "ll_setxattr setxattr");
+    else fuse_reply_err(req, 0);
+}
+
+static void ll_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name, size_t size) {
+    char proc[64];
+    char *value = NULL;
+    ssize_t n;
+
+    log_msg("\nll_getxattr(ino=%lu, name=\"%s\", size=%d)\n", ino, name, size);
+
+    if (bb_xattr_hidden(name)) {
+        fuse_reply_err(req, ENODATA);
+        return;
+    }
+    if (size && (value = malloc(size)) == NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    ll_proc(proc, ll_fd(ino));
+    n = getxattr(proc, name, value, size);
+    if (n < 0) ll_error(req, "ll_getxattr getxattr");
+    else if (size == 0) fuse_reply_xattr(req, n);
+    else fuse_reply_buf(req, value, n);
+    free(value);
+}
+
+static void ll_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size) {
+    char proc[64];
+    char *list = NULL, *ptr;
+    ssize_t n;
+    size_t len;
+
+    log_msg("\nll_listxattr(ino=%lu, size=%d)\n", ino, size);
+
+    if (size && (list = malloc(size)) == NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    ll_proc(proc, ll_fd(ino));
+    n = listxattr(proc, list, size);
+    if (n < 0) {
+        ll_error(req, "ll_listxattr listxattr");
+    } else if (size == 0) {
+        fuse_reply_xattr(req, n);
+    } else {
+        for (ptr = list; ptr < list + n; )
+            if (bb_xattr_hidden(ptr)) {
+                len = strlen(ptr) + 1;
+                memmove(ptr, ptr + len, list + n - (ptr + len));
+                n -= len;
+            } else {
+                ptr += strlen(ptr) + 1;
+            }
+        fuse_reply_buf(req, list, n);
+    }
+    free(list);
+}
+
+static void ll_removexattr(fuse_req_t req, fuse_ino_t ino, const char *name) {
+    char proc[64];
+
+    log_msg("\nll_removexattr(ino=%lu, name=\"%s\")\n", ino, name);
+
+    if (bb_xattr_hidden(name)) {
+        fuse_reply_err(req, EPERM);
+        return;
+    }
+    ll_proc(proc, ll_fd(ino));
+    if (removexattr(proc, name) < 0) ll_error(req, "ll_removexattr removexattr");
+    else fuse_reply_err(req, 0);
+}
+
+static void ll_access(fuse_req_t req, fuse_ino_t ino, int mask) {
+    char proc[64];
+
+    log_msg("\nll_access(ino=%lu, mask=0%o)\n", ino, mask);
+
+    ll_proc(proc, ll_fd(ino));
+    if (faccessat(AT_FDCWD, proc, mask, 0) < 0) ll_error(req, "ll_access faccessat");
+    else fuse_reply_err(req, 0);
+}
+
+static struct fuse_lowlevel_ops ll_oper = {
+    .init = ll_init,
+    .destroy = ll_destroy,
+    .lookup = ll_lookup,
+    .forget = ll_forget,
+    .forget_multi = ll_forget_multi,
+    .getattr = ll_getattr,
+    .setattr = ll_setattr,
+    .readlink = ll_readlink,
+    .mknod = ll_mknod,
+    .mkdir = ll_mkdir,
+    .unlink = ll_unlink,
+    .rmdir = ll_rmdir,
+    .symlink = ll_symlink,
+    .rename = ll_rename,
+    .link = ll_link,
+    .open = ll_open,
+    .read = ll_read,
+    .write_buf = ll_write_buf,
+    .flush = ll_flush,
+    .release = ll_release,
+    .fsync = ll_fsync,
+    .opendir = ll_opendir,
+    .readdir = ll_readdir,
+    .releasedir = ll_releasedir,
+    .fsyncdir = ll_fsyncdir,
+    .statfs = ll_statfs,
+    .setxattr = ll_setxattr,
+    .getxattr = ll_getxattr,
+    .listxattr = ll_listxattr,
+    .removexattr = ll_removexattr,
+    .access = ll_access,
+    .create = ll_create,
+};
+
+// fuse_main() for the low-level API, taken apart the same way as in
+// main() so -o workers=N works here too
+int lowlevel_main(struct fuse_args *args, struct bb_state *bb_data) {
+    struct fuse_session *se;
+    struct fuse_chan *ch;
+    char *mountpoint;
+    int multithreaded, foreground;
+    int err = -1;
+
+    bb_lowlevel_data = bb_data;
+    ll.root.fd = bb_data->rootfd;
+    ll.root.nlookup = 1;
+    ll.timeout = bb_data->attr_ttl_ms ? bb_data->attr_ttl_ms / 1000.0 : 1.0;
+    ll.nbuckets = LL_BUCKETS_MIN;
+    ll.buckets = calloc(ll.nbuckets, sizeof(*ll.buckets));
+    if (ll.buckets == NULL) {
+        perror("lowlevel_main calloc");
+        return 1;
+    }
+
+    if (fuse_parse_cmdline(args, &mountpoint, &multithreaded, &foreground) == -1)
+        return 1;
+
+    ch = fuse_mount(mountpoint, args);
+    if (ch != NULL) {
+        se = fuse_lowlevel_new(args, &ll_oper, sizeof(ll_oper), bb_data);
+        if (se != NULL) {
+            if (fuse_set_signal_handlers(se) != -1) {
+                fuse_session_add_chan(se, ch);
+                if (fuse_daemonize(foreground) != -1) {
+                    if (!multithreaded)
+                        err = fuse_session_loop(se);
+                    else if (bb_data->workers > 0)
+                        err = loop_run(se, bb_data->workers);
+                    else
+                        err = fuse_session_loop_mt(se);
+                }
+                fuse_remove_signal_handlers(se);
+                fuse_session_remove_chan(ch);
+            }
+            fuse_session_destroy(se);
+        }
+        fuse_unmount(mountpoint, ch);
+    }
+    free(mountpoint);
+
+    fprintf(stderr, "fuse loop returned %d\n", err);
+    return err ? 1 : 0;
+}
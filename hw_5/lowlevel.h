@@ -0,0 +1,26 @@
+#ifndef _LOWLEVEL_H_
+#define _LOWLEVEL_H_
+// bbfs on the low-level, inode-based FUSE API, turned on with
+// -o lowlevel.
+//
+// Instead of a path, every request names an inode by the node id
+// bbfs handed the kernel when it looked the name up.  bbfs keeps an
+// inode table that maps each node id to an O_PATH fd for the backing
+// file, so no path is ever rebuilt or walked again; the kernel's
+// lookup count decides when an entry goes.  Open files go through
+// the same struct bb_file as with the path API, so the content
+// transform, the caches and the log come out the same.
+//
+// The per-op stats and trace (instr.c) wrap the path API's
+// operations and aren't collected here, and neither the attribute
+// nor the directory cache applies: the kernel caches entries and
+// attributes for -o attr_ttl (1s if not given), and the inode table
+// does the directory cache's job.
+
+struct bb_state;
+struct fuse_args;
+
+// Mount and serve until unmounted; what main() returns
+int lowlevel_main(struct fuse_args *args, struct bb_state *bb_data);
+
+#endif
@@ -0,0 +1,230 @@
+// LZ77 compression in LZ4's block format, see lz.h
+//
+// A block is a run of sequences, each a token byte (literal count in
+// the high nibble, match length - 4 in the low one; 15 means more
+// bytes of it follow, 255 at a time), the literals, and a 2-byte
+// little-endian match offset.  The last sequence is literals only.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lz.h"
+
+#define HASH_BITS     14
+#define WINDOW        65535
+#define MIN_MATCH     4
+// LZ4's end-of-block rules, which let a decoder copy in whole words:
+// the last match starts at least 12 bytes from the end, and the last
+// 5 bytes are always literals
+#define MF_LIMIT      12
+#define LAST_LITERALS 5
+
+struct lz_work {
+    uint32_t head[1 << HASH_BITS];  // latest position + 1 with each hash, 0: none
+    uint16_t chain[1 << 16];        // from a position back to the one before, 0: none
+};
+
+// one per thread, kept from call to call; only head is cleared, since
+// whatever chain leads to is checked against the data anyway
+static __thread struct lz_work *lz_work;
+
+static uint32_t load32(const unsigned char *p) {
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t lz_hash(uint32_t v) {
+    return (v * 2654435761U) >> (32 - HASH_BITS);
+}
+
+// how many bytes from a and b on are the same, stopping at b_end
+static size_t lz_common(const unsigned char *a, const unsigned char *b, const unsigned char *b_end) {
+    const unsigned char *start = b;
+    uint64_t x, y;
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    while (b_end - b >= 8) {
+        memcpy(&x, a, sizeof(x));
+        memcpy(&y, b, sizeof(y));
+        if (x != y) return b - start + (__builtin_ctzll(x ^ y) >> 3);
+        a += 8;
+        b += 8;
+    }
+#endif
+    while (b < b_end && *a == *b) {
+        a++;
+        b++;
+    }
+    return b - start;
+}
+
+// Make pos the latest place its hash h turned up, and return the one
+// before.  Only depth > 1 follows the chain, so only it keeps it.
+static uint32_t lz_insert(struct lz_work *w, uint32_t h, uint32_t pos, int depth) {
+    uint32_t prev = w->head[h];
+
+    if (depth > 1)
+        w->chain[pos & 0xffff] = prev && pos - (prev - 1) <= WINDOW ? pos - (prev - 1) : 0;
+    w->head[h] = pos + 1;
+    return prev;
+}
+
+// One sequence: llen literals from lit, then a match of mlen bytes
+// off back, or none if mlen is 0.  NULL if it doesn't fit before oend.
+static unsigned char *lz_emit(unsigned char *op, unsigned char *oend, const unsigned char *lit,
+        size_t llen, size_t off, size_t mlen) {
+    unsigned char *token;
+    size_t l;
+
+    if ((size_t) (oend - op) < 1 + llen / 255 + 1 + llen + 2 + mlen / 255 + 1) return NULL;
+    token = op++;
+    if (llen >= 15) {
+        *token = 15 << 4;
+        for (l = llen - 15; l >= 255; l -= 255) *op++ = 255;
+        *op++ = l;
+    } else {
+        *token = llen << 4;
+    }
+    memcpy(op, lit, llen);
+    op += llen;
+    if (mlen == 0) return op;
+
+    *op++ = off;
+    *op++ = off >> 8;
+    mlen -= MIN_MATCH;
+    if (mlen >= 15) {
+        *token |= 15;
+        for (l = mlen - 15; l >= 255; l -= 255) *op++ = 255;
+        *op++ = l;
+    } else {
+        *token |= mlen;
+    }
+    return op;
+}
+
+size_t lz_compress(const void *src, size_t n, void *dst, size_t cap, int level) {
+    const unsigned char *base = src, *ip = base, *anchor = base, *end = base + n;
+    const unsigned char *mflimit, *mend;
+    unsigned char *op = dst, *oend = op + cap;
+    struct lz_work *w;
+    uint32_t pos, c, d, p, best_off = 0;
+    size_t len, best_len;
+    int depth, tries;
+
+    if (level < 1) level = 1;
+    if (level > LZ_LEVEL_MAX) level = LZ_LEVEL_MAX;
+    depth = 1 << (level - 1);
+
+    if (n > MF_LIMIT) {
+        if (lz_work == NULL && (lz_work = malloc(sizeof(*lz_work))) == NULL) return 0;
+        w = lz_work;
+        memset(w->head, 0, sizeof(w->head));
+        mflimit = end - MF_LIMIT;
+        mend = end - LAST_LITERALS;
+
+        while (ip < mflimit) {
+            pos = ip - base;
+            c = lz_insert(w, lz_hash(load32(ip)), pos, depth);
+
+            // the longest match among the last depth places these
+            // four bytes turned up
+            best_len = 0;
+            for (tries = depth; c && tries > 0; tries--) {
+                c--;
+                if (pos - c > WINDOW) break;
+                if (load32(base + c) == load32(ip)) {
+                    len = MIN_MATCH + lz_common(base + c + MIN_MATCH, ip + MIN_MATCH, mend);
+                    if (len > best_len) {
+                        best_len = len;
+                        best_off = pos - c;
+                        if (ip + len >= mend) break;
+                    }
+                }
+                if (depth == 1) break;
+                d = w->chain[c & 0xffff];
+                if (d == 0 || d > c) break;
+                c = c - d + 1;
+            }
+
+            if (best_len == 0) {
+                // stride further the longer there's been no match, so
+                // incompressible data goes by quickly; the higher the
+                // level, the longer it takes to give up
+                ip += 1 + ((ip - anchor) >> (5 + level));
+                continue;
+            }
+            op = lz_emit(op, oend, anchor, ip - anchor, best_off, best_len);
+            if (op == NULL) return 0;
+            for (p = pos + 1; p < pos + best_len && base + p < mflimit; p++)
+                if (level > 1 || p == pos + best_len - 2)
+                    lz_insert(w, lz_hash(load32(base + p)), p, depth);
+            ip += best_len;
+            anchor = ip;
+        }
+    }
+
+    op = lz_emit(op, oend, anchor, end - anchor, 0, 0);
+    if (op == NULL) return 0;
+    return op - (unsigned char *) dst;
+}
+
+ssize_t lz_decompress(const void *src, size_t n, void *dst, size_t cap) {
+    const unsigned char *ip = src, *iend = ip + n;
+    unsigned char *op = dst, *oend = op + cap, *match;
+    size_t len, off;
+    unsigned token, b;
+
+    while (ip < iend) {
+        token = *ip++;
+
+        len = token >> 4;
+        if (len == 15)
+            do {
+                if (ip == iend) return -1;
+                b = *ip++;
+                len += b;
+            } while (b == 255);
+        if (len > (size_t) (iend - ip) || len > (size_t) (oend - op)) return -1;
+        // most runs of literals are short: copy a fixed 16 if there's room
+        if (len <= 16 && iend - ip >= 16 && oend - op >= 16) memcpy(op, ip, 16);
+        else memcpy(op, ip, len);
+        op += len;
+        ip += len;
+        if (ip == iend) break;      // the last sequence
+
+        if (iend - ip < 2) return -1;
+        off = ip[0] | ip[1] << 8;
+        ip += 2;
+        if (off == 0 || off > (size_t) (op - (unsigned char *) dst)) return -1;
+        len = token & 15;
+        if (len == 15)
+            do {
+                if (ip == iend) return -1;
+                b = *ip++;
+                len += b;
+            } while (b == 255);
+        len += MIN_MATCH;
+        if (len > (size_t) (oend - op)) return -1;
+
+        // A match may overlap what it's copying, e.g. a run of one
+        // byte.  Then every copy of what's between it and op doubles
+        // how much can be copied at once next time.
+        match = op - off;
+        if (off >= 8 && (size_t) (oend - op) >= len + 8) {
+            // whole words, the last one running past the end
+            for (b = 0; b < len; b += 8) memcpy(op + b, match + b, 8);
+            op += len;
+            continue;
+        }
+        while (len > 0) {
+            b = op - match < len ? op - match : len;
+            memcpy(op, match, b);
+            op += b;
+            len -= b;
+        }
+    }
+    return op - (unsigned char *) dst;
+}
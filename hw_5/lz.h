@@ -0,0 +1,27 @@
+#ifndef _LZ_H_
+#define _LZ_H_
+// An LZ77 byte-oriented compressor in the LZ4 mould, producing LZ4's
+// block format: runs of literals and (offset, length) matches within
+// the last 64 KiB, no entropy coding.  That's why decompression runs
+// at close to memcpy speed.  The level trades compression speed for
+// ratio: level 1 looks at one earlier occurrence of each 4-byte
+// sequence and skips ahead faster through data that isn't matching,
+// and each level above it follows twice as many candidates.
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define LZ_LEVEL_MAX 9
+
+// the most lz_compress() can write for n bytes of input
+#define LZ_BOUND(n) ((n) + (n) / 255 + 16)
+
+// Compress n bytes of src into at most cap bytes of dst; returns the
+// compressed length, or 0 if it doesn't fit
+size_t lz_compress(const void *src, size_t n, void *dst, size_t cap, int level);
+
+// Decompress n bytes of src into at most cap bytes of dst; returns the
+// decompressed length, or -1 if src is corrupt or doesn't fit
+ssize_t lz_decompress(const void *src, size_t n, void *dst, size_t cap);
+
+#endif
@@ -0,0 +1,135 @@
+/*
+   meta_bench -- create/stat/unlink throughput for a mounted bbfs
+
+   usage: meta_bench [-n files] [-d dirs] dir [dir ...]
+
+   Creates files empty files (default 1000000) spread over dirs
+   subdirectories (default 1000), stats every one of them, then
+   unlinks them all, timing each phase, under every dir given.  Give
+   it the same rootdir mounted once with the path API and once with
+   -o lowlevel to compare the two; the last column is each one's rate
+   over the first one's.  The stat phase runs over the files in a
+   different order from the one they were created in, so it isn't
+   just reading back dentries the kernel has only just cached.
+   */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+enum { PHASE_CREATE, PHASE_STAT, PHASE_UNLINK, NPHASES };
+static const char *phase_name[] = { "create", "stat", "unlink" };
+
+static long nfiles = 1000000, ndirs = 1000;
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void name(char *buf, size_t len, const char *top, long i) {
+    snprintf(buf, len, "%s/meta_bench.%ld/f%ld", top, i % ndirs, i / ndirs);
+}
+
+// one phase over every file; returns ops per second
+static double run(const char *top, int phase, long *errors) {
+    char path[4096];
+    struct stat st;
+    double start = now();
+    long i, j;
+    int fd;
+
+    for (i = 0; i < nfiles; i++) {
+        switch (phase) {
+        case PHASE_CREATE:
+            name(path, sizeof(path), top, i);
+            fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+            if (fd < 0) (*errors)++;
+            else close(fd);
+            break;
+        case PHASE_STAT:
+            // a stride that's prime to nfiles visits every file once
+            j = (i * 7919) % nfiles;
+            name(path, sizeof(path), top, j);
+            if (lstat(path, &st) < 0 || !S_ISREG(st.st_mode)) (*errors)++;
+            break;
+        case PHASE_UNLINK:
+            name(path, sizeof(path), top, i);
+            if (unlink(path) < 0) (*errors)++;
+            break;
+        }
+    }
+    return nfiles / (now() - start);
+}
+
+static int mkdirs(const char *top) {
+    char path[4096];
+    long d;
+
+    for (d = 0; d < ndirs; d++) {
+        snprintf(path, sizeof(path), "%s/meta_bench.%ld", top, d);
+        if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+            perror(path);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void rmdirs(const char *top) {
+    char path[4096];
+    long d;
+
+    for (d = 0; d < ndirs; d++) {
+        snprintf(path, sizeof(path), "%s/meta_bench.%ld", top, d);
+        rmdir(path);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    double rate, first[NPHASES];
+    long errors = 0;
+    int opt, i, p;
+
+    while ((opt = getopt(argc, argv, "n:d:")) != -1) {
+        switch (opt) {
+        case 'n': nfiles = atol(optarg); break;
+        case 'd': ndirs = atol(optarg); break;
+        default:
+            fprintf(stderr, "usage: meta_bench [-n files] [-d dirs] dir [dir ...]\n");
+            return 2;
+        }
+    }
+    if (optind == argc || nfiles < 1 || ndirs < 1) {
+        fprintf(stderr, "usage: meta_bench [-n files] [-d dirs] dir [dir ...]\n");
+        return 2;
+    }
+    // keep the stat stride prime to nfiles
+    if (nfiles % 7919 == 0) nfiles++;
+
+    printf("%ld files in %ld dirs\n\n", nfiles, ndirs);
+    printf("%-32s %-7s %12s %8s\n", "dir", "phase", "ops/s", "vs first");
+
+    for (i = optind; i < argc; i++) {
+        if (mkdirs(argv[i]) < 0) return 1;
+        for (p = 0; p < NPHASES; p++) {
+            rate = run(argv[i], p, &errors);
+            if (i == optind) first[p] = rate;
+            printf("%-32s %-7s %12.0f %7.2fx\n", argv[i], phase_name[p], rate, rate / first[p]);
+            fflush(stdout);
+        }
+        rmdirs(argv[i]);
+    }
+
+    if (errors) printf("\n%ld errors\n", errors);
+    return errors ? 1 : 0;
+}
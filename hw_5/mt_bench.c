@@ -0,0 +1,255 @@
+/*
+   mt_bench -- parallel read/write stress test for a mounted bbfs
+
+   usage: mt_bench [-t max threads] [-m MiB per thread] [-b block size] [-d] dir
+
+   For 1, 2, 4, ... up to max threads (default 8), every thread
+   writes its own file in dir block by block, then reads it back, and
+   then all threads pwrite() and pread() interleaved blocks of one
+   shared file.  Prints the aggregate MB/s of each phase and the
+   speedup over one thread, so run it against bbfs mounted with
+   different -o workers=N (or -s) to see how bbfs scales.
+
+   Each block is filled with a pattern made from the thread number
+   and the file offset, and every read is checked against it, so
+   requests that get mixed up between threads show up as errors
+   rather than just as numbers.
+
+   Reads would normally be answered out of the kernel's page cache
+   without ever reaching bbfs; the cache is dropped with
+   posix_fadvise() before each read phase, or bypassed entirely with
+   -d (O_DIRECT).
+   */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+enum { PHASE_WRITE, PHASE_READ, PHASE_SHARED };
+
+static const char *dir;
+static size_t per_thread = 64 << 20;
+static size_t bs = 128 << 10;
+static int direct;
+static int nthreads;
+static pthread_barrier_t barrier;
+
+struct worker {
+    pthread_t thread;
+    int id;
+    int phase;
+    int fd;
+    unsigned char *buf;
+    long errors;
+};
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fill(unsigned char *buf, size_t len, int id, uint64_t off) {
+    uint64_t v;
+    size_t i;
+
+    for (i = 0; i < len; i += 8) {
+        v = (off + i) * 0x9e3779b97f4a7c15ULL ^ (uint64_t) id << 56;
+        memcpy(buf + i, &v, 8);
+    }
+}
+
+static int check(const unsigned char *buf, size_t len, int id, uint64_t off) {
+    uint64_t v, w;
+    size_t i;
+
+    for (i = 0; i < len; i += 8) {
+        v = (off + i) * 0x9e3779b97f4a7c15ULL ^ (uint64_t) id << 56;
+        memcpy(&w, buf + i, 8);
+        if (v != w) return -1;
+    }
+    return 0;
+}
+
+static int open_file(const char *name, int flags) {
+    char path[4096];
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    fd = open(path, flags | (direct ? O_DIRECT : 0), 0644);
+    if (fd < 0) perror(path);
+    return fd;
+}
+
+// write or read one block, complaining about short transfers
+static int io(struct worker *w, int writing, uint64_t off) {
+    ssize_t n;
+
+    if (writing) {
+        fill(w->buf, bs, w->id, off);
+        n = pwrite(w->fd, w->buf, bs, off);
+    } else {
+        n = pread(w->fd, w->buf, bs, off);
+    }
+    if (n != (ssize_t) bs) {
+        fprintf(stderr, "thread %d: %s at %llu: %s\n", w->id, writing ? "pwrite" : "pread",
+                (unsigned long long) off, n < 0 ? strerror(errno) : "short transfer");
+        w->errors++;
+        return -1;
+    }
+    if (!writing && check(w->buf, bs, w->id, off) < 0) {
+        fprintf(stderr, "thread %d: wrong data at %llu\n", w->id, (unsigned long long) off);
+        w->errors++;
+        return -1;
+    }
+    return 0;
+}
+
+static void *worker(void *arg) {
+    struct worker *w = arg;
+    uint64_t off, step, base;
+    int pass;
+
+    pthread_barrier_wait(&barrier);
+
+    if (w->phase == PHASE_SHARED) {
+        // thread i owns blocks i, i+n, i+2n, ... of the shared file;
+        // written in one pass, read back in the next
+        step = (uint64_t) bs * nthreads;
+        base = (uint64_t) bs * w->id;
+        for (pass = 0; pass < 2; pass++)
+            for (off = base; off < (uint64_t) per_thread * nthreads; off += step)
+                if (io(w, pass == 0, off) < 0) break;
+    } else {
+        for (off = 0; off < per_thread; off += bs)
+            if (io(w, w->phase == PHASE_WRITE, off) < 0) break;
+    }
+    return NULL;
+}
+
+// run one phase on every thread; returns aggregate MB/s
+static double run_phase(struct worker *w, int phase, long *errors) {
+    double start, elapsed;
+    size_t bytes;
+    int i;
+
+    pthread_barrier_init(&barrier, NULL, nthreads + 1);
+    for (i = 0; i < nthreads; i++) {
+        w[i].phase = phase;
+        pthread_create(&w[i].thread, NULL, worker, &w[i]);
+    }
+    start = now();
+    pthread_barrier_wait(&barrier);
+    for (i = 0; i < nthreads; i++) pthread_join(w[i].thread, NULL);
+    elapsed = now() - start;
+    pthread_barrier_destroy(&barrier);
+
+    for (i = 0; i < nthreads; i++) *errors += w[i].errors;
+
+    // the shared phase moves every byte twice
+    bytes = per_thread * nthreads * (phase == PHASE_SHARED ? 2 : 1);
+    return bytes / elapsed / 1e6;
+}
+
+static void drop_cache(int fd) {
+    fsync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+}
+
+int main(int argc, char *argv[]) {
+    int max_threads = 8, opt, i, shared;
+    double wr, rd, sh, base[3] = { 0, 0, 0 };
+    struct worker *w;
+    char name[64];
+    long errors = 0;
+
+    while ((opt = getopt(argc, argv, "t:m:b:d")) != -1) {
+        switch (opt) {
+        case 't': max_threads = atoi(optarg); break;
+        case 'm': per_thread = (size_t) atoi(optarg) << 20; break;
+        case 'b': bs = (size_t) atoi(optarg); break;
+        case 'd': direct = 1; break;
+        default:
+            fprintf(stderr, "usage: mt_bench [-t max threads] [-m MiB per thread] [-b block size] [-d] dir\n");
+            return 2;
+        }
+    }
+    if (optind != argc - 1 || max_threads < 1 || bs < 4096 || bs % 4096 || per_thread < bs) {
+        fprintf(stderr, "usage: mt_bench [-t max threads] [-m MiB per thread] [-b block size] [-d] dir\n"
+                "       (block size a multiple of 4096, at least one block per thread)\n");
+        return 2;
+    }
+    dir = argv[optind];
+    per_thread -= per_thread % bs;
+
+    w = calloc(max_threads, sizeof(*w));
+    if (w == NULL) {
+        perror("mt_bench");
+        return 1;
+    }
+    for (i = 0; i < max_threads; i++) {
+        w[i].id = i;
+        // O_DIRECT wants aligned buffers
+        if (posix_memalign((void **) &w[i].buf, 4096, bs) != 0) {
+            perror("mt_bench");
+            return 1;
+        }
+    }
+
+    printf("%zu MiB per thread, %zu byte blocks%s\n\n", per_thread >> 20, bs,
+            direct ? ", O_DIRECT" : "");
+    printf("%7s %12s %12s %12s   %s\n", "threads", "write MB/s", "read MB/s",
+            "shared MB/s", "speedup (w/r/s)");
+
+    for (nthreads = 1; ; nthreads = nthreads * 2 > max_threads && nthreads < max_threads ?
+            max_threads : nthreads * 2) {
+        for (i = 0; i < nthreads; i++) {
+            snprintf(name, sizeof(name), "mt_bench.%d", i);
+            w[i].fd = open_file(name, O_RDWR | O_CREAT | O_TRUNC);
+            if (w[i].fd < 0) return 1;
+        }
+        wr = run_phase(w, PHASE_WRITE, &errors);
+
+        for (i = 0; i < nthreads; i++) drop_cache(w[i].fd);
+        rd = run_phase(w, PHASE_READ, &errors);
+
+        for (i = 0; i < nthreads; i++) {
+            close(w[i].fd);
+            snprintf(name, sizeof(name), "%s/mt_bench.%d", dir, i);
+            unlink(name);
+        }
+
+        shared = open_file("mt_bench.shared", O_RDWR | O_CREAT | O_TRUNC);
+        if (shared < 0) return 1;
+        for (i = 0; i < nthreads; i++) w[i].fd = shared;
+        sh = run_phase(w, PHASE_SHARED, &errors);
+        close(shared);
+        snprintf(name, sizeof(name), "%s/mt_bench.shared", dir);
+        unlink(name);
+
+        if (nthreads == 1) {
+            base[0] = wr;
+            base[1] = rd;
+            base[2] = sh;
+        }
+        printf("%7d %12.1f %12.1f %12.1f   %.2f/%.2f/%.2f\n", nthreads, wr, rd, sh,
+                wr / base[0], rd / base[1], sh / base[2]);
+        fflush(stdout);
+
+        if (nthreads >= max_threads) break;
+    }
+
+    if (errors) printf("\n%ld errors\n", errors);
+    for (i = 0; i < max_threads; i++) free(w[i].buf);
+    free(w);
+    return errors ? 1 : 0;
+}
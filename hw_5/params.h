@@ -10,16 +10,106 @@
 #define FUSE_USE_VERSION 26
 
 // need this to get pwrite().  I have to use setvbuf() instead of
-// setlinebuf() later in consequence.
+// setlinebuf() later in consequence.  (The tracing code also wants
+// strnlen() and syscall(), which _XOPEN_SOURCE 500 alone hides, so
+// ask for the GNU extensions as well.)
 #define _XOPEN_SOURCE 500
+#define _GNU_SOURCE
 
 // maintain bbfs state in here
+#include <dirent.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <sys/types.h>
+
+struct dedup_file;
+struct compress_file;
+struct journal_file;
+struct pgcache_file;
+struct wbcache;
+struct xform_ops;
+
 struct bb_state {
     FILE *logfile;
     char *rootdir;
+    int rootfd;             // rootdir, opened O_PATH
+
+    // bbfs-specific mount options (-o name[=value]); the table that
+    // fills these in is bb_opts in bbfs.c
+    int log_sync;           // log_sync: write each log line synchronously
+    unsigned log_ring_kb;   // log_ring=N: per-thread log ring, in KiB
+    char *log_policy;       // log_policy=drop|block: what to do when full
+    char *log_level;        // log_level=off|error|call|detail (log.h)
+    char *log_ops;          // log_ops=op:op...: which calls to log
+    unsigned log_sample;    // log_sample=N: 1 in N reads, writes, getattrs
+    int trace;              // trace: binary bbfs.trace instead of bbfs.log
+    int trace_fd;
+    int nostats;            // nostats: no timing, no /.bbfs_stats
+    int stats_fd;           // bbfs.stats, rewritten on SIGUSR1
+    char *xform_name;       // xform=NAME: content transform (xform.c)
+    char *key_hex;          // key=HEX: 256-bit mount key for keyed xforms
+    char *keyfile;          // keyfile=PATH: ... or read it from a file
+    char *policy_file;      // policy=PATH: other users' xforms and keys (policy.c)
+    unsigned workers;       // workers=N: fixed number of FUSE threads
+    unsigned wb_cache_mb;   // wb_cache=MiB: write-back cache size, 0 = off
+    unsigned wb_age_ms;     // wb_age=ms: write out dirty data this old
+    unsigned pg_cache_mb;   // pg_cache=MiB: page cache size, 0 = off
+    unsigned pg_ra_kb;      // pg_readahead=KiB: read-ahead limit
+    unsigned attr_ttl_ms;   // attr_ttl=ms: attribute cache TTL, 0 = off
+    unsigned dir_cache;     // dir_cache=N: directory fds to keep, 0 = off
+    int lowlevel;           // lowlevel: inode-based FUSE API (lowlevel.c)
+    int nosplice;           // nosplice: always copy file data through bbfs
+    unsigned io_write_kb;   // io_write=KiB: largest write request, 0 = max
+    unsigned io_readahead_kb;   // io_readahead=KiB: largest read-ahead, 0 = max
+    int small_writes;       // small_writes: one page per write request
+    int sync_read;          // sync_read: one read request at a time per file
+    int writeback;          // writeback: kernel write-back caching, if any
+    int readdir_plus;       // readdir_plus: stat entries into the attr cache
+    int dedup;              // dedup: store file data as shared chunks (dedup.c)
+    unsigned dedup_cache_mb;    // dedup_cache=MiB: chunk cache for reads
+    int dedup_gc;           // dedup_gc: drop unused chunks at mount
+    unsigned compress;      // compress=N: compress new files at level 1-9, 0 = off
+    int journal;            // journal: log writes ahead (journal.c)
+    unsigned journal_mb;    // journal_size=MiB: the log's size
+    unsigned journal_ms;    // journal_ms=N: checkpoint at least this often
+
+    // the command line's user's; policy.c has everybody's
+    const struct xform_ops *xform;
+    unsigned char master_key[32];
 };
-#define BB_DATA ((struct bb_state *) fuse_get_context()->private_data)
+
+// What bb_open() and bb_create() hang off fuse_file_info->fh for a
+// regular file.  (Directories get a struct bb_dir, below.)
+struct bb_file {
+    int fd;
+    unsigned char key[32];  // this file's key, if the xform is keyed
+    const struct xform_ops *xform;  // how data is transformed, NULL: not at all
+    struct wbcache *wb;     // write-back cache (wbcache.c), or NULL
+    struct pgcache_file *pc;    // page cache (pgcache.c), or NULL
+    int splice;             // data can go straight between /dev/fuse and fd
+    struct dedup_file *dd;  // with -o dedup (dedup.c), or NULL
+    struct compress_file *cz;   // with -o compress (compress.c), or NULL
+    struct journal_file *jf;    // with -o journal (journal.c), or NULL
+    pthread_mutex_t *append;    // opened O_APPEND: taken around each write
+};
+#define BB_FILE(fi) ((struct bb_file *) (uintptr_t) (fi)->fh)
+
+// ... and what bb_opendir() hangs there, so bb_readdir() can carry on
+// from where the last call left off
+struct bb_dir {
+    DIR *dp;
+    off_t offset;           // where dp is: the last entry handed out's d_off
+    struct dirent *entry;   // read but didn't fit last time, or NULL
+    char path[];            // for the attribute cache
+};
+#define BB_DIR(fi) ((struct bb_dir *) (uintptr_t) (fi)->fh)
+
+// The low-level API has no fuse_context to find private_data in, so
+// with -o lowlevel (lowlevel.c) bb_state is found through this instead
+extern struct bb_state *bb_lowlevel_data;
+#define BB_DATA (bb_lowlevel_data ? bb_lowlevel_data : \
+        (struct bb_state *) fuse_get_context()->private_data)
 
 #endif
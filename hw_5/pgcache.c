@@ -0,0 +1,482 @@
+// Page cache and read-ahead, see pgcache.h.
+//
+// All pages live in one fixed array of slots, chained into a hash
+// table by (dev, ino, index) and swept by a CLOCK hand; pgc.lock
+// covers both.  Readers pin a slot while they copy out of it so the
+// copy can run without the lock; CLOCK never picks a pinned slot.
+// Page buffers change hands rather than being copied in: whoever
+// fills a page inserts its own scratch buffer and takes the victim's
+// buffer as its next scratch.
+//
+// A page read from the backing file may be stale by the time it's
+// inserted if the file was written meanwhile.  Every inode hashes to
+// a generation counter that pgcache_invalidate() bumps; a page is
+// only inserted if its inode's generation hasn't moved since the read
+// started.
+//
+// Read-ahead requests go through a small queue to one helper thread.
+// pf->inflight counts a handle's queued and running requests, under
+// pgc.qlock, so pgcache_close() can wait them out.
+
+#include "params.h"
+
+#include <errno.h>
+#include <fuse.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "pgcache.h"
+
+#define PGCACHE_GENS  4096
+#define PGCACHE_QUEUE 256
+
+struct pg_slot {
+    dev_t dev;
+    ino_t ino;
+    uint64_t index;
+    char *data;
+    int used;
+    int ref;            // CLOCK's second-chance bit
+    int pins;
+    int hnext;          // next slot in the hash chain, -1 at the end
+};
+
+struct pg_job {
+    struct pgcache_file *pf;
+    uint64_t index;
+};
+
+struct pgcache_file {
+    pthread_mutex_t lock;       // the stream state below
+    dev_t dev;
+    ino_t ino;
+    pgcache_fill_t fill;
+    void *arg;
+
+    off_t next_off;             // where a sequential read would start
+    unsigned seq;               // sequential reads in a row
+    uint64_t ra_next;           // first page not yet asked for
+    size_t window;              // read-ahead window, in pages
+
+    int inflight;               // under pgc.qlock
+};
+
+static struct {
+    pthread_mutex_t lock;
+    struct pg_slot *slots;
+    size_t nslots, nhash, hand;
+    int *hash;
+    unsigned gen[PGCACHE_GENS];         // atomic
+    size_t ra_pages;
+    pthread_key_t scratch;
+
+    pthread_mutex_t qlock;
+    pthread_cond_t work, idle;
+    struct pg_job queue[PGCACHE_QUEUE];
+    unsigned qhead, qlen;
+    struct pg_job busy;                 // what the helper is reading now
+    pthread_t helper;
+    int running, stopping;
+
+    uint64_t hits, misses, readahead, evictions;    // under lock
+} pgc = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .qlock = PTHREAD_MUTEX_INITIALIZER,
+    .work = PTHREAD_COND_INITIALIZER,
+    .idle = PTHREAD_COND_INITIALIZER,
+};
+
+static size_t pg_hash(dev_t dev, ino_t ino, uint64_t index) {
+    return ((ino * 0x9e3779b97f4a7c15ULL ^ dev) + index * 0xbf58476d1ce4e5b9ULL) >> 20;
+}
+
+static unsigned *pg_gen(dev_t dev, ino_t ino) {
+    return &pgc.gen[(ino * 0x9e3779b97f4a7c15ULL ^ dev) >> 52 & (PGCACHE_GENS - 1)];
+}
+
+static char *pg_scratch(void) {
+    char *p = pthread_getspecific(pgc.scratch);
+
+    if (p == NULL) {
+        p = malloc(PGCACHE_PAGE);
+        pthread_setspecific(pgc.scratch, p);
+    }
+    return p;
+}
+
+// these four take pgc.lock held
+
+static int pg_find(dev_t dev, ino_t ino, uint64_t index) {
+    int i;
+
+    for (i = pgc.hash[pg_hash(dev, ino, index) % pgc.nhash]; i >= 0; i = pgc.slots[i].hnext)
+        if (pgc.slots[i].index == index && pgc.slots[i].ino == ino && pgc.slots[i].dev == dev)
+            return i;
+    return -1;
+}
+
+static void pg_unhash(int i) {
+    struct pg_slot *s = &pgc.slots[i];
+    int *pp;
+
+    for (pp = &pgc.hash[pg_hash(s->dev, s->ino, s->index) % pgc.nhash]; *pp != i;
+            pp = &pgc.slots[*pp].hnext)
+        ;
+    *pp = s->hnext;
+    s->used = 0;
+}
+
+static int pg_victim(void) {
+    struct pg_slot *s;
+    size_t tries;
+
+    for (tries = 0; tries < 2 * pgc.nslots + 1; tries++) {
+        s = &pgc.slots[pgc.hand];
+        pgc.hand = (pgc.hand + 1) % pgc.nslots;
+        if (s->pins) continue;
+        if (s->used && s->ref) {
+            s->ref = 0;
+            continue;
+        }
+        return s - pgc.slots;
+    }
+    return -1;
+}
+
+// Put the page in *page into the cache, handing back another buffer
+// (possibly NULL) in its place.  Not done if the file has changed
+// since its generation was 'gen', or the page is already there.
+static void pg_insert(dev_t dev, ino_t ino, uint64_t index, char **page, unsigned gen) {
+    struct pg_slot *s;
+    size_t h;
+    char *old;
+    int i;
+
+    if (__atomic_load_n(pg_gen(dev, ino), __ATOMIC_SEQ_CST) != gen ||
+            pg_find(dev, ino, index) >= 0)
+        return;
+
+    i = pg_victim();
+    if (i < 0) return;
+    s = &pgc.slots[i];
+    if (s->used) {
+        pg_unhash(i);
+        pgc.evictions++;
+    }
+
+    old = s->data;
+    s->data = *page;
+    *page = old;
+
+    s->dev = dev;
+    s->ino = ino;
+    s->index = index;
+    s->used = 1;
+    s->ref = 1;
+    h = pg_hash(dev, ino, index) % pgc.nhash;
+    s->hnext = pgc.hash[h];
+    pgc.hash[h] = i;
+}
+
+// Copy len bytes from offset 'in' of a cached page; returns -1 if it
+// isn't cached
+static int pg_copy(struct pgcache_file *pf, uint64_t index, size_t in, char *buf, size_t len) {
+    struct pg_slot *s;
+    int i;
+
+    pthread_mutex_lock(&pgc.lock);
+    i = pg_find(pf->dev, pf->ino, index);
+    if (i < 0) {
+        pgc.misses++;
+        pthread_mutex_unlock(&pgc.lock);
+        return -1;
+    }
+    s = &pgc.slots[i];
+    s->pins++;
+    s->ref = 1;
+    pgc.hits++;
+    pthread_mutex_unlock(&pgc.lock);
+
+    memcpy(buf, s->data + in, len);
+
+    pthread_mutex_lock(&pgc.lock);
+    s->pins--;
+    pthread_mutex_unlock(&pgc.lock);
+    return 0;
+}
+
+// Read page 'index' from the file and cache it if it's a whole one;
+// returns how much of it there was
+static ssize_t pg_fill(struct pgcache_file *pf, uint64_t index, char **page) {
+    unsigned gen = __atomic_load_n(pg_gen(pf->dev, pf->ino), __ATOMIC_SEQ_CST);
+    ssize_t n;
+
+    n = pf->fill(pf->arg, *page, PGCACHE_PAGE, (off_t) index << PGCACHE_PAGE_SHIFT);
+    if (n == PGCACHE_PAGE) {
+        pthread_mutex_lock(&pgc.lock);
+        pg_insert(pf->dev, pf->ino, index, page, gen);
+        pthread_mutex_unlock(&pgc.lock);
+    }
+    return n;
+}
+
+static void *pg_helper(void *arg) {
+    struct pg_job job;
+    char *page = NULL;
+    int cached;
+
+    pthread_mutex_lock(&pgc.qlock);
+    for (;;) {
+        while (pgc.qlen == 0 && !pgc.stopping)
+            pthread_cond_wait(&pgc.work, &pgc.qlock);
+        if (pgc.stopping) break;
+
+        job = pgc.queue[pgc.qhead];
+        pgc.qhead = (pgc.qhead + 1) % PGCACHE_QUEUE;
+        pgc.qlen--;
+        pgc.busy = job;
+        pthread_mutex_unlock(&pgc.qlock);
+
+        pthread_mutex_lock(&pgc.lock);
+        cached = pg_find(job.pf->dev, job.pf->ino, job.index) >= 0;
+        if (!cached) pgc.readahead++;
+        pthread_mutex_unlock(&pgc.lock);
+
+        if (!cached && (page || (page = malloc(PGCACHE_PAGE))))
+            pg_fill(job.pf, job.index, &page);
+
+        pthread_mutex_lock(&pgc.qlock);
+        pgc.busy.pf = NULL;
+        job.pf->inflight--;
+        pthread_cond_broadcast(&pgc.idle);
+    }
+    pthread_mutex_unlock(&pgc.qlock);
+
+    free(page);
+    return NULL;
+}
+
+// If the helper is reading this very page, wait for it rather than
+// reading it a second time; returns whether there was any waiting
+static int pg_wait_busy(struct pgcache_file *pf, uint64_t index) {
+    int waited = 0;
+
+    pthread_mutex_lock(&pgc.qlock);
+    while (pgc.busy.pf && pgc.busy.index == index &&
+            pgc.busy.pf->ino == pf->ino && pgc.busy.pf->dev == pf->dev) {
+        pthread_cond_wait(&pgc.idle, &pgc.qlock);
+        waited = 1;
+    }
+    pthread_mutex_unlock(&pgc.qlock);
+    return waited;
+}
+
+// Keep track of the handle's stream of reads, and queue read-ahead
+// once it looks sequential
+static void pg_stream(struct pgcache_file *pf, off_t off, size_t got) {
+    uint64_t last, start = 0, end = 0, i;
+
+    pthread_mutex_lock(&pf->lock);
+    if (off == pf->next_off) {
+        pf->seq++;
+    } else {
+        pf->seq = 0;
+        pf->window = 0;
+        pf->ra_next = 0;
+    }
+    pf->next_off = off + got;
+
+    if (pf->seq > 0 && got > 0 && pgc.ra_pages > 0) {
+        pf->window = pf->window ? pf->window * 2 : 2;
+        if (pf->window > pgc.ra_pages) pf->window = pgc.ra_pages;
+
+        last = (off + got - 1) >> PGCACHE_PAGE_SHIFT;
+        start = pf->ra_next > last + 1 ? pf->ra_next : last + 1;
+        end = last + 1 + pf->window;
+        if (end > pf->ra_next) pf->ra_next = end;
+    }
+    pthread_mutex_unlock(&pf->lock);
+
+    if (start >= end) return;
+
+    pthread_mutex_lock(&pgc.qlock);
+    for (i = start; i < end && pgc.qlen < PGCACHE_QUEUE; i++) {
+        pgc.queue[(pgc.qhead + pgc.qlen++) % PGCACHE_QUEUE] = (struct pg_job) { pf, i };
+        pf->inflight++;
+    }
+    pthread_cond_signal(&pgc.work);
+    pthread_mutex_unlock(&pgc.qlock);
+}
+
+ssize_t pgcache_read(struct pgcache_file *pf, char *buf, size_t len, off_t off) {
+    size_t done = 0, in, n, copy;
+    uint64_t index;
+    unsigned gen;
+    char *page;
+    ssize_t got;
+
+    while (done < len) {
+        index = (uint64_t) (off + done) >> PGCACHE_PAGE_SHIFT;
+        in = (off + done) & (PGCACHE_PAGE - 1);
+        n = PGCACHE_PAGE - in < len - done ? PGCACHE_PAGE - in : len - done;
+
+        if (pg_copy(pf, index, in, buf + done, n) == 0 ||
+                (pg_wait_busy(pf, index) && pg_copy(pf, index, in, buf + done, n) == 0)) {
+            done += n;
+            continue;
+        }
+
+        page = pg_scratch();
+        if (page == NULL) {
+            errno = ENOMEM;
+            return done ? (ssize_t) done : -1;
+        }
+        gen = __atomic_load_n(pg_gen(pf->dev, pf->ino), __ATOMIC_SEQ_CST);
+        got = pf->fill(pf->arg, page, PGCACHE_PAGE, (off_t) index << PGCACHE_PAGE_SHIFT);
+        if (got < 0) return done ? (ssize_t) done : got;
+
+        copy = (size_t) got > in ? got - in : 0;
+        if (copy > n) copy = n;
+        memcpy(buf + done, page + in, copy);
+        done += copy;
+
+        if (got == PGCACHE_PAGE) {
+            pthread_mutex_lock(&pgc.lock);
+            pg_insert(pf->dev, pf->ino, index, &page, gen);
+            pthread_mutex_unlock(&pgc.lock);
+            pthread_setspecific(pgc.scratch, page);
+        }
+        if (copy < n) break;    // end of file
+    }
+
+    pg_stream(pf, off, done);
+    return done;
+}
+
+struct pgcache_file *pgcache_open(int fd, pgcache_fill_t fill, void *arg) {
+    struct pgcache_file *pf;
+    struct stat st;
+
+    if (!pgc.running || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) return NULL;
+
+    pf = calloc(1, sizeof(*pf));
+    if (pf == NULL) return NULL;
+    pthread_mutex_init(&pf->lock, NULL);
+    pf->dev = st.st_dev;
+    pf->ino = st.st_ino;
+    pf->fill = fill;
+    pf->arg = arg;
+    return pf;
+}
+
+void pgcache_close(struct pgcache_file *pf) {
+    unsigned i, j, n;
+
+    if (pf == NULL) return;
+
+    // take back whatever's still queued, wait for what isn't
+    pthread_mutex_lock(&pgc.qlock);
+    for (i = j = 0, n = pgc.qlen; i < n; i++) {
+        struct pg_job *job = &pgc.queue[(pgc.qhead + i) % PGCACHE_QUEUE];
+
+        if (job->pf == pf) {
+            pf->inflight--;
+            pgc.qlen--;
+        } else {
+            pgc.queue[(pgc.qhead + j++) % PGCACHE_QUEUE] = *job;
+        }
+    }
+    while (pf->inflight > 0)
+        pthread_cond_wait(&pgc.idle, &pgc.qlock);
+    pthread_mutex_unlock(&pgc.qlock);
+
+    pthread_mutex_destroy(&pf->lock);
+    free(pf);
+}
+
+static void pg_drop(dev_t dev, ino_t ino, uint64_t first, uint64_t last) {
+    size_t i;
+    int s;
+
+    // bump the generation first: a page that was being read while
+    // the file changed is then either not inserted, or inserted in
+    // time to be dropped here
+    __atomic_add_fetch(pg_gen(dev, ino), 1, __ATOMIC_SEQ_CST);
+
+    pthread_mutex_lock(&pgc.lock);
+    if (last - first < 64) {
+        for (; first <= last; first++)
+            if ((s = pg_find(dev, ino, first)) >= 0) pg_unhash(s);
+    } else {
+        for (i = 0; i < pgc.nslots; i++)
+            if (pgc.slots[i].used && pgc.slots[i].ino == ino && pgc.slots[i].dev == dev &&
+                    pgc.slots[i].index >= first && pgc.slots[i].index <= last)
+                pg_unhash(i);
+    }
+    pthread_mutex_unlock(&pgc.lock);
+}
+
+void pgcache_invalidate(struct pgcache_file *pf, off_t off, size_t len) {
+    if (pf == NULL) return;
+    if (len == 0)
+        pg_drop(pf->dev, pf->ino, 0, UINT64_MAX);
+    else
+        pg_drop(pf->dev, pf->ino, (uint64_t) off >> PGCACHE_PAGE_SHIFT,
+                (uint64_t) (off + len - 1) >> PGCACHE_PAGE_SHIFT);
+}
+
+void pgcache_invalidate_stat(const struct stat *st) {
+    if (pgc.running && S_ISREG(st->st_mode))
+        pg_drop(st->st_dev, st->st_ino, 0, UINT64_MAX);
+}
+
+int pgcache_enabled(void) {
+    return pgc.running;
+}
+
+int pgcache_start(size_t budget, size_t readahead) {
+    size_t i;
+    int ret;
+
+    pgc.nslots = budget / PGCACHE_PAGE;
+    if (pgc.nslots < 16) pgc.nslots = 16;
+    pgc.nhash = pgc.nslots * 2 + 1;
+    pgc.ra_pages = readahead / PGCACHE_PAGE;
+
+    pgc.slots = calloc(pgc.nslots, sizeof(*pgc.slots));
+    pgc.hash = malloc(pgc.nhash * sizeof(*pgc.hash));
+    if (pgc.slots == NULL || pgc.hash == NULL) return -ENOMEM;
+    for (i = 0; i < pgc.nhash; i++) pgc.hash[i] = -1;
+
+    ret = pthread_key_create(&pgc.scratch, free);
+    if (ret != 0) return -ret;
+    ret = pthread_create(&pgc.helper, NULL, pg_helper, NULL);
+    if (ret != 0) return -ret;
+    pgc.running = 1;
+    return 0;
+}
+
+void pgcache_stop(void) {
+    size_t i;
+
+    if (!pgc.running) return;
+
+    pthread_mutex_lock(&pgc.qlock);
+    pgc.stopping = 1;
+    pthread_cond_signal(&pgc.work);
+    pthread_mutex_unlock(&pgc.qlock);
+    pthread_join(pgc.helper, NULL);
+
+    log_msg("    pgcache: %llu hits, %llu misses, %llu pages read ahead, %llu evictions\n",
+            (unsigned long long) pgc.hits, (unsigned long long) pgc.misses,
+            (unsigned long long) pgc.readahead, (unsigned long long) pgc.evictions);
+
+    for (i = 0; i < pgc.nslots; i++) free(pgc.slots[i].data);
+    free(pgc.slots);
+    free(pgc.hash);
+    pgc.running = 0;
+}
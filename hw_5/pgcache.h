@@ -0,0 +1,56 @@
+#ifndef _PGCACHE_H_
+#define _PGCACHE_H_
+// Page cache and read-ahead for file contents, turned on with
+// -o pg_cache=MiB.
+//
+// Pages are PGCACHE_PAGE bytes of a backing inode, stored the way
+// bb_write() left them -- still run through the writer's content
+// transform, which each reader undoes on its own copy -- and found by
+// (st_dev, st_ino, page index).  Handles with different transforms or
+// keys can share a page that way without one seeing what the other's
+// decodes to.  When the cache is full, CLOCK picks the page to throw
+// out.
+//
+// Each open handle watches its own reads; once they turn sequential,
+// a helper thread starts fetching pages ahead of the reader, in a
+// window that doubles on every read up to -o pg_readahead=KiB.
+//
+// Only whole pages are cached, so the partial page at the end of a
+// file is always read from the backing file; a file that grows can't
+// leave a stale short page behind.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define PGCACHE_PAGE_SHIFT 16
+#define PGCACHE_PAGE       (1 << PGCACHE_PAGE_SHIFT)
+
+#define PGCACHE_READAHEAD  (1 << 20)    // default read-ahead limit
+
+struct stat;
+struct pgcache_file;
+
+// Reads len bytes at off of the file behind arg, not yet decoded, into
+// buf; returns what pread() would
+typedef ssize_t (*pgcache_fill_t)(void *arg, char *buf, size_t len, off_t off);
+
+// called from bb_init() and bb_destroy(); sizes are in bytes
+int pgcache_start(size_t budget, size_t readahead);
+void pgcache_stop(void);
+int pgcache_enabled(void);
+
+// one per open handle; pgcache_close() waits for any read-ahead still
+// running on the handle, so arg stays valid until it returns
+struct pgcache_file *pgcache_open(int fd, pgcache_fill_t fill, void *arg);
+void pgcache_close(struct pgcache_file *pf);
+
+// returns what pread() would, like the fill function
+ssize_t pgcache_read(struct pgcache_file *pf, char *buf, size_t len, off_t off);
+
+// Drop cached pages after the file changed: a byte range, or every
+// page of the file (len 0).  Call after the change has been made.
+void pgcache_invalidate(struct pgcache_file *pf, off_t off, size_t len);
+void pgcache_invalidate_stat(const struct stat *st);
+
+#endif
@@ -0,0 +1,470 @@
+// Per-user transform policy, see policy.h.
+//
+// A table is an open-addressed hash of uids and gids, built whole
+// and never changed once it's in use: a reload builds a new one off
+// to the side and swaps the pointer.  Readers (every open, chmod)
+// bump one of two counters, load the pointer, probe, copy out the
+// entry and drop the counter; nothing they do waits.  The reload
+// thread is the only writer.  After the swap it flips which counter
+// new readers use and waits for the other to drain, twice, so both
+// have been empty at some point since -- and whoever could have seen
+// the old table has let go of it -- before it's freed.
+
+#include "params.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse.h>
+#include <grp.h>
+#include <limits.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "policy.h"
+#include "xform.h"
+
+#define POLICY_UID 0
+#define POLICY_GID 1
+
+struct policy_slot {
+    uint64_t id;            // kind << 32 | uid or gid
+    int used;
+    struct policy pol;
+};
+
+struct policy_table {
+    uint32_t mask;
+    unsigned uids, gids;
+    int keyed;
+    struct policy_slot slot[];
+};
+
+// a line of the file on its way into a table
+struct policy_line {
+    uint64_t id;
+    struct policy pol;
+};
+
+static struct {
+    struct policy_table *table;
+    // copied out of the table, for the report and policy_keyed(); the
+    // stats dumper can't safely look inside a table itself
+    int keyed;
+    unsigned uids, gids;
+    unsigned epoch;         // its low bit picks the readers counter
+    struct {
+        unsigned long n;
+        char pad[64 - sizeof(unsigned long)];
+    } readers[2];
+
+    // what every table is built from
+    char *path;
+    char *dir;              // path's directory, for relative keyfiles
+    uid_t uid;
+    const struct xform_ops *xform;
+    unsigned char key[XFORM_KEY_SIZE];
+    int have_key;
+
+    int pipe[2];
+    pthread_t reloader;
+    int running;
+    unsigned long reloads, failed;
+} pl = {
+    .pipe = { -1, -1 },
+};
+
+static int policy_parse_hex(const char *hex, size_t len, unsigned char key[XFORM_KEY_SIZE]) {
+    unsigned int v;
+    int i;
+
+    if (len != 2 * XFORM_KEY_SIZE) return -1;
+    for (i = 0; i < XFORM_KEY_SIZE; i++) {
+        if (!isxdigit((unsigned char) hex[2*i]) || !isxdigit((unsigned char) hex[2*i+1]) ||
+                sscanf(hex + 2*i, "%2x", &v) != 1)
+            return -1;
+        key[i] = v;
+    }
+    return 0;
+}
+
+int policy_key(const char *hex, const char *file, unsigned char key[XFORM_KEY_SIZE]) {
+    char buf[2 * XFORM_KEY_SIZE + 2];
+    size_t len;
+    FILE *f;
+
+    if (hex) return policy_parse_hex(hex, strlen(hex), key);
+
+    if (file == NULL) return -1;
+    f = fopen(file, "r");
+    if (f == NULL) return -1;
+    len = fread(buf, 1, sizeof(buf), f);
+    fclose(f);
+
+    if (len == XFORM_KEY_SIZE) {
+        memcpy(key, buf, XFORM_KEY_SIZE);
+        return 0;
+    }
+    while (len > 0 && (buf[len-1] == '\n' || buf[len-1] == '\r')) len--;
+    return policy_parse_hex(buf, len, key);
+}
+
+static uint32_t policy_hash(uint64_t id) {
+    return (uint32_t) ((id * 0x9e3779b97f4a7c15ULL) >> 32);
+}
+
+static const struct policy_slot *policy_find(const struct policy_table *t, int kind, uint32_t who) {
+    uint64_t id = (uint64_t) kind << 32 | who;
+    uint32_t i;
+
+    // never full, so there's always an empty slot to stop at
+    for (i = policy_hash(id) & t->mask; t->slot[i].used; i = (i + 1) & t->mask)
+        if (t->slot[i].id == id) return &t->slot[i];
+    return NULL;
+}
+
+// a uid or gid, by number or by name
+static int policy_who(int kind, const char *s, uint32_t *who) {
+    struct passwd *pw;
+    struct group *gr;
+    unsigned long v;
+    char *end;
+
+    errno = 0;
+    v = strtoul(s, &end, 10);
+    if (isdigit((unsigned char) *s) && *end == '\0' && errno == 0 && v < UINT32_MAX) {
+        *who = v;
+        return 0;
+    }
+    // only ever called from main() or the reload thread, one at a time
+    if (kind == POLICY_UID && (pw = getpwnam(s)) != NULL) {
+        *who = pw->pw_uid;
+        return 0;
+    }
+    if (kind == POLICY_GID && (gr = getgrnam(s)) != NULL) {
+        *who = gr->gr_gid;
+        return 0;
+    }
+    return -1;
+}
+
+// one line of the file, comment already cut off; returns 1 if it has
+// an entry, 0 if it's blank, -1 (and why, in err) if it's no good
+static int policy_parse_line(char *line, struct policy_line *pl_line, char *err, size_t errlen) {
+    char *tok[4], *save, keyfile[PATH_MAX];
+    const char *hex = NULL, *file = NULL;
+    uint32_t who;
+    int n, kind;
+
+    for (n = 0; n < 4 && (tok[n] = strtok_r(n ? NULL : line, " \t\r\n", &save)); n++)
+        ;
+    if (n == 0) return 0;
+    if (n == 4 && strtok_r(NULL, " \t\r\n", &save)) n++;
+    if (n < 3 || n > 4) {
+        snprintf(err, errlen, "expected \"uid|gid <who> <xform> [key=HEX|keyfile=PATH]\"");
+        return -1;
+    }
+
+    if (strcmp(tok[0], "uid") == 0) kind = POLICY_UID;
+    else if (strcmp(tok[0], "gid") == 0) kind = POLICY_GID;
+    else {
+        snprintf(err, errlen, "\"%s\" is neither uid nor gid", tok[0]);
+        return -1;
+    }
+    if (policy_who(kind, tok[1], &who) < 0) {
+        snprintf(err, errlen, "no such %s \"%s\"", tok[0], tok[1]);
+        return -1;
+    }
+    pl_line->id = (uint64_t) kind << 32 | who;
+
+    pl_line->pol.xform = xform_lookup(tok[2]);
+    if (pl_line->pol.xform == NULL) {
+        snprintf(err, errlen, "unknown xform \"%s\"", tok[2]);
+        return -1;
+    }
+
+    if (n == 4 && strncmp(tok[3], "key=", 4) == 0) {
+        hex = tok[3] + 4;
+    } else if (n == 4 && strncmp(tok[3], "keyfile=", 8) == 0) {
+        file = tok[3] + 8;
+        if (file[0] != '/' && pl.dir) {
+            snprintf(keyfile, sizeof(keyfile), "%s/%s", pl.dir, file);
+            file = keyfile;
+        }
+    } else if (n == 4) {
+        snprintf(err, errlen, "\"%s\" is neither key= nor keyfile=", tok[3]);
+        return -1;
+    }
+
+    memset(pl_line->pol.key, 0, XFORM_KEY_SIZE);
+    if (!pl_line->pol.xform->keyed) {
+        if (n == 4) {
+            snprintf(err, errlen, "xform %s takes no key", tok[2]);
+            return -1;
+        }
+    } else if (n == 4) {
+        // not the key itself: this goes in the log
+        if (policy_key(hex, file, pl_line->pol.key) < 0) {
+            if (file) snprintf(err, errlen, "no key in %s", file);
+            else snprintf(err, errlen, "key= isn't 64 hex digits");
+            return -1;
+        }
+    } else if (pl.have_key) {
+        memcpy(pl_line->pol.key, pl.key, XFORM_KEY_SIZE);
+    } else {
+        snprintf(err, errlen, "xform %s needs a key, and there's no mount key", tok[2]);
+        return -1;
+    }
+    return 1;
+}
+
+// Build a table from the command line's user and the file; NULL, and
+// why in err, if the file won't do
+static struct policy_table *policy_build(char *err, size_t errlen) {
+    struct policy_line *lines, *more;
+    struct policy_table *t;
+    struct policy_slot *s;
+    size_t n = 0, cap = 16, size, i;
+    char *line = NULL, *hash, why[256];
+    size_t linecap = 0;
+    unsigned lineno = 0;
+    FILE *f = NULL;
+    int ret;
+
+    lines = malloc(cap * sizeof(*lines));
+    if (lines == NULL) {
+        snprintf(err, errlen, "out of memory");
+        return NULL;
+    }
+    lines[n].id = (uint64_t) POLICY_UID << 32 | pl.uid;
+    lines[n].pol.xform = pl.xform;
+    memcpy(lines[n].pol.key, pl.key, XFORM_KEY_SIZE);
+    n++;
+
+    if (pl.path) {
+        f = fopen(pl.path, "r");
+        if (f == NULL) {
+            snprintf(err, errlen, "%s: %s", pl.path, strerror(errno));
+            free(lines);
+            return NULL;
+        }
+    }
+    while (f && getline(&line, &linecap, f) > 0) {
+        lineno++;
+        if ((hash = strchr(line, '#')) != NULL) *hash = '\0';
+        if (n == cap) {
+            more = realloc(lines, 2 * cap * sizeof(*lines));
+            if (more == NULL) {
+                snprintf(err, errlen, "out of memory");
+                goto fail;
+            }
+            lines = more;
+            cap *= 2;
+        }
+        ret = policy_parse_line(line, &lines[n], why, sizeof(why));
+        if (ret < 0) {
+            snprintf(err, errlen, "%s:%u: %s", pl.path, lineno, why);
+            goto fail;
+        }
+        n += ret;
+    }
+    if (f && ferror(f)) {
+        snprintf(err, errlen, "%s: read error", pl.path);
+        goto fail;
+    }
+
+    // at most half full, so probes stay short
+    for (size = 8; size < 2 * n; size *= 2)
+        ;
+    t = calloc(1, sizeof(*t) + size * sizeof(t->slot[0]));
+    if (t == NULL) {
+        snprintf(err, errlen, "out of memory");
+        goto fail;
+    }
+    t->mask = size - 1;
+    for (i = 0; i < n; i++) {
+        // a later line for the same uid or gid replaces the earlier one
+        s = (struct policy_slot *) policy_find(t, lines[i].id >> 32, (uint32_t) lines[i].id);
+        if (s == NULL) {
+            uint32_t j;
+
+            for (j = policy_hash(lines[i].id) & t->mask; t->slot[j].used; j = (j + 1) & t->mask)
+                ;
+            s = &t->slot[j];
+            s->used = 1;
+            s->id = lines[i].id;
+            if (lines[i].id >> 32 == POLICY_UID) t->uids++;
+            else t->gids++;
+        }
+        s->pol = lines[i].pol;
+    }
+    for (i = 0; i <= t->mask; i++)
+        if (t->slot[i].used && t->slot[i].pol.xform->keyed) t->keyed = 1;
+
+    if (f) fclose(f);
+    free(line);
+    free(lines);
+    return t;
+
+fail:
+    if (f) fclose(f);
+    free(line);
+    free(lines);
+    return NULL;
+}
+
+int policy_load(uid_t uid, const struct xform_ops *xform, const unsigned char *key,
+        const char *path) {
+    char err[PATH_MAX + 256], *slash;
+
+    pl.uid = uid;
+    pl.xform = xform;
+    if (key) {
+        memcpy(pl.key, key, XFORM_KEY_SIZE);
+        pl.have_key = 1;
+    }
+    // fuse_main() will have moved to / by the time of a reload
+    if (path) {
+        pl.path = realpath(path, NULL);
+        if (pl.path == NULL) {
+            perror(path);
+            return -1;
+        }
+        pl.dir = strdup(pl.path);
+        if (pl.dir && (slash = strrchr(pl.dir, '/')) != NULL) {
+            if (slash == pl.dir) slash[1] = '\0';
+            else *slash = '\0';
+        }
+    }
+
+    pl.table = policy_build(err, sizeof(err));
+    if (pl.table == NULL) {
+        fprintf(stderr, "policy: %s\n", err);
+        return -1;
+    }
+    pl.keyed = pl.table->keyed;
+    pl.uids = pl.table->uids;
+    pl.gids = pl.table->gids;
+    return 0;
+}
+
+int policy_get(uid_t uid, gid_t gid, struct policy *p) {
+    unsigned e = __atomic_load_n(&pl.epoch, __ATOMIC_ACQUIRE) & 1;
+    const struct policy_table *t;
+    const struct policy_slot *s = NULL;
+
+    // the counter has to be up before the table pointer is read, so
+    // the full barrier on both sides
+    __atomic_add_fetch(&pl.readers[e].n, 1, __ATOMIC_SEQ_CST);
+    t = __atomic_load_n(&pl.table, __ATOMIC_SEQ_CST);
+    if (t) {
+        s = policy_find(t, POLICY_UID, uid);
+        if (s == NULL) s = policy_find(t, POLICY_GID, gid);
+        if (s) *p = s->pol;
+    }
+    __atomic_sub_fetch(&pl.readers[e].n, 1, __ATOMIC_RELEASE);
+    return s != NULL;
+}
+
+int policy_keyed(void) {
+    return __atomic_load_n(&pl.keyed, __ATOMIC_RELAXED);
+}
+
+// Put t in and free the old table once nobody can be using it
+static void policy_swap(struct policy_table *t) {
+    struct policy_table *old;
+    struct timespec ts = { 0, 100000 };
+    unsigned e;
+    int i;
+
+    old = __atomic_exchange_n(&pl.table, t, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&pl.keyed, t->keyed, __ATOMIC_RELAXED);
+    __atomic_store_n(&pl.uids, t->uids, __ATOMIC_RELAXED);
+    __atomic_store_n(&pl.gids, t->gids, __ATOMIC_RELAXED);
+
+    for (i = 0; i < 2; i++) {
+        e = __atomic_add_fetch(&pl.epoch, 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&pl.readers[(e - 1) & 1].n, __ATOMIC_ACQUIRE))
+            nanosleep(&ts, NULL);
+    }
+    free(old);
+}
+
+static void policy_sighup(int sig) {
+    int saved = errno;
+    char c = 0;
+
+    if (write(pl.pipe[1], &c, 1) < 0) { }  // already one pending
+    errno = saved;
+}
+
+// SIGHUP only pokes the pipe; this thread reads the file and swaps
+static void *policy_reloader(void *arg) {
+    struct policy_table *t;
+    char c, err[PATH_MAX + 256];
+
+    while (read(pl.pipe[0], &c, 1) > 0) {
+        t = policy_build(err, sizeof(err));
+        if (t == NULL) {
+            __atomic_add_fetch(&pl.failed, 1, __ATOMIC_RELAXED);
+            log_msg("    policy: keeping the old table: %s\n", err);
+            continue;
+        }
+        policy_swap(t);
+        __atomic_add_fetch(&pl.reloads, 1, __ATOMIC_RELAXED);
+        log_msg("    policy: reloaded %s: %u uids, %u gids\n", pl.path, t->uids, t->gids);
+    }
+    return NULL;
+}
+
+// Called from bb_init(), once we're in the daemonized process.  This
+// takes SIGHUP over from the handler fuse_main() put there.
+int policy_start(void) {
+    struct sigaction sa;
+    int ret;
+
+    if (pipe2(pl.pipe, O_CLOEXEC | O_NONBLOCK) < 0) return -errno;
+    // only the write end may be non-blocking; the reloader sleeps on read
+    fcntl(pl.pipe[0], F_SETFL, 0);
+
+    ret = pthread_create(&pl.reloader, NULL, policy_reloader, NULL);
+    if (ret != 0) {
+        close(pl.pipe[0]);
+        close(pl.pipe[1]);
+        return -ret;
+    }
+    pl.running = 1;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = policy_sighup;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGHUP, &sa, NULL);
+    return 0;
+}
+
+void policy_stop(void) {
+    if (!pl.running) return;
+
+    signal(SIGHUP, SIG_IGN);
+    close(pl.pipe[1]);
+    pthread_join(pl.reloader, NULL);
+    close(pl.pipe[0]);
+    pl.running = 0;
+}
+
+void policy_report(FILE *out) {
+    fprintf(out, "policy: %s, %u uids, %u gids, %lu reloads, %lu failed\n",
+            pl.path ? pl.path : "(command line only)",
+            __atomic_load_n(&pl.uids, __ATOMIC_RELAXED), __atomic_load_n(&pl.gids, __ATOMIC_RELAXED),
+            __atomic_load_n(&pl.reloads, __ATOMIC_RELAXED),
+            __atomic_load_n(&pl.failed, __ATOMIC_RELAXED));
+}
@@ -0,0 +1,64 @@
+#ifndef _POLICY_H_
+#define _POLICY_H_
+// Who gets which content transform: a table of uids and gids, each
+// with a transform and key, looked up by the caller of every open.
+//
+// The uid on the command line gets -o xform with -o key/keyfile, as
+// it always has.  -o policy=FILE adds everyone else, one per line:
+//
+//     # who            xform       key (keyed transforms only)
+//     uid 1000         shift
+//     uid alice        chacha20    key=<64 hex digits>
+//     gid staff        chacha20    keyfile=staff.key
+//     uid 1002         identity
+//
+// A caller's uid entry wins over their gid's, and a later line over
+// an earlier one (the command line's uid comes before the file).  A
+// keyed transform with no key of its own uses the mount key; a
+// relative keyfile is found next to FILE.  Callers with no entry get
+// their data as it is and can't chmod, as users other than the one
+// on the command line always were.  Only the primary gid of a call
+// is looked at, not supplementary groups.
+//
+// kill -HUP rereads FILE and swaps the new table in whole; requests
+// in flight carry on with the table they started with, and the old
+// one goes once the last of them is done with it.  A file that
+// doesn't parse leaves the old table in place, and says why in
+// bbfs.log.  Write a new FILE next to the old one and rename() it
+// into place, or a reload can catch it half written.  (Without
+// -o policy, SIGHUP unmounts, as usual.)
+
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "xform.h"
+
+struct policy {
+    const struct xform_ops *xform;
+    unsigned char key[XFORM_KEY_SIZE];  // master key for the per-file keys
+};
+
+// Read -o key=HEX, or else a key file of 32 raw bytes or 64 hex
+// digits (a trailing newline is fine); returns 0 or -1
+int policy_key(const char *hex, const char *file, unsigned char key[XFORM_KEY_SIZE]);
+
+// Build the first table from main(), before fuse_main() changes
+// directory; key is the mount key, NULL if there isn't one, and path
+// is -o policy, or NULL.  Complains on stderr and returns -1 if the
+// file won't do.
+int policy_load(uid_t uid, const struct xform_ops *xform, const unsigned char *key,
+        const char *path);
+// called from bb_init() and bb_destroy(); SIGHUP reloads in between
+int policy_start(void);
+void policy_stop(void);
+
+// Copy out the entry for a caller; returns 1, or 0 if they have none
+// (and *p is left alone).  Never blocks, reload or no reload.
+int policy_get(uid_t uid, gid_t gid, struct policy *p);
+// whether any entry's transform is keyed, so new files need a nonce
+int policy_keyed(void);
+
+// the "policy:" line in the stats
+void policy_report(FILE *out);
+
+#endif
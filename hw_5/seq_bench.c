@@ -0,0 +1,175 @@
+/*
+   seq_bench -- large sequential reads and writes through a mounted bbfs
+
+   usage: seq_bench [-s MiB] [-b KiB[,KiB...]] [-p passes] dir [dir ...]
+
+   What dd if=/dev/zero of=f bs=1M followed by dd if=f of=/dev/null
+   does, under every dir given: write a file of -s MiB (default 1024)
+   in -b KiB blocks (default 1024), fsync it, then read it back in
+   the same blocks.  The best of -p passes (default 3) is reported, in
+   MiB/s.  Given a list of block sizes, e.g. -b 4,16,64,256,1024, it
+   sweeps through them.  Before reading, the file is dropped from the
+   kernel's page cache with posix_fadvise() so the reads really reach
+   bbfs; every block is checked on the way back, so a transform that
+   doesn't undo itself shows up as errors.
+
+   To see what splicing buys, mount the same rootdir twice, once as is
+   and once with -o nosplice, and give both mountpoints; the last
+   column is each one's rate over the first one's.  Only files bbfs
+   doesn't have to touch can splice, so mount with -o xform=identity
+   and without wb_cache or pg_cache, or run as a user other than the
+   one named on the command line.
+
+   The request sizes bbfs sees are capped by what bb_init() negotiated
+   (the "connection:" line in .bbfs_stats), not just the block size.
+   Sweeping block sizes over mounts with -o small_writes, with
+   -o io_write=N,io_readahead=N, and with the defaults shows what the
+   bigger requests buy.
+   */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+enum { PHASE_WRITE, PHASE_READ, NPHASES };
+static const char *phase_name[] = { "write", "read" };
+
+#define MAX_BLOCKS 16
+
+static long size_mb = 1024, block_kb = 1024, passes = 3;
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// every block starts with its own offset, so misplaced or mangled
+// data is caught without comparing all of it
+static void stamp(char *buf, size_t len, uint64_t off) {
+    memset(buf, 'a' + off / len % 26, len);
+    memcpy(buf, &off, sizeof(off));
+}
+
+static int stamped(const char *buf, size_t len, uint64_t off) {
+    uint64_t got;
+
+    memcpy(&got, buf, sizeof(got));
+    return got == off && buf[len - 1] == (char) ('a' + off / len % 26);
+}
+
+// one phase over the whole file; returns MiB per second
+static double run(const char *path, int phase, char *buf, long *errors) {
+    size_t len = block_kb << 10;
+    uint64_t total = (uint64_t) size_mb << 20, off;
+    double start;
+    int fd;
+
+    fd = phase == PHASE_WRITE ? open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)
+        : open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        (*errors)++;
+        return 0;
+    }
+    if (phase == PHASE_READ) posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+
+    start = now();
+    for (off = 0; off < total; off += len) {
+        if (phase == PHASE_WRITE) {
+            stamp(buf, len, off);
+            if (write(fd, buf, len) != (ssize_t) len) (*errors)++;
+        } else {
+            if (read(fd, buf, len) != (ssize_t) len || !stamped(buf, len, off)) (*errors)++;
+        }
+    }
+    if (phase == PHASE_WRITE && fsync(fd) < 0) (*errors)++;
+    close(fd);
+    return size_mb / (now() - start);
+}
+
+// "4,16,64" -> blocks[]; returns how many, or -1 if it doesn't parse
+static int parse_blocks(char *list, long blocks[MAX_BLOCKS]) {
+    char *tok, *end;
+    int n = 0;
+
+    for (tok = strtok(list, ","); tok; tok = strtok(NULL, ",")) {
+        if (n == MAX_BLOCKS) return -1;
+        blocks[n] = strtol(tok, &end, 10);
+        if (*end || blocks[n] < 1 || ((size_mb << 10) % blocks[n]) != 0) return -1;
+        n++;
+    }
+    return n;
+}
+
+static void usage(void) {
+    fprintf(stderr, "usage: seq_bench [-s MiB] [-b KiB[,KiB...]] [-p passes] dir [dir ...]\n");
+    fprintf(stderr, "(each block size has to divide the file size)\n");
+}
+
+int main(int argc, char *argv[]) {
+    char path[4096], *buf, *list = NULL;
+    double rate, best[NPHASES], first[MAX_BLOCKS][NPHASES];
+    long blocks[MAX_BLOCKS] = { 1024 }, errors = 0;
+    int opt, i, p, n, b, nblocks = 1;
+
+    while ((opt = getopt(argc, argv, "s:b:p:")) != -1) {
+        switch (opt) {
+        case 's': size_mb = atol(optarg); break;
+        case 'b': list = optarg; break;
+        case 'p': passes = atol(optarg); break;
+        default:
+            usage();
+            return 2;
+        }
+    }
+    // the list is checked against the file size, so after -s
+    if (list) nblocks = parse_blocks(list, blocks);
+    if (optind == argc || size_mb < 1 || passes < 1 || nblocks < 1 ||
+            ((size_mb << 10) % blocks[0]) != 0) {
+        usage();
+        return 2;
+    }
+    for (block_kb = blocks[0], b = 1; b < nblocks; b++)
+        if (blocks[b] > block_kb) block_kb = blocks[b];
+    buf = malloc(block_kb << 10);
+    if (buf == NULL) {
+        perror("malloc");
+        return 1;
+    }
+
+    printf("%ld MiB files, best of %ld\n\n", size_mb, passes);
+    printf("%-32s %8s %-6s %10s %8s\n", "dir", "KiB", "phase", "MiB/s", "vs first");
+
+    for (i = optind; i < argc; i++) {
+        snprintf(path, sizeof(path), "%s/seq_bench.dat", argv[i]);
+        for (b = 0; b < nblocks; b++) {
+            block_kb = blocks[b];
+            best[PHASE_WRITE] = best[PHASE_READ] = 0;
+            for (n = 0; n < passes; n++) {
+                for (p = 0; p < NPHASES; p++) {
+                    rate = run(path, p, buf, &errors);
+                    if (rate > best[p]) best[p] = rate;
+                }
+            }
+            for (p = 0; p < NPHASES; p++) {
+                if (i == optind) first[b][p] = best[p];
+                printf("%-32s %8ld %-6s %10.0f %7.2fx\n", argv[i], block_kb, phase_name[p],
+                        best[p], first[b][p] ? best[p] / first[b][p] : 0);
+            }
+            fflush(stdout);
+        }
+        unlink(path);
+    }
+
+    free(buf);
+    if (errors) printf("\n%ld errors\n", errors);
+    return errors ? 1 : 0;
+}
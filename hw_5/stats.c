@@ -0,0 +1,360 @@
+// Live statistics for every bbfs call, see stats.h.
+//
+// Each FUSE worker thread counts into its own stats block, so the
+// hot path is a handful of plain increments with no locking or
+// shared cache lines.  Reading the stats merges all of the blocks
+// under stats.lock; the numbers a reader sees can be a call or two
+// behind the threads that are still running, which is fine for a
+// monitoring view.  When a worker thread exits its block is folded
+// into stats.retired so nothing is lost.
+
+#include "params.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hist.h"
+#include "instr.h"
+#include "stats.h"
+#include "trace.h"
+
+struct stats_block {
+    struct hist lat[BB_OP_COUNT];
+    uint64_t errors[BB_OP_COUNT];
+    uint64_t bytes[BB_OP_COUNT];
+    uint64_t spliced[BB_OP_COUNT];  // calls whose bytes aren't in bytes[]
+    uint64_t errnos[STATS_ERRNO_MAX + 1];
+    struct stats_block *next;
+};
+
+// the rendered text handed out by one open() of the control file
+struct stats_snapshot {
+    size_t len;
+    char *text;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_key_t key;
+    struct stats_block *live;
+    struct stats_block *retired;
+    uint64_t start;
+
+    char conn[256];
+    void (*sections[STATS_SECTIONS_MAX])(FILE *out);
+    int nsections;
+
+    int dump_fd;
+    int pipe[2];
+    pthread_t dumper;
+    int running;
+} stats = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .dump_fd = -1,
+    .pipe = { -1, -1 },
+};
+
+static __thread struct stats_block *my_stats;
+
+static void stats_block_init(struct stats_block *b) {
+    int op;
+
+    memset(b, 0, sizeof(*b));
+    for (op = 0; op < BB_OP_COUNT; op++) hist_init(&b->lat[op]);
+}
+
+static void stats_block_merge(struct stats_block *dst, const struct stats_block *src) {
+    int op, e;
+
+    for (op = 0; op < BB_OP_COUNT; op++) {
+        hist_merge(&dst->lat[op], &src->lat[op]);
+        dst->errors[op] += src->errors[op];
+        dst->bytes[op] += src->bytes[op];
+        dst->spliced[op] += src->spliced[op];
+    }
+    for (e = 0; e <= STATS_ERRNO_MAX; e++)
+        dst->errnos[e] += src->errnos[e];
+}
+
+// pthread key destructor: a worker thread is going away
+static void stats_retire(void *arg) {
+    struct stats_block *b = arg, **pp;
+
+    pthread_mutex_lock(&stats.lock);
+    for (pp = &stats.live; *pp; pp = &(*pp)->next)
+        if (*pp == b) {
+            *pp = b->next;
+            break;
+        }
+    stats_block_merge(stats.retired, b);
+    pthread_mutex_unlock(&stats.lock);
+    free(b);
+}
+
+static struct stats_block *stats_register(void) {
+    struct stats_block *b;
+
+    b = malloc(sizeof(*b));
+    if (b == NULL) return NULL;
+    stats_block_init(b);
+
+    pthread_mutex_lock(&stats.lock);
+    b->next = stats.live;
+    stats.live = b;
+    pthread_mutex_unlock(&stats.lock);
+
+    pthread_setspecific(stats.key, b);
+    my_stats = b;
+    return b;
+}
+
+void stats_record(int op, uint64_t lat, int result, unsigned flags) {
+    struct stats_block *b = my_stats;
+
+    if (b == NULL) {
+        // not set up yet (or stats_start() failed)
+        if (stats.retired == NULL || (b = stats_register()) == NULL) return;
+    }
+
+    hist_add(&b->lat[op], lat);
+    if (result < 0) {
+        b->errors[op]++;
+        b->errnos[-result < STATS_ERRNO_MAX ? -result : STATS_ERRNO_MAX]++;
+    } else if (flags & BB_TRACE_SPLICED)
+        b->spliced[op]++;
+    else if (op == BB_OP_READ || op == BB_OP_WRITE)
+        b->bytes[op] += result;
+}
+
+static void stats_print(FILE *out, const struct stats_block *sum, double secs) {
+    char ebuf[128];
+    const struct hist *h;
+    int op, e, i;
+
+    fprintf(out, "bbfs statistics, up %.3f s\n", secs);
+    if (stats.conn[0]) fprintf(out, "connection: %s\n", stats.conn);
+    fprintf(out, "\n");
+    fprintf(out, "%-12s %10s %8s %10s %9s %9s %9s %9s %9s %9s\n",
+            "op", "count", "errors", "ops/s", "mean_us", "p50_us",
+            "p90_us", "p99_us", "p99.9_us", "max_us");
+    for (op = 0; op < BB_OP_COUNT; op++) {
+        h = &sum->lat[op];
+        if (h->count == 0) continue;
+        fprintf(out, "%-12s %10llu %8llu %10.1f %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n",
+                bb_op_name(op), (unsigned long long) h->count,
+                (unsigned long long) sum->errors[op], h->count / secs,
+                h->sum / 1e3 / h->count, hist_percentile(h, 50) / 1e3,
+                hist_percentile(h, 90) / 1e3, hist_percentile(h, 99) / 1e3,
+                hist_percentile(h, 99.9) / 1e3, h->max / 1e3);
+    }
+
+    fprintf(out, "\nread:  %llu bytes, %.2f MB/s\n",
+            (unsigned long long) sum->bytes[BB_OP_READ], sum->bytes[BB_OP_READ] / 1e6 / secs);
+    if (sum->spliced[BB_OP_READ])
+        fprintf(out, "       not counting %llu spliced reads, whose size bbfs never sees\n",
+                (unsigned long long) sum->spliced[BB_OP_READ]);
+    fprintf(out, "write: %llu bytes, %.2f MB/s\n",
+            (unsigned long long) sum->bytes[BB_OP_WRITE], sum->bytes[BB_OP_WRITE] / 1e6 / secs);
+
+    fprintf(out, "\nerrors by errno:\n");
+    for (e = 1; e <= STATS_ERRNO_MAX; e++) {
+        if (sum->errnos[e] == 0) continue;
+        if (e == STATS_ERRNO_MAX)
+            fprintf(out, "  >=%-4d %-32s %llu\n", e, "(other)",
+                    (unsigned long long) sum->errnos[e]);
+        else
+            fprintf(out, "  %-6d %-32s %llu\n", e, strerror_r(e, ebuf, sizeof(ebuf)),
+                    (unsigned long long) sum->errnos[e]);
+    }
+
+    for (i = 0; i < stats.nsections; i++) {
+        fprintf(out, "\n");
+        stats.sections[i](out);
+    }
+}
+
+void stats_conn(const char *desc) {
+    snprintf(stats.conn, sizeof(stats.conn), "%s", desc);
+}
+
+void stats_section(void (*print)(FILE *out)) {
+    if (stats.nsections < STATS_SECTIONS_MAX) stats.sections[stats.nsections++] = print;
+}
+
+// Snapshot of everything so far as text; the caller frees it
+char *stats_render(size_t *len) {
+    struct stats_block *sum, *b;
+    double secs;
+    char *text = NULL;
+    FILE *out;
+
+    sum = malloc(sizeof(*sum));
+    if (sum == NULL) return NULL;
+    stats_block_init(sum);
+
+    pthread_mutex_lock(&stats.lock);
+    if (stats.retired) stats_block_merge(sum, stats.retired);
+    for (b = stats.live; b; b = b->next)
+        stats_block_merge(sum, b);
+    pthread_mutex_unlock(&stats.lock);
+
+    secs = (instr_now() - stats.start) / 1e9;
+    if (secs <= 0) secs = 1e-9;
+
+    out = open_memstream(&text, len);
+    if (out != NULL) {
+        stats_print(out, sum, secs);
+        fclose(out);
+    }
+    free(sum);
+    return text;
+}
+
+// Opened from main() so SIGUSR1 dumps land next to bbfs.log even
+// after fuse_main() has daemonized and changed directory to /
+int stats_open(void) {
+    int fd;
+
+    fd = open(BB_STATS_FILE, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) perror("statsfile");
+    return fd;
+}
+
+static void stats_sigusr1(int sig) {
+    int saved = errno;
+    char c = 0;
+
+    if (write(stats.pipe[1], &c, 1) < 0) { }   // already one pending
+    errno = saved;
+}
+
+// SIGUSR1 only pokes the pipe; this thread does the actual dump
+static void *stats_dumper(void *arg) {
+    char c, *text;
+    size_t len;
+
+    while (read(stats.pipe[0], &c, 1) > 0) {
+        if (stats.dump_fd < 0) continue;
+        text = stats_render(&len);
+        if (text == NULL) continue;
+        if (ftruncate(stats.dump_fd, 0) == 0 &&
+                pwrite(stats.dump_fd, text, len, 0) < 0) { }
+        free(text);
+    }
+    return NULL;
+}
+
+// Called from bb_init(), once we're in the daemonized process
+int stats_start(int dump_fd) {
+    struct sigaction sa;
+    int ret;
+
+    stats.start = instr_now();
+    stats.dump_fd = dump_fd;
+
+    ret = pthread_key_create(&stats.key, stats_retire);
+    if (ret != 0) return -ret;
+    stats.retired = malloc(sizeof(*stats.retired));
+    if (stats.retired == NULL) return -ENOMEM;
+    stats_block_init(stats.retired);
+
+    if (pipe2(stats.pipe, O_CLOEXEC | O_NONBLOCK) < 0) return -errno;
+    // only the write end may be non-blocking; the dumper sleeps on read
+    fcntl(stats.pipe[0], F_SETFL, 0);
+
+    ret = pthread_create(&stats.dumper, NULL, stats_dumper, NULL);
+    if (ret != 0) return -ret;
+    stats.running = 1;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stats_sigusr1;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, NULL);
+    return 0;
+}
+
+void stats_stop(void) {
+    if (!stats.running) return;
+
+    signal(SIGUSR1, SIG_IGN);
+    close(stats.pipe[1]);
+    pthread_join(stats.dumper, NULL);
+    close(stats.pipe[0]);
+    stats.running = 0;
+
+    // leave a final copy behind
+    if (stats.dump_fd >= 0) {
+        char *text;
+        size_t len;
+
+        text = stats_render(&len);
+        if (text && ftruncate(stats.dump_fd, 0) == 0 &&
+                pwrite(stats.dump_fd, text, len, 0) < 0) { }
+        free(text);
+    }
+}
+
+int stats_ctl_getattr(struct stat *st) {
+    char *text;
+    size_t len = 0;
+
+    text = stats_render(&len);
+    free(text);
+
+    memset(st, 0, sizeof(*st));
+    st->st_mode = S_IFREG | 0444;
+    st->st_nlink = 1;
+    st->st_uid = getuid();
+    st->st_gid = getgid();
+    st->st_size = len;
+    st->st_mtime = st->st_ctime = st->st_atime = time(NULL);
+    return 0;
+}
+
+// The text is rendered once per open() so a reader sees one
+// consistent snapshot however it chops up its reads.  direct_io stops
+// the kernel from caching it or trusting the size from getattr.
+int stats_ctl_open(struct fuse_file_info *fi) {
+    struct stats_snapshot *snap;
+
+    if ((fi->flags & O_ACCMODE) != O_RDONLY) return -EACCES;
+
+    snap = malloc(sizeof(*snap));
+    if (snap == NULL) return -ENOMEM;
+    snap->text = stats_render(&snap->len);
+    if (snap->text == NULL) {
+        free(snap);
+        return -ENOMEM;
+    }
+
+    fi->fh = (uintptr_t) snap;
+    fi->direct_io = 1;
+    return 0;
+}
+
+int stats_ctl_read(char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+    struct stats_snapshot *snap = (struct stats_snapshot *) (uintptr_t) fi->fh;
+
+    if (offset >= snap->len) return 0;
+    if (size > snap->len - offset) size = snap->len - offset;
+    memcpy(buf, snap->text + offset, size);
+    return size;
+}
+
+int stats_ctl_release(struct fuse_file_info *fi) {
+    struct stats_snapshot *snap = (struct stats_snapshot *) (uintptr_t) fi->fh;
+
+    free(snap->text);
+    free(snap);
+    return 0;
+}
@@ -0,0 +1,47 @@
+#ifndef _STATS_H_
+#define _STATS_H_
+// Live per-operation statistics: latency histograms, error counts by
+// errno and read/write byte counters.  Fed by the wrappers in instr.c
+// and readable at any time, either as the virtual file
+// <mountpoint>/.bbfs_stats or by sending bbfs SIGUSR1, which rewrites
+// bbfs.stats in the directory bbfs was started from.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+
+#define BB_STATS_PATH "/.bbfs_stats"
+#define BB_STATS_FILE "bbfs.stats"
+
+// errno values above this are lumped together in the last slot
+#define STATS_ERRNO_MAX 160
+
+struct stat;
+struct fuse_file_info;
+
+int stats_open(void);
+int stats_start(int dump_fd);
+void stats_stop(void);
+// flags are the trace's, BB_TRACE_*
+void stats_record(int op, uint64_t lat, int result, unsigned flags);
+char *stats_render(size_t *len);
+// what bb_init() got out of the kernel, shown at the top of the stats
+void stats_conn(const char *desc);
+// a section of its own that some other part of bbfs adds at the end;
+// registered from bb_init(), and print may be called after that part
+// has been stopped
+#define STATS_SECTIONS_MAX 4
+void stats_section(void (*print)(FILE *out));
+
+// the control file itself
+int stats_ctl_getattr(struct stat *st);
+int stats_ctl_open(struct fuse_file_info *fi);
+int stats_ctl_read(char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
+int stats_ctl_release(struct fuse_file_info *fi);
+
+static inline int stats_is_ctl(const char *path) {
+    return path && path[0] == '/' && path[1] == '.' && strcmp(path, BB_STATS_PATH) == 0;
+}
+
+#endif
@@ -0,0 +1,109 @@
+// Binary tracing of every bbfs call (-o trace).  See trace.h for the
+// file format.  The calls themselves are timed by the wrappers in
+// instr.c, which hand each finished call to trace_emit(); records are
+// queued on the calling thread's log ring.
+
+#include "params.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "instr.h"
+#include "logring.h"
+#include "trace.h"
+
+// per-thread memory of which path names are already in the trace
+#define TRACE_SEEN 1024
+
+static __thread uint32_t my_tid;
+static __thread uint64_t seen[TRACE_SEEN];
+
+int trace_open(void) {
+    struct bb_trace_hdr hdr;
+    struct timespec ts;
+    int fd;
+
+    // like the logfile, if we can't open the trace we're dead
+    fd = open(BB_TRACE_FILE, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("tracefile");
+        exit(EXIT_FAILURE);
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, BB_TRACE_MAGIC, sizeof(BB_TRACE_MAGIC));
+    hdr.version = BB_TRACE_VERSION;
+    hdr.rec_size = sizeof(struct bb_trace_rec);
+    hdr.mono_ns = instr_now();
+    clock_gettime(CLOCK_REALTIME, &ts);
+    hdr.real_ns = (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+    if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+        perror("tracefile");
+        exit(EXIT_FAILURE);
+    }
+    return fd;
+}
+
+// passed to logring_start() so a full ring shows up as a record
+// rather than as text in the middle of the binary trace
+size_t trace_drop_note(char *buf, size_t len, uint64_t dropped) {
+    struct bb_trace_rec rec;
+
+    if (len < sizeof(rec)) return 0;
+    memset(&rec, 0, sizeof(rec));
+    rec.ts = instr_now();
+    rec.op = BB_OP_DROPPED;
+    rec.size = dropped;
+    memcpy(buf, &rec, sizeof(rec));
+    return sizeof(rec);
+}
+
+// make sure the decoder can name path_id before it's first used
+static void trace_pathname(uint64_t id, const char *path) {
+    char buf[sizeof(struct bb_trace_rec) * (1 + PATH_MAX / sizeof(struct bb_trace_rec) + 1)];
+    struct bb_trace_rec *rec = (struct bb_trace_rec *) buf;
+    size_t len, padded;
+
+    if (seen[id % TRACE_SEEN] == id) return;
+
+    len = strnlen(path, PATH_MAX);
+    padded = (len + sizeof(*rec) - 1) / sizeof(*rec) * sizeof(*rec);
+    memset(rec, 0, sizeof(*rec) + padded);
+    rec->ts = instr_now();
+    rec->path_id = id;
+    rec->size = len;
+    rec->op = BB_OP_PATHNAME;
+    rec->tid = my_tid;
+    memcpy(buf + sizeof(*rec), path, len);
+
+    // only remember it if it actually made it into the ring
+    if (logring_write(buf, sizeof(*rec) + padded) == 0)
+        seen[id % TRACE_SEEN] = id;
+}
+
+void trace_emit(int op, const char *path, int64_t offset, uint64_t size,
+        int result, unsigned flags, uint64_t t0, uint64_t lat) {
+    struct bb_trace_rec rec;
+
+    if (my_tid == 0) my_tid = syscall(SYS_gettid);
+
+    rec.ts = t0;
+    rec.path_id = path ? bb_trace_hash(path) : 0;
+    rec.offset = offset;
+    rec.size = size;
+    rec.latency = lat > UINT32_MAX ? UINT32_MAX : lat;
+    rec.result = result;
+    rec.op = op;
+    rec.flags = flags;
+    rec.tid = my_tid;
+
+    if (path) trace_pathname(rec.path_id, path);
+    logring_write((const char *) &rec, sizeof(rec));
+}
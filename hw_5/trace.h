@@ -0,0 +1,106 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+// Binary operation trace.  With -o trace, bbfs stops writing the text
+// log and instead emits one fixed-size bb_trace_rec per filesystem
+// call to bbfs.trace.  bbtrace (bbtrace.c) turns the file back into
+// text or CSV and prints per-operation latency histograms.
+//
+// This header is shared with bbtrace, so it mustn't pull in fuse.h.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BB_TRACE_MAGIC   "BBTRACE"
+#define BB_TRACE_VERSION 1
+#define BB_TRACE_FILE    "bbfs.trace"
+
+// Every operation bbfs implements, as X(OPCODE, name).  The order
+// fixes the opcode numbers in the file, so only ever append.
+#define BB_OPS(X)                                               \
+    X(GETATTR, getattr)     X(READLINK, readlink)               \
+    X(MKNOD, mknod)         X(MKDIR, mkdir)                     \
+    X(UNLINK, unlink)       X(RMDIR, rmdir)                     \
+    X(SYMLINK, symlink)     X(RENAME, rename)                   \
+    X(LINK, link)           X(CHMOD, chmod)                     \
+    X(CHOWN, chown)         X(TRUNCATE, truncate)               \
+    X(UTIME, utime)         X(OPEN, open)                       \
+    X(READ, read)           X(WRITE, write)                     \
+    X(STATFS, statfs)       X(FLUSH, flush)                     \
+    X(RELEASE, release)     X(FSYNC, fsync)                     \
+    X(SETXATTR, setxattr)   X(GETXATTR, getxattr)               \
+    X(LISTXATTR, listxattr) X(REMOVEXATTR, removexattr)         \
+    X(OPENDIR, opendir)     X(READDIR, readdir)                 \
+    X(RELEASEDIR, releasedir) X(FSYNCDIR, fsyncdir)             \
+    X(ACCESS, access)       X(CREATE, create)                   \
+    X(FTRUNCATE, ftruncate) X(FGETATTR, fgetattr)
+
+enum bb_op {
+#define BB_OP_ENUM(op, name) BB_OP_##op,
+    BB_OPS(BB_OP_ENUM)
+#undef BB_OP_ENUM
+    BB_OP_COUNT,
+
+    // not filesystem calls: bookkeeping records in the trace
+    BB_OP_PATHNAME = 0xfff0,    // size = strlen, name follows
+    BB_OP_DROPPED  = 0xfff1,    // size = records lost to a full ring
+};
+
+static inline const char *bb_op_name(unsigned op) {
+    static const char *const names[BB_OP_COUNT] = {
+#define BB_OP_NAME(op, name) #name,
+        BB_OPS(BB_OP_NAME)
+#undef BB_OP_NAME
+    };
+
+    return op < BB_OP_COUNT ? names[op] : "?";
+}
+
+// At the start of the file.  The two clock readings are taken
+// together so the decoder can turn record timestamps into wall time.
+struct bb_trace_hdr {
+    char magic[8];
+    uint32_t version;
+    uint32_t rec_size;          // sizeof(struct bb_trace_rec)
+    uint64_t mono_ns;           // CLOCK_MONOTONIC when the trace opened
+    uint64_t real_ns;           // CLOCK_REALTIME at the same moment
+};
+
+// One filesystem call.  Paths are stored as a 64-bit FNV-1a hash; the
+// first time a thread sees a path it also writes a BB_OP_PATHNAME
+// record followed by the name itself, zero-padded to a multiple of
+// the record size.
+struct bb_trace_rec {
+    uint64_t ts;                // CLOCK_MONOTONIC ns at entry
+    uint64_t path_id;
+    int64_t offset;             // read/write/truncate offset, else 0
+    uint64_t size;              // bytes requested, else 0
+    uint32_t latency;           // ns, saturates at UINT32_MAX (~4.3 s)
+    int32_t result;             // what bbfs returned, -errno on failure
+    uint16_t op;                // enum bb_op
+    uint16_t flags;             // BB_TRACE_*
+    uint32_t tid;               // kernel thread id of the FUSE worker
+};
+
+// flags: a read whose data was spliced straight from the backing
+// file; bbfs never sees how much of it there was, so result is 0
+// rather than the bytes read
+#define BB_TRACE_SPLICED 1
+
+// FNV-1a, 64 bit
+static inline uint64_t bb_trace_hash(const char *s) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    while (*s) {
+        h ^= (unsigned char) *s++;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+// bbfs side, in trace.c
+int trace_open(void);
+void trace_emit(int op, const char *path, int64_t offset, uint64_t size,
+        int result, unsigned flags, uint64_t t0, uint64_t lat);
+size_t trace_drop_note(char *buf, size_t len, uint64_t dropped);
+
+#endif
@@ -0,0 +1,496 @@
+// Write-back cache, see wbcache.h.
+//
+// Each cache holds a sorted list of non-overlapping dirty extents and
+// its own dup() of a writable descriptor for writing them out, so it
+// can be flushed by whichever thread gets there first -- the writer,
+// fsync(), the last release() or the background flusher.  Caches are
+// found by (st_dev, st_ino) in a small hash table and live for as long
+// as somebody holds a reference.
+//
+// Memory is accounted as the sum of the extent buffers' capacities.
+// A writer reserves the most its write could add before touching the
+// extents, so concurrent writers can't overshoot the cap between
+// them.  A cache's lock may be held while taking wbc.lock, never the
+// other way round, and nothing does I/O while holding wbc.lock.
+
+#include "params.h"
+
+#include <errno.h>
+#include <fuse.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "instr.h"
+#include "log.h"
+#include "wbcache.h"
+
+#define WBCACHE_HASH 1024
+
+struct wb_extent {
+    uint64_t off;
+    size_t len, cap;
+    unsigned char *data;
+    struct wb_extent *next;
+};
+
+struct wbcache {
+    pthread_mutex_t lock;
+    dev_t dev;
+    ino_t ino;
+    int refs;                   // under wbc.lock
+    struct wbcache *hnext;      // under wbc.lock
+
+    int fd;                     // -1 until the first cached write
+    struct wb_extent *ext;
+    uint64_t dirty_since;       // instr_now() of the oldest dirty data, 0 if
+                                // clean; written under lock, read atomically
+    uint64_t end;               // end of the last extent
+    int error;                  // first write error since the last flush
+};
+
+static struct {
+    pthread_mutex_t lock;
+    struct wbcache *hash[WBCACHE_HASH];
+    size_t cap;
+    size_t used;                // atomic
+    uint64_t age_ns;
+
+    pthread_t flusher;
+    pthread_cond_t wake;
+    int running, stopping, pressure;
+} wbc = { .lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER };
+
+static unsigned wb_hash(dev_t dev, ino_t ino) {
+    return (unsigned) ((ino * 0x9e3779b97f4a7c15ULL ^ dev) >> 22) % WBCACHE_HASH;
+}
+
+static size_t wb_round(size_t len) {
+    return (len + WBCACHE_ROUND - 1) / WBCACHE_ROUND * WBCACHE_ROUND;
+}
+
+// both of these take the cache's lock held
+
+static void wb_free_extent(struct wb_extent *e) {
+    __atomic_sub_fetch(&wbc.used, e->cap, __ATOMIC_RELAXED);
+    free(e->data);
+    free(e);
+}
+
+static void wb_write_extent(struct wbcache *wb, struct wb_extent *e) {
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < e->len) {
+        n = pwrite(wb->fd, e->data + done, e->len - done, e->off + done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            if (wb->error == 0) wb->error = n < 0 ? -errno : -EIO;
+            log_err("wbcache: pwrite of %zu bytes at %llu failed: %s\n", e->len - done,
+                    (unsigned long long) (e->off + done), strerror(-wb->error));
+            return;
+        }
+        done += n;
+    }
+}
+
+static int wb_flush_locked(struct wbcache *wb) {
+    struct wb_extent *e;
+    int ret;
+
+    while ((e = wb->ext) != NULL) {
+        wb_write_extent(wb, e);
+        wb->ext = e->next;
+        wb_free_extent(e);
+    }
+    __atomic_store_n(&wb->dirty_since, 0, __ATOMIC_RELAXED);
+    wb->end = 0;
+
+    ret = wb->error;
+    wb->error = 0;
+    return ret;
+}
+
+// Merge [off, off+len) into the extent list.  The caller has
+// reserved len + WBCACHE_ROUND bytes of wbc.used; returns how much of
+// that was really used, or -ENOMEM.
+static ssize_t wb_insert(struct wbcache *wb, const unsigned char *buf, size_t len, uint64_t off) {
+    struct wb_extent **pp, *e, *nx;
+    uint64_t start, end;
+    size_t cap, oldcap;
+    unsigned char *data;
+
+    // first extent that overlaps or touches the new data
+    for (pp = &wb->ext; *pp && (*pp)->off + (*pp)->len < off; pp = &(*pp)->next)
+        ;
+    e = *pp;
+
+    if (e == NULL || e->off > off + len) {
+        nx = malloc(sizeof(*nx));
+        cap = wb_round(len);
+        data = malloc(cap);
+        if (nx == NULL || data == NULL) {
+            free(nx);
+            free(data);
+            return -ENOMEM;
+        }
+        memcpy(data, buf, len);
+        *nx = (struct wb_extent) { off, len, cap, data, e };
+        *pp = nx;
+        if (off + len > wb->end) wb->end = off + len;
+        return cap;
+    }
+
+    start = e->off < off ? e->off : off;
+    end = e->off + e->len > off + len ? e->off + e->len : off + len;
+    for (nx = e->next; nx && nx->off <= end; nx = nx->next)
+        if (nx->off + nx->len > end) end = nx->off + nx->len;
+
+    oldcap = e->cap;
+    cap = wb_round(end - start);
+    if (start == e->off) {
+        // the common case, appending to e: grow it in place
+        if (cap > e->cap) {
+            data = realloc(e->data, cap);
+            if (data == NULL) return -ENOMEM;
+            e->data = data;
+            e->cap = cap;
+        }
+    } else {
+        data = malloc(cap);
+        if (data == NULL) return -ENOMEM;
+        memcpy(data + (e->off - start), e->data, e->len);
+        free(e->data);
+        e->data = data;
+        e->cap = cap;
+        e->off = start;
+    }
+    e->len = end - start;
+
+    // swallow the extents the new data bridges over to
+    while ((nx = e->next) && nx->off <= end) {
+        memcpy(e->data + (nx->off - start), nx->data, nx->len);
+        e->next = nx->next;
+        wb_free_extent(nx);
+    }
+    memcpy(e->data + (off - start), buf, len);
+
+    if (end > wb->end) wb->end = end;
+    return e->cap - oldcap;
+}
+
+// a flush's -errno, which may be one the flusher thread ran into
+// earlier, the way pwrite() would report it: in errno, not in the
+// return value
+static ssize_t wb_failed(int ret) {
+    errno = -ret;
+    return -1;
+}
+
+// write around the cache; the caller holds wb->lock and has flushed,
+// so no older cached data can overwrite this later
+static ssize_t wb_write_through(struct wbcache *wb, int fd, const void *buf, size_t len, off_t off) {
+    ssize_t ret;
+
+    ret = wb_flush_locked(wb);
+    if (ret == 0) ret = pwrite(fd, buf, len, off);
+    else ret = wb_failed(ret);
+    pthread_mutex_unlock(&wb->lock);
+    return ret;
+}
+
+ssize_t wbcache_write(struct wbcache *wb, int fd, const void *buf, size_t len, off_t off) {
+    size_t reserve = len + WBCACHE_ROUND;
+    ssize_t ret, used;
+    struct wb_extent *e;
+
+    if (wb == NULL) return pwrite(fd, buf, len, off);
+
+    pthread_mutex_lock(&wb->lock);
+    if (len > WBCACHE_EXTENT_MAX) return wb_write_through(wb, fd, buf, len, off);
+    if (wb->fd < 0) {
+        wb->fd = dup(fd);
+        if (wb->fd < 0) return wb_write_through(wb, fd, buf, len, off);
+    }
+
+    if (__atomic_add_fetch(&wbc.used, reserve, __ATOMIC_RELAXED) > wbc.cap) {
+        // out of room: make some by writing out this file, and get
+        // the flusher started on everybody else's
+        __atomic_sub_fetch(&wbc.used, reserve, __ATOMIC_RELAXED);
+        ret = wb_flush_locked(wb);
+        pthread_mutex_lock(&wbc.lock);
+        wbc.pressure = 1;
+        pthread_cond_signal(&wbc.wake);
+        pthread_mutex_unlock(&wbc.lock);
+        if (ret < 0) {
+            pthread_mutex_unlock(&wb->lock);
+            return wb_failed(ret);
+        }
+        if (__atomic_add_fetch(&wbc.used, reserve, __ATOMIC_RELAXED) > wbc.cap) {
+            __atomic_sub_fetch(&wbc.used, reserve, __ATOMIC_RELAXED);
+            return wb_write_through(wb, fd, buf, len, off);
+        }
+    }
+
+    // (the difference may be "negative" if extents were merged away;
+    // unsigned wraparound makes that come out right)
+    used = wb_insert(wb, buf, len, off);
+    __atomic_sub_fetch(&wbc.used, reserve - (used > 0 ? used : 0), __ATOMIC_RELAXED);
+    if (used < 0) return wb_write_through(wb, fd, buf, len, off);
+
+    if (wb->dirty_since == 0) __atomic_store_n(&wb->dirty_since, instr_now(), __ATOMIC_RELAXED);
+
+    // big enough to be worth writing now
+    for (e = wb->ext; e; e = e->next)
+        if (e->len >= WBCACHE_EXTENT_MAX) {
+            ret = wb_flush_locked(wb);
+            pthread_mutex_unlock(&wb->lock);
+            return ret < 0 ? wb_failed(ret) : (ssize_t) len;
+        }
+
+    pthread_mutex_unlock(&wb->lock);
+    return len;
+}
+
+ssize_t wbcache_read(struct wbcache *wb, int fd, void *buf, size_t len, off_t off) {
+    struct wb_extent *e;
+    uint64_t from, to;
+    ssize_t n;
+
+    // (dirty_since is the one field that's safe to peek at unlocked)
+    if (wb == NULL || __atomic_load_n(&wb->dirty_since, __ATOMIC_RELAXED) == 0)
+        return pread(fd, buf, len, off);
+
+    // hold the lock across the pread() too, or a flush could retire
+    // an extent in between and leave us with neither copy of it
+    pthread_mutex_lock(&wb->lock);
+    n = pread(fd, buf, len, off);
+    if (n >= 0) {
+        // the file really ends at the last dirty byte if that's past
+        // the end of the backing file, with a hole in between
+        if ((uint64_t) off + n < wb->end) {
+            to = wb->end - off < len ? wb->end - off : len;
+            memset((char *) buf + n, 0, to - n);
+            n = to;
+        }
+
+        for (e = wb->ext; e && e->off < (uint64_t) off + len; e = e->next) {
+            if (e->off + e->len <= (uint64_t) off) continue;
+            from = e->off > (uint64_t) off ? e->off : (uint64_t) off;
+            to = e->off + e->len < (uint64_t) off + len ? e->off + e->len : (uint64_t) off + len;
+            memcpy((char *) buf + (from - off), e->data + (from - e->off), to - from);
+        }
+    }
+    pthread_mutex_unlock(&wb->lock);
+    return n;
+}
+
+int wbcache_flush(struct wbcache *wb) {
+    int ret;
+
+    if (wb == NULL) return 0;
+    pthread_mutex_lock(&wb->lock);
+    ret = wb_flush_locked(wb);
+    pthread_mutex_unlock(&wb->lock);
+    return ret;
+}
+
+// find and take a reference to an existing cache
+static struct wbcache *wb_lookup(dev_t dev, ino_t ino) {
+    struct wbcache *wb;
+
+    pthread_mutex_lock(&wbc.lock);
+    for (wb = wbc.hash[wb_hash(dev, ino)]; wb; wb = wb->hnext)
+        if (wb->dev == dev && wb->ino == ino) {
+            wb->refs++;
+            break;
+        }
+    pthread_mutex_unlock(&wbc.lock);
+    return wb;
+}
+
+struct wbcache *wbcache_get(int fd) {
+    struct wbcache *wb, *nw;
+    struct stat st;
+    unsigned h;
+
+    if (!wbc.running || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) return NULL;
+
+    nw = calloc(1, sizeof(*nw));
+    if (nw == NULL) return NULL;
+    pthread_mutex_init(&nw->lock, NULL);
+    nw->dev = st.st_dev;
+    nw->ino = st.st_ino;
+    nw->refs = 1;
+    nw->fd = -1;
+
+    h = wb_hash(st.st_dev, st.st_ino);
+    pthread_mutex_lock(&wbc.lock);
+    for (wb = wbc.hash[h]; wb; wb = wb->hnext)
+        if (wb->dev == st.st_dev && wb->ino == st.st_ino) {
+            wb->refs++;
+            break;
+        }
+    if (wb == NULL) {
+        nw->hnext = wbc.hash[h];
+        wbc.hash[h] = wb = nw;
+        nw = NULL;
+    }
+    pthread_mutex_unlock(&wbc.lock);
+
+    if (nw) {
+        pthread_mutex_destroy(&nw->lock);
+        free(nw);
+    }
+    return wb;
+}
+
+void wbcache_put(struct wbcache *wb) {
+    struct wbcache **pp;
+
+    if (wb == NULL) return;
+
+    pthread_mutex_lock(&wbc.lock);
+    if (--wb->refs > 0) {
+        pthread_mutex_unlock(&wbc.lock);
+        return;
+    }
+    for (pp = &wbc.hash[wb_hash(wb->dev, wb->ino)]; *pp != wb; pp = &(*pp)->hnext)
+        ;
+    *pp = wb->hnext;
+    pthread_mutex_unlock(&wbc.lock);
+
+    // nobody can see it any more; errors have nobody left to go to
+    // but the log
+    if (wb_flush_locked(wb) < 0)
+        log_err("wbcache: dirty data for inode %llu lost\n", (unsigned long long) wb->ino);
+    if (wb->fd >= 0) close(wb->fd);
+    pthread_mutex_destroy(&wb->lock);
+    free(wb);
+}
+
+int wbcache_flush_stat(const struct stat *st) {
+    struct wbcache *wb;
+    int ret;
+
+    if (!wbc.running) return 0;
+    wb = wb_lookup(st->st_dev, st->st_ino);
+    if (wb == NULL) return 0;
+    ret = wbcache_flush(wb);
+    wbcache_put(wb);
+    return ret;
+}
+
+void wbcache_stat(struct stat *st) {
+    struct wbcache *wb;
+
+    if (!wbc.running || !S_ISREG(st->st_mode)) return;
+    wb = wb_lookup(st->st_dev, st->st_ino);
+    if (wb == NULL) return;
+
+    pthread_mutex_lock(&wb->lock);
+    if (wb->end > (uint64_t) st->st_size) st->st_size = wb->end;
+    pthread_mutex_unlock(&wb->lock);
+    wbcache_put(wb);
+}
+
+int wbcache_enabled(void) {
+    return wbc.running;
+}
+
+// Every age/2, write out the caches whose oldest dirty data is older
+// than age -- or all of them, if a writer has run out of room
+static void *wb_flusher(void *arg) {
+    struct wbcache **todo = NULL, *wb;
+    size_t n, i, max = 0;
+    struct timespec ts;
+    uint64_t now, wait_ns;
+    int all;
+
+    wait_ns = wbc.age_ns / 2;
+    if (wait_ns < 10000000) wait_ns = 10000000;
+
+    pthread_mutex_lock(&wbc.lock);
+    while (!wbc.stopping) {
+        if (!wbc.pressure) {
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec += (ts.tv_nsec + wait_ns) / 1000000000;
+            ts.tv_nsec = (ts.tv_nsec + wait_ns) % 1000000000;
+            pthread_cond_timedwait(&wbc.wake, &wbc.lock, &ts);
+            if (wbc.stopping) break;
+        }
+        all = wbc.pressure;
+        wbc.pressure = 0;
+        now = instr_now();
+
+        // collect references under wbc.lock, then flush without it
+        n = 0;
+        for (i = 0; i < WBCACHE_HASH; i++)
+            for (wb = wbc.hash[i]; wb; wb = wb->hnext) {
+                uint64_t since = __atomic_load_n(&wb->dirty_since, __ATOMIC_RELAXED);
+
+                if (since == 0 || (!all && now - since < wbc.age_ns)) continue;
+                if (n == max) {
+                    struct wbcache **t = realloc(todo, (max ? 2 * max : 64) * sizeof(*t));
+                    if (t == NULL) break;
+                    todo = t;
+                    max = max ? 2 * max : 64;
+                }
+                wb->refs++;
+                todo[n++] = wb;
+            }
+        pthread_mutex_unlock(&wbc.lock);
+
+        for (i = 0; i < n; i++) {
+            pthread_mutex_lock(&todo[i]->lock);
+            // keep the error for the next fsync() or close() to report
+            if (todo[i]->ext) {
+                int err = wb_flush_locked(todo[i]);
+                if (err < 0) todo[i]->error = err;
+            }
+            pthread_mutex_unlock(&todo[i]->lock);
+            wbcache_put(todo[i]);
+        }
+
+        pthread_mutex_lock(&wbc.lock);
+    }
+    pthread_mutex_unlock(&wbc.lock);
+
+    free(todo);
+    return NULL;
+}
+
+int wbcache_start(size_t cap, unsigned age_ms) {
+    int ret;
+
+    wbc.cap = cap;
+    wbc.age_ns = (uint64_t) (age_ms ? age_ms : WBCACHE_AGE_MS) * 1000000;
+
+    ret = pthread_create(&wbc.flusher, NULL, wb_flusher, NULL);
+    if (ret != 0) return -ret;
+    wbc.running = 1;
+    return 0;
+}
+
+// Called from bb_destroy(), after the kernel has released every open
+// file -- so there's nothing left to flush, but be sure
+void wbcache_stop(void) {
+    struct wbcache *wb;
+    int i;
+
+    if (!wbc.running) return;
+
+    pthread_mutex_lock(&wbc.lock);
+    wbc.stopping = 1;
+    pthread_cond_signal(&wbc.wake);
+    pthread_mutex_unlock(&wbc.lock);
+    pthread_join(wbc.flusher, NULL);
+
+    for (i = 0; i < WBCACHE_HASH; i++)
+        for (wb = wbc.hash[i]; wb; wb = wb->hnext)
+            wbcache_flush(wb);
+    wbc.running = 0;
+}
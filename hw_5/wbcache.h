@@ -0,0 +1,53 @@
+#ifndef _WBCACHE_H_
+#define _WBCACHE_H_
+// Write-back cache for file contents, turned on with -o wb_cache=MiB.
+//
+// bb_write() hands its (already transformed) data to the cache rather
+// than pwrite()ing it; adjacent and overlapping writes are merged into
+// extents that go to the backing file in one pwrite() each.  Dirty
+// data is written out on flush/fsync/release, when an extent reaches
+// WBCACHE_EXTENT_MAX, when it's older than -o wb_age=ms, and whenever
+// the cache as a whole runs into its size limit, which is never
+// exceeded: a write that doesn't fit goes straight to the file.
+//
+// There is one cache per backing inode, shared by every open handle
+// on it, so reads and getattr through any handle see the dirty data.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// an extent this big is written out at once
+#define WBCACHE_EXTENT_MAX (1 << 20)
+// extent buffers grow in steps of this much
+#define WBCACHE_ROUND      (64 << 10)
+
+#define WBCACHE_AGE_MS     1000
+
+struct stat;
+struct wbcache;
+
+// called from bb_init() and bb_destroy(); cap is in bytes
+int wbcache_start(size_t cap, unsigned age_ms);
+void wbcache_stop(void);
+int wbcache_enabled(void);
+
+// the cache for the file open on fd, one reference per open handle
+struct wbcache *wbcache_get(int fd);
+void wbcache_put(struct wbcache *wb);
+
+// fd is the caller's descriptor for the file; both return what
+// pwrite()/pread() would
+ssize_t wbcache_write(struct wbcache *wb, int fd, const void *buf, size_t len, off_t off);
+ssize_t wbcache_read(struct wbcache *wb, int fd, void *buf, size_t len, off_t off);
+
+// write out everything that's dirty; returns 0 or the first write
+// error since the last flush, as -errno
+int wbcache_flush(struct wbcache *wb);
+// the same for whatever cache belongs to the file st describes
+int wbcache_flush_stat(const struct stat *st);
+
+// make st_size account for dirty data past the end of the backing file
+void wbcache_stat(struct stat *st);
+
+#endif
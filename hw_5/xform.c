@@ -0,0 +1,203 @@
+// Content transforms, see xform.h, and the SIMD byte-shift kernels
+// behind xform_shift().
+//
+// The AVX2 kernel is compiled with a target attribute rather than
+// -mavx2 so the rest of bbfs still runs on any x86-64; whether it's
+// used is decided at run time with __builtin_cpu_supports().
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define XFORM_X86 1
+#endif
+
+#include "chacha20.h"
+#include "xform.h"
+
+static int xform_always(void) {
+    return 1;
+}
+
+static void xform_shift_scalar(unsigned char *buf, size_t len, unsigned char delta) {
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        buf[i] += delta;
+}
+
+#ifdef XFORM_X86
+static int xform_has_sse2(void) {
+    return __builtin_cpu_supports("sse2");
+}
+
+static int xform_has_avx2(void) {
+    return __builtin_cpu_supports("avx2");
+}
+
+__attribute__((target("sse2")))
+static void xform_shift_sse2(unsigned char *buf, size_t len, unsigned char delta) {
+    __m128i d = _mm_set1_epi8((char) delta);
+    size_t i = 0;
+
+    for (; i + 64 <= len; i += 64) {
+        __m128i a = _mm_loadu_si128((__m128i *) (buf + i));
+        __m128i b = _mm_loadu_si128((__m128i *) (buf + i + 16));
+        __m128i c = _mm_loadu_si128((__m128i *) (buf + i + 32));
+        __m128i e = _mm_loadu_si128((__m128i *) (buf + i + 48));
+        _mm_storeu_si128((__m128i *) (buf + i), _mm_add_epi8(a, d));
+        _mm_storeu_si128((__m128i *) (buf + i + 16), _mm_add_epi8(b, d));
+        _mm_storeu_si128((__m128i *) (buf + i + 32), _mm_add_epi8(c, d));
+        _mm_storeu_si128((__m128i *) (buf + i + 48), _mm_add_epi8(e, d));
+    }
+    for (; i + 16 <= len; i += 16) {
+        __m128i a = _mm_loadu_si128((__m128i *) (buf + i));
+        _mm_storeu_si128((__m128i *) (buf + i), _mm_add_epi8(a, d));
+    }
+    xform_shift_scalar(buf + i, len - i, delta);
+}
+
+__attribute__((target("avx2")))
+static void xform_shift_avx2(unsigned char *buf, size_t len, unsigned char delta) {
+    __m256i d = _mm256_set1_epi8((char) delta);
+    size_t i = 0;
+
+    for (; i + 128 <= len; i += 128) {
+        __m256i a = _mm256_loadu_si256((__m256i *) (buf + i));
+        __m256i b = _mm256_loadu_si256((__m256i *) (buf + i + 32));
+        __m256i c = _mm256_loadu_si256((__m256i *) (buf + i + 64));
+        __m256i e = _mm256_loadu_si256((__m256i *) (buf + i + 96));
+        _mm256_storeu_si256((__m256i *) (buf + i), _mm256_add_epi8(a, d));
+        _mm256_storeu_si256((__m256i *) (buf + i + 32), _mm256_add_epi8(b, d));
+        _mm256_storeu_si256((__m256i *) (buf + i + 64), _mm256_add_epi8(c, d));
+        _mm256_storeu_si256((__m256i *) (buf + i + 96), _mm256_add_epi8(e, d));
+    }
+    for (; i + 32 <= len; i += 32) {
+        __m256i a = _mm256_loadu_si256((__m256i *) (buf + i));
+        _mm256_storeu_si256((__m256i *) (buf + i), _mm256_add_epi8(a, d));
+    }
+    xform_shift_scalar(buf + i, len - i, delta);
+}
+#endif
+
+const struct xform_kernel xform_kernels[] = {
+    { "scalar", xform_always,   xform_shift_scalar },
+#ifdef XFORM_X86
+    { "sse2",   xform_has_sse2, xform_shift_sse2 },
+    { "avx2",   xform_has_avx2, xform_shift_avx2 },
+#endif
+    { NULL, NULL, NULL }
+};
+
+static const struct xform_kernel *xform_best;
+
+// Racing threads all come up with the same answer, so there's no
+// need to lock around this
+static const struct xform_kernel *xform_pick(void) {
+    const struct xform_kernel *k, *best;
+
+    best = __atomic_load_n(&xform_best, __ATOMIC_ACQUIRE);
+    if (best) return best;
+
+#ifdef XFORM_X86
+    __builtin_cpu_init();
+#endif
+    best = &xform_kernels[0];
+    for (k = xform_kernels; k->name; k++)
+        if (k->supported()) best = k;
+
+    __atomic_store_n(&xform_best, best, __ATOMIC_RELEASE);
+    return best;
+}
+
+void xform_shift(unsigned char *buf, size_t len, unsigned char delta) {
+    xform_pick()->shift(buf, len, delta);
+}
+
+const char *xform_kernel_name(void) {
+    return xform_pick()->name;
+}
+
+static void xform_identity(const unsigned char *key, unsigned char *buf,
+        size_t len, uint64_t off, int dir) {
+}
+
+// the original bbfs scheme: +1 on the way in, -1 on the way out
+static void xform_legacy_shift(const unsigned char *key, unsigned char *buf,
+        size_t len, uint64_t off, int dir) {
+    xform_shift(buf, len, dir == XFORM_ENCODE ? 1 : 0xff);
+}
+
+// splitmix64's output function
+static uint64_t xform_mix(uint64_t z) {
+    z += 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+// A cheap keyed keystream: the 8 bytes at file offset 8*w are XORed
+// with mix(k0 + w) ^ k1 (little-endian).  It hides the data from a
+// casual look at rootdir, but it is NOT a cipher -- use chacha20 for
+// that.
+static void xform_xor(const unsigned char *key, unsigned char *buf,
+        size_t len, uint64_t off, int dir) {
+    uint64_t k0, k1, w, ks, v;
+    size_t i = 0;
+
+    memcpy(&k0, key, 8);
+    memcpy(&k1, key + 8, 8);
+
+    // leading bytes up to an 8-byte boundary in the file
+    for (; i < len && (off + i) % 8; i++)
+        buf[i] ^= (xform_mix(k0 + (off + i) / 8) ^ k1) >> (8 * ((off + i) % 8));
+
+    for (w = (off + i) / 8; i + 8 <= len; i += 8, w++) {
+        ks = xform_mix(k0 + w) ^ k1;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        ks = __builtin_bswap64(ks);
+#endif
+        memcpy(&v, buf + i, 8);
+        v ^= ks;
+        memcpy(buf + i, &v, 8);
+    }
+
+    for (; i < len; i++)
+        buf[i] ^= (xform_mix(k0 + (off + i) / 8) ^ k1) >> (8 * ((off + i) % 8));
+}
+
+// the per-file key is already unique, so the stream nonce can be 0
+static void xform_chacha20(const unsigned char *key, unsigned char *buf,
+        size_t len, uint64_t off, int dir) {
+    chacha20_xor(key, 0, off, buf, len);
+}
+
+const struct xform_ops xform_ops_list[] = {
+    { "identity", 0, xform_identity },
+    { "shift",    0, xform_legacy_shift },
+    { "xor",      1, xform_xor },
+    { "chacha20", 1, xform_chacha20 },
+    { NULL, 0, NULL }
+};
+
+int xform_is_identity(const struct xform_ops *x) {
+    return x->apply == xform_identity;
+}
+
+const struct xform_ops *xform_lookup(const char *name) {
+    const struct xform_ops *x;
+
+    for (x = xform_ops_list; x->name; x++)
+        if (strcmp(x->name, name) == 0) return x;
+    return NULL;
+}
+
+// file key = HChaCha20(mount key, file nonce), so no two files share
+// a keystream and a leaked file key says nothing about the others
+void xform_file_key(unsigned char key[XFORM_KEY_SIZE],
+        const unsigned char master[XFORM_KEY_SIZE],
+        const unsigned char nonce[XFORM_NONCE_SIZE]) {
+    hchacha20(key, master, nonce);
+}
@@ -0,0 +1,63 @@
+#ifndef _XFORM_H_
+#define _XFORM_H_
+// Byte transforms applied to file contents on their way through bbfs.
+//
+// Which transform a mount uses is picked with -o xform=NAME from the
+// table below.  Every transform is a pure function of (file key, file
+// offset, byte), so bb_read()/bb_write() can apply it to any range of
+// a file without looking at the data before it.
+//
+// xform_shift() adds 'delta' (mod 256) to every one of the len bytes
+// at buf: bb_write() shifts by +1 and bb_read() by -1 (255).  It is
+// binary-safe -- NUL bytes are transformed like any other -- and
+// picks the widest SIMD kernel the CPU supports the first time it is
+// called.
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef void (*xform_shift_fn)(unsigned char *buf, size_t len, unsigned char delta);
+
+struct xform_kernel {
+    const char *name;
+    int (*supported)(void);
+    xform_shift_fn shift;
+};
+
+// every kernel built into this binary, best last, NULL-terminated;
+// exported for xform_bench
+extern const struct xform_kernel xform_kernels[];
+
+void xform_shift(unsigned char *buf, size_t len, unsigned char delta);
+const char *xform_kernel_name(void);
+
+#define XFORM_KEY_SIZE   32
+#define XFORM_NONCE_SIZE 16
+
+// keyed transforms remember each file's nonce in this xattr on the
+// backing file; bbfs hides it from users
+#define XFORM_NONCE_XATTR "user.bbfs.nonce"
+
+// which way the data is going
+#define XFORM_ENCODE 0     // bb_write(): user data -> backing file
+#define XFORM_DECODE 1     // bb_read(): backing file -> user data
+
+struct xform_ops {
+    const char *name;
+    int keyed;          // needs -o key/keyfile and a per-file nonce
+    // transform len bytes that sit at file offset 'off'
+    void (*apply)(const unsigned char *key, unsigned char *buf, size_t len,
+            uint64_t off, int dir);
+};
+
+// NULL-terminated, for xform_bench and the usage message
+extern const struct xform_ops xform_ops_list[];
+
+const struct xform_ops *xform_lookup(const char *name);
+// true if x leaves data as it is, so bbfs needn't touch it at all
+int xform_is_identity(const struct xform_ops *x);
+void xform_file_key(unsigned char key[XFORM_KEY_SIZE],
+        const unsigned char master[XFORM_KEY_SIZE],
+        const unsigned char nonce[XFORM_NONCE_SIZE]);
+
+#endif
@@ -0,0 +1,180 @@
+/*
+   xform_bench -- throughput of the bbfs content transform
+
+   usage: xform_bench [seconds per run]
+
+   Times the byte-at-a-time loop bbfs used to have in bb_read() and
+   bb_write() against every xform_shift() kernel this CPU supports,
+   for buffers from 4 KiB to 1 MiB, and prints GB/s.  Each run
+   alternates a write-side (+1) and a read-side (-1) pass over the
+   same buffer, like a write followed by a read of the same data.
+
+   Then does the same for every -o xform= transform, each pass at a
+   random (unaligned) file offset, and checks that decoding undoes
+   encoding at whatever offset it's done.
+   */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "xform.h"
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// the old bb_write()/bb_read() loops, minus the pointer bug: they
+// stop at the first NUL, so the buffer is filled with 1..253 and
+// NUL-terminated to let them cover all of it
+static void legacy_shift(unsigned char *byte, size_t len, unsigned char delta) {
+    int i = 0;
+
+    if (delta == 1) {
+        while (*byte != '\0') {
+            byte[i] = (byte[i] + 1) % 256;
+            byte++;
+        }
+    } else {
+        while (*byte != '\0') {
+            byte[i] = (byte[i] == 0) ? 255 : ((byte[i] - 1) % 256);
+            byte++;
+        }
+    }
+}
+
+static const unsigned char bench_key[XFORM_KEY_SIZE] = {
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+    0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
+    0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17,
+    0x18, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f
+};
+
+static uint64_t bench_off(void) {
+    return ((uint64_t) rand() << 16 ^ rand()) % (1ULL << 36);
+}
+
+static double run_ops(const struct xform_ops *x, unsigned char *buf, size_t len, double secs) {
+    double start, elapsed;
+    long iters = 0;
+    uint64_t off;
+
+    start = now();
+    do {
+        off = bench_off();
+        x->apply(bench_key, buf, len, off, XFORM_ENCODE);
+        x->apply(bench_key, buf, len, off, XFORM_DECODE);
+        iters += 2;
+        elapsed = now() - start;
+    } while (elapsed < secs);
+
+    return (double) len * iters / elapsed / 1e9;
+}
+
+// encode the whole buffer at 'off', then decode it again in odd-sized
+// pieces; every piece must come back as it was
+static int check_ops(const struct xform_ops *x, unsigned char *buf,
+        const unsigned char *check, size_t len) {
+    uint64_t off = bench_off();
+    size_t i, n;
+
+    memcpy(buf, check, len);
+    x->apply(bench_key, buf, len, off, XFORM_ENCODE);
+    for (i = 0; i < len; i += n) {
+        n = 1 + rand() % 1000;
+        if (n > len - i) n = len - i;
+        x->apply(bench_key, buf + i, n, off + i, XFORM_DECODE);
+    }
+    return memcmp(buf, check, len);
+}
+
+static double run(xform_shift_fn fn, unsigned char *buf, size_t len, double secs) {
+    double start, elapsed;
+    long iters = 0;
+
+    start = now();
+    do {
+        fn(buf, len, 1);
+        fn(buf, len, 0xff);
+        iters += 2;
+        elapsed = now() - start;
+    } while (elapsed < secs);
+
+    return (double) len * iters / elapsed / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+    static const size_t sizes[] = { 4 << 10, 16 << 10, 64 << 10, 256 << 10, 1 << 20 };
+    const struct xform_kernel *k;
+    const struct xform_ops *x;
+    double secs = 0.25;
+    unsigned char *buf, *check;
+    size_t s, i, len;
+
+    if (argc > 1) secs = atof(argv[1]);
+
+    buf = malloc((1 << 20) + 1);
+    check = malloc(1 << 20);
+    if (buf == NULL || check == NULL) {
+        perror("xform_bench");
+        return 1;
+    }
+
+    printf("xform_shift() uses the %s kernel on this CPU\n\n", xform_kernel_name());
+    printf("%-10s %10s", "size", "legacy");
+    for (k = xform_kernels; k->name; k++)
+        if (k->supported()) printf(" %10s", k->name);
+    printf("   (GB/s)\n");
+
+    for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        len = sizes[s];
+        for (i = 0; i < len; i++) buf[i] = 1 + i % 253;
+        buf[len] = '\0';
+
+        printf("%-10zu %10.2f", len, run(legacy_shift, buf, len, secs));
+
+        for (k = xform_kernels; k->name; k++) {
+            if (!k->supported()) continue;
+            printf(" %10.2f", run(k->shift, buf, len, secs));
+
+            // every kernel must agree with the scalar one, NULs included
+            for (i = 0; i < len; i++) check[i] = i * 7;
+            memcpy(buf, check, len);
+            k->shift(buf, len, 1);
+            for (i = 0; i < len; i++)
+                if (buf[i] != (unsigned char) (check[i] + 1)) {
+                    printf("\n%s kernel is wrong at byte %zu\n", k->name, i);
+                    return 1;
+                }
+            for (i = 0; i < len; i++) buf[i] = 1 + i % 253;
+        }
+        printf("\n");
+    }
+
+    printf("\n%-10s", "size");
+    for (x = xform_ops_list; x->name; x++) printf(" %10s", x->name);
+    printf("   (GB/s, random offsets)\n");
+
+    for (i = 0; i < (1 << 20); i++) check[i] = i * 7;
+    for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        len = sizes[s];
+        printf("%-10zu", len);
+        for (x = xform_ops_list; x->name; x++) {
+            if (check_ops(x, buf, check, len)) {
+                printf("\n%s doesn't round-trip\n", x->name);
+                return 1;
+            }
+            printf(" %10.2f", run_ops(x, buf, len, secs));
+        }
+        printf("\n");
+    }
+
+    free(buf);
+    free(check);
+    return 0;
+}
@@ -0,0 +1,84 @@
+// Portable XXH64, see xxhash.h
+
+#include <stdint.h>
+#include <string.h>
+
+#include "xxhash.h"
+
+#define P1 0x9E3779B185EBCA87ULL
+#define P2 0xC2B2AE3D27D4EB4FULL
+#define P3 0x165667B19E3779F9ULL
+#define P4 0x85EBCA77C2B2AE63ULL
+#define P5 0x27D4EB2F165667C5ULL
+
+#define ROTL64(v, n) (((v) << (n)) | ((v) >> (64 - (n))))
+
+static uint64_t load64(const uint8_t *p) {
+    return (uint64_t) p[0] | (uint64_t) p[1] << 8 | (uint64_t) p[2] << 16 |
+        (uint64_t) p[3] << 24 | (uint64_t) p[4] << 32 | (uint64_t) p[5] << 40 |
+        (uint64_t) p[6] << 48 | (uint64_t) p[7] << 56;
+}
+
+static uint32_t load32(const uint8_t *p) {
+    return (uint32_t) p[0] | (uint32_t) p[1] << 8 |
+        (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static uint64_t round64(uint64_t acc, uint64_t in) {
+    acc += in * P2;
+    acc = ROTL64(acc, 31);
+    return acc * P1;
+}
+
+static uint64_t merge64(uint64_t acc, uint64_t v) {
+    acc ^= round64(0, v);
+    return acc * P1 + P4;
+}
+
+uint64_t xxh64(const void *data, size_t len, uint64_t seed) {
+    const uint8_t *p = data, *end = p + len;
+    uint64_t v1, v2, v3, v4, h;
+
+    if (len >= 32) {
+        v1 = seed + P1 + P2;
+        v2 = seed + P2;
+        v3 = seed;
+        v4 = seed - P1;
+        do {
+            v1 = round64(v1, load64(p));
+            v2 = round64(v2, load64(p + 8));
+            v3 = round64(v3, load64(p + 16));
+            v4 = round64(v4, load64(p + 24));
+            p += 32;
+        } while (p + 32 <= end);
+        h = ROTL64(v1, 1) + ROTL64(v2, 7) + ROTL64(v3, 12) + ROTL64(v4, 18);
+        h = merge64(h, v1);
+        h = merge64(h, v2);
+        h = merge64(h, v3);
+        h = merge64(h, v4);
+    } else {
+        h = seed + P5;
+    }
+    h += len;
+
+    for (; p + 8 <= end; p += 8) {
+        h ^= round64(0, load64(p));
+        h = ROTL64(h, 27) * P1 + P4;
+    }
+    if (p + 4 <= end) {
+        h ^= (uint64_t) load32(p) * P1;
+        h = ROTL64(h, 23) * P2 + P3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= *p * P5;
+        h = ROTL64(h, 11) * P1;
+    }
+
+    h ^= h >> 33;
+    h *= P2;
+    h ^= h >> 29;
+    h *= P3;
+    h ^= h >> 32;
+    return h;
+}
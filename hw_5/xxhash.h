@@ -0,0 +1,11 @@
+#ifndef _XXHASH_H_
+#define _XXHASH_H_
+// XXH64 (Yann Collet's xxHash, 64-bit variant).  Fast and well mixed,
+// but not meant to stand up to anyone crafting collisions on purpose.
+
+#include <stddef.h>
+#include <stdint.h>
+
+uint64_t xxh64(const void *data, size_t len, uint64_t seed);
+
+#endif